@@ -0,0 +1,116 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define NUM_FILES 200
+#define SIZE_SCALE 64
+#define CAPACITY ((size_t)512 << 20)
+#define SEED 42
+
+typedef struct {
+    const char *name;
+    size_t data_bytes;
+    size_t stored_bytes;
+    int blocks;
+    double write_file_mbs;
+    double read_file_mbs;
+} BlockClassResult;
+
+static double mb_per_s(size_t bytes, double ms)
+{
+    return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+// Space taken and throughput of writing then reading back NUM_FILES files of
+// web-like sizes, each file picking its block size class from its size
+static BlockClassResult bench_block_class(const char *name, MDOptions opts,
+                                          const size_t *sizes, const char *data)
+{
+    BlockClassResult r = { name, 0, 0, 0, 0, 0 };
+
+    metadatanode_init_opts(NUM_NODES, CAPACITY, "roundrobin", &opts);
+
+    int fids[NUM_FILES];
+    for (int i = 0; i < NUM_FILES; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "web_%d.dat", i);
+        metadatanode_create_file(filename, sizes[i], &fids[i]);
+        r.data_bytes += sizes[i];
+    }
+
+    double start = get_time_ms();
+    for (int i = 0; i < NUM_FILES; i++)
+        metadatanode_write_file(fids[i], (void *)data, sizes[i]);
+    r.write_file_mbs = mb_per_s(r.data_bytes, get_time_ms() - start);
+
+    start = get_time_ms();
+    for (int i = 0; i < NUM_FILES; i++) {
+        void *buffer;
+        size_t file_size;
+        if (metadatanode_read_file(fids[i], &buffer, &file_size) == MDN_SUCCESS)
+            free(buffer);
+    }
+    r.read_file_mbs = mb_per_s(r.data_bytes, get_time_ms() - start);
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        size_t block_size;
+        metadatanode_file_block_size(fids[i], &block_size);
+        size_t blocks = (sizes[i] + block_size - 1) / block_size;
+        r.blocks += blocks;
+        r.stored_bytes += blocks * block_size;
+    }
+
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    // any byte count up to the drawn size, scaled so the large files span
+    // many of the biggest blocks
+    size_t sizes[NUM_FILES];
+    size_t max_size = 0;
+    srand(SEED);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sizes[i] = 1 + rand() % (generate_file_size(DIST_WEB_REALISTIC) * SIZE_SCALE);
+        if (sizes[i] > max_size) max_size = sizes[i];
+    }
+
+    char *data = malloc(max_size);
+    for (size_t i = 0; i < max_size; i++)
+        data[i] = (char)rand();
+
+    MDOptions small_opts = { .block_size = 4 << 10 };
+    MDOptions medium_opts = { .block_size = 64 << 10 };
+    MDOptions large_opts = { .block_size = 1 << 20 };
+    MDOptions class_opts = { .block_classes = { 4 << 10, 64 << 10, 1 << 20 } };
+
+    BlockClassResult results[] = {
+        bench_block_class("4k", small_opts, sizes, data),
+        bench_block_class("64k", medium_opts, sizes, data),
+        bench_block_class("1m", large_opts, sizes, data),
+        bench_block_class("4k+64k+1m", class_opts, sizes, data),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    free(data);
+
+    printf("\n========================================\n");
+    printf("Space and throughput by block size classes (%d nodes, %d %s files scaled %dx)\n",
+           NUM_NODES, NUM_FILES, dist_to_string(DIST_WEB_REALISTIC), SIZE_SCALE);
+    printf("========================================\n");
+    printf("%-12s %8s %12s %16s %16s\n", "classes", "blocks", "waste_pct",
+           "write_file_mbs", "read_file_mbs");
+    for (int i = 0; i < num_results; i++) {
+        double waste = results[i].stored_bytes > 0
+            ? 100.0 * (results[i].stored_bytes - results[i].data_bytes) / results[i].stored_bytes : 0;
+        printf("%-12s %8d %12.2f %16.1f %16.1f\n", results[i].name, results[i].blocks, waste,
+               results[i].write_file_mbs, results[i].read_file_mbs);
+    }
+
+    return 0;
+}
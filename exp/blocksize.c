@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BYTES (64 << 20)
+#define ROUNDS 4
+#define SEED 42
+
+typedef struct {
+    size_t block_size;
+    int blocks;
+    double write_file_mbs;
+    double read_file_mbs;
+    double read_block_mbs;
+} BlockSizeResult;
+
+static double mb_per_s(size_t bytes, double ms)
+{
+    return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+// Throughput of moving the same FILE_BYTES file whole and block by block,
+// with the cluster running on blocks of size bytes
+static BlockSizeResult bench_block_size(size_t size)
+{
+    BlockSizeResult r = { size, FILE_BYTES / size, 0, 0, 0 };
+
+    MDOptions opts = { .block_size = size };
+    metadatanode_init_opts(NUM_NODES, 2 * (size_t)FILE_BYTES, "roundrobin", &opts);
+
+    int fid;
+    metadatanode_create_file("blocksize.dat", FILE_BYTES, &fid);
+
+    char *data = malloc(FILE_BYTES);
+    srand(SEED);
+    for (size_t i = 0; i < FILE_BYTES; i++)
+        data[i] = (char)rand();
+
+    double start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++)
+        metadatanode_write_file(fid, data, FILE_BYTES);
+    r.write_file_mbs = mb_per_s((size_t)ROUNDS * FILE_BYTES, get_time_ms() - start);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        void *buffer;
+        size_t file_size;
+        if (metadatanode_read_file(fid, &buffer, &file_size) == MDN_SUCCESS)
+            free(buffer);
+    }
+    r.read_file_mbs = mb_per_s((size_t)ROUNDS * FILE_BYTES, get_time_ms() - start);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < r.blocks; i++)
+            metadatanode_read_block(fid, i, data + (size_t)i * size);
+    }
+    r.read_block_mbs = mb_per_s((size_t)ROUNDS * FILE_BYTES, get_time_ms() - start);
+
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    size_t sizes[] = { 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    BlockSizeResult results[sizeof(sizes) / sizeof(sizes[0])];
+    for (int i = 0; i < num_sizes; i++)
+        results[i] = bench_block_size(sizes[i]);
+
+    printf("\n========================================\n");
+    printf("Throughput by block size (%d nodes, %d MiB file, %d rounds)\n",
+           NUM_NODES, FILE_BYTES >> 20, ROUNDS);
+    printf("========================================\n");
+    printf("%-12s %8s %16s %16s %16s\n", "block_size", "blocks", "write_file_mbs",
+           "read_file_mbs", "read_block_mbs");
+    for (int i = 0; i < num_sizes; i++) {
+        printf("%-12zu %8d %16.1f %16.1f %16.1f\n", results[i].block_size, results[i].blocks,
+               results[i].write_file_mbs, results[i].read_file_mbs, results[i].read_block_mbs);
+    }
+
+    return 0;
+}
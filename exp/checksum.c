@@ -0,0 +1,96 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "crc32c.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define CRC_ROUNDS 200000
+#define IO_BLOCKS 64
+#define IO_ROUNDS 20
+
+typedef uint32_t (*CrcFn)(uint32_t, const void *, size_t);
+
+// Nanoseconds to checksum one block
+static double bench_crc(CrcFn fn, const char *block, uint32_t *sink)
+{
+    uint32_t acc = 0;
+    double start = get_time_ms();
+    for (int i = 0; i < CRC_ROUNDS; i++) {
+        acc = fn(acc, block, BLOCK_SIZE);
+    }
+    double elapsed = get_time_ms() - start;
+
+    *sink += acc;
+    return elapsed * 1e6 / CRC_ROUNDS;
+}
+
+// Microseconds per metadatanode_read_block, checksums included
+static double bench_block_read(void)
+{
+    metadatanode_init(1, 2 * IO_BLOCKS * BLOCK_SIZE, "roundrobin");
+
+    int fid;
+    metadatanode_create_file("checksum.dat", IO_BLOCKS * BLOCK_SIZE, &fid);
+
+    char *block = malloc(BLOCK_SIZE);
+    memset(block, 'C', BLOCK_SIZE);
+    for (int i = 0; i < IO_BLOCKS; i++) {
+        metadatanode_write_block(fid, i, block);
+    }
+
+    double start = get_time_ms();
+    for (int round = 0; round < IO_ROUNDS; round++) {
+        for (int i = 0; i < IO_BLOCKS; i++) {
+            metadatanode_read_block(fid, i, block);
+        }
+    }
+    double us = (get_time_ms() - start) * 1000.0 / (IO_ROUNDS * IO_BLOCKS);
+
+    free(block);
+    metadatanode_exit(1);
+    return us;
+}
+
+int main(void)
+{
+    const char *check = "123456789";
+    uint32_t expected = 0xE3069283;
+    if (crc32c(0, check, 9) != expected || crc32c_sw(0, check, 9) != expected) {
+        printf("CRC32C check value mismatch\n");
+        return 1;
+    }
+
+    char *block = malloc(BLOCK_SIZE + 8);
+    for (size_t i = 0; i < BLOCK_SIZE + 8; i++) {
+        block[i] = (char)(rand() & 0xff);
+    }
+
+    // both paths agree on odd lengths and alignments
+    for (int off = 0; off < 8; off++) {
+        for (size_t len = 0; len <= BLOCK_SIZE; len += (len < 64 ? 1 : 61)) {
+            if (crc32c(0, block + off, len) != crc32c_sw(0, block + off, len)) {
+                printf("hardware and software CRC32C differ\n");
+                return 1;
+            }
+        }
+    }
+
+    uint32_t sink = 0;
+    double hw_ns = bench_crc(crc32c, block, &sink);
+    double sw_ns = bench_crc(crc32c_sw, block, &sink);
+    double read_us = bench_block_read();
+
+    printf("\n========================================\n");
+    printf("CRC32C cost per %zu byte block (sink %08x)\n", BLOCK_SIZE, sink);
+    printf("========================================\n");
+    printf("%-10s %12s %12s %14s\n", "path", "ns/block", "GB/s", "of read_block");
+    printf("%-10s %12.1f %12.2f %13.2f%%\n", crc32c_hw_available() ? "sse4.2" : "sse4.2 n/a",
+           hw_ns, BLOCK_SIZE / hw_ns, 100.0 * hw_ns / (read_us * 1000.0));
+    printf("%-10s %12.1f %12.2f %13.2f%%\n", "software",
+           sw_ns, BLOCK_SIZE / sw_ns, 100.0 * sw_ns / (read_us * 1000.0));
+    printf("read_block: %.2f us per block\n", read_us);
+
+    free(block);
+    return 0;
+}
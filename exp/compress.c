@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define NUM_FILES 64
+#define FILE_BLOCKS 16
+#define BLOCK_BYTES (64 << 10)
+#define CAPACITY ((size_t)256 << 20)
+#define SEED 42
+
+typedef enum {
+    DATA_ALPHABET,  // 'A' + (i % 26), what the workloads write
+    DATA_TEXT,      // words drawn from a small vocabulary
+    DATA_RANDOM,    // incompressible, stored raw
+} DataKind;
+
+static const char *kind_to_string(DataKind kind)
+{
+    switch (kind) {
+        case DATA_ALPHABET: return "alphabet";
+        case DATA_TEXT: return "text";
+        case DATA_RANDOM: return "random";
+    }
+    return "unknown";
+}
+
+typedef struct {
+    DataKind kind;
+    int compress;
+    double write_file_mbs;
+    double read_file_mbs;
+    int files_fit;      // files of the data the capacity holds
+    SystemMetrics m;
+} CompressResult;
+
+static double mb_per_s(size_t bytes, double ms)
+{
+    return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+static void fill_data(char *data, size_t size, DataKind kind)
+{
+    static const char *words[] = {
+        "block ", "node ", "file ", "write ", "read ", "metadata ", "the ", "a ",
+        "capacity ", "error ", "request ", "segment ", "cache ", "of ", "to ", "\n",
+    };
+
+    size_t i = 0;
+    switch (kind) {
+        case DATA_ALPHABET:
+            for (; i < size; i++)
+                data[i] = 'A' + (i % 26);
+            break;
+        case DATA_TEXT:
+            while (i < size) {
+                const char *w = words[rand() % 16];
+                for (; *w && i < size; w++)
+                    data[i++] = *w;
+            }
+            break;
+        case DATA_RANDOM:
+            for (; i < size; i++)
+                data[i] = (char)rand();
+            break;
+    }
+}
+
+// Write NUM_FILES files of one kind of data and read them back, with the
+// datanodes storing blocks raw or compressed, then see how many fit
+static CompressResult bench_compress(DataKind kind, int compress, const char *data)
+{
+    CompressResult r = { kind, compress, 0, 0, 0, {0} };
+
+    MDOptions opts = { .block_size = BLOCK_BYTES, .compress = compress };
+    metadatanode_init_opts(NUM_NODES, CAPACITY, "roundrobin", &opts);
+
+    size_t file_bytes = (size_t)FILE_BLOCKS * BLOCK_BYTES;
+    int fids[NUM_FILES];
+    for (int i = 0; i < NUM_FILES; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "compress_%d.dat", i);
+        metadatanode_create_file(filename, file_bytes, &fids[i]);
+    }
+
+    double start = get_time_ms();
+    for (int i = 0; i < NUM_FILES; i++)
+        metadatanode_write_file(fids[i], (void *)(data + (size_t)i * file_bytes), file_bytes);
+    double write_ms = get_time_ms() - start;
+    r.write_file_mbs = mb_per_s(NUM_FILES * file_bytes, write_ms);
+
+    start = get_time_ms();
+    for (int i = 0; i < NUM_FILES; i++) {
+        void *buffer;
+        size_t file_size;
+        if (metadatanode_read_file(fids[i], &buffer, &file_size) == MDN_SUCCESS)
+            free(buffer);
+    }
+    double read_ms = get_time_ms() - start;
+    r.read_file_mbs = mb_per_s(NUM_FILES * file_bytes, read_ms);
+
+    r.m = capture_metrics(write_ms, read_ms, NUM_FILES, NUM_FILES);
+
+    // keep writing the same data until the capacity runs out
+    r.files_fit = NUM_FILES;
+    for (;; r.files_fit++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "compress_%d.dat", r.files_fit);
+        int fid;
+        if (metadatanode_create_file(filename, file_bytes, &fid) != MDN_SUCCESS ||
+            metadatanode_write_file(fid, (void *)(data + (size_t)(r.files_fit % NUM_FILES) * file_bytes),
+                                    file_bytes) != MDN_SUCCESS)
+            break;
+    }
+
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    size_t data_bytes = (size_t)NUM_FILES * FILE_BLOCKS * BLOCK_BYTES;
+    char *data = malloc(data_bytes);
+
+    DataKind kinds[] = { DATA_ALPHABET, DATA_TEXT, DATA_RANDOM };
+    int num_kinds = sizeof(kinds) / sizeof(kinds[0]);
+
+    CompressResult results[6];
+    int num_results = 0;
+    srand(SEED);
+    for (int k = 0; k < num_kinds; k++) {
+        fill_data(data, data_bytes, kinds[k]);
+        results[num_results++] = bench_compress(kinds[k], 0, data);
+        results[num_results++] = bench_compress(kinds[k], 1, data);
+    }
+
+    free(data);
+
+    printf("\n========================================\n");
+    printf("Datanode block compression (%d nodes, %d files of %d x %d KB blocks)\n",
+           NUM_NODES, NUM_FILES, FILE_BLOCKS, BLOCK_BYTES >> 10);
+    printf("========================================\n");
+    printf("%-10s %9s %10s %8s %16s %16s %10s\n", "data", "compress", "stored_mb", "ratio",
+           "write_file_mbs", "read_file_mbs", "files_fit");
+    for (int i = 0; i < num_results; i++) {
+        CompressResult *r = &results[i];
+        printf("%-10s %9s %10.1f %8.2f %16.1f %16.1f %10d\n", kind_to_string(r->kind),
+               r->compress ? "on" : "off", r->m.stored_bytes / (1024.0 * 1024.0),
+               r->m.compression_ratio, r->write_file_mbs, r->read_file_mbs, r->files_fit);
+    }
+
+    return 0;
+}
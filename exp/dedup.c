@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define NUM_FILES 64
+#define FILE_BLOCKS 16
+#define NUM_TEMPLATES 8
+#define BLOCK_BYTES (64 << 10)
+#define CAPACITY ((size_t)512 << 20)
+#define SEED 42
+
+typedef enum {
+    DATA_ZEROS,     // every block the same
+    DATA_TEMPLATES, // blocks drawn from a few templates, like VM images
+    DATA_RANDOM,    // nothing repeats
+} DataKind;
+
+static const char *kind_to_string(DataKind kind)
+{
+    switch (kind) {
+        case DATA_ZEROS: return "zeros";
+        case DATA_TEMPLATES: return "templates";
+        case DATA_RANDOM: return "random";
+    }
+    return "unknown";
+}
+
+typedef struct {
+    DataKind kind;
+    int dedup;
+    double write_file_mbs;
+    SystemMetrics m;
+} DedupResult;
+
+static double mb_per_s(size_t bytes, double ms)
+{
+    return ms > 0 ? bytes / (1024.0 * 1024.0) / (ms / 1000.0) : 0;
+}
+
+static void fill_file(char *data, DataKind kind, const char *templates)
+{
+    size_t file_bytes = (size_t)FILE_BLOCKS * BLOCK_BYTES;
+    switch (kind) {
+        case DATA_ZEROS:
+            memset(data, 0, file_bytes);
+            break;
+        case DATA_TEMPLATES:
+            for (int b = 0; b < FILE_BLOCKS; b++)
+                memcpy(data + (size_t)b * BLOCK_BYTES,
+                       templates + (size_t)(rand() % NUM_TEMPLATES) * BLOCK_BYTES, BLOCK_BYTES);
+            break;
+        case DATA_RANDOM:
+            for (size_t i = 0; i < file_bytes; i++)
+                data[i] = (char)rand();
+            break;
+    }
+}
+
+// Write NUM_FILES files of the given content, then overwrite each once more
+// the same way, and report what dedup kept off the datanodes
+static DedupResult bench_dedup(DataKind kind, int dedup, const char *templates)
+{
+    DedupResult r = { kind, dedup, 0, {0} };
+
+    MDOptions opts = { .block_size = BLOCK_BYTES, .dedup = dedup };
+    metadatanode_init_opts(NUM_NODES, CAPACITY, "roundrobin", &opts);
+
+    size_t file_bytes = (size_t)FILE_BLOCKS * BLOCK_BYTES;
+    char *data = malloc(file_bytes);
+
+    int fids[NUM_FILES];
+    for (int i = 0; i < NUM_FILES; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "dedup_%d.dat", i);
+        metadatanode_create_file(filename, file_bytes, &fids[i]);
+    }
+
+    srand(SEED);
+    double write_ms = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < NUM_FILES; i++) {
+            fill_file(data, kind, templates);
+            double start = get_time_ms();
+            metadatanode_write_file(fids[i], data, file_bytes);
+            write_ms += get_time_ms() - start;
+        }
+    }
+    r.write_file_mbs = mb_per_s(2 * NUM_FILES * file_bytes, write_ms);
+    r.m = capture_metrics(write_ms, 0, 2 * NUM_FILES, 0);
+
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    srand(SEED);
+    char *templates = malloc((size_t)NUM_TEMPLATES * BLOCK_BYTES);
+    for (size_t i = 0; i < (size_t)NUM_TEMPLATES * BLOCK_BYTES; i++)
+        templates[i] = (char)rand();
+
+    DataKind kinds[] = { DATA_ZEROS, DATA_TEMPLATES, DATA_RANDOM };
+    int num_kinds = sizeof(kinds) / sizeof(kinds[0]);
+
+    DedupResult results[6];
+    int num_results = 0;
+    for (int k = 0; k < num_kinds; k++) {
+        results[num_results++] = bench_dedup(kinds[k], 0, templates);
+        results[num_results++] = bench_dedup(kinds[k], 1, templates);
+    }
+
+    free(templates);
+
+    printf("\n========================================\n");
+    printf("Deduplication (%d nodes, %d files of %d x %d KB blocks, written twice)\n",
+           NUM_NODES, NUM_FILES, FILE_BLOCKS, BLOCK_BYTES >> 10);
+    printf("========================================\n");
+    printf("%-10s %6s %8s %12s %12s %14s %16s\n", "data", "dedup", "ratio", "saved_mb",
+           "blocks_used", "writes_saved", "write_file_mbs");
+    for (int i = 0; i < num_results; i++) {
+        DedupResult *r = &results[i];
+        printf("%-10s %6s %8.2f %12.1f %12zu %14llu %16.1f\n", kind_to_string(r->kind),
+               r->dedup ? "on" : "off", r->m.dedup_ratio, r->m.dedup_bytes_saved / (1024.0 * 1024.0),
+               r->m.blocks_used, r->m.dedup_writes_saved, r->write_file_mbs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BLOCKS 256
+#define ROUNDS 4
+
+typedef struct {
+    const char *name;
+    double write_block_us;
+    double write_async_us;
+    double write_file_us;
+} DurabilityResult;
+
+// Per-block write latency of one-at-a-time, pipelined and whole-file writes
+static DurabilityResult bench_durability(const char *name, MDOptions opts)
+{
+    DurabilityResult r = { name, 0, 0, 0 };
+
+    metadatanode_init_opts(NUM_NODES, 2 * FILE_BLOCKS * BLOCK_SIZE, "roundrobin", &opts);
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("durable.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'D', size);
+
+    double start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILE_BLOCKS; i++) {
+            metadatanode_write_block(fid, i, data + (size_t)i * BLOCK_SIZE);
+        }
+    }
+    r.write_block_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILE_BLOCKS; i++) {
+            MDHandle handle;
+            metadatanode_write_block_async(fid, i, data + (size_t)i * BLOCK_SIZE,
+                                           NULL, NULL, &handle);
+        }
+        metadatanode_drain();
+
+        MDCompletion completions[FILE_BLOCKS];
+        while (metadatanode_reap(completions, FILE_BLOCKS) > 0);
+    }
+    r.write_async_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        metadatanode_write_file(fid, data, size);
+    }
+    r.write_file_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    MDOptions none_opts = { .durability = DN_DURABILITY_NONE };
+    MDOptions sync_opts = { .durability = DN_DURABILITY_SYNC };
+    MDOptions group_opts = { .durability = DN_DURABILITY_GROUP };
+    MDOptions window_opts = { .durability = DN_DURABILITY_GROUP, .group_commit_us = 200 };
+
+    DurabilityResult results[] = {
+        bench_durability("none", none_opts),
+        bench_durability("sync", sync_opts),
+        bench_durability("group", group_opts),
+        bench_durability("group200", window_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    printf("\n========================================\n");
+    printf("Per-block write latency by durability mode (%d nodes, %d blocks, %d rounds)\n",
+           NUM_NODES, FILE_BLOCKS, ROUNDS);
+    printf("========================================\n");
+    printf("%-10s %16s %16s %16s\n", "mode", "write_block_us", "write_async_us", "write_file_us");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-10s %16.2f %16.2f %16.2f\n", results[i].name,
+               results[i].write_block_us, results[i].write_async_us, results[i].write_file_us);
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define FILE_BLOCKS 512
+#define ROUNDS 10
+
+// Whole-file throughput of a file striped over num_nodes datanodes
+static void bench_fanout(int num_nodes, double *read_mbps, double *write_mbps)
+{
+    metadatanode_init(num_nodes, 2 * FILE_BLOCKS * BLOCK_SIZE, "roundrobin");
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("striped.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'F', size);
+
+    double start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        metadatanode_write_file(fid, data, size);
+    }
+    double write_ms = get_time_ms() - start;
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        void *buffer;
+        size_t read_size;
+        if (metadatanode_read_file(fid, &buffer, &read_size) == MDN_SUCCESS)
+            free(buffer);
+    }
+    double read_ms = get_time_ms() - start;
+
+    double mb = (double)size * ROUNDS / (1024.0 * 1024.0);
+    *write_mbps = mb / (write_ms / 1000.0);
+    *read_mbps = mb / (read_ms / 1000.0);
+
+    free(data);
+    metadatanode_exit(1);
+}
+
+int main(void)
+{
+    int node_counts[] = { 1, 2, 4, 8 };
+    int num_counts = sizeof(node_counts) / sizeof(node_counts[0]);
+    double read_mbps[4], write_mbps[4];
+
+    for (int i = 0; i < num_counts; i++) {
+        bench_fanout(node_counts[i], &read_mbps[i], &write_mbps[i]);
+    }
+
+    printf("\n========================================\n");
+    printf("Whole-file fan-out (%d blocks, %d rounds)\n", FILE_BLOCKS, ROUNDS);
+    printf("========================================\n");
+    printf("%-6s %12s %12s %10s\n", "nodes", "read_MBps", "write_MBps", "read_x");
+    for (int i = 0; i < num_counts; i++) {
+        printf("%-6d %12.1f %12.1f %10.2f\n", node_counts[i],
+               read_mbps[i], write_mbps[i], read_mbps[i] / read_mbps[0]);
+    }
+
+    return 0;
+}
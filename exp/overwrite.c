@@ -0,0 +1,101 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BLOCKS 1024
+#define OVERWRITES 8192
+#define SEED 42
+
+typedef struct {
+    const char *name;
+    double write_us;
+    double write_async_us;
+    double read_file_us;
+} OverwriteResult;
+
+// Per-block latency of random single-block overwrites of a file filling half
+// the capacity, then of reading it back whole
+static OverwriteResult bench_overwrite(const char *name, MDOptions opts)
+{
+    OverwriteResult r = { name, 0, 0, 0 };
+
+    metadatanode_init_opts(NUM_NODES, 2 * FILE_BLOCKS * BLOCK_SIZE, "roundrobin", &opts);
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("overwrite.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'O', size);
+    metadatanode_write_file(fid, data, size);
+
+    srand(SEED);
+    double start = get_time_ms();
+    for (int i = 0; i < OVERWRITES; i++) {
+        int block = rand() % FILE_BLOCKS;
+        metadatanode_write_block(fid, block, data + (size_t)block * BLOCK_SIZE);
+    }
+    r.write_us = (get_time_ms() - start) * 1000.0 / OVERWRITES;
+
+    start = get_time_ms();
+    for (int i = 0; i < OVERWRITES; i += MD_PIPELINE_DEPTH) {
+        for (int k = 0; k < MD_PIPELINE_DEPTH; k++) {
+            int block = rand() % FILE_BLOCKS;
+            MDHandle handle;
+            metadatanode_write_block_async(fid, block, data + (size_t)block * BLOCK_SIZE,
+                                           NULL, NULL, &handle);
+        }
+        metadatanode_drain();
+
+        MDCompletion completions[MD_PIPELINE_DEPTH];
+        while (metadatanode_reap(completions, MD_PIPELINE_DEPTH) > 0);
+    }
+    r.write_async_us = (get_time_ms() - start) * 1000.0 / OVERWRITES;
+
+    start = get_time_ms();
+    void *buffer;
+    size_t read_size;
+    if (metadatanode_read_file(fid, &buffer, &read_size) == MDN_SUCCESS)
+        free(buffer);
+    r.read_file_us = (get_time_ms() - start) * 1000.0 / FILE_BLOCKS;
+
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    MDOptions container_opts = { .store = "container" };
+    MDOptions log_opts = { .store = "log" };
+    MDOptions container_sync_opts = { .store = "container", .durability = DN_DURABILITY_SYNC };
+    MDOptions log_sync_opts = { .store = "log", .durability = DN_DURABILITY_SYNC };
+    MDOptions container_direct_opts = { .store = "container", .direct_io = 1, .block_cache = -1 };
+    MDOptions log_direct_opts = { .store = "log", .direct_io = 1, .block_cache = -1 };
+
+    OverwriteResult results[] = {
+        bench_overwrite("container", container_opts),
+        bench_overwrite("log", log_opts),
+        bench_overwrite("container+sync", container_sync_opts),
+        bench_overwrite("log+sync", log_sync_opts),
+        bench_overwrite("container+direct", container_direct_opts),
+        bench_overwrite("log+direct", log_direct_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    printf("\n========================================\n");
+    printf("Per-block latency of random overwrites by block store (%d nodes, %d blocks, %d overwrites)\n",
+           NUM_NODES, FILE_BLOCKS, OVERWRITES);
+    printf("========================================\n");
+    printf("%-18s %16s %16s %16s\n", "store", "write_us", "write_async_us", "read_file_us");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-18s %16.2f %16.2f %16.2f\n", results[i].name,
+               results[i].write_us, results[i].write_async_us, results[i].read_file_us);
+    }
+
+    return 0;
+}
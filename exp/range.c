@@ -0,0 +1,117 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BLOCKS 1024
+#define UPDATES 2048
+#define UPDATE_SIZE 100
+#define WHOLE_FILE_UPDATES 16
+#define SEED 42
+
+typedef struct {
+    const char *name;
+    double pread_us;
+    double read_block_us;
+    double pwrite_us;
+    double rmw_block_us;
+    double write_file_us;
+} RangeResult;
+
+// Per-update latency of UPDATE_SIZE byte reads and writes at random offsets of
+// a large file, as ranges, as whole blocks and by re-sending the whole file
+static RangeResult bench_range(const char *name, MDOptions opts)
+{
+    RangeResult r = { name, 0, 0, 0, 0, 0 };
+
+    metadatanode_init_opts(NUM_NODES, 2 * FILE_BLOCKS * BLOCK_SIZE, "roundrobin", &opts);
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("range.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'R', size);
+    metadatanode_write_file(fid, data, size);
+
+    char update[UPDATE_SIZE];
+    memset(update, 'U', sizeof(update));
+    char *block = malloc(BLOCK_SIZE);
+
+    srand(SEED);
+    double start = get_time_ms();
+    for (int i = 0; i < UPDATES; i++) {
+        size_t offset = (size_t)rand() % (size - UPDATE_SIZE);
+        metadatanode_pread(fid, offset, UPDATE_SIZE, update);
+    }
+    r.pread_us = (get_time_ms() - start) * 1000.0 / UPDATES;
+
+    start = get_time_ms();
+    for (int i = 0; i < UPDATES; i++) {
+        size_t offset = (size_t)rand() % (size - UPDATE_SIZE);
+        metadatanode_read_block(fid, offset / BLOCK_SIZE, block);
+    }
+    r.read_block_us = (get_time_ms() - start) * 1000.0 / UPDATES;
+
+    start = get_time_ms();
+    for (int i = 0; i < UPDATES; i++) {
+        size_t offset = (size_t)rand() % (size - UPDATE_SIZE);
+        metadatanode_pwrite(fid, offset, UPDATE_SIZE, update);
+    }
+    r.pwrite_us = (get_time_ms() - start) * 1000.0 / UPDATES;
+
+    // what a caller had to do before: fetch the block, patch it, send it back
+    start = get_time_ms();
+    for (int i = 0; i < UPDATES; i++) {
+        int index = rand() % FILE_BLOCKS;
+        size_t offset = (size_t)rand() % (BLOCK_SIZE - UPDATE_SIZE);
+        metadatanode_read_block(fid, index, block);
+        memcpy(block + offset, update, UPDATE_SIZE);
+        metadatanode_write_block(fid, index, block);
+    }
+    r.rmw_block_us = (get_time_ms() - start) * 1000.0 / UPDATES;
+
+    start = get_time_ms();
+    for (int i = 0; i < WHOLE_FILE_UPDATES; i++) {
+        size_t offset = (size_t)rand() % (size - UPDATE_SIZE);
+        memcpy(data + offset, update, UPDATE_SIZE);
+        metadatanode_write_file(fid, data, size);
+    }
+    r.write_file_us = (get_time_ms() - start) * 1000.0 / WHOLE_FILE_UPDATES;
+
+    free(block);
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    MDOptions socket_opts = { .transport = MD_TRANSPORT_SOCKET };
+    MDOptions shm_opts = { .transport = MD_TRANSPORT_SHM };
+    MDOptions sync_opts = { .transport = MD_TRANSPORT_SOCKET, .durability = DN_DURABILITY_SYNC };
+
+    RangeResult results[] = {
+        bench_range("socket", socket_opts),
+        bench_range("shm", shm_opts),
+        bench_range("socket+sync", sync_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    printf("\n========================================\n");
+    printf("Per-update latency of %d byte accesses at random offsets (%d nodes, %d blocks, %d updates)\n",
+           UPDATE_SIZE, NUM_NODES, FILE_BLOCKS, UPDATES);
+    printf("========================================\n");
+    printf("%-12s %12s %14s %12s %14s %16s\n", "transport", "pread_us", "read_block_us",
+           "pwrite_us", "rmw_block_us", "write_file_us");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-12s %12.2f %14.2f %12.2f %14.2f %16.2f\n", results[i].name,
+               results[i].pread_us, results[i].read_block_us, results[i].pwrite_us,
+               results[i].rmw_block_us, results[i].write_file_us);
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BLOCKS 65536
+#define CRASH_BLOCKS 1024
+
+extern MetadataNode *md;
+
+typedef struct {
+    const char *name;
+    double start_ms;
+    double restart_ms;
+    int recovered;
+} RestartResult;
+
+// Time to bring up empty datanodes, then to restart them over the blocks of
+// a file written by the previous run
+static RestartResult bench_restart(const char *name, MDOptions opts)
+{
+    RestartResult r = { name, 0, 0, 0 };
+    size_t capacity = 2 * (size_t)FILE_BLOCKS * BLOCK_SIZE;
+
+    double start = get_time_ms();
+    metadatanode_init_opts(NUM_NODES, capacity, "roundrobin", &opts);
+    r.start_ms = get_time_ms() - start;
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("restart.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'R', size);
+    metadatanode_write_file(fid, data, size);
+    free(data);
+
+    metadatanode_exit(0);
+
+    opts.recover = 1;
+    start = get_time_ms();
+    metadatanode_init_opts(NUM_NODES, capacity, "roundrobin", &opts);
+    r.restart_ms = get_time_ms() - start;
+
+    for (int i = 0; i < NUM_NODES; i++) {
+        int *blocks;
+        int count;
+        if (metadatanode_list_blocks(i, &blocks, &count) == MDN_SUCCESS) {
+            r.recovered += count;
+            free(blocks);
+        }
+    }
+
+    metadatanode_exit(1);
+
+    return r;
+}
+
+// Blocks a restart gets wrong after the datanodes are killed right behind
+// writes answered under DN_DURABILITY_SYNC. Every other block of the file is
+// overwritten first, the log store moving each of them to a fresh slot
+static int crash_lost(MDOptions opts)
+{
+    size_t capacity = 2 * (size_t)CRASH_BLOCKS * BLOCK_SIZE;
+    opts.durability = DN_DURABILITY_SYNC;
+    metadatanode_init_opts(NUM_NODES, capacity, "roundrobin", &opts);
+
+    size_t size = (size_t)CRASH_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("crash.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'A', size);
+    metadatanode_write_file(fid, data, size);
+    for (int i = 0; i < CRASH_BLOCKS; i += 2) {
+        memset(data + (size_t)i * BLOCK_SIZE, 'B', BLOCK_SIZE);
+        metadatanode_write_block(fid, i, data + (size_t)i * BLOCK_SIZE);
+    }
+
+    int blocks[CRASH_BLOCKS];
+    uint32_t crcs[CRASH_BLOCKS];
+    for (int i = 0; i < CRASH_BLOCKS; i++) {
+        blocks[i] = md->files[fid].blocks[i];
+        crcs[i] = md->block_crc[blocks[i]];
+    }
+
+    // no datanode gets to write anything out on its way down
+    for (int i = 0; i < md->num_nodes; i++) {
+        kill(md->connections[i].pid, SIGKILL);
+        waitpid(md->connections[i].pid, NULL, 0);
+        close(md->connections[i].sock_fd);
+    }
+    metadatanode_end();
+
+    opts.recover = 1;
+    metadatanode_init_opts(NUM_NODES, capacity, "roundrobin", &opts);
+
+    char *recovered = calloc(md->num_block_ids, 1);
+    for (int i = 0; i < md->num_nodes; i++) {
+        int *listed;
+        int count;
+        if (metadatanode_list_blocks(i, &listed, &count) == MDN_SUCCESS) {
+            for (int k = 0; k < count; k++)
+                recovered[listed[k]] = 1;
+            free(listed);
+        }
+    }
+
+    // the recovered blocks make up the file again
+    metadatanode_create_file("crash.dat", 0, &fid);
+    FileEntry *file = &md->files[fid];
+    file->blocks = malloc(sizeof(blocks));
+    memcpy(file->blocks, blocks, sizeof(blocks));
+    file->num_blocks = CRASH_BLOCKS;
+    for (int i = 0; i < CRASH_BLOCKS; i++)
+        md->block_crc[blocks[i]] = crcs[i];
+
+    int lost = 0;
+    char *block = malloc(BLOCK_SIZE);
+    for (int i = 0; i < CRASH_BLOCKS; i++) {
+        if (!recovered[blocks[i]] || metadatanode_read_block(fid, i, block) != MDN_SUCCESS ||
+            memcmp(block, data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE) != 0)
+            lost++;
+    }
+    free(block);
+    free(recovered);
+    free(data);
+
+    metadatanode_exit(1);
+
+    return lost;
+}
+
+int main(void)
+{
+    MDOptions container_opts = { .store = "container" };
+    MDOptions files_opts = { .store = "files" };
+    MDOptions log_opts = { .store = "log" };
+
+    RestartResult results[] = {
+        bench_restart("container", container_opts),
+        bench_restart("files", files_opts),
+        bench_restart("log", log_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    int lost[] = {
+        crash_lost(container_opts),
+        crash_lost(files_opts),
+        crash_lost(log_opts),
+    };
+
+    printf("\n========================================\n");
+    printf("Cluster start and restart time by block store (%d nodes, %d blocks)\n",
+           NUM_NODES, FILE_BLOCKS);
+    printf("========================================\n");
+    printf("%-10s %12s %12s %12s %12s\n", "store", "start_ms", "restart_ms", "recovered",
+           "crash_lost");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-10s %12.2f %12.2f %12d %12d\n", results[i].name,
+               results[i].start_ms, results[i].restart_ms, results[i].recovered, lost[i]);
+    }
+
+    return 0;
+}
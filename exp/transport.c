@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <signal.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define NUM_NODES 4
+#define FILE_BLOCKS 64
+#define ROUNDS 20
+// files of the mixed case, 2 MiB per node with 4 KiB blocks, more than a
+// connection buffers
+#define MIXED_BLOCKS 2048
+#define MIXED_ROUNDS 5
+#define TCP_BASE_PORT 7400
+
+typedef struct {
+    const char *name;
+    double write_block_us;
+    double read_block_us;
+    double read_file_us;
+    double mixed_async_us;
+} TransportResult;
+
+static void count_failure(MDHandle handle, MDNStatus status, void *arg)
+{
+    (void)handle;
+    if (status != MDN_SUCCESS)
+        (*(int *)arg)++;
+}
+
+// Per-block latency of single-block and whole-file operations over one transport
+TransportResult bench_transport(const char *name, MDOptions opts)
+{
+    TransportResult r = { name, 0, 0, 0, 0 };
+
+    metadatanode_init_opts(NUM_NODES, 2 * (FILE_BLOCKS + 2 * MIXED_BLOCKS) * BLOCK_SIZE, "roundrobin", &opts);
+
+    int fid;
+    metadatanode_create_file("bench.dat", FILE_BLOCKS * BLOCK_SIZE, &fid);
+
+    char *block = malloc(BLOCK_SIZE);
+    memset(block, 'A', BLOCK_SIZE);
+
+    double start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILE_BLOCKS; i++) {
+            metadatanode_write_block(fid, i, block);
+        }
+    }
+    r.write_block_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILE_BLOCKS; i++) {
+            metadatanode_read_block(fid, i, block);
+        }
+    }
+    r.read_block_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    start = get_time_ms();
+    for (int round = 0; round < ROUNDS; round++) {
+        void *buffer;
+        size_t size;
+        if (metadatanode_read_file(fid, &buffer, &size) == MDN_SUCCESS)
+            free(buffer);
+    }
+    r.read_file_us = (get_time_ms() - start) * 1000.0 / (ROUNDS * FILE_BLOCKS);
+
+    // a whole-file read and a whole-file write outstanding together on every
+    // node, both larger than the connections buffer
+    size_t mixed_size = (size_t)MIXED_BLOCKS * BLOCK_SIZE;
+    int src, dst;
+    metadatanode_create_file("mixed_src.dat", mixed_size, &src);
+    metadatanode_create_file("mixed_dst.dat", mixed_size, &dst);
+
+    char *in = malloc(mixed_size);
+    char *out = malloc(mixed_size);
+    memset(out, 'M', mixed_size);
+    metadatanode_write_file(src, out, mixed_size);
+
+    int failed = 0;
+    start = get_time_ms();
+    for (int round = 0; round < MIXED_ROUNDS; round++) {
+        MDHandle handle;
+        metadatanode_read_file_async(src, in, mixed_size, count_failure, &failed, &handle);
+        metadatanode_write_file_async(dst, out, mixed_size, count_failure, &failed, &handle);
+        metadatanode_drain();
+    }
+    r.mixed_async_us = (get_time_ms() - start) * 1000.0 / (MIXED_ROUNDS * 2 * MIXED_BLOCKS);
+
+    if (failed > 0 || memcmp(in, out, mixed_size) != 0)
+        fprintf(stderr, "%s: mixed asynchronous read and write came back wrong\n", name);
+
+    free(in);
+    free(out);
+    free(block);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+// Standalone datanodes on localhost, as if started by the datanode executable
+static int spawn_tcp_datanodes(char addresses[][32], pid_t *pids)
+{
+    for (int i = 0; i < NUM_NODES; i++) {
+        snprintf(addresses[i], 32, "127.0.0.1:%d", TCP_BASE_PORT + i);
+
+        int listen_fd = comm_tcp_listen(addresses[i]);
+        if (listen_fd < 0) return -1;
+
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            datanode_serve(listen_fd);
+            exit(1);
+        }
+        close(listen_fd);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    char tcp_addresses[NUM_NODES][32];
+    const char *tcp_list[NUM_NODES];
+    pid_t tcp_pids[NUM_NODES] = {0};
+
+    if (spawn_tcp_datanodes(tcp_addresses, tcp_pids) != 0)
+        return 1;
+    for (int i = 0; i < NUM_NODES; i++)
+        tcp_list[i] = tcp_addresses[i];
+
+    MDOptions socket_opts = { .transport = MD_TRANSPORT_SOCKET };
+    MDOptions files_opts = { .transport = MD_TRANSPORT_SOCKET, .store = "files" };
+    MDOptions mmap_opts = { .transport = MD_TRANSPORT_SOCKET, .mmap_reads = 1 };
+    MDOptions direct_opts = { .transport = MD_TRANSPORT_SOCKET, .direct_io = 1 };
+    MDOptions shm_opts = { .transport = MD_TRANSPORT_SHM };
+    MDOptions uring_opts = { .transport = MD_TRANSPORT_SOCKET, .engine = DN_ENGINE_URING };
+    MDOptions threads_opts = { .transport = MD_TRANSPORT_SOCKET, .engine = DN_ENGINE_THREADS };
+    MDOptions tcp_opts = { .transport = MD_TRANSPORT_TCP, .addresses = tcp_list,
+                           .num_addresses = NUM_NODES };
+
+    TransportResult results[] = {
+        bench_transport("socket", socket_opts),
+        bench_transport("files", files_opts),
+        bench_transport("mmap", mmap_opts),
+        bench_transport("direct", direct_opts),
+        bench_transport("shm", shm_opts),
+        bench_transport("io_uring", uring_opts),
+        bench_transport("threads", threads_opts),
+        bench_transport("tcp", tcp_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    for (int i = 0; i < NUM_NODES; i++) {
+        if (tcp_pids[i] > 0) {
+            kill(tcp_pids[i], SIGTERM);
+            waitpid(tcp_pids[i], NULL, 0);
+        }
+    }
+
+    printf("\n========================================\n");
+    printf("Per-block latency by transport, datanode engine and block store (%d nodes, %d blocks, %d rounds)\n",
+           NUM_NODES, FILE_BLOCKS, ROUNDS);
+    printf("========================================\n");
+    printf("%-10s %16s %16s %16s %16s\n", "transport", "write_block_us", "read_block_us", "read_file_us",
+           "mixed_async_us");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-10s %16.2f %16.2f %16.2f %16.2f\n", results[i].name,
+               results[i].write_block_us, results[i].read_block_us, results[i].read_file_us,
+               results[i].mixed_async_us);
+    }
+
+    return 0;
+}
@@ -154,7 +154,7 @@ int test_write_and_read_file() {
     
     // Verify
     if (file_size != 3 * BLOCK_SIZE) {
-        printf("File size mismatch: expected %d, got %zu\n", 3 * BLOCK_SIZE, file_size);
+        printf("File size mismatch: expected %zu, got %zu\n", 3 * BLOCK_SIZE, file_size);
         free(write_data);
         free(read_data);
         metadatanode_exit(0);
@@ -363,7 +363,7 @@ int test_truncate_file() {
     }
     
     if (size != BLOCK_SIZE) {
-        printf("Truncated file has wrong size: %zu (expected %d)\n", size, BLOCK_SIZE);
+        printf("Truncated file has wrong size: %zu (expected %zu)\n", size, BLOCK_SIZE);
         free(data);
         metadatanode_exit(0);
         return 0;
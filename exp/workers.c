@@ -0,0 +1,79 @@
+#include <stdio.h>
+
+#include "metric.h"
+#include "datanode.h"
+#include "metadatanode.h"
+
+#define FILE_BLOCKS 1024
+#define READS 8192
+
+typedef struct {
+    const char *name;
+    double read_us;
+} WorkersResult;
+
+// Per-block latency of pipelined random reads that miss every cache, a slow
+// read only stalls the whole node when nothing else can run beside it
+static WorkersResult bench_workers(const char *name, MDOptions opts)
+{
+    WorkersResult r = { name, 0 };
+
+    opts.direct_io = 1;
+    opts.block_cache = -1;
+    metadatanode_init_opts(1, FILE_BLOCKS * BLOCK_SIZE, "roundrobin", &opts);
+
+    size_t size = (size_t)FILE_BLOCKS * BLOCK_SIZE;
+    int fid;
+    metadatanode_create_file("random.dat", size, &fid);
+
+    char *data = malloc(size);
+    memset(data, 'W', size);
+    metadatanode_write_file(fid, data, size);
+
+    srand(42);
+    double start = get_time_ms();
+    for (int i = 0; i < READS; i++) {
+        MDHandle handle;
+        metadatanode_read_block_async(fid, rand() % FILE_BLOCKS, data + (size_t)(i % FILE_BLOCKS) * BLOCK_SIZE,
+                                      NULL, NULL, &handle);
+
+        MDCompletion completions[MD_PIPELINE_DEPTH];
+        metadatanode_reap(completions, MD_PIPELINE_DEPTH);
+    }
+    metadatanode_drain();
+    r.read_us = (get_time_ms() - start) * 1000.0 / READS;
+
+    free(data);
+    metadatanode_exit(1);
+
+    return r;
+}
+
+int main(void)
+{
+    MDOptions sync_opts = { .engine = DN_ENGINE_SYNC };
+    MDOptions threads1_opts = { .engine = DN_ENGINE_THREADS, .workers = 1 };
+    MDOptions threads4_opts = { .engine = DN_ENGINE_THREADS, .workers = 4 };
+    MDOptions threads8_opts = { .engine = DN_ENGINE_THREADS, .workers = 8 };
+    MDOptions uring_opts = { .engine = DN_ENGINE_URING };
+
+    WorkersResult results[] = {
+        bench_workers("sync", sync_opts),
+        bench_workers("threads1", threads1_opts),
+        bench_workers("threads4", threads4_opts),
+        bench_workers("threads8", threads8_opts),
+        bench_workers("io_uring", uring_opts),
+    };
+    int num_results = sizeof(results) / sizeof(results[0]);
+
+    printf("\n========================================\n");
+    printf("Pipelined uncached random reads by datanode engine (1 node, %d blocks, %d reads)\n",
+           FILE_BLOCKS, READS);
+    printf("========================================\n");
+    printf("%-10s %12s\n", "engine", "read_us");
+    for (int i = 0; i < num_results; i++) {
+        printf("%-10s %12.2f\n", results[i].name, results[i].read_us);
+    }
+
+    return 0;
+}
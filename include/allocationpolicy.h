@@ -10,6 +10,7 @@ extern struct AllocPolicy *policy;
 
 typedef struct AllocContext {
 	size_t file_blocks;
+	int block_class;	// policies pick among the nodes with room in this class
 } AllocContext;
 
 #define ALLOCPOLICIES \
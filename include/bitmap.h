@@ -12,6 +12,10 @@ typedef size_t bitmap_t;
 
 int bitmap_init(bitmap_t *bitmap, uint32_t nbits);
 
+// Extend a bitmap of nbits to new_nbits free bits, its words already
+// allocated
+void bitmap_grow(bitmap_t *bitmap, uint32_t nbits, uint32_t new_nbits);
+
 int bitmap_alloc(bitmap_t *bitmap, uint32_t nbits, uint32_t *index);
 
 void bitmap_free(bitmap_t *bitmap, uint32_t nbits, uint32_t index);
@@ -0,0 +1,72 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory cache of block data inside a datanode, replaced with ARC
+// (Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead Replacement Cache").
+// Blocks seen once live in T1 and blocks seen again in T2. Ghost lists B1
+// and B2 remember recently evicted block indices without their data, and
+// hits on them steer how much of the cache T1 may use. A scan only churns
+// T1, so the frequently read blocks in T2 survive it.
+enum {
+    ARC_T1,
+    ARC_T2,
+    ARC_B1,
+    ARC_B2,
+    ARC_LISTS,
+};
+
+typedef struct BlockCacheEntry {
+    int block_index;
+    int list;
+    char *data;                     // NULL on the ghost lists
+    struct BlockCacheEntry *prev;   // towards the MRU end of its list
+    struct BlockCacheEntry *next;
+    struct BlockCacheEntry *hnext;  // hash chain, or free list
+} BlockCacheEntry;
+
+typedef struct {
+    BlockCacheEntry *mru;
+    BlockCacheEntry *lru;
+    int size;
+} BlockCacheList;
+
+typedef struct BlockCache {
+    int capacity;           // blocks with data
+    size_t block_size;
+    int target_t1;          // ARC's p
+
+    BlockCacheList lists[ARC_LISTS];
+
+    BlockCacheEntry *entries;       // 2 * capacity, data plus ghosts
+    BlockCacheEntry *free_entries;
+    BlockCacheEntry **buckets;
+    int mask;
+
+    char *arena;
+    char **free_data;
+    int num_free_data;
+
+    uint64_t hits;
+    uint64_t misses;
+} BlockCache;
+
+// Cache as many blocks as fit in budget bytes, none for a budget below a block
+int blockcache_init(BlockCache *cache, size_t budget, size_t block_size);
+
+// Copy block_index into buffer, 0 on a hit and -1 on a miss
+int blockcache_get(BlockCache *cache, int block_index, void *buffer);
+
+// Admit a block read from storage after a miss
+void blockcache_insert(BlockCache *cache, int block_index, const void *data);
+
+// Write-through, refresh a cached copy without changing its recency
+void blockcache_update(BlockCache *cache, int block_index, const void *data);
+
+void blockcache_invalidate(BlockCache *cache, int block_index);
+
+void blockcache_destroy(BlockCache *cache);
+
+#endif // BLOCKCACHE_H
@@ -0,0 +1,94 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "communication.h"
+
+extern struct BlockStore *store;
+
+// Where a block lives on the datanode's disk. The checksum is a separate
+// DN_CRC_SIZE bytes at crc_offset of crc_fd, right after the data for
+// stores that keep it as a trailer
+typedef struct DNBlockLoc {
+    int fd;
+    off_t offset;
+    int crc_fd;
+    off_t crc_offset;
+    size_t size;        // bytes of data, set by datanode_block_open
+    void *handle;       // store private, until release
+} DNBlockLoc;
+
+#define DN_DEFAULT_STORE "container"
+
+#define BLOCKSTORES \
+    S(container) \
+    S(files) \
+    S(log) \
+
+#define S(name) \
+    int name##_init(void); \
+    DNStatus name##_alloc(int block_index); \
+    DNStatus name##_free(int block_index); \
+    int name##_locate(int block_index, int for_write, DNBlockLoc *loc); \
+    void name##_release(DNBlockLoc *loc); \
+    const void *name##_map(int block_index, uint32_t *crc); \
+    void name##_advise(int count, const int *block_indices); \
+    int name##_sync(void); \
+    int name##_commit(DNBlockLoc *loc); \
+    int name##_list(int **block_indices); \
+    void name##_destroy(void);
+    BLOCKSTORES
+#undef S
+
+typedef struct BlockStore {
+    const char *name;
+
+    // dn is initialized with its directory and block classes. Stores keep
+    // each class apart, in slots of its block size. With dn->recover the
+    // blocks a previous run left in the directory are kept, found from the
+    // store's own index rather than a directory walk
+    int (*init)(void);
+    // A newly allocated block reads as zeros with a valid checksum
+    DNStatus (*alloc)(int block_index);
+    // DN_INVALID_BLOCK for a block that was never allocated
+    DNStatus (*free)(int block_index);
+    // Location of an allocated block, 1 if it was never allocated, -1 on error
+    int (*locate)(int block_index, int for_write, DNBlockLoc *loc);
+    void (*release)(DNBlockLoc *loc);
+    // With dn->direct_io, fd must be opened with O_DIRECT. Stores that cannot
+    // clear direct_io in init, like mmap_reads below
+    // With dn->mmap_reads, the block's data in mapped storage and its checksum.
+    // Stores without a mapping clear mmap_reads in init
+    const void *(*map)(int block_index, uint32_t *crc);
+    // Access hint ahead of mapped reads of a batch
+    void (*advise)(int count, const int *block_indices);
+    // Make everything written so far durable
+    int (*sync)(void);
+    // Make the block just written at loc durable, index included, before the
+    // write is answered under DN_DURABILITY_SYNC. Runs without dn->lock
+    int (*commit)(DNBlockLoc *loc);
+    // Every allocated block in no particular order, the caller frees the
+    // array. Returns how many or -1
+    int (*list)(int **block_indices);
+    // Leaves everything needed to recover the blocks behind
+    void (*destroy)(void);
+
+    void *state;
+} BlockStore;
+
+bool block_store_init(const char *name);
+void block_store_end(void);
+
+// Give the filesystem back the part of the size byte slot at offset past its
+// first length bytes, which reads as zeros afterwards. Compressed blocks fill
+// only the start of their slot
+int block_store_trim(int fd, off_t offset, size_t length, size_t size);
+
+// Path of the store file name holds block class c in, name.dat for the first
+// class, the file a single class node has always used, name.c.dat for others
+void block_store_path(char *path, size_t size, const char *name, int c);
+
+#endif // BLOCK_STORE_H
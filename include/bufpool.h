@@ -0,0 +1,27 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+// Fixed number of equally sized buffers carved out of one aligned arena,
+// allocated once so the I/O path never goes to malloc
+typedef struct BufPool {
+    char *arena;
+    size_t buf_size;
+    int count;
+
+    void **free_bufs;
+    int num_free;
+} BufPool;
+
+// buf_size is rounded up to a multiple of align, which must be a power of two
+int bufpool_init(BufPool *pool, int count, size_t buf_size, size_t align);
+
+// NULL once every buffer is taken
+void *bufpool_get(BufPool *pool);
+
+void bufpool_put(BufPool *pool, void *buf);
+
+void bufpool_destroy(BufPool *pool);
+
+#endif // BUFPOOL_H
@@ -2,18 +2,33 @@
 #define COMMUNICATION_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/uio.h>
+
+#include "shmring.h"
 
 typedef enum {
     DN_INIT,
-    DN_ALLOC_BLOCK,
+    DN_ALLOC_BLOCK,     // deprecated, blocks get storage on their first write.
+                        // Answered with success and no effect, for older
+                        // metadata nodes
     DN_FREE_BLOCK,
     DN_READ_BLOCK,
     DN_WRITE_BLOCK,
+    DN_ALLOC_BLOCKS,    // deprecated, as DN_ALLOC_BLOCK
+    DN_FREE_BLOCKS,
+    DN_READ_BLOCKS,
+    DN_WRITE_BLOCKS,
+    DN_STATS,
+    DN_SYNC,        // barrier, every write answered so far is durable after it
+    DN_LIST_BLOCKS, // every block the datanode holds, answered with their indices
+    DN_READ_RANGE,  // part of a block, see DNRangePayload
+    DN_WRITE_RANGE,
     DN_EXIT,
 } DNCommand;
 
@@ -21,33 +36,126 @@ typedef enum {
     DN_SUCCESS = 0,
     DN_NO_SPACE,
     DN_INVALID_BLOCK,
-    DN_FAIL
+    DN_FAIL,
+    DN_CORRUPT,     // block data does not match its checksum
 } DNStatus;
 
+// Most block size classes a datanode stores
+#define DN_MAX_CLASSES 4
+
+// Every request carries an id chosen by the metadata node, the datanode echoes
+// it back in the response so several requests can be outstanding per socket
 typedef struct {
+    uint32_t req_id;
     DNCommand cmd;
     size_t payload_size;
 } DNHeader;
 
 typedef struct {
+    uint32_t req_id;
     DNStatus status;
     size_t payload_size;
+    // the node's block storage of each class as it answered, what the
+    // metadata node counts its room by under compression. Set by compressing
+    // datanodes, 0 otherwise
+    uint64_t stored_bytes[DN_MAX_CLASSES];
+    int32_t stored_blocks[DN_MAX_CLASSES];
 } DNResponseHeader;
 
+// How a datanode serves its connection
+typedef enum {
+    DN_ENGINE_SYNC = 0,     // one command at a time, blocking I/O
+    DN_ENGINE_URING,        // io_uring, block I/O of many commands in flight
+    DN_ENGINE_THREADS,      // a receiver thread and a pool of I/O threads
+} DNEngine;
+
+// When a datanode answers a write
+typedef enum {
+    DN_DURABILITY_NONE = 0,     // once the data is in the page cache
+    DN_DURABILITY_SYNC,         // after an fdatasync of every written block
+    DN_DURABILITY_GROUP,        // after an fdatasync shared by a group of writes
+} DNDurability;
+
+#define DN_STORE_NAME_MAX 16
+
+// One block size class of a datanode. Block ids are dealt to the classes in
+// turn, block_index % num_classes is the class a block belongs to
+typedef struct {
+    size_t block_size;
+    size_t capacity;                // bytes of the class's blocks the node may store
+    int slots;                      // block slots the store lays out, 0 for capacity / block size
+} DNClassInit;
+
 typedef struct {
     int node_id;
-    size_t capacity;
+    int num_classes;
+    DNClassInit classes[DN_MAX_CLASSES];
+    DNEngine engine;
+    char store[DN_STORE_NAME_MAX];  // block store backend, empty for the default
+    int mmap_reads;
+    int direct_io;
+    int fd_cache;                   // descriptors to keep open, 0 default, < 0 none
+    int64_t block_cache;            // bytes of cached block data, 0 default, < 0 none
+    int workers;                    // DN_ENGINE_THREADS: I/O threads, 0 default
+    DNDurability durability;
+    int group_commit_us;            // DN_DURABILITY_GROUP: wait for more writes this long
+    int group_commit_batch;         // and commit once this many are held, 0 default
+    int recover;                    // keep the blocks a previous run left behind
+    int compress;                   // store blocks LZ compressed where it pays
+    int log_level;                  // see log.h, 0 keeps the default
 } DNInitPayload;
 
+// Datanode counters, returned by DN_STATS
+typedef struct {
+    uint64_t fd_cache_hits;
+    uint64_t fd_cache_misses;
+    uint64_t block_cache_hits;
+    uint64_t block_cache_misses;
+    uint64_t block_cache_hit_bytes; // block data served from the cache
+    uint64_t stored_blocks;         // blocks given storage
+    uint64_t stored_bytes;          // disk they take, compressed or not
+    uint64_t block_bytes;           // their data, uncompressed
+} DNStats;
+
 typedef struct {
     int block_index;
 } DNBlockIndexPayload;
 
+// Every written block travels with the CRC32C of its data, the block size of
+// its class in bytes of it follow
 typedef struct {
     int block_index;
-    char buffer[4096]; // for read/write
+    uint32_t crc;
+    char buffer[];
 } DNBlockPayload;
 
+// Bytes [offset, offset + length) of a block. DN_WRITE_RANGE is followed by
+// length bytes of data with crc as their CRC32C and answers with the new
+// checksum of the whole block. DN_READ_RANGE answers with the CRC32C of the
+// range followed by its length bytes
+typedef struct {
+    int block_index;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t crc;
+} DNRangePayload;
+
+// Batched commands carry count block indices, DN_WRITE_BLOCKS is followed by
+// count checksums and then count blocks of data in the same order.
+// DN_READ_BLOCKS answers with count blocks of data in that order. Blocks read
+// or written together are all of one class
+#define DN_MAX_BATCH 256
+
+typedef struct {
+    int count;
+    int block_indices[];
+} DNBlockListPayload;
+
+static inline uint32_t *dn_block_list_crcs(DNBlockListPayload *list)
+{
+    return (uint32_t *)&list->block_indices[list->count];
+}
+
 typedef struct {
 	int cleanup;
 } DNExitPayload;
@@ -56,12 +164,64 @@ ssize_t send_all(int sock_fd, const void *buf, size_t len);
 
 ssize_t recv_all(int sock_fd, void *buf, size_t len);
 
-ssize_t md_send_command(int sock_fd, DNCommand cmd, void *payload, size_t payload_size);
+// Route all traffic of sock_fd through shared-memory rings instead of the
+// socket itself, tx is the ring this end produces into
+int comm_attach_shm(int sock_fd, ShmRing *tx, ShmRing *rx);
+
+void comm_detach(int sock_fd);
+
+int comm_is_shm(int sock_fd);
+
+// Close the rings of a shm endpoint, how is SHUT_RD, SHUT_WR or SHUT_RDWR
+// as for shutdown(2). A peer blocked on them fails instead of waiting,
+// bytes already written still read. Sockets are left alone
+void comm_close_shm(int sock_fd, int how);
+
+// Wait up to timeout_ms (-1 forever) until one of fds has data to read and
+// flag those in ready, returns how many are ready or -1
+int comm_wait_readable(const int *fds, int nfds, int *ready, int timeout_ms);
+
+// Socket buffer size asked for on TCP connections
+#define COMM_TCP_BUFFER (4 * 1024 * 1024)
+
+// TCP endpoints are "host:port", listening returns the bound socket
+int comm_tcp_listen(const char *address);
+
+int comm_tcp_connect(const char *address);
+
+// Disable Nagle and enlarge the socket buffers of a TCP connection
+int comm_tcp_tune(int sock_fd);
+
+// Scatter-gather I/O, loops until every byte of iov went through. iov is
+// used up on the way, its entries no longer describe the buffers after
+ssize_t send_allv(int sock_fd, struct iovec *iov, int iovcnt);
+
+ssize_t recv_allv(int sock_fd, struct iovec *iov, int iovcnt);
+
+ssize_t recv_discard(int sock_fd, size_t len);
+
+// Zero-copy message layer: the header and the caller's iovecs go out in a
+// single sendmsg, receivers read the header first and then pull the payload
+// straight into their own memory with recv_all/recv_allv
+#define DN_MAX_IOV (DN_MAX_BATCH + 2)
+
+ssize_t md_send_commandv(int sock_fd, uint32_t req_id, DNCommand cmd, const struct iovec *iov, int iovcnt);
+
+ssize_t dn_send_responsev(int sock_fd, uint32_t req_id, DNStatus status, const struct iovec *iov, int iovcnt);
+
+// Send a response header filled in by the caller, payload_size is set from iov
+ssize_t dn_send_response_headerv(int sock_fd, DNResponseHeader *header, const struct iovec *iov, int iovcnt);
+
+ssize_t md_recv_response_header(int sock_fd, DNResponseHeader *header);
+
+ssize_t dn_recv_command_header(int sock_fd, DNHeader *header);
+
+ssize_t md_send_command(int sock_fd, uint32_t req_id, DNCommand cmd, void *payload, size_t payload_size);
 
-ssize_t md_recv_response(int sock_fd, DNStatus *status, void **payload, size_t *payload_size);
+ssize_t md_recv_response(int sock_fd, uint32_t *req_id, DNStatus *status, void **payload, size_t *payload_size);
 
-ssize_t dn_recv_command(int sock_fd, DNCommand *cmd, void **payload, size_t *payload_size);
+ssize_t dn_recv_command(int sock_fd, uint32_t *req_id, DNCommand *cmd, void **payload, size_t *payload_size);
 
-ssize_t dn_send_response(int sock_fd, DNStatus status, void *payload, size_t payload_size);
+ssize_t dn_send_response(int sock_fd, uint32_t req_id, DNStatus status, void *payload, size_t payload_size);
 
 #endif // COMMUNICATION_H
@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) of len bytes continuing from crc, start with crc = 0.
+// Uses the SSE4.2 crc32 instruction when the CPU has it
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Same result without the hardware path, for comparison and testing
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+// Whether crc32c() runs on the SSE4.2 path
+int crc32c_hw_available(void);
+
+#endif // CRC32C_H
@@ -1,8 +1,6 @@
 #ifndef DATANODE_H
 #define DATANODE_H
 
-#define BLOCK_SIZE 4096
-
 #define _XOPEN_SOURCE 500
 
 #include <stdio.h>
@@ -13,22 +11,92 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ftw.h>
+#include <pthread.h>
 
 #include "communication.h"
+#include "crc32c.h"
+#include "blockstore.h"
+#include "bufpool.h"
+#include "fdcache.h"
+#include "blockcache.h"
+#include "lz.h"
+#include "log.h"
+
+// Bytes of data in a block. A cluster parameter, the metadata node sets it at
+// init and hands datanodes the size of every block class in DNInitPayload.
+// A power of two between BLOCK_SIZE_MIN and BLOCK_SIZE_MAX. On a datanode
+// BLOCK_SIZE is the largest class's, what buffers for any block are sized by
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX (4 * 1024 * 1024)
+#define BLOCK_SIZE_DEFAULT BLOCK_SIZE_MIN
+
+extern size_t block_size;
+#define BLOCK_SIZE block_size
 
-#define LOGD(node_id, fmt, ...) \
-    do { \
-        printf("[DataNode %d] " fmt "\n", node_id, ##__VA_ARGS__); \
-        fflush(stdout); \
-    } while (0)
+static inline int block_size_valid(size_t size)
+{
+    return size >= BLOCK_SIZE_MIN && size <= BLOCK_SIZE_MAX && (size & (size - 1)) == 0;
+}
+
+// Leveled datanode logging, see log.h. LOGD is the informational level
+#define LOGD_ERROR(node_id, fmt, ...) LOG_AT(LOG_LEVEL_ERROR, "[DataNode %d] ERROR: " fmt, node_id, ##__VA_ARGS__)
+#define LOGD_WARN(node_id, fmt, ...) LOG_AT(LOG_LEVEL_WARN, "[DataNode %d] WARNING: " fmt, node_id, ##__VA_ARGS__)
+#define LOGD(node_id, fmt, ...) LOG_AT(LOG_LEVEL_INFO, "[DataNode %d] " fmt, node_id, ##__VA_ARGS__)
+#define LOGD_DEBUG(node_id, fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, "[DataNode %d] " fmt, node_id, ##__VA_ARGS__)
+
+// Blocks of one size, with their own share of the node's space
+typedef struct {
+    size_t block_size;
+    size_t capacity;
+    size_t size;            // bytes of block data stored, compressed with compress
+    int num_slots;          // blocks the store lays out at first, with
+                            // compress it adds more as blocks come in smaller
+    int num_blocks;         // blocks with storage
+    uint32_t zero_crc;      // checksum of a freshly allocated block
+    BlockCache cache;       // hot block data, skips the store on a hit
+} DNClass;
 
 typedef struct DataNode {
     int node_id;
     char dir_path[256];
-    size_t capacity;
-    size_t size;
+    // block ids are dealt to the classes in turn, see datanode_class
+    DNClass classes[DN_MAX_CLASSES];
+    int num_classes;
+    int recover;            // the store picked up blocks of a previous run
+
+    // blocks are stored LZ compressed unless that saves too little. Their
+    // compressed bytes are charged as written, stored[] has each block's
+    // share, and the whole pages of a slot past them go back to the filesystem
+    int compress;
+    uint32_t *stored;
+    int stored_cap;
 
     int sock_fd;
+    DNEngine engine;
+    int workers;            // I/O threads of DN_ENGINE_THREADS
+    // the store, caches, pool and counters below, shared by the I/O threads
+    // and the log store's compactor. Other engines take it uncontended
+    pthread_mutex_t lock;
+    int mmap_reads;         // reads are sent from mapped storage, no copy
+    int direct_io;          // block data bypasses the page cache
+    BufPool pool;           // aligned bounce buffers for direct_io, or
+                            // compression buffers for compress
+    FdCache fds;            // open block files of the files store
+
+    DNDurability durability;
+    int group_commit_us;
+    int group_commit_batch;
+    // group commit, ids of successful writes answered at the next sync
+    uint32_t *held;
+    int num_held;
+    int cap_held;
+    uint64_t held_since_us;
+
+    // message buffers reused across commands
+    void *recv_buf;
+    size_t recv_cap;
+    void *send_buf;
+    size_t send_cap;
 } DataNode;
 
 // Initialize a data node, create its starting directory
@@ -36,17 +104,148 @@ DNStatus datanode_init(int sock_fd, void *payload, size_t payload_size);
 
 DNStatus datanode_service_loop(int sock_fd);
 
-// Allocate a block, this is for creating a file
-DNStatus datanode_alloc_block(int block_index);
+// Serve metadata node connections accepted on listen_fd one after another,
+// only returns if accept fails
+DNStatus datanode_serve(int listen_fd);
+
+// Class of block_index, NULL for a negative index. Every other index has one,
+// block_index % num_classes
+DNClass *datanode_class(int block_index);
+
+// Bytes of data in block_index, those of its class, 0 for a negative index
+size_t datanode_block_size(int block_index);
+
+// Send a response, with the node's stored bytes and blocks in the header when
+// it compresses. Every datanode answer goes through these
+ssize_t datanode_respondv(int sock_fd, uint32_t req_id, DNStatus status, const struct iovec *iov, int iovcnt);
+
+ssize_t datanode_respond(int sock_fd, uint32_t req_id, DNStatus status, void *payload, size_t payload_size);
+
+// Serve one command and send its response, returns 1 once the node exited
+int datanode_dispatch(int sock_fd, uint32_t req_id, DNCommand cmd, void *payload, size_t payload_size);
+
+// Serve the connection with the io_uring engine until DN_EXIT, returns -1
+// without touching the socket if io_uring is unavailable
+int datanode_uring_loop(int sock_fd, DNStatus *status);
+
+// Serve the connection with a receiver and dn->workers I/O threads until
+// DN_EXIT, returns -1 without touching the socket if no thread could start
+int datanode_threads_loop(int sock_fd, DNStatus *status);
+
+// Validate a batched payload of block indices. With block_size the blocks
+// must all be of one class, whose block size is returned there, and with
+// data a checksum and a block of data follow every index
+DNBlockListPayload *datanode_block_list(void *payload, size_t payload_size, int data, size_t *block_size);
+
+// A received block read or write, blocks, crcs and wdata point into its payload
+typedef struct {
+    int is_write;
+    int count;
+    size_t block_size;      // the blocks are all of one class
+    const int *blocks;
+    const uint32_t *crcs;
+    char *wdata;
+} DNBlockOp;
+
+// Decode a block read or write, 0 for any other or a malformed command
+int datanode_block_op(DNCommand cmd, void *payload, size_t payload_size, DNBlockOp *op);
+
+// Block operations that must run in arrival order, they share a block and
+// one of them writes it
+int datanode_block_ops_conflict(const DNBlockOp *a, const DNBlockOp *b);
+
+// Point iov at the mapped data of every block, checksums are verified in place
+DNStatus datanode_map_blocks(int count, const int * block_indices, struct iovec * iov);
+
+// Reusable buffer of at least size bytes aligned for O_DIRECT, contents do
+// not survive growing
+void *datanode_buffer(void **buf, size_t *cap, size_t size);
+
+// O_DIRECT transfers need buffers, offsets and lengths aligned to this
+#define DN_DIRECT_ALIGN 4096
+// Bounce buffers for direct_io, enough for every block op the io_uring
+// engine keeps in flight with BLOCK_SIZE_MIN blocks. Larger blocks get
+// proportionally fewer, no less than DN_DIRECT_POOL_MIN or one per worker
+#define DN_DIRECT_POOL 128
+#define DN_DIRECT_POOL_MIN 16
+
+// Open descriptors kept by default, leaves room under the usual 1024 limit
+#define DN_FD_CACHE_DEFAULT 256
+// Bytes of block data cached by default
+#define DN_BLOCK_CACHE_DEFAULT (4 << 20)
+
+// Writes held for one group commit by default. The metadata node keeps no
+// more requests than this in flight, so a larger group could never fill
+#define DN_GROUP_COMMIT_BATCH 16
+
+// I/O threads of DN_ENGINE_THREADS by default
+#define DN_WORKERS_DEFAULT 4
+
+// Every stored block keeps the CRC32C of its data
+#define DN_CRC_SIZE sizeof(uint32_t)
+
+// A compressed block starts its storage with this header, the compressed
+// data follows. The checksum stays that of the uncompressed data
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+} DNCompressedHeader;
+
+#define DN_COMPRESSED_MAGIC 0x315a4c44u     // "DLZ1"
+
+// Blocks are kept raw unless compression saves an eighth of them, as ZFS
+// does
+#define DN_COMPRESS_LIMIT(size) ((size) - (size) / 8)
+
+// Where the block store keeps block_index, for engines issuing their own I/O.
+// 1 for a block that was never written, writes give it storage first. -1 on
+// failure, with the reason in status when not NULL. Both run with dn->lock held
+int datanode_block_open(int block_index, int for_write, DNBlockLoc *loc, DNStatus *status);
+
+void datanode_block_close(DNBlockLoc *loc);
+
+// Bytes at the start of block_index's slot holding its data, less than its
+// block size when it is stored compressed. With dn->lock held
+size_t datanode_block_bytes(int block_index);
+
+// The checksum directly follows the data, one request moves both
+static inline int datanode_block_trailer(const DNBlockLoc *loc)
+{
+    return loc->crc_fd == loc->fd && loc->crc_offset == loc->offset + (off_t)loc->size;
+}
+
+// Group commit: answer a successful write once it is durable. The group is
+// committed right away when it is full. These take dn->lock themselves
+void datanode_hold_response(int sock_fd, uint32_t req_id);
+
+// Sync the block store and answer every held write
+DNStatus datanode_commit(int sock_fd);
+
+// Microseconds left to wait for more writes before the held ones must be
+// committed, -1 when nothing is held
+long datanode_commit_due(void);
 
 // Freeing blocks, might not be used in DFS
 DNStatus datanode_free_block(int block_index);
 
-// Reading a block from its index
+// Reading a block from its index, DN_CORRUPT if it fails its checksum
 DNStatus datanode_read_block(int block_index, void * buffer);
 
-// Writing a block to its index
-DNStatus datanode_write_block(int block_index, void * buffer);
+// Writing a block to its index, crc is checked against buffer first
+DNStatus datanode_write_block(int block_index, void * buffer, uint32_t crc);
+
+// Read-modify-write of bytes [offset, offset + length) of a block, crc is
+// checked against data first. The new checksum of the whole block is
+// returned in block_crc
+DNStatus datanode_write_range(int block_index, uint32_t offset, uint32_t length,
+                              const void * data, uint32_t crc, uint32_t * block_crc);
+
+// Batched variants
+DNStatus datanode_free_blocks(int count, const int * block_indices);
+
+DNStatus datanode_read_blocks(int count, const int * block_indices, void * buffer);
+
+DNStatus datanode_write_blocks(int count, const int * block_indices, const uint32_t * crcs, void * buffer);
 
 DNStatus datanode_exit(int cleanup, int * sock_fd);
 
@@ -0,0 +1,66 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content-addressed index of the blocks the metadata node has handed out.
+// Every block written whole is fingerprinted, and a later write of the same
+// content takes a reference on that block instead of storing it again. Blocks
+// are counted by the file positions referencing them and go back to the free
+// space with their last reference. Fingerprints are trusted like those of
+// other dedup stores, a 64-bit hash and the block's CRC32C must both match
+typedef struct {
+    uint64_t hash;
+    uint32_t crc;
+} DedupFingerprint;
+
+typedef struct DedupEntry {
+    DedupFingerprint fp;
+    uint32_t refs;
+    int hnext;          // hash chain, -1 ends it
+    uint8_t indexed;    // fp is the block's content
+    uint8_t stored;     // its datanode has data for it
+} DedupEntry;
+
+typedef struct DedupIndex {
+    int num_blocks;
+    DedupEntry *entries;    // by block id
+    int *buckets;
+    int mask;
+
+    size_t logical_bytes;   // referenced by files
+    size_t physical_bytes;  // held by referenced blocks
+    uint64_t writes;        // block writes asked for
+    uint64_t writes_saved;  // answered from the index, never sent
+    size_t bytes_saved;     // data of the writes not sent
+} DedupIndex;
+
+int dedup_init(DedupIndex *index, int num_blocks);
+
+// Make room for blocks up to num_blocks - 1, the index keeps what it holds
+int dedup_grow(DedupIndex *index, int num_blocks);
+
+// crc is the CRC32C of the size bytes at data, already at hand for the write
+void dedup_fingerprint(const void *data, size_t size, uint32_t crc, DedupFingerprint *fp);
+
+// Block holding content fp, -1 if none does
+int dedup_lookup(DedupIndex *index, const DedupFingerprint *fp);
+
+// block now holds content fp, whatever it held before is forgotten
+void dedup_insert(DedupIndex *index, int block, const DedupFingerprint *fp);
+
+// block's content changed in a way the index cannot follow
+void dedup_forget(DedupIndex *index, int block);
+
+void dedup_ref(DedupIndex *index, int block, size_t block_size);
+
+// References left, at 0 the block is forgotten and up to the caller to free
+uint32_t dedup_unref(DedupIndex *index, int block, size_t block_size);
+
+// Drop every reference, for a block freed outright
+void dedup_clear(DedupIndex *index, int block, size_t block_size);
+
+void dedup_destroy(DedupIndex *index);
+
+#endif // DEDUP_H
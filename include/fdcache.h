@@ -0,0 +1,48 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stdint.h>
+
+// Bounded LRU cache of open descriptors keyed by block index, so repeated
+// I/O on a block skips the path walk and open/close
+typedef struct FdCacheEntry {
+    int key;                    // -1 once invalidated while still in use
+    int fd;
+    int refs;                   // callers between open and release
+    struct FdCacheEntry *prev;  // LRU order, most recently used first
+    struct FdCacheEntry *next;
+    struct FdCacheEntry *hnext; // hash chain, or free list
+} FdCacheEntry;
+
+typedef struct FdCache {
+    int capacity;
+    int size;
+
+    FdCacheEntry *entries;
+    FdCacheEntry **buckets;
+    int mask;
+    FdCacheEntry *head;
+    FdCacheEntry *tail;
+    FdCacheEntry *free_list;
+
+    uint64_t hits;
+    uint64_t misses;
+} FdCache;
+
+// A capacity of 0 caches nothing, every open is a miss
+int fdcache_init(FdCache *cache, int capacity);
+
+// Descriptor of key, opening path with flags on a miss. Hand *entry back to
+// fdcache_release; a NULL entry means the descriptor is not cached and the
+// caller closes it, which happens when every cached one is in use
+int fdcache_open(FdCache *cache, int key, const char *path, int flags, FdCacheEntry **entry);
+
+void fdcache_release(FdCache *cache, FdCacheEntry *entry);
+
+// Close key's descriptor, before its file goes away
+void fdcache_invalidate(FdCache *cache, int key);
+
+// Close every descriptor
+void fdcache_destroy(FdCache *cache);
+
+#endif // FDCACHE_H
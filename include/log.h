@@ -0,0 +1,44 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+// Log levels, a message goes out when its level is at most the current one
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Messages above this level compile to nothing, the build sets it from the
+// LOG_LEVEL cache variable
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_LEVEL_DEFAULT LOG_LEVEL_INFO
+
+extern _Atomic int log_level;
+
+#define LOG_ENABLED(level) \
+    ((level) <= LOG_COMPILE_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define LOG_AT(level, fmt, ...) \
+    do { \
+        if (LOG_ENABLED(level)) \
+            log_write(fmt, ##__VA_ARGS__); \
+    } while (0)
+
+// Runtime level, LOG_LEVEL_OFF to LOG_LEVEL_DEBUG
+void log_set_level(int level);
+
+// Queue a message for the process's log thread, which formats and prints it.
+// fmt must outlive the process, a string literal. %s arguments are copied
+// with the message, all others by value. Never blocks, a message finding the
+// queue full is dropped and counted
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Print every message queued so far, done at exit too
+void log_flush(void);
+
+#endif // LOG_H
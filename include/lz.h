@@ -0,0 +1,18 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Byte-oriented LZ77 in the LZ4 block format (Collet): sequences of literals
+// followed by a back reference of at least four bytes into the last 64 KiB.
+// Fast on both ends, meant for whole blocks compressed independently
+
+// Compress size bytes of src into dst. Returns the compressed length, 0 when
+// it would not fit in capacity bytes, which callers use to store data raw
+size_t lz_compress(const void *src, size_t size, void *dst, size_t capacity);
+
+// Decompress size bytes of src into dst. Returns the decompressed length, -1
+// for a malformed stream or one expanding past capacity bytes
+long lz_decompress(const void *src, size_t size, void *dst, size_t capacity);
+
+#endif // LZ_H
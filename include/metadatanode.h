@@ -7,14 +7,18 @@
 #include <sys/wait.h>
 
 #include "bitmap.h"
+#include "communication.h"
+#include "dedup.h"
+#include "log.h"
 
-#define LOGM(fmt, ...) \
-    do { \
-        printf("[MetaDtNode] " fmt "\n", ##__VA_ARGS__); \
-        fflush(stdout); \
-    } while (0)
+// Leveled metadata node logging, see log.h. LOGM is the informational level
+#define LOGM_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, "[MetaDtNode] ERROR: " fmt, ##__VA_ARGS__)
+#define LOGM_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, "[MetaDtNode] WARNING: " fmt, ##__VA_ARGS__)
+#define LOGM(fmt, ...) LOG_AT(LOG_LEVEL_INFO, "[MetaDtNode] " fmt, ##__VA_ARGS__)
+#define LOGM_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, "[MetaDtNode] " fmt, ##__VA_ARGS__)
 
 typedef struct DataNode DataNode;
+typedef struct ShmChannel ShmChannel;
 typedef struct AllocPolicy AllocPolicy;
 typedef struct AllocContext AllocContext;
 
@@ -23,27 +27,159 @@ typedef enum {
     MDN_NO_SPACE,
     MDN_INVALID_BLOCK,
     MDN_FILE_DNE,
-    MDN_FAIL
+    MDN_FAIL,
+    MDN_CORRUPT,    // data came back different from what was written
 } MDNStatus;
 
 typedef struct {
     int fid;
     char * filename;
+    int block_class;    // index in md->classes, fixed at creation
     int num_blocks;
     int * blocks;
 } FileEntry;
 
+typedef enum {
+    MD_TRANSPORT_SOCKET = 0,    // AF_UNIX socketpair per datanode
+    MD_TRANSPORT_SHM,           // shared-memory rings mapped before fork
+    MD_TRANSPORT_TCP,           // already running datanodes reached over TCP
+} MDTransport;
+
+// Most block size classes a cluster can have
+#define MD_MAX_BLOCK_CLASSES DN_MAX_CLASSES
+
+// A file takes the largest class it fills at least this many blocks of
+#define MD_CLASS_MIN_BLOCKS 16
+
+// Cluster options chosen at init, zero means the default for every field
 typedef struct {
-    int pid;
+    MDTransport transport;
+    DNEngine engine;
+    // bytes per block for the whole cluster, a power of two between
+    // BLOCK_SIZE_MIN and BLOCK_SIZE_MAX
+    size_t block_size;
+    // block sizes files choose from, in increasing order, the unused tail
+    // left zero. Every datanode stores blocks of all the classes, and
+    // block_size is ignored in favour of the smallest class
+    size_t block_classes[MD_MAX_BLOCK_CLASSES];
+    // relative share of the capacity each class gets, all zero for equal shares
+    int block_class_shares[MD_MAX_BLOCK_CLASSES];
+    // DN_ENGINE_THREADS: I/O threads per datanode
+    int workers;
+    // datanode block store, "container", "files" or "log", NULL for the default
+    const char *store;
+    // datanodes on the sync or threads engine send reads straight from mapped storage
+    int mmap_reads;
+    // datanodes move block data with O_DIRECT, bypassing the page cache
+    int direct_io;
+    // open block files each datanode keeps cached, negative disables
+    int fd_cache;
+    // bytes of hot block data each datanode keeps in memory, negative disables
+    int64_t block_cache;
+    // when datanodes answer writes, see DNDurability. Group commit waits up
+    // to group_commit_us for more writes, 0 commits as soon as none is queued.
+    // The sync engine waits in whole milliseconds
+    DNDurability durability;
+    int group_commit_us;
+    int group_commit_batch;
+    // MD_TRANSPORT_TCP: "host:port" of every datanode, in node id order,
+    // num_addresses of them, one per node
+    const char *const *addresses;
+    int num_addresses;
+    // datanodes keep the blocks a previous run left in their directories,
+    // which stay reserved until freed with metadatanode_dealloc_block
+    int recover;
+    // blocks written with content already stored reference it instead, see
+    // dedup.h. Recovered blocks are not fingerprinted
+    int dedup;
+    // datanodes store blocks LZ compressed where that saves space and charge
+    // the compressed bytes to their capacity. Block slots are added as the
+    // bytes left make room for them, so the capacity holds as many more
+    // blocks as the data's ratio allows. Mapped reads, direct I/O and
+    // io_uring give way to plain reads and I/O threads. Recover with the
+    // setting the blocks were written with
+    int compress;
+    // messages logged from LOG_LEVEL_ERROR to LOG_LEVEL_DEBUG, see log.h. 0
+    // keeps LOG_LEVEL_DEFAULT, levels above the build's LOG_LEVEL log nothing
+    int log_level;
+} MDOptions;
+
+// Maximum number of requests kept in flight on a single datanode connection
+#define MD_PIPELINE_DEPTH 16
+
+// Most response bytes asynchronous requests in flight on a connection may
+// owe, below what a shm ring (256 KiB) or a default AF_UNIX socket (about
+// 208 KiB) holds. A datanode then never blocks answering while the metadata
+// node blocks sending it more. A single larger request still goes out alone
+#define MD_ASYNC_WINDOW_BYTES (128 * 1024)
+
+typedef struct MDAsyncOp MDAsyncOp;
+typedef struct MDAsyncRequest MDAsyncRequest;
+
+// Asynchronous requests return at once with a handle. Their completion is
+// reported to the callback from metadatanode_poll, or queued for
+// metadatanode_reap when no callback is given
+typedef uint64_t MDHandle;
+
+typedef void (*MDCallback)(MDHandle handle, MDNStatus status, void *arg);
+
+typedef struct {
+    MDHandle handle;
+    MDNStatus status;
+    void *arg;
+} MDCompletion;
+
+typedef struct {
+    int pid;                // 0 for datanodes this process did not fork
     int sock_fd;
+    uint32_t next_req_id;
+    int inflight;
+    size_t owed;            // response bytes of asynchronous requests in flight
+    ShmChannel *shm;
+    // the storage of every class the datanode last reported in a response
+    uint64_t stored_bytes[MD_MAX_BLOCK_CLASSES];
+    int stored_blocks[MD_MAX_BLOCK_CLASSES];
+
+    // asynchronous requests waiting for the window, and sent ones
+    MDAsyncOp *queued;
+    MDAsyncOp *queued_tail;
+    MDAsyncOp *sent;
 } NodeConnection;
 
+// Blocks of one size. Global block ids are dealt to the classes in turn, the
+// class's slot s has id s * num_classes + class. Every datanode stores blocks
+// of every class, the class's bitmap numbers its slots
 typedef struct {
-    int fs_capacity;
+    size_t block_size;
     size_t num_blocks;
     size_t free_blocks;
-	bitmap_t *bitmap;
-	int * block_mapping;
+    bitmap_t *bitmap;
+    size_t bitmap_bits;         // bits the bitmap has words for
+    uint32_t zero_crc;
+    size_t * node_capacity;     // bytes of the class each node may store
+    int * blocks_per_node;
+    int * blocks_free;
+    // with compress blocks_per_node counts store slots, grown while the
+    // bytes a node last reported storing leave room for more blocks than it
+    // has slots free, see DNResponseHeader. slots_free are those left,
+    // blocks_free the blocks there is room for
+    int * slots_free;
+} MDBlockClass;
+
+typedef struct {
+    MDOptions opts;
+
+    int fs_capacity;
+    size_t num_blocks;          // over all classes
+    size_t free_blocks;
+    size_t num_block_ids;       // at least num_classes times the largest class's num_blocks
+	int * block_mapping;        // node id of every block
+    uint32_t * block_crc;       // CRC32C of every block's current content
+
+    int num_classes;
+    MDBlockClass * classes;
+
+    DedupIndex dedup;           // with opts.dedup
 
     int num_files;
     FileEntry * files;
@@ -51,18 +187,33 @@ typedef struct {
     int num_nodes;
     DataNode * nodes;
     NodeConnection * connections;
-	int * blocks_per_node;
-	int * blocks_free;
+
+    MDHandle next_handle;
+    int async_requests;             // submitted and not yet reported
+    MDAsyncRequest *async_ready;    // finished without a datanode round trip
+    MDCompletion *completions;
+    int num_completions;
+    int cap_completions;
 
     // AllocPolicy * policy;
 } MetadataNode;
 
 MDNStatus metadatanode_init(int num_dns, size_t capacity, const char *policy_name);
 
+MDNStatus metadatanode_init_opts(int num_dns, size_t capacity, const char *policy_name, const MDOptions *opts);
+
 MDNStatus metadatanode_exit(int cleanup);
 
 MDNStatus metadatanode_create_file(const char * filename, size_t file_size, int * fid);
 
+// As metadatanode_create_file, with the largest class not above block_size
+// rather than one picked from file_size. 0 picks from file_size
+MDNStatus metadatanode_create_file_hint(const char * filename, size_t file_size,
+                                        size_t block_size, int * fid);
+
+// Bytes per block of a file, what its block reads and writes move
+MDNStatus metadatanode_file_block_size(int fid, size_t * block_size);
+
 MDNStatus metadatanode_find_file(const char * filename, int * fid);
 
 MDNStatus metadatanode_truncate_file(int fid, size_t new_size);
@@ -71,6 +222,13 @@ MDNStatus metadatanode_read_file(int fid, void ** buffer, size_t * file_size);
 
 MDNStatus metadatanode_write_file(int fid, void * buffer, size_t buffer_size);
 
+// Bytes [offset, offset + length) of a file, only the blocks the range covers
+// are touched and the partial ones at its ends move just the bytes asked for.
+// Reads must lie within the file, writes grow it as needed
+MDNStatus metadatanode_pread(int fid, size_t offset, size_t length, void * buffer);
+
+MDNStatus metadatanode_pwrite(int fid, size_t offset, size_t length, const void * buffer);
+
 MDNStatus metadatanode_alloc_block(AllocContext ctx, int * block_index, int * node_id);
 
 MDNStatus metadatanode_dealloc_block(int block_index);
@@ -79,6 +237,43 @@ MDNStatus metadatanode_read_block(int fid, int file_index, void * buffer);
 
 MDNStatus metadatanode_write_block(int fid, int file_index, void * buffer);
 
+// Buffers must stay untouched until the request completes. Synchronous calls
+// wait for every outstanding asynchronous request first
+MDNStatus metadatanode_read_block_async(int fid, int file_index, void * buffer,
+                                        MDCallback cb, void * arg, MDHandle * handle);
+
+MDNStatus metadatanode_write_block_async(int fid, int file_index, void * buffer,
+                                         MDCallback cb, void * arg, MDHandle * handle);
+
+// buffer has room for the whole file, num_blocks times its block size
+MDNStatus metadatanode_read_file_async(int fid, void * buffer, size_t buffer_size,
+                                       MDCallback cb, void * arg, MDHandle * handle);
+
+// Blocks the file grows by are allocated before returning, only the data
+// transfer is asynchronous
+MDNStatus metadatanode_write_file_async(int fid, void * buffer, size_t buffer_size,
+                                        MDCallback cb, void * arg, MDHandle * handle);
+
+// Wait up to timeout_ms (-1 forever) for datanode responses and complete the
+// requests they finish, returns how many completed or -1 on error
+int metadatanode_poll(int timeout_ms);
+
+// Take up to max completions of requests submitted without a callback
+int metadatanode_reap(MDCompletion * completions, int max);
+
+// Poll until no asynchronous request is outstanding
+MDNStatus metadatanode_drain(void);
+
+// Make every write answered so far durable on all datanodes
+MDNStatus metadatanode_sync(void);
+
+// Counters of one datanode. Datanode ids run class by class, with a single
+// class they are the node ids
+MDNStatus metadatanode_node_stats(int node_id, DNStats * stats);
+
+// Indices of every block one datanode holds, the caller frees block_indices
+MDNStatus metadatanode_list_blocks(int node_id, int ** block_indices, int * count);
+
 MDNStatus metadatanode_end(void);
 
 #endif // METADATA_NODE_H
@@ -17,8 +17,8 @@ typedef enum {
 typedef struct {
 	double timestamp_ms;
     
-	int fill_percentage;
-    size_t blocks_used;
+	int fill_percentage;        // with compress, of the capacity in stored bytes
+    size_t blocks_used;         // with compress, block slots
     size_t blocks_free;
     
 	double load_imbalance;
@@ -36,12 +36,31 @@ typedef struct {
 	int num_files;
     
 	size_t metadata_bytes;
+
+    // datanode block caches, summed over all nodes
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    double cache_hit_ratio;
+    size_t cache_bytes_saved;       // block data not read from storage
+
+    // metadata node deduplication, zero when off
+    double dedup_ratio;             // bytes files reference per byte stored
+    size_t dedup_bytes_saved;       // referenced bytes not stored
+    unsigned long long dedup_writes_saved;  // block writes never sent
+
+    // block data on the datanodes, summed over all nodes
+    size_t stored_bytes;            // disk taken, compressed where it paid
+    double compression_ratio;       // block bytes per byte taken
 } SystemMetrics;
 
 double get_time_ms();
 
 void calculate_load_balance(double *imbalance, double *std_dev, int *max_blocks, int *min_blocks);
 
+void calculate_cache_stats(SystemMetrics *m);
+
+void calculate_storage_stats(SystemMetrics *m);
+
 SystemMetrics capture_metrics(double write_time_ms, double read_time_ms, int write_count, int read_count);
 
 void print_metrics(SystemMetrics *m, const char *label);
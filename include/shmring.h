@@ -0,0 +1,101 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A ring is a single-producer single-consumer byte stream living in memory
+// shared by the metadata node and one forked datanode. Its storage is
+// SHM_RING_SLOTS block-sized slots, messages stream across slot boundaries.
+#define SHM_SLOT_SIZE 4096
+#define SHM_RING_SLOTS 64
+#define SHM_RING_BYTES (SHM_SLOT_SIZE * SHM_RING_SLOTS)
+
+// Busy-poll iterations before falling back to a futex wait, while there
+// are CPUs enough for the peer to run meanwhile, see shm_spin_for
+#define SHM_SPIN_LIMIT 256
+
+// Longest a waiter sleeps before looking whether its peer is still alive
+#define SHM_WAIT_MAX_MS 100
+
+typedef struct {
+    // written by the producer
+    _Alignas(64) _Atomic uint64_t head;
+    _Atomic uint32_t head_seq;      // futex word, bumped on every publish
+    _Atomic uint32_t readers_waiting;   // on the futex
+    _Atomic uint32_t readers_polling;   // on notify_fd
+
+    // written by the consumer
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint32_t tail_seq;      // futex word, bumped on every consume
+    _Atomic uint32_t writers_waiting;
+
+    _Alignas(64) _Atomic uint32_t closed;
+
+    // processes on either end, 0 until known. A waiter that times out
+    // closes the ring if the other one died
+    _Atomic pid_t producer_pid;
+    _Atomic pid_t consumer_pid;
+
+    // eventfd the producer also signals while readers wait, so a reader can
+    // poll the ring along with sockets. -1 for none
+    int notify_fd;
+
+    _Alignas(64) char data[SHM_RING_BYTES];
+} ShmRing;
+
+// One request ring (metadata node -> datanode) and one response ring
+typedef struct ShmChannel {
+    ShmRing requests;
+    ShmRing responses;
+} ShmChannel;
+
+// Map a channel shared with children forked afterwards
+ShmChannel *shm_channel_create(void);
+
+void shm_channel_destroy(ShmChannel *channel);
+
+// Record the metadata node and the datanode serving the channel
+void shm_channel_bind(ShmChannel *channel, pid_t md_pid, pid_t dn_pid);
+
+// Say how many processes share rings, set before forking them. Waiters
+// spin only if each can have a CPU of its own, otherwise a spinner only
+// keeps its peer from running
+void shm_spin_for(int processes);
+
+// Block until all of len bytes went in / came out, -1 once the ring is closed
+ssize_t shm_ring_write(ShmRing *ring, const void *buf, size_t len);
+
+ssize_t shm_ring_read(ShmRing *ring, void *buf, size_t len);
+
+ssize_t shm_ring_writev(ShmRing *ring, const struct iovec *iov, int iovcnt);
+
+ssize_t shm_ring_readv(ShmRing *ring, const struct iovec *iov, int iovcnt);
+
+// Bytes that can be read without blocking
+size_t shm_ring_readable(ShmRing *ring);
+
+// Block on the ring's futex until it is readable, at most timeout_ms (-1
+// forever). Returns 1 if it is readable
+int shm_ring_wait_readable(ShmRing *ring, int timeout_ms);
+
+// Count the caller among the ring's polling readers, so producers signal
+// notify_fd, and take itself off again
+void shm_ring_wait_begin(ShmRing *ring);
+
+void shm_ring_wait_end(ShmRing *ring);
+
+// Reset notify_fd once it polled readable, a signal left over only costs a
+// later poll a spurious wakeup
+void shm_ring_clear_notify(ShmRing *ring);
+
+// Wake any waiter and make further reads fail once the ring is drained
+void shm_ring_close(ShmRing *ring);
+
+// Close the ring if its producer died, so a reader polling it notices
+void shm_ring_check_producer(ShmRing *ring);
+
+#endif // SHMRING_H
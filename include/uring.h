@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+// linux/io_uring.h pulls in linux/fs.h, whose BLOCK_SIZE would shadow ours
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+
+// Minimal io_uring wrapper over the raw syscalls, enough for the datanode
+// engine without depending on liburing
+typedef struct {
+    int ring_fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_pending;    // prepared but not yet submitted
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} URing;
+
+int uring_init(URing *ring, unsigned entries);
+
+void uring_exit(URing *ring);
+
+// Next free submission entry, zeroed, or NULL when the queue is full
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+
+// Free submission entries left
+unsigned uring_sq_space(URing *ring);
+
+// Submit prepared entries and wait for at least wait_nr completions
+int uring_submit(URing *ring, unsigned wait_nr);
+
+// Oldest unconsumed completion or NULL, release it with uring_cqe_seen
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+
+void uring_cqe_seen(URing *ring);
+
+#endif // URING_H
@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+#include "datanode.h"
+#include "communication.h"
+
+// Standalone datanode serving metadata nodes over TCP, one at a time.
+// Block directories are created under dir, so nodes can be spread over disks
+// (and over cores with taskset).
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <host:port> [dir]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 3 && chdir(argv[2]) != 0) {
+        perror("chdir");
+        return 1;
+    }
+
+    int listen_fd = comm_tcp_listen(argv[1]);
+    if (listen_fd < 0)
+        return 1;
+
+    printf("[DataNode] Listening on %s\n", argv[1]);
+    fflush(stdout);
+
+    datanode_serve(listen_fd);
+
+    close(listen_fd);
+    return 1;
+}
@@ -20,6 +20,24 @@ int bitmap_init(bitmap_t *bitmap, uint32_t nbits)
     return 0;
 }
 
+void bitmap_grow(bitmap_t *bitmap, uint32_t nbits, uint32_t new_nbits)
+{
+    // the bits past nbits in its last word were set by bitmap_init
+    uint32_t idx = nbits / bits_per_word;
+    if (nbits % bits_per_word != 0) {
+        bitmap[idx] &= ((size_t)1 << (nbits % bits_per_word)) - 1;
+        idx++;
+    }
+
+    uint32_t nwords = (new_nbits + bits_per_word - 1) / bits_per_word;
+    if (nwords > idx)
+        memset(&bitmap[idx], 0, (nwords - idx) * sizeof(size_t));
+
+    // and past new_nbits from now on
+    if (new_nbits % bits_per_word != 0)
+        bitmap[nwords - 1] |= word_all_bits << (new_nbits % bits_per_word);
+}
+
 int bitmap_alloc(bitmap_t *bitmap, uint32_t nbits, uint32_t *index)
 {
     uint32_t max_idx = (nbits + bits_per_word - 1) / bits_per_word;
@@ -0,0 +1,256 @@
+#include "blockcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline unsigned blockcache_hash(BlockCache *cache, int block_index)
+{
+    return ((unsigned)block_index * 2654435761u) & cache->mask;
+}
+
+static BlockCacheEntry *blockcache_find(BlockCache *cache, int block_index)
+{
+    for (BlockCacheEntry *e = cache->buckets[blockcache_hash(cache, block_index)]; e; e = e->hnext) {
+        if (e->block_index == block_index)
+            return e;
+    }
+    return NULL;
+}
+
+static void list_remove(BlockCache *cache, BlockCacheEntry *e)
+{
+    BlockCacheList *l = &cache->lists[e->list];
+    if (e->prev) e->prev->next = e->next;
+    else l->mru = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else l->lru = e->prev;
+    e->prev = e->next = NULL;
+    l->size--;
+}
+
+static void list_push_mru(BlockCache *cache, BlockCacheEntry *e, int list)
+{
+    BlockCacheList *l = &cache->lists[list];
+    e->list = list;
+    e->prev = NULL;
+    e->next = l->mru;
+    if (l->mru) l->mru->prev = e;
+    l->mru = e;
+    if (!l->lru) l->lru = e;
+    l->size++;
+}
+
+static void drop_data(BlockCache *cache, BlockCacheEntry *e)
+{
+    if (e->data) {
+        cache->free_data[cache->num_free_data++] = e->data;
+        e->data = NULL;
+    }
+}
+
+// Forget an entry altogether
+static void drop_entry(BlockCache *cache, BlockCacheEntry *e)
+{
+    list_remove(cache, e);
+    drop_data(cache, e);
+
+    BlockCacheEntry **p = &cache->buckets[blockcache_hash(cache, e->block_index)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+
+    e->block_index = -1;
+    e->hnext = cache->free_entries;
+    cache->free_entries = e;
+}
+
+static void drop_lru(BlockCache *cache, int list)
+{
+    if (cache->lists[list].lru)
+        drop_entry(cache, cache->lists[list].lru);
+}
+
+// Move the LRU block of T1 or T2 to its ghost list, freeing its data
+static void arc_replace(BlockCache *cache, int hit_in_b2)
+{
+    BlockCacheList *t1 = &cache->lists[ARC_T1];
+    BlockCacheList *t2 = &cache->lists[ARC_T2];
+
+    BlockCacheEntry *victim;
+    int ghost;
+    if (t1->size > 0 &&
+        (t1->size > cache->target_t1 || (hit_in_b2 && t1->size == cache->target_t1) || t2->size == 0)) {
+        victim = t1->lru;
+        ghost = ARC_B1;
+    } else {
+        victim = t2->lru;
+        ghost = ARC_B2;
+    }
+
+    if (!victim)
+        return;
+
+    list_remove(cache, victim);
+    drop_data(cache, victim);
+    list_push_mru(cache, victim, ghost);
+}
+
+static void blockcache_fill(BlockCache *cache, BlockCacheEntry *e, const void *data)
+{
+    e->data = cache->free_data[--cache->num_free_data];
+    memcpy(e->data, data, cache->block_size);
+}
+
+int blockcache_init(BlockCache *cache, size_t budget, size_t block_size)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    int capacity = (int)(budget / block_size);
+    if (capacity <= 0)
+        return 0;
+
+    int buckets = 16;
+    while (buckets < 4 * capacity)
+        buckets *= 2;
+
+    cache->entries = calloc(2 * capacity, sizeof(BlockCacheEntry));
+    cache->buckets = calloc(buckets, sizeof(BlockCacheEntry *));
+    cache->arena = malloc((size_t)capacity * block_size);
+    cache->free_data = malloc(sizeof(char *) * capacity);
+    if (!cache->entries || !cache->buckets || !cache->arena || !cache->free_data) {
+        blockcache_destroy(cache);
+        return -1;
+    }
+
+    cache->capacity = capacity;
+    cache->block_size = block_size;
+    cache->mask = buckets - 1;
+
+    for (int i = 2 * capacity - 1; i >= 0; i--) {
+        cache->entries[i].block_index = -1;
+        cache->entries[i].hnext = cache->free_entries;
+        cache->free_entries = &cache->entries[i];
+    }
+    for (int i = 0; i < capacity; i++)
+        cache->free_data[i] = cache->arena + (size_t)(capacity - 1 - i) * block_size;
+    cache->num_free_data = capacity;
+
+    return 0;
+}
+
+int blockcache_get(BlockCache *cache, int block_index, void *buffer)
+{
+    if (cache->capacity == 0)
+        return -1;
+
+    BlockCacheEntry *e = blockcache_find(cache, block_index);
+    if (!e || !e->data) {
+        cache->misses++;
+        return -1;
+    }
+
+    // a second reference makes the block frequent
+    list_remove(cache, e);
+    list_push_mru(cache, e, ARC_T2);
+
+    memcpy(buffer, e->data, cache->block_size);
+    cache->hits++;
+    return 0;
+}
+
+void blockcache_insert(BlockCache *cache, int block_index, const void *data)
+{
+    if (cache->capacity == 0)
+        return;
+
+    int c = cache->capacity;
+    BlockCacheList *t1 = &cache->lists[ARC_T1];
+    BlockCacheList *t2 = &cache->lists[ARC_T2];
+    BlockCacheList *b1 = &cache->lists[ARC_B1];
+    BlockCacheList *b2 = &cache->lists[ARC_B2];
+
+    BlockCacheEntry *e = blockcache_find(cache, block_index);
+
+    if (e && e->data) {
+        memcpy(e->data, data, cache->block_size);
+        return;
+    }
+
+    if (e) {
+        // ghost hit, the list it was evicted from deserved more room
+        int hit_in_b2 = e->list == ARC_B2;
+        if (hit_in_b2) {
+            int delta = b1->size > b2->size ? b1->size / b2->size : 1;
+            cache->target_t1 = cache->target_t1 > delta ? cache->target_t1 - delta : 0;
+        } else {
+            int delta = b2->size > b1->size ? b2->size / b1->size : 1;
+            cache->target_t1 = cache->target_t1 + delta < c ? cache->target_t1 + delta : c;
+        }
+
+        list_remove(cache, e);
+        if (cache->num_free_data == 0)
+            arc_replace(cache, hit_in_b2);
+        list_push_mru(cache, e, ARC_T2);
+        blockcache_fill(cache, e, data);
+        return;
+    }
+
+    // a block never seen before
+    if (t1->size + b1->size >= c) {
+        if (t1->size < c) {
+            drop_lru(cache, ARC_B1);
+            if (cache->num_free_data == 0)
+                arc_replace(cache, 0);
+        } else {
+            drop_lru(cache, ARC_T1);
+        }
+    } else if (t1->size + t2->size + b1->size + b2->size >= c) {
+        if (t1->size + t2->size + b1->size + b2->size >= 2 * c)
+            drop_lru(cache, ARC_B2);
+        if (cache->num_free_data == 0)
+            arc_replace(cache, 0);
+    }
+
+    if (!cache->free_entries)
+        drop_lru(cache, b2->size > 0 ? ARC_B2 : ARC_B1);
+
+    e = cache->free_entries;
+    cache->free_entries = e->hnext;
+    e->block_index = block_index;
+
+    unsigned h = blockcache_hash(cache, block_index);
+    e->hnext = cache->buckets[h];
+    cache->buckets[h] = e;
+
+    list_push_mru(cache, e, ARC_T1);
+    blockcache_fill(cache, e, data);
+}
+
+void blockcache_update(BlockCache *cache, int block_index, const void *data)
+{
+    if (cache->capacity == 0)
+        return;
+
+    BlockCacheEntry *e = blockcache_find(cache, block_index);
+    if (e && e->data)
+        memcpy(e->data, data, cache->block_size);
+}
+
+void blockcache_invalidate(BlockCache *cache, int block_index)
+{
+    if (cache->capacity == 0)
+        return;
+
+    BlockCacheEntry *e = blockcache_find(cache, block_index);
+    if (e)
+        drop_entry(cache, e);
+}
+
+void blockcache_destroy(BlockCache *cache)
+{
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->arena);
+    free(cache->free_data);
+    memset(cache, 0, sizeof(*cache));
+}
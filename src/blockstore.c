@@ -0,0 +1,69 @@
+#define _GNU_SOURCE
+#include "datanode.h"
+#include "blockstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+extern DataNode *dn;
+
+BlockStore block_stores[] = {
+#define S(name) { #name, name##_init, name##_alloc, name##_free, name##_locate, name##_release, \
+              name##_map, name##_advise, name##_sync, name##_commit, name##_list, \
+              name##_destroy, NULL },
+    BLOCKSTORES
+#undef S
+};
+
+struct BlockStore * store = NULL;
+
+const int num_block_stores = sizeof(block_stores)/sizeof(BlockStore);
+
+bool block_store_init(const char *name)
+{
+    if (name == NULL || name[0] == '\0')
+        name = DN_DEFAULT_STORE;
+
+    store = NULL;
+    for (int i = 0; i < num_block_stores; i++) {
+        if (strcmp(name, block_stores[i].name) == 0) {
+            store = &block_stores[i];
+            if (store->init() == 0)
+                return true;
+            block_store_end();
+            return false;
+        }
+    }
+    return false;
+}
+
+void block_store_end(void)
+{
+    if (store != NULL)
+        store->destroy();
+    store = NULL;
+}
+
+int block_store_trim(int fd, off_t offset, size_t length, size_t size)
+{
+    // only whole pages can be handed back
+    size_t keep = (length + DN_DIRECT_ALIGN - 1) / DN_DIRECT_ALIGN * DN_DIRECT_ALIGN;
+    if (keep >= size)
+        return 0;
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset + (off_t)keep, size - keep) == 0 ||
+        errno == EOPNOTSUPP)
+        return 0;
+
+    perror("fallocate");
+    return -1;
+}
+
+void block_store_path(char *path, size_t size, const char *name, int c)
+{
+    if (c == 0)
+        snprintf(path, size, "%s/%s.dat", dn->dir_path, name);
+    else
+        snprintf(path, size, "%s/%s.%d.dat", dn->dir_path, name, c);
+}
@@ -0,0 +1,50 @@
+#include "bufpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int bufpool_init(BufPool *pool, int count, size_t buf_size, size_t align)
+{
+    memset(pool, 0, sizeof(*pool));
+
+    buf_size = (buf_size + align - 1) & ~(align - 1);
+
+    void *arena;
+    if (posix_memalign(&arena, align, buf_size * count) != 0)
+        return -1;
+
+    pool->free_bufs = malloc(sizeof(void *) * count);
+    if (!pool->free_bufs) {
+        free(arena);
+        return -1;
+    }
+
+    pool->arena = arena;
+    pool->buf_size = buf_size;
+    pool->count = count;
+
+    for (int i = 0; i < count; i++)
+        pool->free_bufs[i] = pool->arena + (size_t)(count - 1 - i) * buf_size;
+    pool->num_free = count;
+
+    return 0;
+}
+
+void *bufpool_get(BufPool *pool)
+{
+    if (pool->num_free == 0)
+        return NULL;
+    return pool->free_bufs[--pool->num_free];
+}
+
+void bufpool_put(BufPool *pool, void *buf)
+{
+    pool->free_bufs[pool->num_free++] = buf;
+}
+
+void bufpool_destroy(BufPool *pool)
+{
+    free(pool->arena);
+    free(pool->free_bufs);
+    memset(pool, 0, sizeof(*pool));
+}
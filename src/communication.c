@@ -1,12 +1,273 @@
 #include "communication.h"
 
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Shared-memory endpoints, indexed by the socket they stand in for
+#define COMM_MAX_FDS 1024
+
+typedef struct {
+    ShmRing *tx;
+    ShmRing *rx;
+} CommEndpoint;
+
+static CommEndpoint comm_endpoints[COMM_MAX_FDS];
+
+int comm_attach_shm(int sock_fd, ShmRing *tx, ShmRing *rx)
+{
+    if (sock_fd < 0 || sock_fd >= COMM_MAX_FDS)
+        return -1;
+
+    comm_endpoints[sock_fd].tx = tx;
+    comm_endpoints[sock_fd].rx = rx;
+    return 0;
+}
+
+void comm_detach(int sock_fd)
+{
+    if (sock_fd < 0 || sock_fd >= COMM_MAX_FDS)
+        return;
+
+    comm_endpoints[sock_fd].tx = NULL;
+    comm_endpoints[sock_fd].rx = NULL;
+}
+
+static inline CommEndpoint *comm_shm(int sock_fd)
+{
+    if (sock_fd < 0 || sock_fd >= COMM_MAX_FDS || !comm_endpoints[sock_fd].tx)
+        return NULL;
+    return &comm_endpoints[sock_fd];
+}
+
+int comm_is_shm(int sock_fd)
+{
+    return comm_shm(sock_fd) != NULL;
+}
+
+void comm_close_shm(int sock_fd, int how)
+{
+    CommEndpoint *shm = comm_shm(sock_fd);
+    if (!shm)
+        return;
+
+    if (how == SHUT_RD || how == SHUT_RDWR)
+        shm_ring_close(shm->rx);
+    if (how == SHUT_WR || how == SHUT_RDWR)
+        shm_ring_close(shm->tx);
+}
+
+static double comm_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int comm_wait_readable(const int *fds, int nfds, int *ready, int timeout_ms)
+{
+    struct pollfd pfds[COMM_MAX_FDS];
+    ShmRing *rings[COMM_MAX_FDS];
+
+    if (nfds <= 0 || nfds > COMM_MAX_FDS)
+        return nfds == 0 ? 0 : -1;
+
+    // a lone ring is waited for on its futex
+    CommEndpoint *lone = nfds == 1 ? comm_shm(fds[0]) : NULL;
+    if (lone) {
+        ready[0] = shm_ring_wait_readable(lone->rx, timeout_ms);
+        return ready[0];
+    }
+
+    // rings are polled through the eventfd their producer signals while a
+    // reader waits, sockets directly
+    int spin = 0, any_ring = 0;
+    for (int i = 0; i < nfds; i++) {
+        CommEndpoint *shm = comm_shm(fds[i]);
+        rings[i] = shm ? shm->rx : NULL;
+        pfds[i].fd = shm ? shm->rx->notify_fd : fds[i];
+        pfds[i].events = POLLIN;
+        if (shm) {
+            any_ring = 1;
+            spin |= shm->rx->notify_fd < 0;
+            shm_ring_wait_begin(shm->rx);
+        }
+    }
+
+    double deadline = timeout_ms > 0 ? comm_now_ms() + timeout_ms : 0;
+    int count = 0;
+    while (1) {
+        for (int i = 0; i < nfds; i++) {
+            ready[i] = rings[i] && shm_ring_readable(rings[i]) > 0;
+            count += ready[i];
+        }
+
+        int wait = timeout_ms;
+        if (count > 0 || timeout_ms == 0) {
+            wait = 0;
+        } else if (timeout_ms > 0) {
+            wait = (int)(deadline - comm_now_ms() + 1);
+            if (wait < 1) wait = 1;
+        }
+        // a ring without an eventfd is looked at between short waits, and
+        // no wait on rings outlasts the time to notice a dead producer
+        if (spin && wait != 0)
+            wait = 1;
+        else if (any_ring && (wait < 0 || wait > SHM_WAIT_MAX_MS))
+            wait = SHM_WAIT_MAX_MS;
+
+        int n = poll(pfds, nfds, wait);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            count = -1;
+            break;
+        }
+
+        count = 0;
+        for (int i = 0; i < nfds; i++) {
+            if (rings[i]) {
+                // a signal for data taken already wakes the poll for nothing
+                if (pfds[i].revents)
+                    shm_ring_clear_notify(rings[i]);
+                else if (n == 0 && wait != 0)
+                    shm_ring_check_producer(rings[i]);
+                ready[i] = shm_ring_readable(rings[i]) > 0;
+            } else {
+                ready[i] = pfds[i].revents != 0;
+            }
+            count += ready[i];
+        }
+
+        if (count > 0 || timeout_ms == 0 || (timeout_ms > 0 && comm_now_ms() >= deadline))
+            break;
+        count = 0;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        if (rings[i])
+            shm_ring_wait_end(rings[i]);
+    }
+    return count;
+}
+
+// Split "host:port" and resolve it, an empty host means any address
+static struct addrinfo *comm_tcp_resolve(const char *address, int passive)
+{
+    const char *colon = address ? strrchr(address, ':') : NULL;
+    if (!colon || colon[1] == '\0') {
+        fprintf(stderr, "[Communication] ERROR: bad address '%s', expected host:port\n", address ? address : "");
+        return NULL;
+    }
+
+    char host[256];
+    size_t host_len = colon - address;
+    if (host_len >= sizeof(host))
+        return NULL;
+    memcpy(host, address, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    struct addrinfo *res;
+    int err = getaddrinfo(host_len > 0 ? host : NULL, colon + 1, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "[Communication] ERROR: cannot resolve '%s': %s\n", address, gai_strerror(err));
+        return NULL;
+    }
+    return res;
+}
+
+int comm_tcp_tune(int sock_fd)
+{
+    int one = 1;
+    int buf = COMM_TCP_BUFFER;
+
+    if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0 ||
+        setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf)) != 0 ||
+        setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf)) != 0) {
+        perror("setsockopt");
+        return -1;
+    }
+    return 0;
+}
+
+int comm_tcp_listen(const char *address)
+{
+    struct addrinfo *res = comm_tcp_resolve(address, 1);
+    if (!res) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        // buffer sizes are inherited by accepted connections
+        int buf = COMM_TCP_BUFFER;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "[Communication] ERROR: cannot listen on '%s' (errno=%d)\n", address, errno);
+    return fd;
+}
+
+int comm_tcp_connect(const char *address)
+{
+    struct addrinfo *res = comm_tcp_resolve(address, 0);
+    if (!res) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+
+        // the receive buffer has to be set before the handshake to take effect
+        if (comm_tcp_tune(fd) == 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, "[Communication] ERROR: cannot connect to '%s' (errno=%d)\n", address, errno);
+    return fd;
+}
+
 ssize_t send_all(int sock_fd, const void *buf, size_t len) {
+    CommEndpoint *shm = comm_shm(sock_fd);
+    if (shm) return shm_ring_write(shm->tx, buf, len);
+
     size_t total = 0;
     const char *p = buf;
 
     while (total < len) {
-        size_t n = write(sock_fd, p + total, len - total);
+        ssize_t n = write(sock_fd, p + total, len - total);
         if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
             fprintf(stderr, "[Communication] ERROR: write() failed after %zu/%zu bytes (errno=%d)\n", total, len, errno);
             return -1;
         }
@@ -17,12 +278,16 @@ ssize_t send_all(int sock_fd, const void *buf, size_t len) {
 }
 
 ssize_t recv_all(int sock_fd, void *buf, size_t len) {
+    CommEndpoint *shm = comm_shm(sock_fd);
+    if (shm) return shm_ring_read(shm->rx, buf, len);
+
     size_t total = 0;
     char *p = buf;
 
     while (total < len) {
-        size_t n = read(sock_fd, p + total, len - total);
+        ssize_t n = read(sock_fd, p + total, len - total);
         if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
             fprintf(stderr, "[Communication] ERROR: read() failed after %zu/%zu bytes (errno=%d)\n", total, len, errno);
             return -1;
         }
@@ -32,27 +297,172 @@ ssize_t recv_all(int sock_fd, void *buf, size_t len) {
     return total;
 }
 
-ssize_t md_send_command(int sock_fd, DNCommand cmd, void *payload, size_t payload_size) {
-    // DNHeader header = {cmd, payload_size};
+// Advance iov past n consumed bytes, returns the new start of the array
+static struct iovec *iov_advance(struct iovec *iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        (*iovcnt)--;
+    }
+
+    if (*iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+
+    return iov;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+ssize_t send_allv(int sock_fd, struct iovec *iov, int iovcnt)
+{
+    CommEndpoint *shm = comm_shm(sock_fd);
+    if (shm) return shm_ring_writev(shm->tx, iov, iovcnt);
+
+    size_t len = iov_length(iov, iovcnt);
+    size_t total = 0;
+
+    while (total < len) {
+        int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+
+        ssize_t n = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fprintf(stderr, "[Communication] ERROR: sendmsg() failed after %zu/%zu bytes (errno=%d)\n", total, len, errno);
+            return -1;
+        }
+        total += n;
+        iov = iov_advance(iov, &iovcnt, n);
+    }
+
+    return total;
+}
+
+ssize_t recv_allv(int sock_fd, struct iovec *iov, int iovcnt)
+{
+    CommEndpoint *shm = comm_shm(sock_fd);
+    if (shm) return shm_ring_readv(shm->rx, iov, iovcnt);
+
+    size_t len = iov_length(iov, iovcnt);
+    size_t total = 0;
+
+    while (total < len) {
+        int cnt = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        ssize_t n = readv(sock_fd, iov, cnt);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            fprintf(stderr, "[Communication] ERROR: readv() failed after %zu/%zu bytes (errno=%d)\n", total, len, errno);
+            return -1;
+        }
+        total += n;
+        iov = iov_advance(iov, &iovcnt, n);
+    }
+
+    return total;
+}
+
+ssize_t recv_discard(int sock_fd, size_t len)
+{
+    char scratch[4096];
+
+    while (len > 0) {
+        size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (recv_all(sock_fd, scratch, chunk) != chunk)
+            return -1;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// The header goes out in front of iov, iovcnt is limited to DN_MAX_IOV
+static ssize_t send_with_header(int sock_fd, void *header, size_t header_size,
+                                const struct iovec *iov, int iovcnt)
+{
+    struct iovec vec[DN_MAX_IOV + 1];
+
+    if (iovcnt > DN_MAX_IOV)
+        return -1;
+
+    vec[0].iov_base = header;
+    vec[0].iov_len = header_size;
+    if (iovcnt > 0)
+        memcpy(&vec[1], iov, sizeof(struct iovec) * iovcnt);
+
+    size_t len = header_size + iov_length(iov, iovcnt);
+    if (send_allv(sock_fd, vec, iovcnt + 1) != len)
+        return -1;
+
+    return 0;
+}
+
+ssize_t md_send_commandv(int sock_fd, uint32_t req_id, DNCommand cmd, const struct iovec *iov, int iovcnt)
+{
     DNHeader header = {0};
+    header.req_id = req_id;
     header.cmd = cmd;
-    header.payload_size = payload_size;
-    
-    if (send_all(sock_fd, &header, sizeof(header)) != sizeof(header)) 
+    header.payload_size = iov_length(iov, iovcnt);
+
+    return send_with_header(sock_fd, &header, sizeof(header), iov, iovcnt);
+}
+
+ssize_t dn_send_responsev(int sock_fd, uint32_t req_id, DNStatus status, const struct iovec *iov, int iovcnt)
+{
+    DNResponseHeader header = {0};
+    header.req_id = req_id;
+    header.status = status;
+
+    return dn_send_response_headerv(sock_fd, &header, iov, iovcnt);
+}
+
+ssize_t dn_send_response_headerv(int sock_fd, DNResponseHeader *header, const struct iovec *iov, int iovcnt)
+{
+    header->payload_size = iov_length(iov, iovcnt);
+
+    return send_with_header(sock_fd, header, sizeof(*header), iov, iovcnt);
+}
+
+ssize_t md_recv_response_header(int sock_fd, DNResponseHeader *header)
+{
+    if (recv_all(sock_fd, header, sizeof(*header)) != sizeof(*header))
         return -1;
 
-    if (payload_size > 0 && send_all(sock_fd, payload, payload_size) != payload_size)
+    return 0;
+}
+
+ssize_t dn_recv_command_header(int sock_fd, DNHeader *header)
+{
+    if (recv_all(sock_fd, header, sizeof(*header)) != sizeof(*header))
         return -1;
 
     return 0;
 }
 
-ssize_t dn_recv_command(int sock_fd, DNCommand *cmd, void **payload, size_t *payload_size) {
+ssize_t md_send_command(int sock_fd, uint32_t req_id, DNCommand cmd, void *payload, size_t payload_size) {
+    struct iovec iov = { payload, payload_size };
+    return md_send_commandv(sock_fd, req_id, cmd, &iov, payload_size > 0 ? 1 : 0);
+}
+
+ssize_t dn_recv_command(int sock_fd, uint32_t *req_id, DNCommand *cmd, void **payload, size_t *payload_size) {
     DNHeader header = {0};
     
-    if (recv_all(sock_fd, &header, sizeof(header)) != sizeof(header))
+    if (dn_recv_command_header(sock_fd, &header) != 0)
         return -1;
     
+    *req_id = header.req_id;
     *cmd = header.cmd;
     *payload_size = header.payload_size;
     
@@ -71,26 +481,18 @@ ssize_t dn_recv_command(int sock_fd, DNCommand *cmd, void **payload, size_t *pay
     return 0;
 }
 
-ssize_t dn_send_response(int sock_fd, DNStatus status, void *payload, size_t payload_size) {
-    DNResponseHeader header = {0};
-    header.status = status;
-    header.payload_size = payload_size;
-    
-    if (send_all(sock_fd, &header, sizeof(header)) != sizeof(header))
-        return -1;
-
-    if (payload_size > 0 && send_all(sock_fd, payload, payload_size) != payload_size)
-        return -1;
-
-    return 0;
+ssize_t dn_send_response(int sock_fd, uint32_t req_id, DNStatus status, void *payload, size_t payload_size) {
+    struct iovec iov = { payload, payload_size };
+    return dn_send_responsev(sock_fd, req_id, status, &iov, payload_size > 0 ? 1 : 0);
 }
 
-ssize_t md_recv_response(int sock_fd, DNStatus *status, void **payload, size_t *payload_size) {
+ssize_t md_recv_response(int sock_fd, uint32_t *req_id, DNStatus *status, void **payload, size_t *payload_size) {
     DNResponseHeader header = {0};
     
-    if (recv_all(sock_fd, &header, sizeof(header)) != sizeof(header)) 
+    if (md_recv_response_header(sock_fd, &header) != 0)
         return -1;
     
+    *req_id = header.req_id;
     *status = header.status;
     *payload_size = header.payload_size;
     
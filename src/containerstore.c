@@ -0,0 +1,524 @@
+#define _GNU_SOURCE
+#include "datanode.h"
+#include "blockstore.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+
+// One preallocated container file per block class of a datanode, laid out
+// as extents of the slots the class starts with. An extent's head is a table
+// with the checksum of every slot and another with the block index owning it
+// (plus one, 0 for a free slot), rounded up to DN_DIRECT_ALIGN, followed by
+// the slots themselves, each the class's block size. Without compress there
+// is a single extent, compressed blocks leaving room add more. Global block
+// indices map to local slots through an open-addressed table rebuilt from
+// the owners on recovery, freed slots get their space punched out.
+
+extern DataNode *dn;
+
+#define SLOT_EMPTY -1
+
+typedef struct {
+    int fd;
+    int direct_fd;      // slots opened again with O_DIRECT, -1 if unused
+    size_t block_size;
+    int num_slots;
+    int extent_slots;
+    int num_extents;
+    off_t extent_size;
+    off_t owners_start;     // within an extent
+    off_t data_start;
+
+    // the whole container mapped read-only with dn->mmap_reads
+    char *map;
+    size_t map_size;
+
+    // open-addressed block index -> slot map, map_mask + 1 entries
+    int *keys;
+    int *slots;
+    int map_mask;
+
+    // stack of unused slots
+    int *free_slots;
+    int num_free;
+} ContainerState;
+
+// The container of block_index's class
+static inline ContainerState *container_state(int block_index)
+{
+    return (ContainerState *)store->state + (datanode_class(block_index) - dn->classes);
+}
+
+static inline unsigned container_hash(int block_index)
+{
+    return (unsigned)block_index * 2654435761u;
+}
+
+static int container_find(ContainerState *s, int block_index)
+{
+    unsigned i = container_hash(block_index) & s->map_mask;
+    while (s->keys[i] != SLOT_EMPTY) {
+        if (s->keys[i] == block_index)
+            return (int)i;
+        i = (i + 1) & s->map_mask;
+    }
+    return -1;
+}
+
+static void container_insert(ContainerState *s, int block_index, int slot)
+{
+    unsigned i = container_hash(block_index) & s->map_mask;
+    while (s->keys[i] != SLOT_EMPTY)
+        i = (i + 1) & s->map_mask;
+    s->keys[i] = block_index;
+    s->slots[i] = slot;
+}
+
+// Empty entry i, shifting back later entries of its probe run so lookups
+// never need tombstones
+static void container_remove(ContainerState *s, unsigned i)
+{
+    unsigned j = i;
+    while (1) {
+        j = (j + 1) & s->map_mask;
+        if (s->keys[j] == SLOT_EMPTY)
+            break;
+
+        // entries whose home lies cyclically in (i, j] stay where they are
+        unsigned home = container_hash(s->keys[j]) & s->map_mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        s->keys[i] = s->keys[j];
+        s->slots[i] = s->slots[j];
+        i = j;
+    }
+    s->keys[i] = SLOT_EMPTY;
+}
+
+static off_t container_extent(ContainerState *s, int slot)
+{
+    return (off_t)(slot / s->extent_slots) * s->extent_size;
+}
+
+static off_t container_offset(ContainerState *s, int slot)
+{
+    return container_extent(s, slot) + s->data_start + (off_t)(slot % s->extent_slots) * s->block_size;
+}
+
+static off_t container_crc_offset(ContainerState *s, int slot)
+{
+    return container_extent(s, slot) + (off_t)(slot % s->extent_slots) * DN_CRC_SIZE;
+}
+
+static int container_set_crc(ContainerState *s, int slot, uint32_t crc)
+{
+    return pwrite(s->fd, &crc, DN_CRC_SIZE, container_crc_offset(s, slot)) == DN_CRC_SIZE ? 0 : -1;
+}
+
+// block_index -1 marks the slot free
+static int container_set_owner(ContainerState *s, int slot, int block_index)
+{
+    int32_t owner = block_index + 1;
+    off_t offset = container_extent(s, slot) + s->owners_start + (off_t)(slot % s->extent_slots) * sizeof(owner);
+    return pwrite(s->fd, &owner, sizeof(owner), offset) == sizeof(owner) ? 0 : -1;
+}
+
+// Size the slot map for num_slots, keeping the blocks it holds
+static int container_rehash(ContainerState *s, int num_slots)
+{
+    int map_size = 16;
+    while (map_size < 2 * num_slots)
+        map_size *= 2;
+    if (s->keys && map_size == s->map_mask + 1)
+        return 0;
+
+    int *keys = s->keys;
+    int *slots = s->slots;
+    int old_size = keys ? s->map_mask + 1 : 0;
+
+    s->keys = malloc(sizeof(int) * map_size);
+    s->slots = malloc(sizeof(int) * map_size);
+    if (!s->keys || !s->slots) {
+        free(s->keys);
+        free(s->slots);
+        s->keys = keys;
+        s->slots = slots;
+        return -1;
+    }
+
+    memset(s->keys, 0xff, sizeof(int) * map_size);   // SLOT_EMPTY
+    s->map_mask = map_size - 1;
+    for (int i = 0; i < old_size; i++) {
+        if (keys[i] != SLOT_EMPTY)
+            container_insert(s, keys[i], slots[i]);
+    }
+
+    free(keys);
+    free(slots);
+    return 0;
+}
+
+// Lay out another extent once every slot is taken, with compress only. The
+// container is sparse then, the extent takes space as written
+static int container_grow(ContainerState *s)
+{
+    int num_slots = s->num_slots + s->extent_slots;
+    int *free_slots = realloc(s->free_slots, sizeof(int) * num_slots);
+    if (!free_slots)
+        return -1;
+    s->free_slots = free_slots;
+
+    if (container_rehash(s, num_slots) != 0)
+        return -1;
+
+    // a fresh extent reads as zeros, no slot has an owner
+    if (ftruncate(s->fd, (off_t)(s->num_extents + 1) * s->extent_size) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
+    s->num_extents++;
+
+    for (int slot = num_slots - 1; slot >= s->num_slots; slot--)
+        s->free_slots[s->num_free++] = slot;
+    s->num_slots = num_slots;
+
+    LOGD_DEBUG(dn->node_id, "container of %zu byte blocks grew to %d slots", s->block_size, s->num_slots);
+    return 0;
+}
+
+// Rebuild the slot map from the owners tables, a read per extent
+static int container_recover(ContainerState *s)
+{
+    size_t size = sizeof(int32_t) * s->num_slots;
+    int32_t *owners = malloc(size > 0 ? size : 1);
+    if (!owners)
+        return -1;
+
+    size_t extent = sizeof(int32_t) * s->extent_slots;
+    for (int e = 0; e < s->num_extents; e++) {
+        off_t offset = (off_t)e * s->extent_size + s->owners_start;
+        if (pread(s->fd, owners + (size_t)e * s->extent_slots, extent, offset) != (ssize_t)extent) {
+            perror("pread");
+            free(owners);
+            return -1;
+        }
+    }
+
+    // free slots are still handed out lowest first
+    s->num_free = 0;
+    for (int slot = s->num_slots - 1; slot >= 0; slot--) {
+        if (owners[slot] > 0 && container_find(s, owners[slot] - 1) < 0)
+            container_insert(s, owners[slot] - 1, slot);
+        else
+            s->free_slots[s->num_free++] = slot;
+    }
+
+    free(owners);
+    return 0;
+}
+
+// Give a slot's space back to the filesystem, it reads as zeros afterwards
+static int container_punch(ContainerState *s, int slot)
+{
+    if (fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  container_offset(s, slot), s->block_size) == 0)
+        return 0;
+
+    if (errno != EOPNOTSUPP) {
+        perror("fallocate");
+        return -1;
+    }
+
+    static char zero_block[BLOCK_SIZE_MAX];
+    return pwrite(s->fd, zero_block, s->block_size, container_offset(s, slot)) == (ssize_t)s->block_size ? 0 : -1;
+}
+
+static int container_init_class(ContainerState *s, int c)
+{
+    s->block_size = dn->classes[c].block_size;
+    int num_slots = dn->classes[c].num_slots;
+    s->extent_slots = num_slots > 0 ? num_slots : 1;
+    s->num_extents = num_slots > 0 ? 1 : 0;
+    s->owners_start = (off_t)s->extent_slots * DN_CRC_SIZE;
+    size_t table = (size_t)s->extent_slots * (DN_CRC_SIZE + sizeof(int32_t));
+    s->data_start = (off_t)((table + DN_DIRECT_ALIGN - 1) / DN_DIRECT_ALIGN * DN_DIRECT_ALIGN);
+    s->extent_size = s->data_start + (off_t)s->extent_slots * s->block_size;
+
+    char filepath[512];
+    block_store_path(filepath, sizeof(filepath), "blocks", c);
+
+    s->fd = open(filepath, O_CREAT | O_RDWR | (dn->recover ? 0 : O_TRUNC), 0644);
+    if (s->fd < 0) {
+        LOGD_ERROR(dn->node_id, "Failed to create container '%s'", filepath);
+        perror("open");
+        return -1;
+    }
+
+    // a container laid out for another capacity cannot be read back, one
+    // grown by compressed blocks keeps its extents
+    off_t total = (off_t)s->num_extents * s->extent_size;
+    struct stat st;
+    int recover = dn->recover && fstat(s->fd, &st) == 0 &&
+                  (st.st_size == total || (dn->compress && total > 0 && st.st_size > total &&
+                                           st.st_size % s->extent_size == 0));
+    if (dn->recover && !recover) {
+        LOGD_WARN(dn->node_id, "container '%s' does not match the capacity, starting empty", filepath);
+        if (ftruncate(s->fd, 0) != 0) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    if (recover) {
+        s->num_extents = (int)(st.st_size / s->extent_size);
+        total = st.st_size;
+    }
+
+    s->num_slots = s->num_extents * s->extent_slots;
+    s->free_slots = malloc(sizeof(int) * (s->num_slots > 0 ? s->num_slots : 1));
+    if (!s->free_slots || container_rehash(s, s->num_slots) != 0)
+        return -1;
+
+    for (int i = 0; i < s->num_slots; i++)
+        s->free_slots[i] = s->num_slots - 1 - i;
+    s->num_free = s->num_slots;
+
+    // reserve the whole capacity up front so writes never extend the file.
+    // Compressed slots are only partly filled, their space is taken as written
+    if (total > 0 && (dn->compress || fallocate(s->fd, 0, 0, total) != 0)) {
+        if ((!dn->compress && errno != EOPNOTSUPP) || ftruncate(s->fd, total) != 0) {
+            perror("fallocate");
+            return -1;
+        }
+    }
+
+    if (recover && container_recover(s) != 0)
+        return -1;
+
+    if (dn->direct_io) {
+        // slots are DN_DIRECT_ALIGN aligned, the checksum table stays buffered
+        s->direct_fd = open(filepath, O_RDWR | O_DIRECT);
+        if (s->direct_fd < 0) {
+            LOGD_WARN(dn->node_id, "O_DIRECT unsupported for '%s', using buffered I/O", filepath);
+            dn->direct_io = 0;
+        }
+    }
+
+    if (dn->mmap_reads && total > 0) {
+        s->map = mmap(NULL, total, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (s->map == MAP_FAILED) {
+            perror("mmap");
+            s->map = NULL;
+            dn->mmap_reads = 0;
+        } else {
+            // single block reads land anywhere, readahead would be wasted
+            s->map_size = total;
+            madvise(s->map, s->map_size, MADV_RANDOM);
+        }
+    }
+
+    LOGD(dn->node_id, "container '%s' holds %d slots", filepath, s->num_slots);
+    return 0;
+}
+
+int container_init(void)
+{
+    ContainerState *states = calloc(DN_MAX_CLASSES, sizeof(ContainerState));
+    if (!states) return -1;
+    store->state = states;
+    for (int c = 0; c < DN_MAX_CLASSES; c++) {
+        states[c].fd = -1;
+        states[c].direct_fd = -1;
+    }
+
+    for (int c = 0; c < dn->num_classes; c++) {
+        if (container_init_class(&states[c], c) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+DNStatus container_alloc(int block_index)
+{
+    ContainerState *s = container_state(block_index);
+
+    int slot;
+    int i = container_find(s, block_index);
+    if (i >= 0) {
+        // allocating again starts the block over
+        slot = s->slots[i];
+        if (container_punch(s, slot) != 0)
+            return DN_FAIL;
+    } else {
+        if (s->num_free == 0 && (!dn->compress || container_grow(s) != 0))
+            return DN_NO_SPACE;
+        slot = s->free_slots[--s->num_free];
+        container_insert(s, block_index, slot);
+        if (container_set_owner(s, slot, block_index) != 0) {
+            perror("pwrite");
+            return DN_FAIL;
+        }
+    }
+
+    if (container_set_crc(s, slot, datanode_class(block_index)->zero_crc) != 0) {
+        perror("pwrite");
+        return DN_FAIL;
+    }
+    return DN_SUCCESS;
+}
+
+DNStatus container_free(int block_index)
+{
+    ContainerState *s = container_state(block_index);
+
+    int i = container_find(s, block_index);
+    if (i < 0)
+        return DN_INVALID_BLOCK;
+
+    int slot = s->slots[i];
+    container_remove(s, i);
+    s->free_slots[s->num_free++] = slot;
+
+    if (container_set_owner(s, slot, -1) != 0) {
+        perror("pwrite");
+        return DN_FAIL;
+    }
+    return container_punch(s, slot) == 0 ? DN_SUCCESS : DN_FAIL;
+}
+
+int container_locate(int block_index, int for_write, DNBlockLoc *loc)
+{
+    (void)for_write;
+    ContainerState *s = container_state(block_index);
+
+    int i = container_find(s, block_index);
+    if (i < 0)
+        return 1;
+
+    loc->fd = s->direct_fd >= 0 ? s->direct_fd : s->fd;
+    loc->offset = container_offset(s, s->slots[i]);
+    loc->crc_fd = s->fd;
+    loc->crc_offset = container_crc_offset(s, s->slots[i]);
+    return 0;
+}
+
+void container_release(DNBlockLoc *loc)
+{
+    (void)loc;
+}
+
+const void *container_map(int block_index, uint32_t *crc)
+{
+    ContainerState *s = container_state(block_index);
+
+    int i = container_find(s, block_index);
+    if (i < 0 || !s->map)
+        return NULL;
+
+    int slot = s->slots[i];
+    memcpy(crc, s->map + container_crc_offset(s, slot), DN_CRC_SIZE);
+    return s->map + container_offset(s, slot);
+}
+
+// Runs of consecutive slots in a batch are read sequentially, have the
+// kernel start reading them in ahead of the send. A batch is of one class
+void container_advise(int count, const int *block_indices)
+{
+    if (count < 2)
+        return;
+
+    ContainerState *s = container_state(block_indices[0]);
+    if (!s->map)
+        return;
+
+    int run_start = -1;
+    int run_len = 0;
+    for (int k = 0; k <= count; k++) {
+        int slot = -1;
+        if (k < count) {
+            int i = container_find(s, block_indices[k]);
+            slot = i < 0 ? -1 : s->slots[i];
+        }
+
+        if (slot >= 0 && run_len > 0 && slot == run_start + run_len && slot % s->extent_slots != 0) {
+            run_len++;
+            continue;
+        }
+
+        if (run_len > 1)
+            madvise(s->map + container_offset(s, run_start), (size_t)run_len * s->block_size, MADV_WILLNEED);
+
+        run_start = slot;
+        run_len = slot >= 0 ? 1 : 0;
+    }
+}
+
+int container_sync(void)
+{
+    ContainerState *states = store->state;
+
+    // one descriptor per container covers the slots and the checksum table
+    for (int c = 0; c < dn->num_classes; c++) {
+        if (fdatasync(states[c].fd) != 0) {
+            perror("fdatasync");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int container_commit(DNBlockLoc *loc)
+{
+    // slots and checksums are in place, one file holds them
+    if (fdatasync(loc->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+int container_list(int **block_indices)
+{
+    ContainerState *states = store->state;
+
+    int total = 1;
+    for (int c = 0; c < dn->num_classes; c++)
+        total += states[c].num_slots - states[c].num_free;
+
+    int count = 0;
+    int *blocks = malloc(sizeof(int) * total);
+    if (!blocks)
+        return -1;
+
+    for (int c = 0; c < dn->num_classes; c++) {
+        ContainerState *s = &states[c];
+        for (int i = 0; i <= s->map_mask; i++) {
+            if (s->keys[i] != SLOT_EMPTY)
+                blocks[count++] = s->keys[i];
+        }
+    }
+
+    *block_indices = blocks;
+    return count;
+}
+
+void container_destroy(void)
+{
+    ContainerState *states = store->state;
+    if (!states) return;
+
+    for (int c = 0; c < DN_MAX_CLASSES; c++) {
+        ContainerState *s = &states[c];
+        if (s->map)
+            munmap(s->map, s->map_size);
+        if (s->direct_fd >= 0)
+            close(s->direct_fd);
+        if (s->fd >= 0)
+            close(s->fd);
+        free(s->keys);
+        free(s->slots);
+        free(s->free_slots);
+    }
+    free(states);
+    store->state = NULL;
+}
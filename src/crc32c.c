@@ -0,0 +1,187 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// Slicing-by-8 tables, crc32c_table[0] is the classic byte table
+static uint32_t crc32c_table[8][256];
+
+// The hardware path runs three independent streams of CRC32C_CHUNK bytes to
+// hide the latency of the crc32 instruction, crc32c_shift_table advances a
+// register over CRC32C_CHUNK zero bytes to stitch the streams together
+#define CRC32C_CHUNK 1360
+static uint32_t crc32c_shift_table[4][256];
+
+static int crc32c_hw;
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int t = 1; t < 8; t++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[t][n] = crc;
+        }
+    }
+
+    // shifting is linear, build it from the images of the 32 single bits
+    uint32_t bit_shift[32];
+    for (int j = 0; j < 32; j++) {
+        uint32_t crc = 1u << j;
+        for (int n = 0; n < CRC32C_CHUNK; n++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+        bit_shift[j] = crc;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            uint32_t crc = 0;
+            for (int j = 0; j < 8; j++) {
+                if (b & (1u << j))
+                    crc ^= bit_shift[i * 8 + j];
+            }
+            crc32c_shift_table[i][b] = crc;
+        }
+    }
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    // eight bytes per step, little-endian word loads
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+
+        crc = crc32c_table[7][lo & 0xff] ^
+              crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^
+              crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^
+              crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^
+              crc32c_table[0][hi >> 24];
+
+        p += 8;
+        len -= 8;
+    }
+
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+    return crc32c_shift_table[0][crc & 0xff] ^
+           crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+           crc32c_shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_update(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+
+    while (len >= 3 * CRC32C_CHUNK) {
+        uint64_t a = crc64, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_CHUNK; i += 8) {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, p + i, 8);
+            memcpy(&wb, p + CRC32C_CHUNK + i, 8);
+            memcpy(&wc, p + 2 * CRC32C_CHUNK + i, 8);
+            a = _mm_crc32_u64(a, wa);
+            b = _mm_crc32_u64(b, wb);
+            c = _mm_crc32_u64(c, wc);
+        }
+
+        crc64 = crc32c_shift((uint32_t)crc32c_shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        p += 3 * CRC32C_CHUNK;
+        len -= 3 * CRC32C_CHUNK;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    return ~crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef CRC32C_X86
+    if (crc32c_hw)
+        return crc32c_hw_update(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+    return crc32c_hw;
+}
@@ -1,129 +1,845 @@
+#define _DEFAULT_SOURCE
 #include "datanode.h"
 #include "communication.h"
+#include "blockstore.h"
+
+#include <sys/socket.h>
+#include <time.h>
 
 DataNode * dn = NULL;
 
+size_t block_size = BLOCK_SIZE_DEFAULT;
+
+// What a reserved block that was never written reads as. Sized for the
+// largest blocks and left out of .rodata, untouched pages cost nothing
+static char datanode_zero_block[BLOCK_SIZE_MAX];
+
+// Every class's size and num_blocks as responses report them, written with
+// dn->lock held and read by whichever thread answers
+static _Atomic uint64_t datanode_stored_bytes[DN_MAX_CLASSES];
+static _Atomic int32_t datanode_stored_blocks[DN_MAX_CLASSES];
+
+// Report the classes' size and num_blocks in the responses from now on, with
+// dn->lock held
+static void datanode_publish(void)
+{
+    for (int c = 0; c < dn->num_classes; c++) {
+        datanode_stored_bytes[c] = dn->classes[c].size;
+        datanode_stored_blocks[c] = dn->classes[c].num_blocks;
+    }
+}
+
+DNClass *datanode_class(int block_index)
+{
+    return block_index >= 0 ? &dn->classes[block_index % dn->num_classes] : NULL;
+}
+
+size_t datanode_block_size(int block_index)
+{
+    DNClass *c = datanode_class(block_index);
+    return c ? c->block_size : 0;
+}
+
+ssize_t datanode_respondv(int sock_fd, uint32_t req_id, DNStatus status, const struct iovec *iov, int iovcnt)
+{
+    DNResponseHeader header = {0};
+    header.req_id = req_id;
+    header.status = status;
+    if (dn && dn->compress) {
+        for (int c = 0; c < dn->num_classes; c++) {
+            header.stored_bytes[c] = datanode_stored_bytes[c];
+            header.stored_blocks[c] = datanode_stored_blocks[c];
+        }
+    }
+
+    return dn_send_response_headerv(sock_fd, &header, iov, iovcnt);
+}
+
+ssize_t datanode_respond(int sock_fd, uint32_t req_id, DNStatus status, void *payload, size_t payload_size)
+{
+    struct iovec iov = { payload, payload_size };
+    return datanode_respondv(sock_fd, req_id, status, &iov, payload_size > 0 ? 1 : 0);
+}
+
+// Bytes block_index takes from now on, its compressed length, with dn->lock
+// held. Only compressed blocks are charged this way, DN_NO_SPACE if they
+// would not fit in their class
+static DNStatus datanode_charge(int block_index, size_t bytes)
+{
+    DNClass *c = datanode_class(block_index);
+    if (!c)
+        return DN_FAIL;
+
+    if (bytes > c->block_size)
+        bytes = c->block_size;
+
+    if (block_index >= dn->stored_cap) {
+        int cap = dn->stored_cap ? dn->stored_cap : 1024;
+        while (cap <= block_index)
+            cap *= 2;
+
+        uint32_t *grown = realloc(dn->stored, sizeof(uint32_t) * cap);
+        if (!grown)
+            return DN_FAIL;
+        memset(grown + dn->stored_cap, 0, sizeof(uint32_t) * (cap - dn->stored_cap));
+        dn->stored = grown;
+        dn->stored_cap = cap;
+    }
+
+    size_t old = dn->stored[block_index];
+    if (bytes > old && c->size + (bytes - old) > c->capacity) {
+        LOGD_ERROR(dn->node_id, "No space for block %d (would exceed capacity)", block_index);
+        return DN_NO_SPACE;
+    }
+
+    c->size = c->size - old + bytes;
+    dn->stored[block_index] = bytes;
+    datanode_publish();
+    return DN_SUCCESS;
+}
+
+static int datanode_compressed(const DNCompressedHeader *header, size_t size)
+{
+    return header->magic == DN_COMPRESSED_MAGIC && header->length <= size - sizeof(*header);
+}
+
+// Bytes a block left by a previous run takes, read from its header, with
+// dn->lock held
+static size_t datanode_stored_size(int block_index)
+{
+    DNBlockLoc loc;
+    if (datanode_block_open(block_index, 0, &loc, NULL) != 0)
+        return 0;
+
+    DNCompressedHeader header;
+    size_t bytes = loc.size;
+    if (pread(loc.fd, &header, sizeof(header), loc.offset) == sizeof(header) &&
+        datanode_compressed(&header, loc.size))
+        bytes = sizeof(header) + header.length;
+
+    datanode_block_close(&loc);
+    return bytes;
+}
+
 DNStatus datanode_init(int sock_fd, void *payload, size_t payload_size)
 {
     dn->sock_fd = sock_fd;
 
-    if (payload_size < sizeof(int) + sizeof(size_t)) {
-        DNStatus status = DN_FAIL;
-        dn_send_response(sock_fd, status, NULL, 0);
-        free(dn);
+    if (payload_size < sizeof(DNInitPayload)) {
         return DN_FAIL;
     }
 
     DNInitPayload *init = (DNInitPayload*)payload;
+    if (init->num_classes < 1 || init->num_classes > DN_MAX_CLASSES) {
+        LOGD_ERROR(init->node_id, "unsupported number of block classes %d", init->num_classes);
+        return DN_FAIL;
+    }
+
+    // buffers are sized for the largest class
+    block_size = 0;
+    for (int i = 0; i < init->num_classes; i++) {
+        DNClassInit *ci = &init->classes[i];
+        if (!block_size_valid(ci->block_size)) {
+            LOGD_ERROR(init->node_id, "unsupported block size %zu", ci->block_size);
+            return DN_FAIL;
+        }
+
+        DNClass *c = &dn->classes[i];
+        c->block_size = ci->block_size;
+        c->capacity = ci->capacity;
+        c->num_slots = ci->slots > 0 ? ci->slots : (int)(ci->capacity / ci->block_size);
+        c->zero_crc = crc32c(0, datanode_zero_block, c->block_size);
+        if (c->block_size > block_size)
+            block_size = c->block_size;
+    }
+    dn->num_classes = init->num_classes;
+
     dn->node_id = init->node_id;
-    dn->capacity = init->capacity;
+    dn->engine = init->engine;
+    dn->workers = init->workers > 0 ? init->workers : DN_WORKERS_DEFAULT;
+    dn->mmap_reads = init->mmap_reads;
+    dn->direct_io = init->direct_io;
+    dn->durability = init->durability;
+    dn->group_commit_us = init->group_commit_us > 0 ? init->group_commit_us : 0;
+    dn->group_commit_batch = init->group_commit_batch > 0 ? init->group_commit_batch : DN_GROUP_COMMIT_BATCH;
+    dn->recover = init->recover;
+    dn->compress = init->compress;
+
+    if (init->log_level > 0)
+        log_set_level(init->log_level);
 
-    LOGD(dn->node_id, "received node id=%d capacity=%zu", dn->node_id, dn->capacity);
+    for (int i = 0; i < dn->num_classes; i++) {
+        DNClass *c = &dn->classes[i];
+        LOGD(dn->node_id, "received node id=%d class %d: capacity=%zu block size=%zu slots=%d",
+             dn->node_id, i, c->capacity, c->block_size, c->num_slots);
+    }
 
     snprintf(dn->dir_path, sizeof(dn->dir_path), "dn_%d", dn->node_id);
     mkdir(dn->dir_path, 0755);
 
-    dn->size = 0;
-    
-    return DN_SUCCESS;
-}
+    datanode_publish();
 
-DNStatus datanode_alloc_block(int block_index)
-{
-    LOGD(dn->node_id, "Allocating block %d (current size=%zu, capacity=%zu)", block_index, dn->size, dn->capacity);
+    if (dn->direct_io && dn->mmap_reads) {
+        // mapped reads would pull every block back into the page cache
+        LOGD_WARN(dn->node_id, "direct I/O requested, mapped reads disabled");
+        dn->mmap_reads = 0;
+    }
 
-    if (dn->size + BLOCK_SIZE > dn->capacity) {
-        LOGD(dn->node_id, "ERROR: No space for block %d (would exceed capacity)", block_index);
-        return DN_NO_SPACE;
+    if (dn->compress) {
+        // storage holds compressed data, which is neither sent as it is nor
+        // sized for O_DIRECT
+        if (dn->mmap_reads || dn->direct_io)
+            LOGD_WARN(dn->node_id, "compression on, mapped reads and direct I/O disabled");
+        dn->mmap_reads = 0;
+        dn->direct_io = 0;
+
+        // io_uring moves whole raw blocks
+        if (dn->engine == DN_ENGINE_URING) {
+            LOGD_WARN(dn->node_id, "compression on, serving with I/O threads instead of io_uring");
+            dn->engine = DN_ENGINE_THREADS;
+        }
     }
 
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/block_%d.dat", dn->dir_path, block_index);
-    
-    int fd = open(filepath, O_CREAT | O_WRONLY, 0644);
-    if (!fd) {
-        LOGD(dn->node_id, "ERROR: Failed to create block file '%s'", filepath);
-        perror("open");
+    int fd_cache = init->fd_cache == 0 ? DN_FD_CACHE_DEFAULT : init->fd_cache;
+    if (fdcache_init(&dn->fds, fd_cache) != 0)
         return DN_FAIL;
+
+    // the classes share the cache budget evenly
+    int64_t block_cache = init->block_cache == 0 ? DN_BLOCK_CACHE_DEFAULT : init->block_cache;
+    for (int i = 0; i < dn->num_classes; i++) {
+        size_t budget = block_cache > 0 ? (size_t)block_cache / dn->num_classes : 0;
+        if (blockcache_init(&dn->classes[i].cache, budget, dn->classes[i].block_size) != 0)
+            return DN_FAIL;
     }
 
-    if (ftruncate(fd, BLOCK_SIZE) == -1) {
-        perror("ftruncate");
-        close(fd);
+    init->store[sizeof(init->store) - 1] = '\0';
+    if (!block_store_init(init->store)) {
+        LOGD_ERROR(dn->node_id, "block store '%s' failed to start", init->store);
         return DN_FAIL;
     }
 
-    close(fd);
+    if (dn->recover) {
+        int *blocks = NULL;
+        int count = store->list(&blocks);
+        if (count < 0)
+            return DN_FAIL;
 
-    dn->size += BLOCK_SIZE;
+        pthread_mutex_lock(&dn->lock);
+        for (int i = 0; i < count; i++) {
+            DNClass *c = datanode_class(blocks[i]);
+            c->num_blocks++;
+            if (dn->compress)
+                datanode_charge(blocks[i], datanode_stored_size(blocks[i]));
+            else
+                c->size += c->block_size;
+        }
+        datanode_publish();
+        pthread_mutex_unlock(&dn->lock);
+        free(blocks);
 
-    LOGD(dn->node_id, "Block %d created successfully (new size=%zu)", block_index, dn->size);
+        LOGD(dn->node_id, "recovered %d blocks", count);
+    }
+
+    int pool = (int)(DN_DIRECT_POOL * BLOCK_SIZE_MIN / BLOCK_SIZE);
+    if (pool < DN_DIRECT_POOL_MIN)
+        pool = DN_DIRECT_POOL_MIN;
+    if (pool < dn->workers)
+        pool = dn->workers;
+
+    if ((dn->direct_io || dn->compress) && bufpool_init(&dn->pool, pool, BLOCK_SIZE, DN_DIRECT_ALIGN) != 0) {
+        LOGD_ERROR(dn->node_id, "could not allocate the %s buffer pool", dn->direct_io ? "direct I/O" : "compression");
+        return DN_FAIL;
+    }
+    
+    return DN_SUCCESS;
+}
+
+// Give a block its storage, with dn->lock held
+static DNStatus datanode_store_alloc(int block_index)
+{
+    DNClass *c = datanode_class(block_index);
+    LOGD_DEBUG(dn->node_id, "Allocating block %d (current size=%zu, capacity=%zu)", block_index, c->size, c->capacity);
+
+    // compressed blocks are charged once written
+    if (!dn->compress && c->size + c->block_size > c->capacity) {
+        LOGD_ERROR(dn->node_id, "No space for block %d (would exceed capacity)", block_index);
+        return DN_NO_SPACE;
+    }
+
+    // allocating a block again starts it over
+    blockcache_invalidate(&c->cache, block_index);
+
+    DNStatus status = store->alloc(block_index);
+    if (status != DN_SUCCESS)
+        return status;
+
+    if (dn->compress)
+        datanode_charge(block_index, 0);
+    else
+        c->size += c->block_size;
+    c->num_blocks++;
+    datanode_publish();
+
+    LOGD_DEBUG(dn->node_id, "Block %d created successfully (new size=%zu)", block_index, c->size);
     
     return DN_SUCCESS;
 }
 
 DNStatus datanode_free_block(int block_index)
 {
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/block_%d.dat", dn->dir_path, block_index);
+    DNClass *c = datanode_class(block_index);
+    if (!c)
+        return DN_INVALID_BLOCK;
 
-    if (unlink(filepath) != 0) {
-        perror("unlink");
-        return DN_FAIL;
+    pthread_mutex_lock(&dn->lock);
+    fdcache_invalidate(&dn->fds, block_index);
+    blockcache_invalidate(&c->cache, block_index);
+
+    // a block that was never written has no storage to give back
+    DNStatus status = store->free(block_index);
+    if (status == DN_SUCCESS) {
+        if (dn->compress)
+            datanode_charge(block_index, 0);
+        else
+            c->size -= c->block_size;
+        c->num_blocks--;
+        datanode_publish();
     }
+    pthread_mutex_unlock(&dn->lock);
 
-    dn->size -= BLOCK_SIZE;
+    if (status == DN_INVALID_BLOCK)
+        return DN_SUCCESS;
+    if (status != DN_SUCCESS)
+        return status;
 
-    LOGD(dn->node_id, "block with id=%d deleted", block_index);
+    LOGD_DEBUG(dn->node_id, "block with id=%d deleted", block_index);
     return DN_SUCCESS;
 }
 
+static void *datanode_pool_get(void)
+{
+    pthread_mutex_lock(&dn->lock);
+    void *buf = bufpool_get(&dn->pool);
+    pthread_mutex_unlock(&dn->lock);
+    return buf;
+}
+
+static void datanode_pool_put(void *buf)
+{
+    pthread_mutex_lock(&dn->lock);
+    bufpool_put(&dn->pool, buf);
+    pthread_mutex_unlock(&dn->lock);
+}
+
+// Compressed form of size bytes of block data in a pool buffer, header first,
+// with its length in length. NULL when the block is better stored raw
+static char *datanode_compress(const void *data, size_t size, size_t *length)
+{
+    char *packed = datanode_pool_get();
+    if (!packed)
+        return NULL;
+
+    DNCompressedHeader header = { DN_COMPRESSED_MAGIC, 0 };
+    size_t n = lz_compress(data, size, packed + sizeof(header), DN_COMPRESS_LIMIT(size) - sizeof(header));
+    if (n == 0) {
+        datanode_pool_put(packed);
+        return NULL;
+    }
+
+    header.length = n;
+    memcpy(packed, &header, sizeof(header));
+    *length = sizeof(header) + n;
+    return packed;
+}
+
+// Expand a size byte block read whole into buffer in place, 1 if it was
+// compressed and came out matching crc. Raw data that only looks compressed
+// is left alone
+static int datanode_decompress(void *buffer, size_t size, uint32_t crc)
+{
+    DNCompressedHeader header;
+    memcpy(&header, buffer, sizeof(header));
+    if (!datanode_compressed(&header, size))
+        return 0;
+
+    char *data = datanode_pool_get();
+    if (!data)
+        return 0;
+
+    int ok = lz_decompress((char *)buffer + sizeof(header), header.length, data, size) == (long)size &&
+             crc32c(0, data, size) == crc;
+    if (ok)
+        memcpy(buffer, data, size);
+
+    datanode_pool_put(data);
+    return ok;
+}
+
+// Move length bytes of a block's data and its checksum, in one call when the
+// checksum is a trailer the data reaches
+static int datanode_block_io(DNBlockLoc *loc, void *buffer, size_t length, uint32_t *crc, int write)
+{
+    if (length == loc->size && datanode_block_trailer(loc)) {
+        struct iovec iov[2] = {
+            { buffer, length },
+            { crc, DN_CRC_SIZE },
+        };
+        ssize_t n = write ? pwritev(loc->fd, iov, 2, loc->offset) : preadv(loc->fd, iov, 2, loc->offset);
+        return n == (ssize_t)(length + DN_CRC_SIZE) ? 0 : -1;
+    }
+
+    // O_DIRECT needs an aligned buffer, unaligned ones bounce through the pool
+    char *data = buffer;
+    if (dn->direct_io && ((uintptr_t)buffer & (DN_DIRECT_ALIGN - 1))) {
+        data = datanode_pool_get();
+        if (!data)
+            return -1;
+        if (write)
+            memcpy(data, buffer, length);
+    }
+
+    int ret = 0;
+    if (write) {
+        if (pwrite(loc->fd, data, length, loc->offset) != (ssize_t)length ||
+            pwrite(loc->crc_fd, crc, DN_CRC_SIZE, loc->crc_offset) != DN_CRC_SIZE)
+            ret = -1;
+    } else {
+        if (pread(loc->fd, data, length, loc->offset) != (ssize_t)length ||
+            pread(loc->crc_fd, crc, DN_CRC_SIZE, loc->crc_offset) != DN_CRC_SIZE)
+            ret = -1;
+        else if (data != buffer)
+            memcpy(buffer, data, length);
+    }
+
+    if (data != buffer)
+        datanode_pool_put(data);
+    return ret;
+}
+
 DNStatus datanode_read_block(int block_index, void * buffer)
 {
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/block_%d.dat", dn->dir_path, block_index);
+    DNClass *c = datanode_class(block_index);
+    if (!c)
+        return DN_INVALID_BLOCK;
 
-    FILE *f = fopen(filepath, "rb");
-    if (!f) {
-        perror("fopen");
+    // only the block I/O itself runs unlocked
+    pthread_mutex_lock(&dn->lock);
+    if (blockcache_get(&c->cache, block_index, buffer) == 0) {
+        pthread_mutex_unlock(&dn->lock);
+        LOGD_DEBUG(dn->node_id, "read block %d from cache", block_index);
+        return DN_SUCCESS;
+    }
+
+    DNBlockLoc loc;
+    int opened = datanode_block_open(block_index, 0, &loc, NULL);
+    pthread_mutex_unlock(&dn->lock);
+    if (opened < 0)
         return DN_FAIL;
+    if (opened > 0) {
+        LOGD_DEBUG(dn->node_id, "block %d was never written, reads as zeros", block_index);
+        memset(buffer, 0, c->block_size);
+        return DN_SUCCESS;
     }
 
-    size_t read_bytes = fread(buffer, 1, BLOCK_SIZE, f);
-    fclose(f);
+    uint32_t crc;
+    int ret = datanode_block_io(&loc, buffer, c->block_size, &crc, 0);
+    pthread_mutex_lock(&dn->lock);
+    datanode_block_close(&loc);
+    pthread_mutex_unlock(&dn->lock);
 
-    if (read_bytes != BLOCK_SIZE) {
-        LOGD(dn->node_id, "incomplete read for block %d", block_index);
+    if (ret != 0) {
+        LOGD_ERROR(dn->node_id, "incomplete read for block %d", block_index);
         return DN_FAIL;
     }
 
-    LOGD(dn->node_id, "read block %d", block_index);
+    // a decompressed block was checked on the way
+    int verified = dn->compress && datanode_decompress(buffer, c->block_size, crc);
+    if (!verified && crc32c(0, buffer, c->block_size) != crc) {
+        LOGD_ERROR(dn->node_id, "block %d fails its checksum", block_index);
+        return DN_CORRUPT;
+    }
+
+    pthread_mutex_lock(&dn->lock);
+    blockcache_insert(&c->cache, block_index, buffer);
+    pthread_mutex_unlock(&dn->lock);
+
+    LOGD_DEBUG(dn->node_id, "read block %d", block_index);
     return DN_SUCCESS;
 }
 
-DNStatus datanode_write_block(int block_index, void * buffer)
+int datanode_block_open(int block_index, int for_write, DNBlockLoc *loc, DNStatus *status)
 {
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/block_%d.dat", dn->dir_path, block_index);
+    if (status)
+        *status = DN_FAIL;
 
-    FILE *f = fopen(filepath, "wb");
-    if (!f) {
-        perror("fopen");
+    DNClass *c = datanode_class(block_index);
+    if (!c) {
+        if (status)
+            *status = DN_INVALID_BLOCK;
+        return -1;
+    }
+
+    int ret = store->locate(block_index, for_write, loc);
+
+    // blocks are reserved by the metadata node alone, the first write gives
+    // one its storage
+    if (ret > 0 && for_write) {
+        DNStatus alloc = datanode_store_alloc(block_index);
+        if (alloc != DN_SUCCESS) {
+            if (status)
+                *status = alloc;
+            return -1;
+        }
+        ret = store->locate(block_index, for_write, loc);
+    }
+
+    if (ret < 0) {
+        LOGD_ERROR(dn->node_id, "block %d could not be opened", block_index);
+        return -1;
+    }
+    loc->size = c->block_size;
+    return ret;
+}
+
+void datanode_block_close(DNBlockLoc *loc)
+{
+    store->release(loc);
+}
+
+size_t datanode_block_bytes(int block_index)
+{
+    if (!dn->compress || block_index < 0 || block_index >= dn->stored_cap || dn->stored[block_index] == 0)
+        return datanode_block_size(block_index);
+    return dn->stored[block_index];
+}
+
+DNStatus datanode_write_block(int block_index, void * buffer, uint32_t crc)
+{
+    DNClass *c = datanode_class(block_index);
+    if (!c)
+        return DN_INVALID_BLOCK;
+
+    if (crc32c(0, buffer, c->block_size) != crc) {
+        LOGD_ERROR(dn->node_id, "block %d arrived damaged", block_index);
+        return DN_CORRUPT;
+    }
+
+    size_t length = c->block_size;
+    char *packed = dn->compress ? datanode_compress(buffer, c->block_size, &length) : NULL;
+
+    DNBlockLoc loc;
+    DNStatus open_status;
+    DNStatus charged = DN_SUCCESS;
+    pthread_mutex_lock(&dn->lock);
+    int opened = datanode_block_open(block_index, 1, &loc, &open_status);
+    if (opened == 0 && dn->compress) {
+        charged = datanode_charge(block_index, length);
+        if (charged != DN_SUCCESS)
+            datanode_block_close(&loc);
+    }
+    pthread_mutex_unlock(&dn->lock);
+    if (opened != 0 || charged != DN_SUCCESS) {
+        if (packed)
+            datanode_pool_put(packed);
+        return opened != 0 ? open_status : charged;
+    }
+
+    int ret = datanode_block_io(&loc, packed ? packed : buffer, length, &crc, 1);
+    if (packed) {
+        datanode_pool_put(packed);
+        if (ret == 0)
+            ret = block_store_trim(loc.fd, loc.offset, length, c->block_size);
+    }
+    if (ret == 0 && dn->durability == DN_DURABILITY_SYNC && store->commit(&loc) != 0)
+        ret = -1;
+
+    pthread_mutex_lock(&dn->lock);
+    datanode_block_close(&loc);
+    if (ret != 0)
+        blockcache_invalidate(&c->cache, block_index);
+    else
+        blockcache_update(&c->cache, block_index, buffer);
+    pthread_mutex_unlock(&dn->lock);
+
+    if (ret != 0) {
+        LOGD_ERROR(dn->node_id, "incomplete write for block %d", block_index);
         return DN_FAIL;
     }
 
-    size_t written = fwrite(buffer, 1, BLOCK_SIZE, f);
-    fclose(f);
+    LOGD_DEBUG(dn->node_id, "wrote block %d", block_index);
+    return DN_SUCCESS;
+}
+
+DNStatus datanode_free_blocks(int count, const int * block_indices)
+{
+    DNStatus result = DN_SUCCESS;
+
+    for (int i = 0; i < count; i++) {
+        DNStatus status = datanode_free_block(block_indices[i]);
+        if (status != DN_SUCCESS) {
+            result = status;
+        }
+    }
+
+    return result;
+}
+
+DNStatus datanode_read_blocks(int count, const int * block_indices, void * buffer)
+{
+    char *data = buffer;
+    for (int i = 0; i < count; i++) {
+        DNStatus status = datanode_read_block(block_indices[i], data);
+        if (status != DN_SUCCESS) {
+            return status;
+        }
+        data += datanode_block_size(block_indices[i]);
+    }
+
+    return DN_SUCCESS;
+}
+
+DNStatus datanode_write_blocks(int count, const int * block_indices, const uint32_t * crcs, void * buffer)
+{
+    char *data = buffer;
+    for (int i = 0; i < count; i++) {
+        DNStatus status = datanode_write_block(block_indices[i], data, crcs[i]);
+        if (status != DN_SUCCESS) {
+            return status;
+        }
+        data += datanode_block_size(block_indices[i]);
+    }
+
+    return DN_SUCCESS;
+}
 
-    if (written != BLOCK_SIZE) {
-        LOGD(dn->node_id, "incomplete write for block %d", block_index);
+DNStatus datanode_write_range(int block_index, uint32_t offset, uint32_t length,
+                              const void * data, uint32_t crc, uint32_t * block_crc)
+{
+    size_t size = datanode_block_size(block_index);
+    if (size == 0)
+        return DN_INVALID_BLOCK;
+    if ((size_t)offset + length > size)
         return DN_FAIL;
+
+    if (crc32c(0, data, length) != crc) {
+        LOGD_ERROR(dn->node_id, "range of block %d arrived damaged", block_index);
+        return DN_CORRUPT;
+    }
+
+    // ranges are served by datanode_dispatch, whose send buffer is free until
+    // the response goes out
+    void *block = datanode_buffer(&dn->send_buf, &dn->send_cap, size);
+    if (!block) return DN_FAIL;
+
+    DNStatus status = datanode_read_block(block_index, block);
+    if (status != DN_SUCCESS)
+        return status;
+
+    memcpy((char *)block + offset, data, length);
+    *block_crc = crc32c(0, block, size);
+
+    return datanode_write_block(block_index, block, *block_crc);
+}
+
+DNBlockListPayload *datanode_block_list(void *payload, size_t payload_size, int data, size_t *block_size)
+{
+    if (payload_size < sizeof(DNBlockListPayload))
+        return NULL;
+
+    DNBlockListPayload *list = (DNBlockListPayload *)payload;
+    if (list->count < 0 || list->count > DN_MAX_BATCH ||
+        payload_size < sizeof(DNBlockListPayload) + (size_t)list->count * sizeof(int))
+        return NULL;
+
+    DNClass *first = list->count > 0 ? datanode_class(list->block_indices[0]) : NULL;
+    for (int i = 0; i < list->count; i++) {
+        DNClass *c = datanode_class(list->block_indices[i]);
+        if (!c || (block_size && c != first))
+            return NULL;
+    }
+
+    size_t size = first ? first->block_size : 0;
+    size_t expected = sizeof(DNBlockListPayload) + (size_t)list->count * (sizeof(int) + (data ? DN_CRC_SIZE + size : 0));
+    if (payload_size < expected)
+        return NULL;
+
+    if (block_size)
+        *block_size = size;
+    return list;
+}
+
+int datanode_block_op(DNCommand cmd, void *payload, size_t payload_size, DNBlockOp *op)
+{
+    memset(op, 0, sizeof(*op));
+
+    switch (cmd) {
+        case DN_READ_BLOCK:
+            if (payload_size < sizeof(int)) return 0;
+            op->blocks = payload;
+            op->count = 1;
+            op->block_size = datanode_block_size(op->blocks[0]);
+            return op->block_size > 0;
+        case DN_WRITE_BLOCK: {
+            if (payload_size < sizeof(DNBlockPayload)) return 0;
+            DNBlockPayload *p = payload;
+            op->block_size = datanode_block_size(p->block_index);
+            if (op->block_size == 0 || payload_size < sizeof(DNBlockPayload) + op->block_size) return 0;
+            op->blocks = &p->block_index;
+            op->crcs = &p->crc;
+            op->count = 1;
+            op->wdata = p->buffer;
+            op->is_write = 1;
+            return 1;
+        }
+        case DN_READ_BLOCKS:
+        case DN_WRITE_BLOCKS: {
+            int write = cmd == DN_WRITE_BLOCKS;
+            DNBlockListPayload *list = datanode_block_list(payload, payload_size, write, &op->block_size);
+            if (!list) return 0;
+            op->blocks = list->block_indices;
+            op->crcs = dn_block_list_crcs(list);
+            op->count = list->count;
+            op->wdata = (char *)&op->crcs[list->count];
+            op->is_write = write;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+int datanode_block_ops_conflict(const DNBlockOp *a, const DNBlockOp *b)
+{
+    if (!a->is_write && !b->is_write)
+        return 0;
+
+    for (int i = 0; i < a->count; i++) {
+        for (int j = 0; j < b->count; j++) {
+            if (a->blocks[i] == b->blocks[j])
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t datanode_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void datanode_hold_response(int sock_fd, uint32_t req_id)
+{
+    pthread_mutex_lock(&dn->lock);
+    if (dn->num_held == dn->cap_held) {
+        int cap = dn->cap_held ? 2 * dn->cap_held : dn->group_commit_batch;
+        uint32_t *grown = realloc(dn->held, sizeof(uint32_t) * cap);
+        if (!grown) {
+            pthread_mutex_unlock(&dn->lock);
+            // no room to wait, this write is committed with the held ones
+            DNStatus status = datanode_commit(sock_fd);
+            datanode_respond(sock_fd, req_id, status, NULL, 0);
+            return;
+        }
+        dn->held = grown;
+        dn->cap_held = cap;
+    }
+
+    if (dn->num_held == 0)
+        dn->held_since_us = datanode_now_us();
+    dn->held[dn->num_held++] = req_id;
+    int full = dn->num_held >= dn->group_commit_batch;
+    pthread_mutex_unlock(&dn->lock);
+
+    if (full)
+        datanode_commit(sock_fd);
+}
+
+DNStatus datanode_commit(int sock_fd)
+{
+    pthread_mutex_lock(&dn->lock);
+    DNStatus status = store->sync() == 0 ? DN_SUCCESS : DN_FAIL;
+
+    if (dn->num_held > 0)
+        LOGD_DEBUG(dn->node_id, "group commit of %d writes", dn->num_held);
+
+    for (int i = 0; i < dn->num_held; i++)
+        datanode_respond(sock_fd, dn->held[i], status, NULL, 0);
+    dn->num_held = 0;
+    pthread_mutex_unlock(&dn->lock);
+
+    return status;
+}
+
+long datanode_commit_due(void)
+{
+    pthread_mutex_lock(&dn->lock);
+    long due = -1;
+    if (dn->num_held > 0) {
+        uint64_t waited = datanode_now_us() - dn->held_since_us;
+        due = waited >= (uint64_t)dn->group_commit_us ? 0 : (long)(dn->group_commit_us - waited);
+    }
+    pthread_mutex_unlock(&dn->lock);
+    return due;
+}
+
+DNStatus datanode_map_blocks(int count, const int * block_indices, struct iovec * iov)
+{
+    pthread_mutex_lock(&dn->lock);
+    store->advise(count, block_indices);
+    pthread_mutex_unlock(&dn->lock);
+
+    for (int i = 0; i < count; i++) {
+        DNClass *c = datanode_class(block_indices[i]);
+        if (!c)
+            return DN_INVALID_BLOCK;
+
+        uint32_t crc;
+        DNBlockLoc loc;
+        pthread_mutex_lock(&dn->lock);
+        const void *data = store->map(block_indices[i], &crc);
+        int missing = !data && store->locate(block_indices[i], 0, &loc) > 0;
+        pthread_mutex_unlock(&dn->lock);
+
+        if (!data) {
+            if (!missing) {
+                LOGD_ERROR(dn->node_id, "block %d is not mapped", block_indices[i]);
+                return DN_FAIL;
+            }
+            data = datanode_zero_block;
+            crc = c->zero_crc;
+        }
+
+        if (crc32c(0, data, c->block_size) != crc) {
+            LOGD_ERROR(dn->node_id, "block %d fails its checksum", block_indices[i]);
+            return DN_CORRUPT;
+        }
+
+        iov[i].iov_base = (void *)data;
+        iov[i].iov_len = c->block_size;
     }
 
-    LOGD(dn->node_id, "wrote block %d", block_index);
     return DN_SUCCESS;
 }
 
+// Grow-only scratch buffer, returns NULL if it cannot hold size bytes.
+// It is aligned for O_DIRECT and its contents do not survive growing
+void *datanode_buffer(void **buf, size_t *cap, size_t size)
+{
+    if (size <= *cap && *buf)
+        return *buf;
+
+    void *grown;
+    if (posix_memalign(&grown, DN_DIRECT_ALIGN, size > 0 ? size : 1) != 0)
+        return NULL;
+
+    free(*buf);
+    *buf = grown;
+    *cap = size;
+    return grown;
+}
+
 static int remove_callback(const char *fpath, const struct stat *sb,
                            int typeflag, struct FTW *ftwbuf)
 {
@@ -135,6 +851,22 @@ static int remove_callback(const char *fpath, const struct stat *sb,
 DNStatus datanode_exit(int cleanup, int * sockfd)
 {   
     *sockfd = dn->sock_fd;
+
+    // nothing more is read, a metadata node still writing gives up. The
+    // response to DN_EXIT goes out on the other ring
+    comm_close_shm(dn->sock_fd, SHUT_RD);
+
+    block_store_end();
+
+    LOGD(dn->node_id, "fd cache: %llu hits, %llu misses",
+         (unsigned long long)dn->fds.hits, (unsigned long long)dn->fds.misses);
+    fdcache_destroy(&dn->fds);
+    for (int c = 0; c < dn->num_classes; c++) {
+        BlockCache *cache = &dn->classes[c].cache;
+        LOGD(dn->node_id, "block cache of class %d: %llu hits, %llu misses", c,
+             (unsigned long long)cache->hits, (unsigned long long)cache->misses);
+        blockcache_destroy(cache);
+    }
     
 	if (cleanup) {
 		if (dn->dir_path[0] != '\0') {
@@ -145,115 +877,350 @@ DNStatus datanode_exit(int cleanup, int * sockfd)
 	}
 
 	if (dn) {
+        free(dn->recv_buf);
+        free(dn->send_buf);
+        free(dn->held);
+        free(dn->stored);
+        bufpool_destroy(&dn->pool);
+        pthread_mutex_destroy(&dn->lock);
         free(dn);
         dn = NULL;
     }	
     return DN_SUCCESS;
 }
 
-DNStatus datanode_service_loop(int sock_fd)
+// Serve one command and send its response, returns 1 once the node exited
+int datanode_dispatch(int sock_fd, uint32_t req_id, DNCommand cmd, void *payload, size_t payload_size)
 {
-    dn = malloc(sizeof(DataNode));
-    memset(dn, 0, sizeof(DataNode));
+    LOGD_DEBUG(dn ? dn->node_id : -1, "Command %d (request %u)", cmd, req_id);
 
-    while (1) {
-        DNCommand cmd = DN_EXIT;
-        void *payload = NULL;
-        size_t payload_size = 0;
+    DNStatus status;
 
-        if (dn_recv_command(sock_fd, &cmd, &payload, &payload_size) == -1) {
-            if (payload) free(payload);
-            return DN_FAIL;
+    // held writes are answered before anything that follows them
+    if (dn && dn->num_held > 0 && cmd != DN_WRITE_BLOCK && cmd != DN_WRITE_BLOCKS && cmd != DN_SYNC)
+        datanode_commit(sock_fd);
+
+    switch(cmd) {
+        case DN_INIT:
+            status = datanode_init(sock_fd, payload, payload_size);
+            datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
+        case DN_ALLOC_BLOCK:
+        case DN_ALLOC_BLOCKS:
+            // deprecated, the first write gives a block its storage
+            datanode_respond(sock_fd, req_id, DN_SUCCESS, NULL, 0);
+            break;
+        case DN_FREE_BLOCK: {
+            if (payload_size >= sizeof(int)) {
+                int block_index;
+                memcpy(&block_index, payload, sizeof(int));
+                status = datanode_free_block(block_index);
+                datanode_respond(sock_fd, req_id, status, NULL, 0);
+            } else {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+            }
+            break;
         }
+        case DN_READ_BLOCK: {
+            if (payload_size >= sizeof(int)) {
+                int block_index;
+                memcpy(&block_index, payload, sizeof(int));
 
-        LOGD(dn->node_id, "Command %d", cmd);
+                if (dn->mmap_reads) {
+                    struct iovec iov;
+                    status = datanode_map_blocks(1, &block_index, &iov);
+                    datanode_respondv(sock_fd, req_id, status, &iov, status == DN_SUCCESS ? 1 : 0);
+                    break;
+                }
+                
+                size_t size = datanode_block_size(block_index);
+                void *buffer = datanode_buffer(&dn->send_buf, &dn->send_cap, size);
+                if (!buffer) {
+                    datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+                    break;
+                }
+
+                LOGD_DEBUG(dn->node_id, "Received read request for block %d", block_index);
+
+                status = datanode_read_block(block_index, buffer);
+                LOGD_DEBUG(dn->node_id, "Block %d read %s",
+                    block_index, status == DN_SUCCESS ? "succeeded" : "failed");
+
+                if (status == DN_SUCCESS)
+                    datanode_respond(sock_fd, req_id, status, buffer, size);
+                else
+                    datanode_respond(sock_fd, req_id, status, NULL, 0);
+            } else {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+            }
+            break;
+        }
+        case DN_WRITE_BLOCK: {
+            DNBlockPayload *p = (DNBlockPayload *)payload;
+            if (payload_size >= sizeof(DNBlockPayload) &&
+                payload_size >= sizeof(DNBlockPayload) + datanode_block_size(p->block_index)) {
+                int block_index = p->block_index;
 
-        DNStatus status;
+                LOGD_DEBUG(dn->node_id, "Received write request for block %d", block_index);
+                status = datanode_write_block(block_index, p->buffer, p->crc);
+                LOGD_DEBUG(dn->node_id, "Block %d write %s",
+                    block_index, status == DN_SUCCESS ? "succeeded" : "failed");
 
-        switch(cmd) {
-            case DN_INIT:
-                status = datanode_init(sock_fd, payload, payload_size);
-                dn_send_response(sock_fd, status, NULL, 0);
+                if (status == DN_SUCCESS && dn->durability == DN_DURABILITY_GROUP)
+                    datanode_hold_response(sock_fd, req_id);
+                else
+                    datanode_respond(sock_fd, req_id, status, NULL, 0);
+            } else {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+            }
+            break;
+        }
+        case DN_READ_RANGE: {
+            DNRangePayload *p = (DNRangePayload *)payload;
+            if (payload_size < sizeof(DNRangePayload) ||
+                (size_t)p->offset + p->length > datanode_block_size(p->block_index)) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
                 break;
-            case DN_ALLOC_BLOCK: {
-                int block_index;
-                memcpy(&block_index, payload, sizeof(int));
-                status = datanode_alloc_block(block_index);
-                dn_send_response(sock_fd, status, NULL, 0);
+            }
+
+            LOGD_DEBUG(dn->node_id, "Received read request for %u bytes at %u of block %d",
+                p->length, p->offset, p->block_index);
+
+            struct iovec iov[2];
+            if (dn->mmap_reads) {
+                status = datanode_map_blocks(1, &p->block_index, &iov[1]);
+            } else {
+                iov[1].iov_base = datanode_buffer(&dn->send_buf, &dn->send_cap, datanode_block_size(p->block_index));
+                status = iov[1].iov_base ? datanode_read_block(p->block_index, iov[1].iov_base) : DN_FAIL;
+            }
+
+            if (status != DN_SUCCESS) {
+                datanode_respond(sock_fd, req_id, status, NULL, 0);
                 break;
             }
-            case DN_FREE_BLOCK: {
-                if (payload_size >= sizeof(int)) {
-                    int block_index;
-                    memcpy(&block_index, payload, sizeof(int));
-                    status = datanode_free_block(block_index);
-                    dn_send_response(sock_fd, status, NULL, 0);
-                } else {
-                    dn_send_response(sock_fd, DN_FAIL, NULL, 0);
-                }
+
+            // the block was checked whole, the range gets its own checksum
+            iov[1].iov_base = (char *)iov[1].iov_base + p->offset;
+            iov[1].iov_len = p->length;
+            uint32_t crc = crc32c(0, iov[1].iov_base, p->length);
+            iov[0].iov_base = &crc;
+            iov[0].iov_len = sizeof(crc);
+            datanode_respondv(sock_fd, req_id, DN_SUCCESS, iov, 2);
+            break;
+        }
+        case DN_WRITE_RANGE: {
+            DNRangePayload *p = (DNRangePayload *)payload;
+            if (payload_size < sizeof(DNRangePayload) || payload_size - sizeof(DNRangePayload) < p->length) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
                 break;
             }
-            case DN_READ_BLOCK: {
-                if (payload_size >= sizeof(int)) {
-                    int block_index;
-                    memcpy(&block_index, payload, sizeof(int));
-                    
-                    void *buffer = malloc(BLOCK_SIZE);
-                    if (!buffer) {
-                        dn_send_response(sock_fd, DN_FAIL, NULL, 0);
-                        break;
-                    }
-
-                    LOGD(dn->node_id, "Received read request for block %d", block_index);
-
-                    status = datanode_read_block(block_index, buffer);
-                    LOGD(dn->node_id, "Block %d read %s",
-                        block_index, status == DN_SUCCESS ? "succeeded" : "failed");
-
-                    LOGD(dn->node_id, "%s", (char *)buffer);
-                    
-                    dn_send_response(sock_fd, status, buffer, BLOCK_SIZE);
-                    free(buffer);
-                } else {
-                    dn_send_response(sock_fd, DN_FAIL, NULL, 0);
-                }
+
+            LOGD_DEBUG(dn->node_id, "Received write request for %u bytes at %u of block %d",
+                p->length, p->offset, p->block_index);
+
+            uint32_t block_crc = 0;
+            status = datanode_write_range(p->block_index, p->offset, p->length, p + 1, p->crc, &block_crc);
+
+            // the answer carries the new checksum so it cannot be held, the
+            // group commits now instead
+            if (status == DN_SUCCESS && dn->durability == DN_DURABILITY_GROUP)
+                status = datanode_commit(sock_fd);
+
+            if (status == DN_SUCCESS)
+                datanode_respond(sock_fd, req_id, status, &block_crc, sizeof(block_crc));
+            else
+                datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
+        }
+        case DN_FREE_BLOCKS: {
+            DNBlockListPayload *list = datanode_block_list(payload, payload_size, 0, NULL);
+            if (!list) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
                 break;
             }
-            case DN_WRITE_BLOCK: {
-                if (payload_size >= sizeof(int) + BLOCK_SIZE) {
-                    DNBlockPayload *p = (DNBlockPayload *)payload;
-                    int block_index = p->block_index;
-
-                    void *buffer = malloc(BLOCK_SIZE);
-                    if (!buffer) {
-                        dn_send_response(sock_fd, DN_FAIL, NULL, 0);
-                        break;
-                    }
-
-                    memcpy(buffer, p->buffer, BLOCK_SIZE);
-
-                    LOGD(dn->node_id, "Received write request for block %d", block_index);
-                    status = datanode_write_block(block_index, buffer);
-                    LOGD(dn->node_id, "Block %d write %s",
-                        block_index, status == DN_SUCCESS ? "succeeded" : "failed");
-
-                    dn_send_response(sock_fd, status, NULL, 0);
-                    free(buffer);
-                } else {
-                    dn_send_response(sock_fd, DN_FAIL, NULL, 0);
-                }
+
+            LOGD_DEBUG(dn->node_id, "Received free request for %d blocks", list->count);
+            status = datanode_free_blocks(list->count, list->block_indices);
+
+            datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
+        }
+        case DN_READ_BLOCKS: {
+            size_t size;
+            DNBlockListPayload *list = datanode_block_list(payload, payload_size, 0, &size);
+            if (!list) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
                 break;
             }
-            case DN_EXIT:
-				DNExitPayload *p = (DNExitPayload *)payload;
 
-                int sockfd;
-                status = datanode_exit(p->cleanup, &sockfd);
-                dn_send_response(sock_fd, status, NULL, 0);
-                if (payload) free(payload);
-                return DN_SUCCESS;
+            if (dn->mmap_reads) {
+                struct iovec iov[DN_MAX_BATCH];
+                status = datanode_map_blocks(list->count, list->block_indices, iov);
+                datanode_respondv(sock_fd, req_id, status, iov, status == DN_SUCCESS ? list->count : 0);
+                break;
+            }
+
+            size_t data_size = (size_t)list->count * size;
+            void *buffer = datanode_buffer(&dn->send_buf, &dn->send_cap, data_size);
+            if (!buffer) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+                break;
+            }
+
+            LOGD_DEBUG(dn->node_id, "Received read request for %d blocks", list->count);
+            status = datanode_read_blocks(list->count, list->block_indices, buffer);
+
+            if (status == DN_SUCCESS)
+                datanode_respond(sock_fd, req_id, status, buffer, data_size);
+            else
+                datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
+        }
+        case DN_WRITE_BLOCKS: {
+            size_t size;
+            DNBlockListPayload *list = datanode_block_list(payload, payload_size, 1, &size);
+            if (!list) {
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+                break;
+            }
+
+            uint32_t *crcs = dn_block_list_crcs(list);
+
+            LOGD_DEBUG(dn->node_id, "Received write request for %d blocks", list->count);
+            status = datanode_write_blocks(list->count, list->block_indices, crcs, &crcs[list->count]);
+
+            if (status == DN_SUCCESS && dn->durability == DN_DURABILITY_GROUP)
+                datanode_hold_response(sock_fd, req_id);
+            else
+                datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
         }
-        
-        if (payload) free(payload);
+        case DN_STATS: {
+            DNStats stats = {0};
+            stats.fd_cache_hits = dn->fds.hits;
+            stats.fd_cache_misses = dn->fds.misses;
+            pthread_mutex_lock(&dn->lock);
+            for (int i = 0; i < dn->num_classes; i++) {
+                DNClass *c = &dn->classes[i];
+                stats.block_cache_hits += c->cache.hits;
+                stats.block_cache_misses += c->cache.misses;
+                stats.block_cache_hit_bytes += c->cache.hits * c->block_size;
+                stats.stored_blocks += c->num_blocks;
+                stats.stored_bytes += c->size;
+                stats.block_bytes += (uint64_t)c->num_blocks * c->block_size;
+            }
+            pthread_mutex_unlock(&dn->lock);
+            datanode_respond(sock_fd, req_id, DN_SUCCESS, &stats, sizeof(stats));
+            break;
+        }
+        case DN_SYNC:
+            status = datanode_commit(sock_fd);
+            datanode_respond(sock_fd, req_id, status, NULL, 0);
+            break;
+        case DN_LIST_BLOCKS: {
+            int *blocks = NULL;
+            pthread_mutex_lock(&dn->lock);
+            int count = store->list(&blocks);
+            pthread_mutex_unlock(&dn->lock);
+
+            if (count < 0)
+                datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+            else
+                datanode_respond(sock_fd, req_id, DN_SUCCESS, blocks, (size_t)count * sizeof(int));
+            free(blocks);
+            break;
+        }
+        case DN_EXIT: {
+            DNExitPayload *p = (DNExitPayload *)payload;
+
+            int sockfd;
+            status = datanode_exit(p->cleanup, &sockfd);
+            datanode_respond(sock_fd, req_id, status, NULL, 0);
+            return 1;
+        }
+        default:
+            datanode_respond(sock_fd, req_id, DN_FAIL, NULL, 0);
+            break;
+    }
+
+    return 0;
+}
+
+DNStatus datanode_service_loop(int sock_fd)
+{
+    dn = malloc(sizeof(DataNode));
+    memset(dn, 0, sizeof(DataNode));
+    pthread_mutex_init(&dn->lock, NULL);
+
+    while (1) {
+        // group commit, keep collecting writes while more commands are queued
+        // or arrive within the window
+        long due = datanode_commit_due();
+        if (due == 0 && dn->group_commit_us > 0) {
+            datanode_commit(sock_fd);
+        } else if (due >= 0) {
+            int ready = 0;
+            int timeout_ms = (int)((due + 999) / 1000);
+            if (comm_wait_readable(&sock_fd, 1, &ready, timeout_ms) <= 0)
+                datanode_commit(sock_fd);
+        }
+
+        DNHeader header = {0};
+        if (dn_recv_command_header(sock_fd, &header) == -1) {
+            return DN_FAIL;
+        }
+
+        uint32_t req_id = header.req_id;
+        DNCommand cmd = header.cmd;
+        size_t payload_size = header.payload_size;
+
+        // payloads land in a buffer reused across commands
+        void *payload = datanode_buffer(&dn->recv_buf, &dn->recv_cap, payload_size);
+        if (!payload || recv_all(sock_fd, payload, payload_size) != payload_size) {
+            return DN_FAIL;
+        }
+
+        if (datanode_dispatch(sock_fd, req_id, cmd, payload, payload_size))
+            return DN_SUCCESS;
+
+        if (cmd == DN_INIT && dn->engine == DN_ENGINE_URING) {
+            DNStatus status;
+            if (!comm_is_shm(sock_fd) && datanode_uring_loop(sock_fd, &status) == 0)
+                return status;
+
+            LOGD_WARN(dn->node_id, "io_uring engine unavailable, serving synchronously");
+            dn->engine = DN_ENGINE_SYNC;
+        }
+
+        if (cmd == DN_INIT && dn->engine == DN_ENGINE_THREADS) {
+            DNStatus status;
+            if (datanode_threads_loop(sock_fd, &status) == 0)
+                return status;
+
+            LOGD_WARN(dn->node_id, "I/O threads unavailable, serving synchronously");
+            dn->engine = DN_ENGINE_SYNC;
+        }
+    }
+}
+
+DNStatus datanode_serve(int listen_fd)
+{
+    while (1) {
+        int sock_fd = accept(listen_fd, NULL, NULL);
+        if (sock_fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return DN_FAIL;
+        }
+
+        comm_tcp_tune(sock_fd);
+
+        if (datanode_service_loop(sock_fd) != DN_SUCCESS && dn) {
+            // the metadata node went away without DN_EXIT, keep the blocks
+            int fd;
+            datanode_exit(0, &fd);
+        }
+
+        close(sock_fd);
     }
 }
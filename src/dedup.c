@@ -0,0 +1,241 @@
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= hash_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// XXH64 (Collet), four lanes over 32-byte stripes
+static uint64_t dedup_hash(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = PRIME64_1 + PRIME64_2;
+        uint64_t v2 = PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -PRIME64_1;
+
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = PRIME64_5;
+    }
+
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline int *dedup_bucket(DedupIndex *index, const DedupFingerprint *fp)
+{
+    return &index->buckets[(fp->hash ^ fp->crc) & index->mask];
+}
+
+int dedup_init(DedupIndex *index, int num_blocks)
+{
+    memset(index, 0, sizeof(*index));
+
+    int buckets = 1;
+    while (buckets < num_blocks)
+        buckets <<= 1;
+
+    index->num_blocks = num_blocks;
+    index->mask = buckets - 1;
+    index->entries = calloc(num_blocks > 0 ? num_blocks : 1, sizeof(DedupEntry));
+    index->buckets = malloc(sizeof(int) * buckets);
+    if (!index->entries || !index->buckets) {
+        dedup_destroy(index);
+        return -1;
+    }
+
+    for (int i = 0; i < buckets; i++)
+        index->buckets[i] = -1;
+    for (int i = 0; i < num_blocks; i++)
+        index->entries[i].hnext = -1;
+
+    return 0;
+}
+
+int dedup_grow(DedupIndex *index, int num_blocks)
+{
+    if (num_blocks <= index->num_blocks)
+        return 0;
+
+    DedupEntry *entries = realloc(index->entries, sizeof(DedupEntry) * num_blocks);
+    if (!entries)
+        return -1;
+    memset(entries + index->num_blocks, 0, sizeof(DedupEntry) * (num_blocks - index->num_blocks));
+    for (int i = index->num_blocks; i < num_blocks; i++)
+        entries[i].hnext = -1;
+    index->entries = entries;
+    index->num_blocks = num_blocks;
+
+    // chains stay short while there are as many buckets as blocks
+    int buckets = index->mask + 1;
+    if (buckets >= num_blocks)
+        return 0;
+    while (buckets < num_blocks)
+        buckets <<= 1;
+
+    int *grown = malloc(sizeof(int) * buckets);
+    if (!grown)
+        return 0;
+    free(index->buckets);
+    index->buckets = grown;
+    index->mask = buckets - 1;
+    for (int i = 0; i < buckets; i++)
+        index->buckets[i] = -1;
+
+    for (int b = 0; b < num_blocks; b++) {
+        DedupEntry *e = &entries[b];
+        if (!e->indexed)
+            continue;
+        int *bucket = dedup_bucket(index, &e->fp);
+        e->hnext = *bucket;
+        *bucket = b;
+    }
+    return 0;
+}
+
+void dedup_fingerprint(const void *data, size_t size, uint32_t crc, DedupFingerprint *fp)
+{
+    fp->hash = dedup_hash(data, size);
+    fp->crc = crc;
+}
+
+int dedup_lookup(DedupIndex *index, const DedupFingerprint *fp)
+{
+    for (int b = *dedup_bucket(index, fp); b >= 0; b = index->entries[b].hnext) {
+        DedupEntry *e = &index->entries[b];
+        if (e->fp.hash == fp->hash && e->fp.crc == fp->crc)
+            return b;
+    }
+    return -1;
+}
+
+void dedup_forget(DedupIndex *index, int block)
+{
+    DedupEntry *e = &index->entries[block];
+    if (!e->indexed)
+        return;
+
+    int *link = dedup_bucket(index, &e->fp);
+    while (*link != block)
+        link = &index->entries[*link].hnext;
+    *link = e->hnext;
+
+    e->hnext = -1;
+    e->indexed = 0;
+}
+
+void dedup_insert(DedupIndex *index, int block, const DedupFingerprint *fp)
+{
+    dedup_forget(index, block);
+
+    DedupEntry *e = &index->entries[block];
+    e->fp = *fp;
+    e->indexed = 1;
+
+    int *bucket = dedup_bucket(index, fp);
+    e->hnext = *bucket;
+    *bucket = block;
+}
+
+void dedup_ref(DedupIndex *index, int block, size_t block_size)
+{
+    DedupEntry *e = &index->entries[block];
+    if (e->refs++ == 0)
+        index->physical_bytes += block_size;
+    index->logical_bytes += block_size;
+}
+
+uint32_t dedup_unref(DedupIndex *index, int block, size_t block_size)
+{
+    DedupEntry *e = &index->entries[block];
+    if (e->refs == 0)
+        return 0;
+
+    index->logical_bytes -= block_size;
+    if (--e->refs == 0) {
+        index->physical_bytes -= block_size;
+        dedup_forget(index, block);
+    }
+    return e->refs;
+}
+
+void dedup_clear(DedupIndex *index, int block, size_t block_size)
+{
+    DedupEntry *e = &index->entries[block];
+    if (e->refs > 0) {
+        index->logical_bytes -= (size_t)e->refs * block_size;
+        index->physical_bytes -= block_size;
+        e->refs = 0;
+    }
+    dedup_forget(index, block);
+    e->stored = 0;
+}
+
+void dedup_destroy(DedupIndex *index)
+{
+    free(index->entries);
+    free(index->buckets);
+    index->entries = NULL;
+    index->buckets = NULL;
+}
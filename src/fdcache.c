@@ -0,0 +1,169 @@
+#include "fdcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static inline unsigned fdcache_hash(FdCache *cache, int key)
+{
+    return ((unsigned)key * 2654435761u) & cache->mask;
+}
+
+static void lru_unlink(FdCache *cache, FdCacheEntry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else cache->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(FdCache *cache, FdCacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head) cache->head->prev = e;
+    cache->head = e;
+    if (!cache->tail) cache->tail = e;
+}
+
+static void hash_unlink(FdCache *cache, FdCacheEntry *e)
+{
+    FdCacheEntry **p = &cache->buckets[fdcache_hash(cache, e->key)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    e->hnext = NULL;
+}
+
+static void entry_free(FdCache *cache, FdCacheEntry *e)
+{
+    close(e->fd);
+    e->key = -1;
+    e->fd = -1;
+    e->hnext = cache->free_list;
+    cache->free_list = e;
+    cache->size--;
+}
+
+int fdcache_init(FdCache *cache, int capacity)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (capacity <= 0)
+        return 0;
+
+    int buckets = 16;
+    while (buckets < 2 * capacity)
+        buckets *= 2;
+
+    cache->entries = calloc(capacity, sizeof(FdCacheEntry));
+    cache->buckets = calloc(buckets, sizeof(FdCacheEntry *));
+    if (!cache->entries || !cache->buckets) {
+        free(cache->entries);
+        free(cache->buckets);
+        memset(cache, 0, sizeof(*cache));
+        return -1;
+    }
+
+    cache->capacity = capacity;
+    cache->mask = buckets - 1;
+    for (int i = capacity - 1; i >= 0; i--) {
+        cache->entries[i].key = -1;
+        cache->entries[i].fd = -1;
+        cache->entries[i].hnext = cache->free_list;
+        cache->free_list = &cache->entries[i];
+    }
+    return 0;
+}
+
+int fdcache_open(FdCache *cache, int key, const char *path, int flags, FdCacheEntry **entry)
+{
+    *entry = NULL;
+
+    if (cache->capacity > 0) {
+        for (FdCacheEntry *e = cache->buckets[fdcache_hash(cache, key)]; e; e = e->hnext) {
+            if (e->key == key) {
+                cache->hits++;
+                e->refs++;
+                lru_unlink(cache, e);
+                lru_push_front(cache, e);
+                *entry = e;
+                return e->fd;
+            }
+        }
+    }
+
+    cache->misses++;
+    int fd = open(path, flags, 0644);
+    if (fd < 0 || cache->capacity == 0)
+        return fd;
+
+    if (!cache->free_list) {
+        // evict the least recently used descriptor nobody is using
+        FdCacheEntry *victim = cache->tail;
+        while (victim && victim->refs > 0)
+            victim = victim->prev;
+        if (!victim)
+            return fd;
+
+        lru_unlink(cache, victim);
+        hash_unlink(cache, victim);
+        entry_free(cache, victim);
+    }
+
+    FdCacheEntry *e = cache->free_list;
+    cache->free_list = e->hnext;
+    cache->size++;
+
+    e->key = key;
+    e->fd = fd;
+    e->refs = 1;
+
+    unsigned h = fdcache_hash(cache, key);
+    e->hnext = cache->buckets[h];
+    cache->buckets[h] = e;
+    lru_push_front(cache, e);
+
+    *entry = e;
+    return fd;
+}
+
+void fdcache_release(FdCache *cache, FdCacheEntry *entry)
+{
+    entry->refs--;
+
+    // invalidated while in use, its last user closes it
+    if (entry->refs == 0 && entry->key == -1)
+        entry_free(cache, entry);
+}
+
+void fdcache_invalidate(FdCache *cache, int key)
+{
+    if (cache->capacity == 0)
+        return;
+
+    for (FdCacheEntry *e = cache->buckets[fdcache_hash(cache, key)]; e; e = e->hnext) {
+        if (e->key != key)
+            continue;
+
+        lru_unlink(cache, e);
+        hash_unlink(cache, e);
+        if (e->refs > 0)
+            e->key = -1;
+        else
+            entry_free(cache, e);
+        return;
+    }
+}
+
+void fdcache_destroy(FdCache *cache)
+{
+    for (int i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].fd >= 0)
+            close(cache->entries[i].fd);
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
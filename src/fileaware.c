@@ -16,12 +16,13 @@ int fileaware_init()
 int fileaware_allocate_block(AllocContext ctx, int *node_index)
 {
 	int blocks_needed = ctx.file_blocks;
+	int *blocks_free = md->classes[ctx.block_class].blocks_free;
 
 	// 1. if blocks needed is small -> random
 	if (blocks_needed < SMALL_FILE) {
 		for (int attempts = 0; attempts < md->num_nodes * 2; attempts++) {
             int candidate = rand() % md->num_nodes;
-            if (0 < md->blocks_free[candidate]) {
+            if (0 < blocks_free[candidate]) {
                 *node_index = candidate;
                 return 0;
             }
@@ -33,12 +34,12 @@ int fileaware_allocate_block(AllocContext ctx, int *node_index)
 	int max_blocks_free = -1;
 
 	for (int i = 0; i < md->num_nodes; i++) {
-		if (md->blocks_free[i] < 1) {
+		if (blocks_free[i] < 1) {
 			continue;
 		}
 
-		if (md->blocks_free[i] > max_blocks_free) {
-			max_blocks_free = md->blocks_free[i];
+		if (blocks_free[i] > max_blocks_free) {
+			max_blocks_free = blocks_free[i];
 			least_loaded = i;
 		}
 	}
@@ -0,0 +1,330 @@
+#include "datanode.h"
+#include "blockstore.h"
+
+// One file per block, its class's block size of data followed by the checksum.
+// Descriptors stay open in dn->fds between requests. A manifest with one
+// byte per block index, set while the block has a file, lets a restarted
+// datanode find its blocks without walking the directory
+
+extern DataNode *dn;
+
+typedef struct {
+    // blocks written since the last sync, may repeat
+    int *dirty;
+    int num_dirty;
+    int cap_dirty;
+
+    // the manifest and its copy in memory, grown on demand
+    int manifest_fd;
+    uint64_t marks;         // manifest changes, under dn->lock
+    uint64_t marks_synced;  // of them known durable
+    unsigned char *present;
+    int present_cap;
+} FilesState;
+
+static void files_dirty(int block_index)
+{
+    FilesState *s = (FilesState *)store->state;
+
+    if (s->num_dirty > 0 && s->dirty[s->num_dirty - 1] == block_index)
+        return;
+
+    if (s->num_dirty == s->cap_dirty) {
+        int cap = s->cap_dirty ? 2 * s->cap_dirty : 64;
+        int *grown = realloc(s->dirty, sizeof(int) * cap);
+        if (!grown)
+            return;
+        s->dirty = grown;
+        s->cap_dirty = cap;
+    }
+    s->dirty[s->num_dirty++] = block_index;
+}
+
+static void files_path(int block_index, char *path, size_t size)
+{
+    snprintf(path, size, "%s/block_%d.dat", dn->dir_path, block_index);
+}
+
+static int files_mark(FilesState *s, int block_index, unsigned char present)
+{
+    if (block_index >= s->present_cap) {
+        int cap = s->present_cap ? s->present_cap : 1024;
+        while (cap <= block_index)
+            cap *= 2;
+
+        unsigned char *grown = realloc(s->present, cap);
+        if (!grown)
+            return -1;
+        memset(grown + s->present_cap, 0, cap - s->present_cap);
+        s->present = grown;
+        s->present_cap = cap;
+    }
+
+    s->present[block_index] = present;
+    if (pwrite(s->manifest_fd, &present, 1, block_index) != 1) {
+        perror("pwrite");
+        return -1;
+    }
+    s->marks++;
+    return 0;
+}
+
+static int files_recover(FilesState *s)
+{
+    struct stat st;
+    if (fstat(s->manifest_fd, &st) != 0) {
+        perror("fstat");
+        return -1;
+    }
+
+    s->present_cap = (int)st.st_size;
+    s->present = calloc(s->present_cap > 0 ? s->present_cap : 1, 1);
+    if (!s->present)
+        return -1;
+
+    if (pread(s->manifest_fd, s->present, s->present_cap, 0) != s->present_cap) {
+        perror("pread");
+        return -1;
+    }
+    return 0;
+}
+
+int files_init(void)
+{
+    FilesState *s = calloc(1, sizeof(FilesState));
+    if (!s)
+        return -1;
+    store->state = s;
+    s->manifest_fd = -1;
+
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/manifest.dat", dn->dir_path);
+
+    s->manifest_fd = open(filepath, O_CREAT | O_RDWR | (dn->recover ? 0 : O_TRUNC), 0644);
+    if (s->manifest_fd < 0) {
+        LOGD_ERROR(dn->node_id, "Failed to open manifest '%s'", filepath);
+        perror("open");
+        return -1;
+    }
+    if (dn->recover && files_recover(s) != 0)
+        return -1;
+
+    if (dn->mmap_reads) {
+        LOGD_WARN(dn->node_id, "files store has no mapped read path, reads are copied");
+        dn->mmap_reads = 0;
+    }
+    if (dn->direct_io) {
+        // the checksum trailer makes every file an unaligned size
+        LOGD_WARN(dn->node_id, "files store cannot bypass the page cache, using buffered I/O");
+        dn->direct_io = 0;
+    }
+    return 0;
+}
+
+DNStatus files_alloc(int block_index)
+{
+    char filepath[512];
+    files_path(block_index, filepath, sizeof(filepath));
+
+    // a new block is usually written next, leave its descriptor cached
+    FdCacheEntry *entry;
+    int fd = fdcache_open(&dn->fds, block_index, filepath, O_CREAT | O_RDWR, &entry);
+    if (fd < 0) {
+        LOGD_ERROR(dn->node_id, "Failed to create block file '%s'", filepath);
+        perror("open");
+        return DN_FAIL;
+    }
+
+    DNStatus status = DN_SUCCESS;
+    DNClass *c = datanode_class(block_index);
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, c->block_size) == -1 ||
+        pwrite(fd, &c->zero_crc, DN_CRC_SIZE, c->block_size) != DN_CRC_SIZE) {
+        perror("ftruncate");
+        status = DN_FAIL;
+    }
+
+    if (entry) fdcache_release(&dn->fds, entry);
+    else close(fd);
+
+    if (status == DN_SUCCESS && files_mark(store->state, block_index, 1) != 0)
+        status = DN_FAIL;
+
+    files_dirty(block_index);
+    return status;
+}
+
+DNStatus files_free(int block_index)
+{
+    char filepath[512];
+    files_path(block_index, filepath, sizeof(filepath));
+
+    if (unlink(filepath) != 0) {
+        if (errno == ENOENT)
+            return DN_INVALID_BLOCK;
+        perror("unlink");
+        return DN_FAIL;
+    }
+    return files_mark(store->state, block_index, 0) == 0 ? DN_SUCCESS : DN_FAIL;
+}
+
+int files_locate(int block_index, int for_write, DNBlockLoc *loc)
+{
+    char filepath[512];
+    files_path(block_index, filepath, sizeof(filepath));
+
+    if (for_write)
+        files_dirty(block_index);
+
+    FdCacheEntry *entry;
+    loc->fd = fdcache_open(&dn->fds, block_index, filepath, O_RDWR, &entry);
+    loc->handle = entry;
+    if (loc->fd < 0) {
+        if (errno == ENOENT)
+            return 1;
+        perror("open");
+        return -1;
+    }
+
+    loc->offset = 0;
+    loc->crc_fd = loc->fd;
+    loc->crc_offset = datanode_block_size(block_index);
+    return 0;
+}
+
+void files_release(DNBlockLoc *loc)
+{
+    if (loc->handle) fdcache_release(&dn->fds, loc->handle);
+    else close(loc->fd);
+}
+
+const void *files_map(int block_index, uint32_t *crc)
+{
+    (void)block_index;
+    (void)crc;
+    return NULL;
+}
+
+void files_advise(int count, const int *block_indices)
+{
+    (void)count;
+    (void)block_indices;
+}
+
+// The manifest and the directory holding the block files
+static int files_sync_manifest(FilesState *s)
+{
+    int ret = 0;
+
+    if (fdatasync(s->manifest_fd) != 0) {
+        perror("fdatasync");
+        ret = -1;
+    }
+
+    // created and removed block files
+    int dir_fd = open(dn->dir_path, O_RDONLY);
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+        perror("fsync");
+        ret = -1;
+    }
+    if (dir_fd >= 0) close(dir_fd);
+
+    return ret;
+}
+
+int files_sync(void)
+{
+    FilesState *s = (FilesState *)store->state;
+    uint64_t marks = s->marks;
+    int ret = 0;
+
+    for (int i = 0; i < s->num_dirty; i++) {
+        char filepath[512];
+        files_path(s->dirty[i], filepath, sizeof(filepath));
+
+        FdCacheEntry *entry;
+        int fd = fdcache_open(&dn->fds, s->dirty[i], filepath, O_RDWR, &entry);
+        if (fd < 0) {
+            // freed since it was written
+            if (errno != ENOENT) ret = -1;
+            continue;
+        }
+
+        if (fdatasync(fd) != 0) {
+            perror("fdatasync");
+            ret = -1;
+        }
+
+        if (entry) fdcache_release(&dn->fds, entry);
+        else close(fd);
+    }
+    s->num_dirty = 0;
+
+    if (files_sync_manifest(s) != 0)
+        ret = -1;
+    else
+        s->marks_synced = marks;
+
+    return ret;
+}
+
+int files_commit(DNBlockLoc *loc)
+{
+    FilesState *s = (FilesState *)store->state;
+
+    if (fdatasync(loc->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+
+    // a first write created the block's file and its manifest entry
+    pthread_mutex_lock(&dn->lock);
+    uint64_t marks = s->marks;
+    int stale = s->marks_synced < marks;
+    pthread_mutex_unlock(&dn->lock);
+    if (!stale)
+        return 0;
+
+    if (files_sync_manifest(s) != 0)
+        return -1;
+
+    pthread_mutex_lock(&dn->lock);
+    if (s->marks_synced < marks)
+        s->marks_synced = marks;
+    pthread_mutex_unlock(&dn->lock);
+    return 0;
+}
+
+int files_list(int **block_indices)
+{
+    FilesState *s = (FilesState *)store->state;
+
+    int count = 0;
+    for (int i = 0; i < s->present_cap; i++)
+        count += s->present[i] != 0;
+
+    int *blocks = malloc(sizeof(int) * (count + 1));
+    if (!blocks)
+        return -1;
+
+    count = 0;
+    for (int i = 0; i < s->present_cap; i++) {
+        if (s->present[i])
+            blocks[count++] = i;
+    }
+
+    *block_indices = blocks;
+    return count;
+}
+
+void files_destroy(void)
+{
+    FilesState *s = (FilesState *)store->state;
+    if (!s) return;
+
+    if (s->manifest_fd >= 0)
+        close(s->manifest_fd);
+    free(s->present);
+    free(s->dirty);
+    free(s);
+    store->state = NULL;
+}
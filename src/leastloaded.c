@@ -12,14 +12,14 @@ int leastloaded_init()
 
 int leastloaded_allocate_block(AllocContext ctx, int *node_index)
 {
-	(void)ctx;
+    int *blocks_free = md->classes[ctx.block_class].blocks_free;
     int least_loaded = -1;
 	for (int i = 0; i < md->num_nodes; i++) {
-		if (md->blocks_free[i] < 0) {
+		if (blocks_free[i] < 0) {
 			continue;
 		}
 		
-		if (least_loaded == -1 || md->blocks_free[i] > md->blocks_free[least_loaded]) {
+		if (least_loaded == -1 || blocks_free[i] > blocks_free[least_loaded]) {
 			least_loaded = i;
 		}
 	}
@@ -0,0 +1,477 @@
+#define _DEFAULT_SOURCE
+#include "log.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+// Messages wait in a bounded multi-producer ring (Vyukov) until the log
+// thread formats them. A producer claims a position with a compare and swap
+// and publishes the slot when its arguments are in. A slot's seq gives its
+// state for the lap of the ring a position is in, 2 * lap free and
+// 2 * lap + 1 written, so zeroed memory is an empty ring
+#define LOG_RING_SLOTS 4096
+#define LOG_ARG_BYTES 240
+
+// longest line a message makes, longer ones are cut
+#define LOG_LINE_MAX 1024
+
+// the log thread polls the ring this often while messages come, backing off
+// to LOG_POLL_MAX_US when they stop. A burst filling LOG_WAKE_SLOTS of the
+// ring wakes it early
+#define LOG_POLL_MIN_US 1000
+#define LOG_POLL_MAX_US 50000
+#define LOG_WAKE_SLOTS (LOG_RING_SLOTS / 4)
+
+typedef struct {
+    _Atomic uint64_t seq;
+    const char *fmt;
+    uint16_t arg_bytes;
+    unsigned char args[LOG_ARG_BYTES];
+} LogRecord;
+
+typedef struct {
+    LogRecord ring[LOG_RING_SLOTS];
+    _Atomic uint64_t head;          // next position a producer claims
+    uint64_t tail;                  // next position printed, under drain_lock
+    _Atomic uint64_t dropped;
+
+    pthread_mutex_t drain_lock;     // one consumer at a time
+    pthread_mutex_t wake_lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    _Atomic int started;
+    int running;                    // thread was created in this process
+    _Atomic int stopping;
+} LogState;
+
+static LogState log_state = {
+    .drain_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+_Atomic int log_level = LOG_LEVEL_DEFAULT;
+
+typedef enum {
+    LOG_ARG_NONE,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+} LogArg;
+
+typedef struct {
+    int star_width;
+    int star_precision;
+    char conv;
+    LogArg arg;
+} LogSpec;
+
+// The printf conversion starting at p, just past its '%'. Returns its end
+static const char *log_parse_spec(const char *p, LogSpec *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*') {
+        spec->star_width = 1;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    LogArg integer = LOG_ARG_INT;
+    int long_double = 0;
+    switch (*p) {
+        case 'h': p++; if (*p == 'h') p++; break;
+        case 'l':
+            p++;
+            integer = LOG_ARG_LONG;
+            if (*p == 'l') {
+                p++;
+                integer = LOG_ARG_LLONG;
+            }
+            break;
+        case 'z': p++; integer = LOG_ARG_SIZE; break;
+        case 'j': p++; integer = LOG_ARG_INTMAX; break;
+        case 't': p++; integer = LOG_ARG_PTRDIFF; break;
+        case 'L': p++; long_double = 1; break;
+    }
+
+    spec->conv = *p;
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+            spec->arg = integer;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->arg = long_double ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 's':
+            spec->arg = LOG_ARG_STR;
+            break;
+        case 'p':
+            spec->arg = LOG_ARG_PTR;
+            break;
+        default:
+            spec->arg = LOG_ARG_NONE;
+            break;
+    }
+    return *p ? p + 1 : p;
+}
+
+#define LOG_PACK(type, value) \
+    do { \
+        type v_ = (value); \
+        if (n + sizeof(type) > LOG_ARG_BYTES) \
+            return n; \
+        memcpy(args + n, &v_, sizeof(type)); \
+        n += sizeof(type); \
+    } while (0)
+
+// Arguments of fmt as their binary values, strings copied in with their
+// terminator. Packing stops where they run out of room
+static size_t log_pack(unsigned char *args, const char *fmt, va_list ap)
+{
+    size_t n = 0;
+
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%')
+            continue;
+
+        LogSpec spec;
+        p = log_parse_spec(p, &spec);
+        if (spec.star_width)
+            LOG_PACK(int, va_arg(ap, int));
+        if (spec.star_precision)
+            LOG_PACK(int, va_arg(ap, int));
+
+        switch (spec.arg) {
+            case LOG_ARG_NONE: break;
+            case LOG_ARG_INT: LOG_PACK(int, va_arg(ap, int)); break;
+            case LOG_ARG_LONG: LOG_PACK(long, va_arg(ap, long)); break;
+            case LOG_ARG_LLONG: LOG_PACK(long long, va_arg(ap, long long)); break;
+            case LOG_ARG_SIZE: LOG_PACK(size_t, va_arg(ap, size_t)); break;
+            case LOG_ARG_INTMAX: LOG_PACK(intmax_t, va_arg(ap, intmax_t)); break;
+            case LOG_ARG_PTRDIFF: LOG_PACK(ptrdiff_t, va_arg(ap, ptrdiff_t)); break;
+            case LOG_ARG_DOUBLE: LOG_PACK(double, va_arg(ap, double)); break;
+            case LOG_ARG_LDOUBLE: LOG_PACK(long double, va_arg(ap, long double)); break;
+            case LOG_ARG_PTR: LOG_PACK(void *, va_arg(ap, void *)); break;
+            case LOG_ARG_STR: {
+                const char *s = va_arg(ap, const char *);
+                if (!s)
+                    s = "(null)";
+                if (n >= LOG_ARG_BYTES)
+                    return n;
+                size_t len = strnlen(s, LOG_ARG_BYTES - n - 1);
+                memcpy(args + n, s, len);
+                args[n + len] = '\0';
+                n += len + 1;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+#define LOG_UNPACK(type, var) \
+    type var; \
+    if (a + sizeof(type) > aend) \
+        goto cut; \
+    memcpy(&var, a, sizeof(type)); \
+    a += sizeof(type)
+
+// Append one conversion formatted with the rebuilt spec f
+#define LOG_EMIT(value) \
+    do { \
+        int r = snprintf(out + n, size - n, f, value); \
+        if (r > 0) \
+            n += (size_t)r < size - n ? (size_t)r : size - n - 1; \
+    } while (0)
+
+// The line a record makes, newline included, in at most size bytes
+static size_t log_format(const LogRecord *rec, char *out, size_t size)
+{
+    const unsigned char *a = rec->args;
+    const unsigned char *aend = a + rec->arg_bytes;
+    size_t n = 0;
+    size -= 1;      // room for the newline
+
+    for (const char *p = rec->fmt; *p && n + 1 < size; ) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+
+        const char *start = p;
+        LogSpec spec;
+        p = log_parse_spec(p + 1, &spec);
+        if (spec.conv == '%') {
+            out[n++] = '%';
+            continue;
+        }
+
+        // the spec again, the values of its stars written in
+        char f[64];
+        size_t fl = 0;
+        for (const char *q = start; q < p && fl + 16 < sizeof(f); q++) {
+            if (*q != '*') {
+                f[fl++] = *q;
+                continue;
+            }
+            LOG_UNPACK(int, star);
+            fl += snprintf(f + fl, sizeof(f) - fl, "%d", star);
+        }
+        f[fl] = '\0';
+
+        switch (spec.arg) {
+            case LOG_ARG_NONE: break;
+            case LOG_ARG_INT: { LOG_UNPACK(int, v); LOG_EMIT(v); break; }
+            case LOG_ARG_LONG: { LOG_UNPACK(long, v); LOG_EMIT(v); break; }
+            case LOG_ARG_LLONG: { LOG_UNPACK(long long, v); LOG_EMIT(v); break; }
+            case LOG_ARG_SIZE: { LOG_UNPACK(size_t, v); LOG_EMIT(v); break; }
+            case LOG_ARG_INTMAX: { LOG_UNPACK(intmax_t, v); LOG_EMIT(v); break; }
+            case LOG_ARG_PTRDIFF: { LOG_UNPACK(ptrdiff_t, v); LOG_EMIT(v); break; }
+            case LOG_ARG_DOUBLE: { LOG_UNPACK(double, v); LOG_EMIT(v); break; }
+            case LOG_ARG_LDOUBLE: { LOG_UNPACK(long double, v); LOG_EMIT(v); break; }
+            case LOG_ARG_PTR: { LOG_UNPACK(void *, v); LOG_EMIT(v); break; }
+            case LOG_ARG_STR: {
+                const char *s = (const char *)a;
+                size_t len = strnlen(s, aend - a);
+                if (len == (size_t)(aend - a))
+                    goto cut;
+                a += len + 1;
+                LOG_EMIT(s);
+                break;
+            }
+        }
+    }
+
+    out[n++] = '\n';
+    return n;
+
+cut:
+    // the arguments did not all fit in the record
+    n += snprintf(out + n, size - n, "...");
+    if (n > size - 1)
+        n = size - 1;
+    out[n++] = '\n';
+    return n;
+}
+
+// Print every published message, with drain_lock held. Returns how many
+static int log_drain(void)
+{
+    LogState *s = &log_state;
+    char batch[16 * LOG_LINE_MAX];
+    size_t used = 0;
+    int count = 0;
+
+    for (;;) {
+        uint64_t pos = s->tail;
+        uint64_t lap = pos / LOG_RING_SLOTS;
+        LogRecord *rec = &s->ring[pos % LOG_RING_SLOTS];
+        if (atomic_load_explicit(&rec->seq, memory_order_acquire) != 2 * lap + 1)
+            break;
+
+        if (used + LOG_LINE_MAX > sizeof(batch)) {
+            fwrite(batch, 1, used, stdout);
+            used = 0;
+        }
+        used += log_format(rec, batch + used, LOG_LINE_MAX);
+
+        atomic_store_explicit(&rec->seq, 2 * (lap + 1), memory_order_release);
+        s->tail++;
+        count++;
+    }
+
+    unsigned long long dropped = atomic_exchange(&s->dropped, 0);
+    if (dropped) {
+        if (used + LOG_LINE_MAX > sizeof(batch)) {
+            fwrite(batch, 1, used, stdout);
+            used = 0;
+        }
+        used += snprintf(batch + used, LOG_LINE_MAX, "[Log] %llu messages dropped, the queue was full\n", dropped);
+    }
+
+    if (used) {
+        fwrite(batch, 1, used, stdout);
+        fflush(stdout);
+    }
+    return count;
+}
+
+static void *log_thread(void *arg)
+{
+    (void)arg;
+    long wait_us = LOG_POLL_MIN_US;
+
+    while (!atomic_load(&log_state.stopping)) {
+        pthread_mutex_lock(&log_state.drain_lock);
+        int drained = log_drain();
+        pthread_mutex_unlock(&log_state.drain_lock);
+
+        wait_us = drained ? LOG_POLL_MIN_US : wait_us * 2;
+        if (wait_us > LOG_POLL_MAX_US)
+            wait_us = LOG_POLL_MAX_US;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += wait_us * 1000;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&log_state.wake_lock);
+        if (!atomic_load(&log_state.stopping))
+            pthread_cond_timedwait(&log_state.wake, &log_state.wake_lock, &ts);
+        pthread_mutex_unlock(&log_state.wake_lock);
+    }
+    return NULL;
+}
+
+static void log_exit(void)
+{
+    LogState *s = &log_state;
+    if (s->running) {
+        pthread_mutex_lock(&s->wake_lock);
+        atomic_store(&s->stopping, 1);
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->wake_lock);
+        pthread_join(s->thread, NULL);
+        s->running = 0;
+    }
+    log_flush();
+}
+
+// A fork copies the ring but not the thread. What was queued before is
+// printed first, so it comes out ahead of anything the child logs, and the
+// child starts with an empty ring and its own thread
+static void log_fork_prepare(void)
+{
+    pthread_mutex_lock(&log_state.drain_lock);
+    log_drain();
+}
+
+static void log_fork_parent(void)
+{
+    pthread_mutex_unlock(&log_state.drain_lock);
+}
+
+static void log_fork_child(void)
+{
+    LogState *s = &log_state;
+
+    // positions claimed so far are skipped, published or not
+    uint64_t head = atomic_load(&s->head);
+    for (uint64_t pos = s->tail; pos < head; pos++)
+        atomic_store(&s->ring[pos % LOG_RING_SLOTS].seq, 2 * (pos / LOG_RING_SLOTS + 1));
+    s->tail = head;
+
+    atomic_store(&s->dropped, 0);
+    atomic_store(&s->started, 0);
+    atomic_store(&s->stopping, 0);
+    s->running = 0;
+
+    // the log thread may have held these, it is gone in the child
+    pthread_mutex_init(&s->wake_lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_mutex_unlock(&s->drain_lock);
+}
+
+static void log_install(void)
+{
+    pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+    atexit(log_exit);
+}
+
+static void log_start(void)
+{
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&log_state.started, &expected, 1))
+        return;
+
+    // without a thread the ring is printed at flush and exit only
+    if (pthread_create(&log_state.thread, NULL, log_thread, NULL) == 0)
+        log_state.running = 1;
+}
+
+void log_set_level(int level)
+{
+    if (level < LOG_LEVEL_OFF)
+        level = LOG_LEVEL_OFF;
+    if (level > LOG_LEVEL_DEBUG)
+        level = LOG_LEVEL_DEBUG;
+    atomic_store(&log_level, level);
+}
+
+void log_write(const char *fmt, ...)
+{
+    LogState *s = &log_state;
+
+    pthread_once(&log_once, log_install);
+    if (!atomic_load_explicit(&s->started, memory_order_relaxed))
+        log_start();
+
+    uint64_t pos = atomic_load_explicit(&s->head, memory_order_relaxed);
+    LogRecord *rec;
+    for (;;) {
+        uint64_t lap = pos / LOG_RING_SLOTS;
+        rec = &s->ring[pos % LOG_RING_SLOTS];
+        int64_t diff = (int64_t)(atomic_load_explicit(&rec->seq, memory_order_acquire) - 2 * lap);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&s->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the slot still holds a message from the lap before
+            atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&s->head, memory_order_relaxed);
+        }
+    }
+
+    rec->fmt = fmt;
+    va_list ap;
+    va_start(ap, fmt);
+    rec->arg_bytes = (uint16_t)log_pack(rec->args, fmt, ap);
+    va_end(ap);
+
+    atomic_store_explicit(&rec->seq, 2 * (pos / LOG_RING_SLOTS) + 1, memory_order_release);
+
+    // no lock, a missed wakeup only waits out the poll
+    if (pos % LOG_WAKE_SLOTS == LOG_WAKE_SLOTS - 1)
+        pthread_cond_signal(&s->wake);
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&log_state.drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&log_state.drain_lock);
+}
@@ -0,0 +1,869 @@
+#define _GNU_SOURCE
+#include "datanode.h"
+#include "blockstore.h"
+
+#include <errno.h>
+
+// Every block write is appended to the active segment of its class's log
+// file, so random overwrites reach the disk as sequential writes. A segment is a
+// LOG_SUMMARY_SIZE summary followed by its data slots. The summary holds
+// a header, the block index owning every slot and every slot's checksum. An
+// in-memory index maps block indices to their latest slot, rebuilt from the
+// summaries on recovery. A compactor thread per log copies the live blocks
+// out of segments dominated by dead versions and gives their space back.
+
+extern DataNode *dn;
+
+// data slots per segment, about LOG_SEGMENT_BYTES of them whatever the
+// block size, at most LOG_SEGMENT_BLOCKS so the summary fits
+#define LOG_SEGMENT_BYTES (1024 * 1024)
+#define LOG_SEGMENT_MIN_BLOCKS 16
+#define LOG_SEGMENT_BLOCKS 256
+#define LOG_SUMMARY_SIZE DN_DIRECT_ALIGN
+
+// segments beyond the capacity, room for dead versions awaiting compaction
+#define LOG_SPARE_SEGMENTS 4
+
+// free segments foreground writes leave to the compactor
+#define LOG_RESERVE 1
+
+#define LOG_MAGIC 0x4c4f4731u   // "LOG1"
+
+// index entries and slot owners without a slot or block
+#define LOG_NONE -1
+#define LOG_UNWRITTEN -2
+
+typedef enum {
+    SEGMENT_FREE,
+    SEGMENT_ACTIVE,         // appended to
+    SEGMENT_SEALED,
+    SEGMENT_COMPACTING,
+} LogSegmentState;
+
+typedef struct LogState LogState;
+
+typedef struct {
+    LogState *log;          // the log the segment belongs to
+    int id;                 // position in the log file
+    LogSegmentState state;
+    int used;               // slots handed out
+    int live;               // slots the index points at
+    int refs;               // block I/O in flight
+    int dirty;              // owners changed since written out
+    uint64_t seq;
+} LogSegment;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t blocks;
+    uint64_t seq;           // activation order, later segments win
+} LogSummary;
+
+struct LogState {
+    int fd;
+    int direct_fd;          // data slots opened again with O_DIRECT, -1 if unused
+    size_t block_size;
+
+    LogSegment **segments;
+    int num_segments;
+    int segment_blocks;
+    int num_free;
+    LogSegment *active;     // fresh writes are appended here
+    LogSegment *moving;     // the compactor's, surviving blocks stay apart
+    uint64_t seq;
+
+    // owning block index of every slot, slots are numbered across segments
+    int *owners;
+
+    // block index -> slot, LOG_NONE or LOG_UNWRITTEN, grown on demand
+    int *index;
+    int index_cap;
+    int num_blocks;         // index entries other than LOG_NONE
+    int num_slots;          // blocks the segments are laid out for
+
+    pthread_t compactor;
+    int started;
+    int stopping;
+    int stalled;            // nothing left to compact, space cannot be made
+    pthread_cond_t work;    // the compactor has something to do
+    pthread_cond_t space;   // a segment was freed or the compactor stalled
+
+    void *copy_buf;         // block moved by the compactor, aligned for direct_fd
+    uint64_t compactions;
+    uint64_t moved;
+};
+
+// The log of block_index's class
+static inline LogState *log_state(int block_index)
+{
+    return (LogState *)store->state + (datanode_class(block_index) - dn->classes);
+}
+
+static off_t log_segment_offset(LogState *s, int segment)
+{
+    return (off_t)segment * (LOG_SUMMARY_SIZE + (off_t)s->segment_blocks * s->block_size);
+}
+
+static off_t log_data_offset(LogState *s, int slot)
+{
+    return log_segment_offset(s, slot / s->segment_blocks) + LOG_SUMMARY_SIZE +
+           (off_t)(slot % s->segment_blocks) * s->block_size;
+}
+
+static off_t log_owners_offset(LogState *s, int segment)
+{
+    return log_segment_offset(s, segment) + sizeof(LogSummary);
+}
+
+static off_t log_crc_offset(LogState *s, int slot)
+{
+    return log_owners_offset(s, slot / s->segment_blocks) +
+           (off_t)s->segment_blocks * sizeof(int32_t) +
+           (off_t)(slot % s->segment_blocks) * DN_CRC_SIZE;
+}
+
+static int log_index_get(LogState *s, int block_index)
+{
+    return block_index >= 0 && block_index < s->index_cap ? s->index[block_index] : LOG_NONE;
+}
+
+static int log_index_grow(LogState *s, int block_index)
+{
+    if (block_index < s->index_cap)
+        return 0;
+
+    int cap = s->index_cap ? s->index_cap : 1024;
+    while (cap <= block_index)
+        cap *= 2;
+
+    int *grown = realloc(s->index, sizeof(int) * cap);
+    if (!grown)
+        return -1;
+    for (int i = s->index_cap; i < cap; i++)
+        grown[i] = LOG_NONE;
+
+    s->index = grown;
+    s->index_cap = cap;
+    return 0;
+}
+
+static int log_write_owners(LogState *s, LogSegment *seg)
+{
+    int segment = seg->id;
+    size_t size = sizeof(int32_t) * s->segment_blocks;
+    if (pwrite(s->fd, s->owners + (size_t)segment * s->segment_blocks, size,
+               log_owners_offset(s, segment)) != (ssize_t)size) {
+        perror("pwrite");
+        return -1;
+    }
+    seg->dirty = 0;
+    return 0;
+}
+
+// Segments keep their space and are written over in place, appends to
+// allocated and written extents skip the filesystem's metadata updates.
+// Only the header goes, so recovery skips the segment
+static void log_reclaim(LogState *s, LogSegment *seg)
+{
+    LogSummary none = {0};
+    if (pwrite(s->fd, &none, sizeof(none), log_segment_offset(s, seg->id)) != sizeof(none))
+        perror("pwrite");
+
+    seg->state = SEGMENT_FREE;
+    seg->used = 0;
+    seg->dirty = 0;
+    s->num_free++;
+    pthread_cond_broadcast(&s->space);
+}
+
+static void log_reclaim_dead(LogState *s, LogSegment *seg)
+{
+    if (seg->state == SEGMENT_SEALED && seg->live == 0 && seg->refs == 0)
+        log_reclaim(s, seg);
+}
+
+// The slot no longer holds the latest version of its block
+static void log_kill(LogState *s, int slot)
+{
+    LogSegment *seg = s->segments[slot / s->segment_blocks];
+    s->owners[slot] = LOG_NONE;
+    seg->live--;
+    seg->dirty = 1;
+    log_reclaim_dead(s, seg);
+}
+
+static int log_activate(LogState *s, LogSegment **head)
+{
+    int segment = 0;
+    while (s->segments[segment]->state != SEGMENT_FREE)
+        segment++;
+    LogSegment *seg = s->segments[segment];
+
+    // a fresh summary: no slot has an owner or a checksum yet
+    static char summary[LOG_SUMMARY_SIZE];
+    LogSummary header = { LOG_MAGIC, s->segment_blocks, ++s->seq };
+    memcpy(summary, &header, sizeof(header));
+    memset(summary + sizeof(header), 0xff, sizeof(int32_t) * s->segment_blocks);   // LOG_NONE
+
+    if (pwrite(s->fd, summary, LOG_SUMMARY_SIZE, log_segment_offset(s, segment)) != LOG_SUMMARY_SIZE) {
+        perror("pwrite");
+        return -1;
+    }
+
+    for (int i = 0; i < s->segment_blocks; i++)
+        s->owners[(size_t)segment * s->segment_blocks + i] = LOG_NONE;
+
+    seg->state = SEGMENT_ACTIVE;
+    seg->used = 0;
+    seg->live = 0;
+    seg->dirty = 0;
+    seg->seq = header.seq;
+    s->num_free--;
+    *head = seg;
+
+    // keep ahead of the writers
+    if (s->num_free < LOG_SPARE_SEGMENTS)
+        pthread_cond_signal(&s->work);
+    return 0;
+}
+
+static void log_seal(LogState *s, LogSegment **head)
+{
+    LogSegment *seg = *head;
+    *head = NULL;
+
+    seg->state = SEGMENT_SEALED;
+    log_write_owners(s, seg);
+    log_reclaim_dead(s, seg);
+}
+
+// Next slot of the segment at head, leaving reserve free segments. Waits for
+// the compactor when there are none to spare, with dn->lock held
+static int log_append(LogState *s, LogSegment **head, int reserve)
+{
+    int waited = 0;
+    while (!*head || (*head)->used == s->segment_blocks) {
+        if (*head)
+            log_seal(s, head);
+
+        if (s->num_free > reserve) {
+            if (log_activate(s, head) != 0)
+                return -1;
+            continue;
+        }
+
+        if ((waited && s->stalled) || s->stopping || reserve == 0) {
+            LOGD_ERROR(dn->node_id, "log is out of segments");
+            return -1;
+        }
+
+        // stalled again only if the compactor finds nothing to do
+        s->stalled = 0;
+        waited = 1;
+        pthread_cond_signal(&s->work);
+        pthread_cond_wait(&s->space, &dn->lock);
+    }
+
+    LogSegment *seg = *head;
+    return seg->id * s->segment_blocks + seg->used++;
+}
+
+static void log_loc(LogState *s, int slot, DNBlockLoc *loc)
+{
+    LogSegment *seg = s->segments[slot / s->segment_blocks];
+    seg->refs++;
+
+    loc->fd = s->direct_fd >= 0 ? s->direct_fd : s->fd;
+    loc->offset = log_data_offset(s, slot);
+    loc->crc_fd = s->fd;
+    loc->crc_offset = log_crc_offset(s, slot);
+    loc->handle = seg;
+}
+
+// The sealed segment with the fewest live blocks, once compacting it pays
+// off or the writers are out of space. Its blocks must fit in the space left
+// to the compactor, a victim is never left half moved
+static LogSegment *log_victim(LogState *s)
+{
+    int room = s->num_free * s->segment_blocks;
+    if (s->moving)
+        room += s->segment_blocks - s->moving->used;
+
+    LogSegment *victim = NULL;
+    for (int i = 0; i < s->num_segments; i++) {
+        LogSegment *seg = s->segments[i];
+        if (seg->state != SEGMENT_SEALED || seg->refs > 0 || seg->live > room ||
+            seg->live == s->segment_blocks)
+            continue;
+        if (!victim || seg->live < victim->live)
+            victim = seg;
+    }
+
+    if (victim && (victim->live * 2 <= s->segment_blocks || s->num_free <= LOG_RESERVE))
+        return victim;
+    return NULL;
+}
+
+// Copy a block's first length bytes of data and its checksum, the rest of
+// the new slot is left to the filesystem
+static int log_copy(LogState *s, int from, int to, size_t length)
+{
+    int fd = s->direct_fd >= 0 ? s->direct_fd : s->fd;
+    size_t n = (length + DN_DIRECT_ALIGN - 1) / DN_DIRECT_ALIGN * DN_DIRECT_ALIGN;
+    if (n > s->block_size)
+        n = s->block_size;
+    uint32_t crc;
+
+    if (pread(fd, s->copy_buf, n, log_data_offset(s, from)) != (ssize_t)n ||
+        pread(s->fd, &crc, DN_CRC_SIZE, log_crc_offset(s, from)) != DN_CRC_SIZE ||
+        pwrite(fd, s->copy_buf, n, log_data_offset(s, to)) != (ssize_t)n ||
+        pwrite(s->fd, &crc, DN_CRC_SIZE, log_crc_offset(s, to)) != DN_CRC_SIZE)
+        return -1;
+    return block_store_trim(s->fd, log_data_offset(s, to), n, s->block_size);
+}
+
+// Move the victim's live blocks to the compactor's segment, with dn->lock
+// held. Block I/O runs unlocked, blocks written meanwhile keep their new slot
+static int log_compact(LogState *s, LogSegment *victim)
+{
+    int segment = victim->id;
+    int moved = 0;
+    int ret = 0;
+
+    victim->state = SEGMENT_COMPACTING;
+    for (int i = 0; i < victim->used && !s->stopping; i++) {
+        int from = segment * s->segment_blocks + i;
+        int block_index = s->owners[from];
+        if (block_index < 0 || s->index[block_index] != from)
+            continue;
+
+        int to = log_append(s, &s->moving, 0);
+        if (to < 0) {
+            ret = -1;
+            break;
+        }
+        LogSegment *dest = s->segments[to / s->segment_blocks];
+        dest->refs++;
+        size_t length = datanode_block_bytes(block_index);
+
+        pthread_mutex_unlock(&dn->lock);
+        int copied = log_copy(s, from, to, length);
+        pthread_mutex_lock(&dn->lock);
+
+        dest->refs--;
+        if (copied != 0) {
+            perror("compaction");
+            ret = -1;
+        } else if (s->index[block_index] == from) {
+            log_kill(s, from);
+            s->index[block_index] = to;
+            s->owners[to] = block_index;
+            dest->live++;
+            dest->dirty = 1;
+            moved++;
+        }
+        log_reclaim_dead(s, dest);
+        if (ret != 0)
+            break;
+    }
+
+    // the moved copies must be found on recovery before the victim is
+    // written over
+    if (moved > 0) {
+        for (int i = 0; i < s->num_segments; i++) {
+            LogSegment *seg = s->segments[i];
+            if (seg != victim && seg->state != SEGMENT_FREE && seg->dirty && log_write_owners(s, seg) != 0)
+                ret = -1;
+        }
+
+        pthread_mutex_unlock(&dn->lock);
+        if (fdatasync(s->fd) != 0) {
+            perror("fdatasync");
+            ret = -1;
+        }
+        pthread_mutex_lock(&dn->lock);
+    }
+
+    victim->state = SEGMENT_SEALED;
+    if (ret == 0)
+        log_reclaim_dead(s, victim);
+
+    s->compactions++;
+    s->moved += moved;
+    LOGD_DEBUG(dn->node_id, "compacted segment %d, moved %d live blocks", segment, moved);
+    return ret;
+}
+
+static void *log_compactor(void *arg)
+{
+    LogState *s = arg;
+
+    pthread_mutex_lock(&dn->lock);
+    while (!s->stopping) {
+        LogSegment *victim = s->num_free < LOG_SPARE_SEGMENTS ? log_victim(s) : NULL;
+        if (!victim) {
+            // writers waiting on a full log would wait forever
+            s->stalled = s->num_free <= LOG_RESERVE;
+            pthread_cond_broadcast(&s->space);
+            pthread_cond_wait(&s->work, &dn->lock);
+            continue;
+        }
+
+        s->stalled = 0;
+        if (log_compact(s, victim) != 0) {
+            // retrying right away would only spin on the failing I/O
+            s->stalled = 1;
+            pthread_cond_broadcast(&s->space);
+            pthread_cond_wait(&s->work, &dn->lock);
+            continue;
+        }
+        pthread_cond_broadcast(&s->space);
+    }
+    pthread_mutex_unlock(&dn->lock);
+
+    return NULL;
+}
+
+// Rebuild the index from the owners in every segment's summary. A block
+// found twice, only after a crash, keeps the version in the later segment
+static int log_recover(LogState *s)
+{
+    struct {
+        LogSummary header;
+        int32_t owners[LOG_SEGMENT_BLOCKS];
+    } summary;
+
+    for (int segment = 0; segment < s->num_segments; segment++) {
+        LogSegment *seg = s->segments[segment];
+        int *owners = s->owners + (size_t)segment * s->segment_blocks;
+
+        if (pread(s->fd, &summary, sizeof(summary), log_segment_offset(s, segment)) != sizeof(summary)) {
+            perror("pread");
+            return -1;
+        }
+        if (summary.header.magic != LOG_MAGIC || summary.header.blocks != (uint32_t)s->segment_blocks)
+            continue;
+
+        // the space left in segments active at exit is only reused once
+        // they are compacted
+        seg->state = SEGMENT_SEALED;
+        seg->used = s->segment_blocks;
+        seg->seq = summary.header.seq;
+        s->num_free--;
+        if (seg->seq > s->seq)
+            s->seq = seg->seq;
+
+        for (int i = 0; i < s->segment_blocks; i++) {
+            int block_index = summary.owners[i];
+            owners[i] = LOG_NONE;
+            if (block_index < 0)
+                continue;
+            if (log_index_grow(s, block_index) != 0)
+                return -1;
+
+            int slot = segment * s->segment_blocks + i;
+            int other = s->index[block_index];
+            if (other >= 0) {
+                LogSegment *older = s->segments[other / s->segment_blocks];
+                if (older->seq > seg->seq) {
+                    seg->dirty = 1;
+                    continue;
+                }
+                s->owners[other] = LOG_NONE;
+                older->live--;
+                older->dirty = 1;
+            }
+
+            if (other == LOG_NONE)
+                s->num_blocks++;
+            s->index[block_index] = slot;
+            owners[i] = block_index;
+            seg->live++;
+        }
+    }
+
+    for (int segment = 0; segment < s->num_segments; segment++)
+        log_reclaim_dead(s, s->segments[segment]);
+    return 0;
+}
+
+// Segments for num_slots blocks, with room for dead versions
+static int log_segments_for(LogState *s, int num_slots)
+{
+    int data_segments = (num_slots + s->segment_blocks - 1) / s->segment_blocks;
+    return data_segments + data_segments / 8 + LOG_SPARE_SEGMENTS;
+}
+
+// Free segments up to num_segments in all, past the end of the file
+static int log_add_segments(LogState *s, int num_segments)
+{
+    if (num_segments <= s->num_segments)
+        return 0;
+
+    LogSegment **segments = realloc(s->segments, sizeof(LogSegment *) * num_segments);
+    if (!segments)
+        return -1;
+    s->segments = segments;
+
+    int *owners = realloc(s->owners, sizeof(int) * (size_t)num_segments * s->segment_blocks);
+    if (!owners)
+        return -1;
+    s->owners = owners;
+
+    for (int i = s->num_segments; i < num_segments; i++) {
+        LogSegment *seg = calloc(1, sizeof(LogSegment));
+        if (!seg)
+            return -1;
+        seg->log = s;
+        seg->id = i;
+        s->segments[i] = seg;
+        s->num_segments++;
+        s->num_free++;
+    }
+    return 0;
+}
+
+// Lay out segments for num_blocks once the log holds more blocks than it
+// was laid out for, with compress only. The file is sparse then, the new
+// segments take space as written
+static int log_grow(LogState *s, int num_blocks)
+{
+    if (!dn->compress || num_blocks <= s->num_slots)
+        return 0;
+
+    int num_slots = s->num_slots + s->segment_blocks;
+    int num_segments = log_segments_for(s, num_slots);
+    if (num_segments > s->num_segments) {
+        if (ftruncate(s->fd, log_segment_offset(s, num_segments)) != 0) {
+            perror("ftruncate");
+            return -1;
+        }
+        if (log_add_segments(s, num_segments) != 0)
+            return -1;
+        pthread_cond_broadcast(&s->space);
+        LOGD_DEBUG(dn->node_id, "log of %zu byte blocks grew to %d segments", s->block_size, s->num_segments);
+    }
+    s->num_slots = num_slots;
+    return 0;
+}
+
+static int log_init_class(LogState *s, int c)
+{
+    s->block_size = dn->classes[c].block_size;
+    s->segment_blocks = LOG_SEGMENT_BYTES / s->block_size;
+    if (s->segment_blocks < LOG_SEGMENT_MIN_BLOCKS)
+        s->segment_blocks = LOG_SEGMENT_MIN_BLOCKS;
+    if (s->segment_blocks > LOG_SEGMENT_BLOCKS)
+        s->segment_blocks = LOG_SEGMENT_BLOCKS;
+
+    s->num_slots = dn->classes[c].num_slots;
+    int num_segments = log_segments_for(s, s->num_slots);
+    if (posix_memalign(&s->copy_buf, DN_DIRECT_ALIGN, s->block_size) != 0)
+        return -1;
+
+    char filepath[512];
+    block_store_path(filepath, sizeof(filepath), "log", c);
+
+    s->fd = open(filepath, O_CREAT | O_RDWR | (dn->recover ? 0 : O_TRUNC), 0644);
+    if (s->fd < 0) {
+        LOGD_ERROR(dn->node_id, "Failed to create log '%s'", filepath);
+        perror("open");
+        return -1;
+    }
+
+    // a log laid out for another capacity or block size cannot be read back,
+    // one grown by compressed blocks keeps its segments
+    off_t total = log_segment_offset(s, num_segments);
+    off_t segment_size = log_segment_offset(s, 1);
+    struct stat st;
+    int recover = dn->recover && fstat(s->fd, &st) == 0 &&
+                  (st.st_size == total || (dn->compress && st.st_size > total &&
+                                           st.st_size % segment_size == 0));
+    if (dn->recover && !recover) {
+        LOGD_WARN(dn->node_id, "log '%s' does not match the capacity or block size, starting empty", filepath);
+        if (ftruncate(s->fd, 0) != 0) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    if (recover) {
+        num_segments = (int)(st.st_size / segment_size);
+        total = st.st_size;
+    }
+
+    if (log_add_segments(s, num_segments) != 0)
+        return -1;
+
+    // reserve every segment up front so appends never extend the file.
+    // Compressed slots are only partly filled, their space is taken as written
+    if (dn->compress || fallocate(s->fd, 0, 0, total) != 0) {
+        if ((!dn->compress && errno != EOPNOTSUPP) || ftruncate(s->fd, total) != 0) {
+            perror("fallocate");
+            return -1;
+        }
+    }
+
+    if (recover && log_recover(s) != 0)
+        return -1;
+
+    if (dn->direct_io) {
+        // slots are DN_DIRECT_ALIGN aligned, the summaries stay buffered
+        s->direct_fd = open(filepath, O_RDWR | O_DIRECT);
+        if (s->direct_fd < 0) {
+            LOGD_WARN(dn->node_id, "O_DIRECT unsupported for '%s', using buffered I/O", filepath);
+            dn->direct_io = 0;
+        }
+    }
+
+    if (dn->mmap_reads) {
+        // blocks move under the compactor, a mapping would go stale
+        LOGD_WARN(dn->node_id, "log store has no mapped read path, reads are copied");
+        dn->mmap_reads = 0;
+    }
+
+    if (pthread_create(&s->compactor, NULL, log_compactor, s) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    s->started = 1;
+
+    LOGD(dn->node_id, "log '%s' holds %d segments of %d blocks", filepath,
+         s->num_segments, s->segment_blocks);
+    return 0;
+}
+
+int log_init(void)
+{
+    LogState *states = calloc(DN_MAX_CLASSES, sizeof(LogState));
+    if (!states) return -1;
+    store->state = states;
+    for (int c = 0; c < DN_MAX_CLASSES; c++) {
+        LogState *s = &states[c];
+        s->fd = -1;
+        s->direct_fd = -1;
+        pthread_cond_init(&s->work, NULL);
+        pthread_cond_init(&s->space, NULL);
+    }
+
+    for (int c = 0; c < dn->num_classes; c++) {
+        if (log_init_class(&states[c], c) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+DNStatus log_alloc(int block_index)
+{
+    LogState *s = log_state(block_index);
+    if (log_index_grow(s, block_index) != 0)
+        return DN_FAIL;
+
+    // allocating again starts the block over
+    int slot = s->index[block_index];
+    if (slot >= 0)
+        log_kill(s, slot);
+    if (slot == LOG_NONE) {
+        if (log_grow(s, s->num_blocks + 1) != 0)
+            return DN_NO_SPACE;
+        s->num_blocks++;
+    }
+
+    s->index[block_index] = LOG_UNWRITTEN;
+    return DN_SUCCESS;
+}
+
+DNStatus log_free(int block_index)
+{
+    LogState *s = log_state(block_index);
+
+    int slot = log_index_get(s, block_index);
+    if (slot == LOG_NONE)
+        return DN_INVALID_BLOCK;
+
+    if (slot >= 0)
+        log_kill(s, slot);
+    s->index[block_index] = LOG_NONE;
+    s->num_blocks--;
+    return DN_SUCCESS;
+}
+
+int log_locate(int block_index, int for_write, DNBlockLoc *loc)
+{
+    LogState *s = log_state(block_index);
+
+    int slot = log_index_get(s, block_index);
+    if (slot == LOG_NONE || (slot == LOG_UNWRITTEN && !for_write))
+        return 1;
+
+    if (!for_write) {
+        log_loc(s, slot, loc);
+        return 0;
+    }
+
+    // a write never lands where the old version is
+    int next = log_append(s, &s->active, LOG_RESERVE);
+    if (next < 0)
+        return -1;
+
+    slot = s->index[block_index];
+    if (slot >= 0)
+        log_kill(s, slot);
+
+    LogSegment *seg = s->segments[next / s->segment_blocks];
+    s->index[block_index] = next;
+    s->owners[next] = block_index;
+    seg->live++;
+    seg->dirty = 1;
+
+    log_loc(s, next, loc);
+    return 0;
+}
+
+void log_release(DNBlockLoc *loc)
+{
+    LogSegment *seg = loc->handle;
+    seg->refs--;
+    log_reclaim_dead(seg->log, seg);
+}
+
+const void *log_map(int block_index, uint32_t *crc)
+{
+    (void)block_index;
+    (void)crc;
+    return NULL;
+}
+
+void log_advise(int count, const int *block_indices)
+{
+    (void)count;
+    (void)block_indices;
+}
+
+static int log_sync_class(LogState *s)
+{
+    for (int i = 0; i < s->num_segments; i++) {
+        LogSegment *seg = s->segments[i];
+        if (seg->state != SEGMENT_FREE && seg->dirty && log_write_owners(s, seg) != 0)
+            return -1;
+    }
+
+    if (fdatasync(s->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+int log_sync(void)
+{
+    LogState *states = store->state;
+    for (int c = 0; c < dn->num_classes; c++) {
+        if (log_sync_class(&states[c]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int log_commit(DNBlockLoc *loc)
+{
+    LogSegment *seg = loc->handle;
+    LogState *s = seg->log;
+
+    // the new slot's owner goes out with the data first, a crash before the
+    // old version is marked dead then recovers one of the two, never neither
+    pthread_mutex_lock(&dn->lock);
+    int ret = seg->dirty ? log_write_owners(s, seg) : 0;
+    pthread_mutex_unlock(&dn->lock);
+    if (ret != 0 || fdatasync(s->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+
+    // recovery prefers the later segment, so an old version left in one,
+    // where the compactor moved it, must be seen dead
+    int later = 0;
+    pthread_mutex_lock(&dn->lock);
+    for (int i = 0; i < s->num_segments && ret == 0; i++) {
+        LogSegment *other = s->segments[i];
+        if (other->state != SEGMENT_FREE && other->dirty && other->seq > seg->seq) {
+            ret = log_write_owners(s, other);
+            later = 1;
+        }
+    }
+    pthread_mutex_unlock(&dn->lock);
+    if (ret != 0 || (later && fdatasync(s->fd) != 0)) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+int log_list(int **block_indices)
+{
+    LogState *states = store->state;
+
+    int total = 1;
+    for (int c = 0; c < dn->num_classes; c++)
+        total += states[c].index_cap;
+
+    int count = 0;
+    int *blocks = malloc(sizeof(int) * total);
+    if (!blocks)
+        return -1;
+
+    for (int c = 0; c < dn->num_classes; c++) {
+        LogState *s = &states[c];
+        for (int i = 0; i < s->index_cap; i++) {
+            if (s->index[i] != LOG_NONE)
+                blocks[count++] = i;
+        }
+    }
+
+    *block_indices = blocks;
+    return count;
+}
+
+static void log_destroy_class(LogState *s)
+{
+    if (s->started) {
+        pthread_mutex_lock(&dn->lock);
+        s->stopping = 1;
+        pthread_cond_signal(&s->work);
+        pthread_mutex_unlock(&dn->lock);
+        pthread_join(s->compactor, NULL);
+
+        LOGD(dn->node_id, "log compactor: %llu segments compacted, %llu blocks moved",
+             (unsigned long long)s->compactions, (unsigned long long)s->moved);
+    }
+
+    // owners of the latest writes and frees, for the next recovery
+    for (int i = 0; s->segments && s->fd >= 0 && i < s->num_segments; i++) {
+        LogSegment *seg = s->segments[i];
+        if (seg->state != SEGMENT_FREE && seg->dirty)
+            log_write_owners(s, seg);
+    }
+
+    pthread_cond_destroy(&s->space);
+    pthread_cond_destroy(&s->work);
+    if (s->direct_fd >= 0)
+        close(s->direct_fd);
+    if (s->fd >= 0)
+        close(s->fd);
+    for (int i = 0; s->segments && i < s->num_segments; i++)
+        free(s->segments[i]);
+    free(s->segments);
+    free(s->owners);
+    free(s->index);
+    free(s->copy_buf);
+}
+
+void log_destroy(void)
+{
+    LogState *states = store->state;
+    if (!states) return;
+
+    for (int c = 0; c < DN_MAX_CLASSES; c++)
+        log_destroy_class(&states[c]);
+    free(states);
+    store->state = NULL;
+}
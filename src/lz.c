@@ -0,0 +1,214 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// the format ends every stream with literals, matches stop this far from the end
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+#define LZ_HASH_BITS 12
+
+// misses before the search starts skipping, incompressible data goes fast
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Copy at least n bytes 8 at a time, the caller leaves LZ_WILD_SLACK bytes of
+// room past both ends
+#define LZ_WILD_SLACK 8
+
+static inline void lz_wild_copy(unsigned char *dst, const unsigned char *src, size_t n)
+{
+    unsigned char *end = dst + n;
+    do {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    } while (dst < end);
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length beyond the token's 15 as a run of 255s and the remainder
+static unsigned char *lz_put_length(unsigned char *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+// Literals [anchor, anchor + literals) and, with offset, a match after them.
+// Returns the end of the output, NULL if it would pass oend
+static unsigned char *lz_put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *anchor,
+                                      size_t literals, size_t offset, size_t match)
+{
+    size_t worst = 1 + literals / 255 + 1 + literals + (offset ? 2 + match / 255 + 1 : 0);
+    if (worst > (size_t)(oend - op))
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15)
+        op = lz_put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    if (offset) {
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        *token |= (unsigned char)(match >= 15 ? 15 : match);
+        if (match >= 15)
+            op = lz_put_length(op, match - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    const unsigned char *base = src;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + size;
+    unsigned char *op = dst;
+    unsigned char *oend = op + capacity;
+
+    if (size > LZ_MATCH_LIMIT) {
+        const unsigned char *mflimit = iend - LZ_MATCH_LIMIT;
+        const unsigned char *matchlimit = iend - LZ_LAST_LITERALS;
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const unsigned char *ip = base + 1;
+        unsigned misses = 0;
+        while (ip < mflimit) {
+            uint32_t h = lz_hash(read32(ip));
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const unsigned char *end = ip + LZ_MIN_MATCH;
+            const unsigned char *r = ref + LZ_MIN_MATCH;
+            while (end + 8 <= matchlimit && read64(end) == read64(r)) {
+                end += 8;
+                r += 8;
+            }
+            while (end < matchlimit && *end == *r) {
+                end++;
+                r++;
+            }
+
+            op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, end - ip - LZ_MIN_MATCH);
+            if (!op)
+                return 0;
+
+            ip = anchor = end;
+            if (ip < mflimit)
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+// Continuation bytes of a length, -1 past the end of the input
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *length)
+{
+    unsigned char b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decompress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = ip + size;
+    unsigned char *op = dst;
+    unsigned char *oend = op + capacity;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15 && lz_get_length(&ip, iend, &literals) != 0)
+            return -1;
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+            return -1;
+        if (literals + LZ_WILD_SLACK <= (size_t)(iend - ip) && literals + LZ_WILD_SLACK <= (size_t)(oend - op))
+            lz_wild_copy(op, ip, literals);
+        else
+            memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        // the last sequence has no match
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char *)dst))
+            return -1;
+
+        size_t match = token & 15;
+        if (match == 15 && lz_get_length(&ip, iend, &match) != 0)
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (match > (size_t)(oend - op))
+            return -1;
+
+        if (offset >= 8 && match <= 64 && match + LZ_WILD_SLACK <= (size_t)(oend - op)) {
+            lz_wild_copy(op, op - offset, match);
+            op += match;
+            continue;
+        }
+
+        // a match overlapping its own output repeats the last offset bytes,
+        // copied in chunks that double as the pattern grows
+        size_t span = offset;
+        while (match > 0) {
+            size_t n = match < span ? match : span;
+            memcpy(op, op - span, n);
+            op += n;
+            match -= n;
+            span += n;
+        }
+    }
+
+    return (long)(op - (unsigned char *)dst);
+}
@@ -4,18 +4,187 @@
 
 MetadataNode * md = NULL;
 
-MDNStatus initialize_datanodes()
+static char md_zero_block[BLOCK_SIZE_MAX];
+
+// Class of a block, ids are dealt to the classes in turn
+static MDBlockClass *md_block_class(int block_id)
+{
+    return &md->classes[block_id % md->num_classes];
+}
+
+// Position of a block in its class's bitmap
+static uint32_t md_block_slot(int block_id)
+{
+    return (uint32_t)(block_id / md->num_classes);
+}
+
+static size_t md_file_block_size(const FileEntry *file)
+{
+    return md->classes[file->block_class].block_size;
+}
+
+// One batched wire request of an asynchronous request, covering
+// req->order[first] .. req->order[first + count - 1]
+struct MDAsyncOp {
+    MDAsyncOp *next;
+    MDAsyncRequest *req;
+    int node_id;
+    uint32_t req_id;
+    int first;
+    int count;
+    size_t response_bytes;      // header and read data the answer brings
+};
+
+typedef struct MDDedupRoute MDDedupRoute;
+
+struct MDAsyncRequest {
+    MDAsyncRequest *next;       // in md->async_ready
+    MDHandle handle;
+    DNCommand cmd;
+    int remaining;              // ops not answered yet
+    MDNStatus status;
+    MDCallback cb;
+    void *arg;
+
+    int nblocks;
+    size_t block_size;          // the blocks are all of one class
+    int *blocks;                // block ids, copied at submission
+    int *order;                 // positions grouped by node
+    uint32_t *crcs;             // checksums of written blocks, by position
+    const char *wdata;
+    size_t wsize;
+    char *rdata;
+    MDDedupRoute *route;        // dedup writes, settled once all ops answer
+};
+
+static void md_async_quiesce(void);
+static void md_note_response(int node_id, const DNResponseHeader *header);
+
+static MDNStatus md_async_submit(const int *blocks, int nblocks, DNCommand cmd,
+                                 const char *wdata, size_t wsize, char *rdata,
+                                 MDCallback cb, void *arg, MDHandle *handle);
+static MDNStatus md_async_submit_route(const int *blocks, int nblocks, DNCommand cmd,
+                                       const char *wdata, size_t wsize, char *rdata, MDDedupRoute *route,
+                                       MDCallback cb, void *arg, MDHandle *handle);
+
+// Send a request to node_id without waiting for the response
+static int md_submit(int node_id, DNCommand cmd, void *payload, size_t payload_size, uint32_t *req_id)
+{
+    NodeConnection *conn = &md->connections[node_id];
+
+    md_async_quiesce();
+
+    *req_id = conn->next_req_id++;
+    if (md_send_command(conn->sock_fd, *req_id, cmd, payload, payload_size) != 0)
+        return -1;
+
+    conn->inflight++;
+    return 0;
+}
+
+// Submit iov as one request and wait for the response header, there must be
+// nothing else in flight on node_id. The payload is left on the socket
+static int md_callv(int node_id, DNCommand cmd, const struct iovec *iov, int iovcnt, DNResponseHeader *header)
+{
+    NodeConnection *conn = &md->connections[node_id];
+
+    md_async_quiesce();
+
+    uint32_t req_id = conn->next_req_id++;
+    if (md_send_commandv(conn->sock_fd, req_id, cmd, iov, iovcnt) != 0)
+        return -1;
+    conn->inflight++;
+
+    if (md_recv_response_header(conn->sock_fd, header) != 0)
+        return -1;
+    conn->inflight--;
+    md_note_response(node_id, header);
+
+    if (header->req_id != req_id) {
+        LOGM_ERROR("Response id=%u does not match request id=%u on node %d", header->req_id, req_id, node_id);
+        recv_discard(conn->sock_fd, header->payload_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Submit a request and wait for its response, there must be nothing else in
+// flight on node_id
+static int md_call(int node_id, DNCommand cmd, void *payload, size_t payload_size,
+                   DNStatus *status, void **response_payload, size_t *response_size)
 {
-	int total_blocks = md->num_blocks;
+    NodeConnection *conn = &md->connections[node_id];
+
+    uint32_t req_id;
+    if (md_submit(node_id, cmd, payload, payload_size, &req_id) != 0)
+        return -1;
+
+    DNResponseHeader header;
+    if (md_recv_response_header(conn->sock_fd, &header) != 0)
+        return -1;
+    conn->inflight--;
+    md_note_response(node_id, &header);
+
+    *status = header.status;
+    *response_size = header.payload_size;
+    *response_payload = NULL;
+    if (header.payload_size > 0) {
+        *response_payload = malloc(header.payload_size);
+        if (!*response_payload ||
+            recv_all(conn->sock_fd, *response_payload, header.payload_size) != (ssize_t)header.payload_size) {
+            free(*response_payload);
+            *response_payload = NULL;
+            return -1;
+        }
+    }
 
-	int base = total_blocks / md->num_nodes;
-    int rem  = total_blocks % md->num_nodes;
+    if (header.req_id != req_id) {
+        LOGM_ERROR("Response id=%u does not match request id=%u on node %d", header.req_id, req_id, node_id);
+        free(*response_payload);
+        *response_payload = NULL;
+        return -1;
+    }
+
+    return 0;
+}
 
+MDNStatus initialize_datanodes()
+{
     LOGM("Initializing %d data nodes", md->num_nodes);
+
+    // every datanode and this process busy-wait on their rings
+    if (md->opts.transport == MD_TRANSPORT_SHM)
+        shm_spin_for(md->num_nodes + 1);
+
     for (int i = 0; i < md->num_nodes; i++) {
-		int blocks_for_node = base + (i < rem ? 1 : 0);
-		md->blocks_per_node[i] = blocks_for_node;
-        md->blocks_free[i] = blocks_for_node;
+        // every class is spread over all the nodes
+        for (int k = 0; k < md->num_classes; k++) {
+            MDBlockClass *c = &md->classes[k];
+            int base = c->num_blocks / md->num_nodes;
+            int rem  = c->num_blocks % md->num_nodes;
+
+            int blocks_for_node = base + (i < rem ? 1 : 0);
+            c->node_capacity[i] = (size_t)blocks_for_node * c->block_size;
+            c->blocks_per_node[i] = blocks_for_node;
+            c->blocks_free[i] = blocks_for_node;
+            c->slots_free[i] = blocks_for_node;
+        }
+
+        if (md->opts.transport == MD_TRANSPORT_TCP) {
+            int fd = comm_tcp_connect(md->opts.addresses[i]);
+            if (fd < 0) {
+                LOGM_ERROR("Could not reach datanode %d at %s", i, md->opts.addresses[i]);
+                return MDN_FAIL;
+            }
+
+            md->connections[i].pid = 0;
+            md->connections[i].sock_fd = fd;
+            md->connections[i].next_req_id = 0;
+            md->connections[i].inflight = 0;
+            md->connections[i].shm = NULL;
+            continue;
+        }
 
         int fds[2];
         if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
@@ -23,18 +192,34 @@ MDNStatus initialize_datanodes()
             return MDN_FAIL;
         }
 
+        // the rings have to exist before fork so both sides share them
+        ShmChannel *shm = NULL;
+        if (md->opts.transport == MD_TRANSPORT_SHM) {
+            shm = shm_channel_create();
+            if (!shm) {
+                close(fds[0]);
+                close(fds[1]);
+                return MDN_FAIL;
+            }
+        }
+
         pid_t pid = fork();
         if (pid < 0) {
             perror("fork failed");
+            shm_channel_destroy(shm);
             return MDN_FAIL;
         }
 
         if (pid == 0) {
             // child
             close(fds[0]);
+            comm_detach(fds[0]);
             
             metadatanode_end();
             
+            if (shm)
+                comm_attach_shm(fds[1], &shm->responses, &shm->requests);
+
             datanode_service_loop(fds[1]);
             exit(0);
         } else {
@@ -42,12 +227,172 @@ MDNStatus initialize_datanodes()
             close(fds[1]);
             md->connections[i].pid = pid;
             md->connections[i].sock_fd = fds[0];
+            md->connections[i].next_req_id = 0;
+            md->connections[i].inflight = 0;
+            md->connections[i].shm = shm;
+
+            if (shm) {
+                shm_channel_bind(shm, getpid(), pid);
+                comm_attach_shm(fds[0], &shm->requests, &shm->responses);
+            }
         }
     }
 
     return MDN_SUCCESS;
 }
 
+// Bytes of block data node of class c may store
+static size_t md_node_capacity(MDBlockClass *c, int node)
+{
+    return c->node_capacity[node];
+}
+
+// Room in block_mapping, block_crc and the dedup index for ids up to ids - 1
+static int md_grow_block_ids(size_t ids)
+{
+    if (ids <= md->num_block_ids)
+        return 0;
+    if (ids < 2 * md->num_block_ids)
+        ids = 2 * md->num_block_ids;
+
+    int *mapping = realloc(md->block_mapping, sizeof(int) * ids);
+    if (!mapping)
+        return -1;
+    md->block_mapping = mapping;
+
+    uint32_t *crcs = realloc(md->block_crc, sizeof(uint32_t) * ids);
+    if (!crcs)
+        return -1;
+    md->block_crc = crcs;
+
+    if (md->opts.dedup && dedup_grow(&md->dedup, (int)ids) != 0)
+        return -1;
+
+    md->num_block_ids = ids;
+    return 0;
+}
+
+// Add slots of class c on node, with compress once the node has room for
+// more blocks than it has slots free
+static int md_grow_class(MDBlockClass *c, int node, int slots)
+{
+    size_t num_blocks = c->num_blocks + slots;
+    if (num_blocks > c->bitmap_bits) {
+        size_t bits_per_word = sizeof(size_t) * CHAR_BIT;
+        size_t bits = 2 * c->bitmap_bits > num_blocks ? 2 * c->bitmap_bits : num_blocks;
+        size_t nwords = (bits + bits_per_word - 1) / bits_per_word;
+        bitmap_t *bitmap = realloc(c->bitmap, sizeof(bitmap_t) * nwords);
+        if (!bitmap)
+            return -1;
+        c->bitmap = bitmap;
+        c->bitmap_bits = nwords * bits_per_word;
+    }
+
+    if (md_grow_block_ids(num_blocks * md->num_classes) != 0)
+        return -1;
+
+    bitmap_grow(c->bitmap, c->num_blocks, num_blocks);
+    c->num_blocks = num_blocks;
+    c->free_blocks += slots;
+    md->num_blocks += slots;
+    md->free_blocks += slots;
+    c->blocks_per_node[node] += slots;
+    c->slots_free[node] += slots;
+    return 0;
+}
+
+// With compress, count the blocks of every class node still has room for
+// from the bytes it last reported storing. Reserved blocks it has not stored
+// yet may come uncompressed and are counted whole. Blocks that came in
+// smaller leave room for more, the class gets slots for them
+static void md_count_room(int node)
+{
+    NodeConnection *conn = &md->connections[node];
+
+    for (int k = 0; k < md->num_classes; k++) {
+        MDBlockClass *c = &md->classes[k];
+        long reserved = c->blocks_per_node[node] - c->slots_free[node];
+        long unstored = reserved > conn->stored_blocks[k] ? reserved - conn->stored_blocks[k] : 0;
+        size_t committed = conn->stored_bytes[k] + (size_t)unstored * c->block_size;
+        size_t capacity = md_node_capacity(c, node);
+
+        size_t room = committed < capacity ? (capacity - committed) / c->block_size : 0;
+        if (room > (size_t)c->slots_free[node] &&
+            md_grow_class(c, node, (int)(room - c->slots_free[node])) != 0)
+            LOGM_WARN("Could not add slots for %zu byte blocks on datanode %d", c->block_size, node);
+        c->blocks_free[node] = room < (size_t)c->slots_free[node] ? (int)room : c->slots_free[node];
+    }
+}
+
+// Every response brings the node's storage, frees and compressed writes
+// give room back this way
+static void md_note_response(int node_id, const DNResponseHeader *header)
+{
+    NodeConnection *conn = &md->connections[node_id];
+    for (int k = 0; k < md->num_classes; k++) {
+        conn->stored_bytes[k] = header->stored_bytes[k];
+        conn->stored_blocks[k] = header->stored_blocks[k];
+    }
+    if (md->opts.compress)
+        md_count_room(node_id);
+}
+
+static int md_class_has_room(MDBlockClass *c)
+{
+    for (int i = 0; i < md->num_nodes; i++)
+        if (c->blocks_free[i] > 0)
+            return 1;
+    return 0;
+}
+
+// Blocks a recovered datanode still holds stay out of new allocations
+static void md_adopt_blocks(int node_id)
+{
+    int *blocks;
+    int count;
+    if (metadatanode_list_blocks(node_id, &blocks, &count) != MDN_SUCCESS) {
+        LOGM_ERROR("Could not list the blocks of datanode %d", node_id);
+        return;
+    }
+
+    int adopted = 0;
+    for (int i = 0; i < count; i++) {
+        int blk = blocks[i];
+        MDBlockClass *c = blk >= 0 ? md_block_class(blk) : NULL;
+        uint32_t slot = blk >= 0 ? md_block_slot(blk) : 0;
+
+        // slots added for compressed blocks are added again
+        if (c && slot >= c->num_blocks && md->opts.compress &&
+            md_grow_class(c, node_id, (int)(slot + 1 - c->num_blocks)) != 0)
+            c = NULL;
+
+        if (!c || slot >= c->num_blocks || bitmap_isset(c->bitmap, c->num_blocks, slot)) {
+            LOGM_WARN("Datanode %d holds block %d outside its class, left alone", node_id, blk);
+            continue;
+        }
+
+        bitmap_set(c->bitmap, c->num_blocks, slot, true);
+        c->free_blocks--;
+        md->free_blocks--;
+        c->blocks_free[node_id]--;
+        c->slots_free[node_id]--;
+        md->block_mapping[blk] = node_id;
+        md->block_crc[blk] = c->zero_crc;
+        if (md->opts.dedup) {
+            dedup_ref(&md->dedup, blk, c->block_size);
+            md->dedup.entries[blk].stored = 1;
+        }
+        adopted++;
+    }
+    free(blocks);
+
+    // they take what they were stored in
+    if (md->opts.compress)
+        md_count_room(node_id);
+
+    LOGM("Datanode %d recovered %d blocks", node_id, adopted);
+}
+
 MDNStatus connect_datanodes()
 {
     LOGM("===================================================================");
@@ -56,21 +401,37 @@ MDNStatus connect_datanodes()
     for (int i = 0; i < md->num_nodes; i++) {
         DNInitPayload payload = {0};
         payload.node_id = i;
-        payload.capacity= md->blocks_per_node[i] * BLOCK_SIZE;
-        
-        if (md_send_command(md->connections[i].sock_fd, DN_INIT, &payload, sizeof(payload)) != 0) {
-            perror("Failed to send DN_INIT");
-            return MDN_FAIL;
+        payload.num_classes = md->num_classes;
+        for (int k = 0; k < md->num_classes; k++) {
+            MDBlockClass *c = &md->classes[k];
+            payload.classes[k].block_size = c->block_size;
+            payload.classes[k].capacity = md_node_capacity(c, i);
+            payload.classes[k].slots = c->blocks_per_node[i];
         }
+        payload.engine = md->opts.engine;
+        payload.workers = md->opts.workers;
+        payload.mmap_reads = md->opts.mmap_reads;
+        payload.direct_io = md->opts.direct_io;
+        payload.fd_cache = md->opts.fd_cache;
+        payload.block_cache = md->opts.block_cache;
+        payload.durability = md->opts.durability;
+        payload.group_commit_us = md->opts.group_commit_us;
+        payload.group_commit_batch = md->opts.group_commit_batch;
+        payload.recover = md->opts.recover;
+        payload.compress = md->opts.compress;
+        payload.log_level = md->opts.log_level;
+        if (md->opts.store)
+            snprintf(payload.store, sizeof(payload.store), "%s", md->opts.store);
         
         DNStatus status;
         void *response_payload = NULL;
         size_t response_size = 0;
 
-        if (md_recv_response(md->connections[i].sock_fd, &status, &response_payload, &response_size) != 0) {
-            perror("Failed to receive DN_INIT response");
+        if (md_call(i, DN_INIT, &payload, sizeof(payload), &status, &response_payload, &response_size) != 0) {
+            perror("Failed DN_INIT");
             return MDN_FAIL;
         }
+        free(response_payload);
 
         if (status != DN_SUCCESS) {
             fprintf(stderr, "Datanode %i failed to initialize.\n", i);
@@ -78,6 +439,9 @@ MDNStatus connect_datanodes()
         }
 
         LOGM("Datanode %d connected", i);
+
+        if (md->opts.recover)
+            md_adopt_blocks(i);
     }
 
     LOGM("===================================================================\n");
@@ -85,45 +449,839 @@ MDNStatus connect_datanodes()
     return MDN_SUCCESS;
 }
 
+// Pick a free block of ctx.block_class and its datanode, metadata only
+static MDNStatus md_reserve_block(AllocContext ctx, int * block_index, int * node_id)
+{
+    MDBlockClass *c = &md->classes[ctx.block_class];
+
+    uint32_t slot;
+    if (bitmap_alloc(c->bitmap, c->num_blocks, &slot) != 0) {
+        LOGM_ERROR("Bitmap allocation failed (no free %zu byte blocks)", c->block_size);
+        return MDN_NO_SPACE;
+    }
+
+    c->free_blocks--;
+    md->free_blocks--;
+
+    // with compress a free slot is no promise of room, the nodes' last
+    // responses tell how much is left
+    if (md->opts.compress && !md_class_has_room(c)) {
+        bitmap_free(c->bitmap, c->num_blocks, slot);
+        c->free_blocks++;
+        md->free_blocks++;
+        LOGM_ERROR("No datanode has room for another %zu byte block", c->block_size);
+        return MDN_NO_SPACE;
+    }
+
+    int data_idx;
+    if (policy->allocate_block(ctx, &data_idx) != 0) {
+        bitmap_free(c->bitmap, c->num_blocks, slot);
+        c->free_blocks++;
+        md->free_blocks++;
+        LOGM_ERROR("Policy failed to allocate block");
+        return MDN_FAIL;
+    }
+
+    int blk = (int)slot * md->num_classes + ctx.block_class;
+    *block_index = blk;
+    *node_id = data_idx;
+
+	c->blocks_free[data_idx]--;
+    c->slots_free[data_idx]--;
+    md->block_mapping[blk] = *node_id;
+    md->block_crc[blk] = c->zero_crc;
+    if (md->opts.dedup)
+        dedup_ref(&md->dedup, blk, c->block_size);
+
+    return MDN_SUCCESS;
+}
+
+static void md_release_block(int block_index)
+{
+    int node_id = md->block_mapping[block_index];
+    MDBlockClass *c = md_block_class(block_index);
+
+    bitmap_free(c->bitmap, c->num_blocks, md_block_slot(block_index));
+    c->free_blocks++;
+    md->free_blocks++;
+    // what a compressed block gave back is only known once the node reports
+    if (!md->opts.compress)
+        c->blocks_free[node_id]++;
+    c->slots_free[node_id]++;
+    if (md->opts.dedup)
+        dedup_clear(&md->dedup, block_index, c->block_size);
+}
+
+// Check a block that came back from a datanode against the checksum recorded
+// when it was written
+static int md_verify_block(int block_id, const void *data)
+{
+    if (crc32c(0, data, md_block_class(block_id)->block_size) == md->block_crc[block_id])
+        return 0;
+
+    LOGM_ERROR("Block %d from node %d fails its checksum", block_id, md->block_mapping[block_id]);
+    return -1;
+}
+
+// Consume the payload of a batch response, read data is received straight
+// into rdata + positions[k] * block_size and verified. A read answered without
+// its data turns *status into DN_FAIL, bad data into DN_CORRUPT, -1 means the
+// stream is unusable
+static int md_recv_blocks(int sock_fd, const DNResponseHeader *header, const int *blocks,
+                          const int *positions, int count, size_t block_size, char *rdata,
+                          DNStatus *status)
+{
+    if (rdata && *status == DN_SUCCESS && header->payload_size == (size_t)count * block_size) {
+        struct iovec iov[DN_MAX_BATCH];
+        for (int k = 0; k < count; k++) {
+            iov[k].iov_base = rdata + (size_t)positions[k] * block_size;
+            iov[k].iov_len = block_size;
+        }
+
+        if (recv_allv(sock_fd, iov, count) != header->payload_size) {
+            *status = DN_FAIL;
+            return -1;
+        }
+
+        // recv_allv moves iov along as it fills it, go back to rdata
+        for (int k = 0; k < count; k++) {
+            if (md_verify_block(blocks[positions[k]], rdata + (size_t)positions[k] * block_size) != 0)
+                *status = DN_CORRUPT;
+        }
+        return 0;
+    }
+
+    if (rdata && *status == DN_SUCCESS)
+        *status = DN_FAIL;
+
+    return recv_discard(sock_fd, header->payload_size) != 0 ? -1 : 0;
+}
+
+// Order the positions of blocks by owning datanode, node's share of order is
+// order[node_start[node]] .. order[node_start[node + 1] - 1]. Positions of
+// block -1 are left out
+static int md_group_by_node(const int *blocks, int nblocks, int *order, int *node_start)
+{
+    int *node_fill = malloc(sizeof(int) * md->num_nodes);
+    if (!node_fill) return -1;
+
+    memset(node_start, 0, sizeof(int) * (md->num_nodes + 1));
+    for (int i = 0; i < nblocks; i++) {
+        if (blocks[i] >= 0)
+            node_start[md->block_mapping[blocks[i]] + 1]++;
+    }
+
+    for (int node = 0; node < md->num_nodes; node++) {
+        node_start[node + 1] += node_start[node];
+        node_fill[node] = node_start[node];
+    }
+
+    for (int i = 0; i < nblocks; i++) {
+        if (blocks[i] >= 0)
+            order[node_fill[md->block_mapping[blocks[i]]]++] = i;
+    }
+
+    free(node_fill);
+    return 0;
+}
+
+// Lay out one batched request for the blocks at positions, all block_size
+// bytes. Block data is sent straight from wdata and only the tail of the last
+// block is padded from a zero block. Checksums of written blocks go in the
+// payload and in crcs[i]. Returns the number of iov entries used, iov[0] is
+// the payload
+static int md_batch_iov(const int *blocks, const int *positions, int count, int write,
+                        const char *wdata, size_t wsize, size_t block_size, uint32_t *crcs,
+                        DNBlockListPayload *payload, struct iovec *iov)
+{
+    int iovcnt = 1;
+
+    payload->count = count;
+    uint32_t *payload_crcs = dn_block_list_crcs(payload);
+
+    for (int k = 0; k < count; k++) {
+        int i = positions[k];
+        payload->block_indices[k] = blocks[i];
+
+        if (write) {
+            size_t offset = (size_t)i * block_size;
+            size_t to_copy = offset < wsize ? wsize - offset : 0;
+            if (to_copy > block_size) to_copy = block_size;
+
+            if (to_copy > 0) {
+                iov[iovcnt].iov_base = (char *)wdata + offset;
+                iov[iovcnt].iov_len = to_copy;
+                iovcnt++;
+            }
+            if (to_copy < block_size && iovcnt < DN_MAX_IOV) {
+                iov[iovcnt].iov_base = (char *)md_zero_block;
+                iov[iovcnt].iov_len = block_size - to_copy;
+                iovcnt++;
+            }
+
+            uint32_t crc = crc32c(0, wdata + offset, to_copy);
+            crcs[i] = payload_crcs[k] = crc32c(crc, md_zero_block, block_size - to_copy);
+        }
+    }
+
+    iov[0].iov_base = payload;
+    iov[0].iov_len = sizeof(DNBlockListPayload) + (size_t)count * (write ? sizeof(int) + DN_CRC_SIZE : sizeof(int));
+
+    return iovcnt;
+}
+
+static void md_batch_done(MDHandle handle, MDNStatus status, void *arg)
+{
+    (void)handle;
+    *(MDNStatus *)arg = status;
+}
+
+// Dispatch blocks to their owning datanodes all at once, one batched cmd per
+// node (split in DN_MAX_BATCH chunks), and gather the responses in whatever
+// order the nodes answer. Blocks of -1 are skipped, the others are all of one
+// class, for DN_WRITE_BLOCKS
+// the data of blocks[i] is taken from wdata + i * its block size (zero padded
+// past wsize), for DN_READ_BLOCKS it lands in rdata + i * its block size
+static MDNStatus md_batch_blocks(const int *blocks, int nblocks, DNCommand cmd,
+                                 const char *wdata, size_t wsize, char *rdata)
+{
+    if (nblocks <= 0) return MDN_SUCCESS;
+
+    md_async_quiesce();
+
+    MDNStatus result = MDN_FAIL;
+    MDHandle handle;
+    if (md_async_submit(blocks, nblocks, cmd, wdata, wsize, rdata, md_batch_done, &result, &handle) != MDN_SUCCESS)
+        return MDN_FAIL;
+
+    // ours is the only request outstanding, a failed drain completes it too
+    metadatanode_drain();
+
+    return result;
+}
+
+// Reserve blocks [from, to) of file, datanodes create their storage on the
+// first write. On failure nothing stays allocated
+static MDNStatus md_alloc_file_blocks(FileEntry *file, int from, int to, AllocContext ctx)
+{
+    for (int i = from; i < to; i++) {
+        int blk, node;
+        MDNStatus status = md_reserve_block(ctx, &blk, &node);
+        if (status != MDN_SUCCESS) {
+            LOGM_ERROR("Failed to allocate block %d for file '%s'", i, file->filename);
+            for (int j = from; j < i; j++) {
+                md_release_block(file->blocks[j]);
+            }
+            return status == MDN_NO_SPACE ? MDN_NO_SPACE : MDN_FAIL;
+        }
+
+        file->blocks[i] = blk;
+        LOGM_DEBUG("Allocated block %d (global id=%d) on node %d for file '%s'", i, blk, node, file->filename);
+    }
+
+    return MDN_SUCCESS;
+}
+
+// Extend file to num_blocks blocks, nothing happens if it is that long already
+static MDNStatus md_grow_file(FileEntry *file, size_t num_blocks, AllocContext ctx)
+{
+    if (num_blocks <= (size_t)file->num_blocks)
+        return MDN_SUCCESS;
+
+    int *new_blocks = realloc(file->blocks, sizeof(int) * num_blocks);
+    if (!new_blocks) return MDN_FAIL;
+    file->blocks = new_blocks;
+
+    MDNStatus status = md_alloc_file_blocks(file, file->num_blocks, num_blocks, ctx);
+    if (status != MDN_SUCCESS)
+        return status;
+
+    file->num_blocks = num_blocks;
+    return MDN_SUCCESS;
+}
+
+static void md_dedup_freed(MDHandle handle, MDNStatus status, void *arg)
+{
+    (void)handle;
+    (void)arg;
+    if (status != MDN_SUCCESS)
+        LOGM_ERROR("Datanodes failed to free blocks no file references anymore");
+}
+
+// Give back blocks whose last reference went, datanodes drop the ones they
+// stored in the background
+static void md_dedup_drop(int *blocks, int count)
+{
+    int stored = 0;
+    for (int k = 0; k < count; k++) {
+        if (md->dedup.entries[blocks[k]].stored) {
+            int blk = blocks[k];
+            blocks[k] = blocks[stored];
+            blocks[stored++] = blk;
+        }
+    }
+
+    MDHandle handle;
+    if (stored > 0 && md_async_submit(blocks, stored, DN_FREE_BLOCKS, NULL, 0, NULL,
+                                      md_dedup_freed, NULL, &handle) != MDN_SUCCESS)
+        LOGM_ERROR("Could not free %d unreferenced blocks", stored);
+
+    for (int k = 0; k < count; k++) {
+        LOGM_DEBUG("Deallocating block: blk=%d node=%d", blocks[k], md->block_mapping[blocks[k]]);
+        md_release_block(blocks[k]);
+    }
+}
+
+// What md_dedup_route changed, kept until the write it routed is answered
+// so a failed write can be taken back
+struct MDDedupRoute {
+    int fid;
+    int *moved;             // positions repointed
+    int *moved_from;        // the block each had before
+    int *moved_to;          // and the one it got
+    int nmoved;
+    int *dropped;           // blocks left without references
+    int ndropped;
+    // what the routing added to the counters
+    uint64_t writes;
+    uint64_t writes_saved;
+    size_t bytes_saved;
+};
+
+static void md_dedup_route_free(MDDedupRoute *route)
+{
+    free(route->moved);
+    free(route->moved_from);
+    free(route->moved_to);
+    free(route->dropped);
+    free(route);
+}
+
+// Finish a routed write. One that failed puts every position still on the
+// block it was routed to back on its old one, latest first so a fresh block
+// is left by the positions that found it before its own goes. Blocks left
+// without references are then given back
+static void md_dedup_settle(MDDedupRoute *route, MDNStatus status)
+{
+    DedupIndex *d = &md->dedup;
+    FileEntry *file = &md->files[route->fid];
+    size_t block_size = md_file_block_size(file);
+
+    if (status != MDN_SUCCESS) {
+        for (int j = route->nmoved - 1; j >= 0; j--) {
+            int i = route->moved[j];
+            int blk = route->moved_to[j];
+            // a later write moved it on already
+            if (i >= file->num_blocks || file->blocks[i] != blk)
+                continue;
+
+            dedup_ref(d, route->moved_from[j], block_size);
+            file->blocks[i] = route->moved_from[j];
+            if (dedup_unref(d, blk, block_size) == 0)
+                md_release_block(blk);
+        }
+
+        d->writes -= route->writes;
+        d->writes_saved -= route->writes_saved;
+        d->bytes_saved -= route->bytes_saved;
+    }
+
+    // blocks referenced again stay
+    int kept = 0;
+    for (int j = 0; j < route->ndropped; j++) {
+        if (d->entries[route->dropped[j]].refs == 0)
+            route->dropped[kept++] = route->dropped[j];
+    }
+    md_dedup_drop(route->dropped, kept);
+
+    md_dedup_route_free(route);
+}
+
+// Decide where each of blocks [from, from + count) of file goes before wdata
+// (laid out as for md_batch_blocks) overwrites them. A position whose new
+// content is stored already references that block and needs no write, and
+// one sharing its block with others leaves it to them for a fresh block.
+// targets[k] is the block to send position from + k to, -1 for none. The
+// changes are recorded in *route for md_dedup_settle once the write is
+// answered. On failure no position has moved
+static MDNStatus md_dedup_route(FileEntry *file, int from, int count,
+                                const char *wdata, size_t wsize, int *targets,
+                                MDDedupRoute **route)
+{
+    DedupIndex *d = &md->dedup;
+    MDBlockClass *c = &md->classes[file->block_class];
+    size_t block_size = c->block_size;
+
+    MDDedupRoute *r = calloc(1, sizeof(MDDedupRoute));
+    if (!r) return MDN_FAIL;
+    r->fid = (int)(file - md->files);
+    r->moved = malloc(sizeof(int) * (count > 0 ? count : 1));
+    r->moved_from = malloc(sizeof(int) * (count > 0 ? count : 1));
+    r->moved_to = malloc(sizeof(int) * (count > 0 ? count : 1));
+    r->dropped = malloc(sizeof(int) * (count > 0 ? count : 1));
+    char *padded = NULL;
+    if (!r->moved || !r->moved_from || !r->moved_to || !r->dropped) {
+        md_dedup_route_free(r);
+        return MDN_FAIL;
+    }
+
+    MDNStatus status = MDN_SUCCESS;
+    int k;
+    for (k = 0; k < count; k++) {
+        int i = from + k;
+        size_t offset = (size_t)k * block_size;
+        size_t to_copy = offset < wsize ? wsize - offset : 0;
+        if (to_copy > block_size) to_copy = block_size;
+
+        const char *data = wdata + offset;
+        if (to_copy < block_size) {
+            if (!padded && !(padded = malloc(block_size))) {
+                status = MDN_FAIL;
+                break;
+            }
+            if (to_copy > 0)
+                memcpy(padded, data, to_copy);
+            memset(padded + to_copy, 0, block_size - to_copy);
+            data = padded;
+        }
+
+        DedupFingerprint fp;
+        dedup_fingerprint(data, block_size, crc32c(0, data, block_size), &fp);
+        d->writes++;
+        r->writes++;
+
+        int cur = file->blocks[i];
+        int found = dedup_lookup(d, &fp);
+        if (found >= 0 && md_block_class(found) != c)
+            found = -1;
+
+        if (found >= 0) {
+            if (found != cur) {
+                dedup_ref(d, found, block_size);
+                file->blocks[i] = found;
+                r->moved[r->nmoved] = i;
+                r->moved_from[r->nmoved] = cur;
+                r->moved_to[r->nmoved++] = found;
+                if (dedup_unref(d, cur, block_size) == 0)
+                    r->dropped[r->ndropped++] = cur;
+            }
+            d->writes_saved++;
+            d->bytes_saved += block_size;
+            r->writes_saved++;
+            r->bytes_saved += block_size;
+            targets[k] = -1;
+            continue;
+        }
+
+        if (d->entries[cur].refs > 1) {
+            AllocContext ctx = {
+                .file_blocks = file->num_blocks,
+                .block_class = file->block_class,
+            };
+            int blk, node;
+            status = md_reserve_block(ctx, &blk, &node);
+            if (status != MDN_SUCCESS)
+                break;
+
+            dedup_unref(d, cur, block_size);
+            file->blocks[i] = blk;
+            r->moved[r->nmoved] = i;
+            r->moved_from[r->nmoved] = cur;
+            r->moved_to[r->nmoved++] = blk;
+            cur = blk;
+        }
+
+        dedup_insert(d, cur, &fp);
+        d->entries[cur].stored = 1;
+        targets[k] = cur;
+    }
+    free(padded);
+
+    // the blocks routed so far will not be written after all
+    if (status != MDN_SUCCESS) {
+        for (int j = 0; j < k; j++) {
+            if (targets[j] >= 0)
+                dedup_forget(d, targets[j]);
+        }
+        md_dedup_settle(r, status);
+        return status;
+    }
+
+    *route = r;
+    return MDN_SUCCESS;
+}
+
+// Write wdata over blocks [from, from + count) of file, laid out as for
+// md_batch_blocks. With dedup only blocks of new content are sent
+static MDNStatus md_write_file_blocks_async(FileEntry *file, int from, int count,
+                                            const char *wdata, size_t wsize,
+                                            MDCallback cb, void *arg, MDHandle *handle)
+{
+    if (!md->opts.dedup)
+        return md_async_submit(file->blocks + from, count, DN_WRITE_BLOCKS, wdata, wsize, NULL, cb, arg, handle);
+
+    int *targets = malloc(sizeof(int) * (count > 0 ? count : 1));
+    if (!targets) return MDN_FAIL;
+
+    MDDedupRoute *route;
+    MDNStatus status = md_dedup_route(file, from, count, wdata, wsize, targets, &route);
+    if (status == MDN_SUCCESS) {
+        status = md_async_submit_route(targets, count, DN_WRITE_BLOCKS, wdata, wsize, NULL, route, cb, arg, handle);
+        if (status != MDN_SUCCESS)
+            md_dedup_settle(route, status);
+    }
+
+    free(targets);
+    return status;
+}
+
+static MDNStatus md_write_file_blocks(FileEntry *file, int from, int count,
+                                      const char *wdata, size_t wsize)
+{
+    md_async_quiesce();
+
+    MDNStatus result = MDN_FAIL;
+    MDHandle handle;
+    MDNStatus status = md_write_file_blocks_async(file, from, count, wdata, wsize, md_batch_done, &result, &handle);
+    if (status != MDN_SUCCESS)
+        return status;
+
+    metadatanode_drain();
+
+    return result;
+}
+
+// Bytes [offset, offset + length) of one block, only the range travels
+static MDNStatus md_read_range(int block_id, uint32_t offset, uint32_t length, void *buffer)
+{
+    int node_id = md->block_mapping[block_id];
+
+    DNRangePayload payload = { block_id, offset, length, 0 };
+    struct iovec iov = { &payload, sizeof(payload) };
+    DNResponseHeader header;
+
+    if (md_callv(node_id, DN_READ_RANGE, &iov, 1, &header) != 0) {
+        perror("Failed DN_READ_RANGE");
+        return MDN_FAIL;
+    }
+
+    int sock_fd = md->connections[node_id].sock_fd;
+
+    if (header.status != DN_SUCCESS || header.payload_size != sizeof(uint32_t) + length) {
+        LOGM_ERROR("DataNode %d failed to read %u bytes of block %d (status=%d)", node_id, length, block_id, header.status);
+        recv_discard(sock_fd, header.payload_size);
+        return header.status == DN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
+    }
+
+    uint32_t crc;
+    if (recv_all(sock_fd, &crc, sizeof(crc)) != sizeof(crc) ||
+        recv_all(sock_fd, buffer, length) != length) {
+        perror("Failed to receive DN_READ_RANGE data");
+        return MDN_FAIL;
+    }
+
+    // the datanode checked the whole block, this covers the trip here
+    if (crc32c(0, buffer, length) != crc) {
+        LOGM_ERROR("Range of block %d from node %d fails its checksum", block_id, node_id);
+        return MDN_CORRUPT;
+    }
+
+    return MDN_SUCCESS;
+}
+
+// Overwrite bytes [offset, offset + length) of one block, the datanode keeps
+// the rest and answers with the checksum of the whole block
+static MDNStatus md_write_range(int block_id, uint32_t offset, uint32_t length, const void *buffer)
+{
+    int node_id = md->block_mapping[block_id];
+
+    DNRangePayload payload = { block_id, offset, length, crc32c(0, buffer, length) };
+    struct iovec iov[2] = {
+        { &payload, sizeof(payload) },
+        { (void *)buffer, length },
+    };
+    DNResponseHeader header;
+
+    if (md_callv(node_id, DN_WRITE_RANGE, iov, 2, &header) != 0) {
+        perror("Failed DN_WRITE_RANGE");
+        return MDN_FAIL;
+    }
+
+    int sock_fd = md->connections[node_id].sock_fd;
+
+    uint32_t crc;
+    if (header.status != DN_SUCCESS || header.payload_size != sizeof(crc)) {
+        LOGM_ERROR("DataNode %d failed to write %u bytes of block %d (status=%d)", node_id, length, block_id, header.status);
+        recv_discard(sock_fd, header.payload_size);
+        return header.status == DN_NO_SPACE ? MDN_NO_SPACE :
+               header.status == DN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
+    }
+
+    if (recv_all(sock_fd, &crc, sizeof(crc)) != sizeof(crc)) {
+        perror("Failed to receive DN_WRITE_RANGE checksum");
+        return MDN_FAIL;
+    }
+
+    md->block_crc[block_id] = crc;
+    return MDN_SUCCESS;
+}
+
+// md_write_range for block index of a file with dedup. A block other
+// positions share is patched in a copy written whole, so they keep theirs
+static MDNStatus md_dedup_write_range(FileEntry *file, int index, uint32_t offset, uint32_t length, const void *buffer)
+{
+    int block_id = file->blocks[index];
+
+    if (md->dedup.entries[block_id].refs <= 1) {
+        MDNStatus status = md_write_range(block_id, offset, length, buffer);
+        dedup_forget(&md->dedup, block_id);
+        if (status == MDN_SUCCESS)
+            md->dedup.entries[block_id].stored = 1;
+        return status;
+    }
+
+    size_t block_size = md_file_block_size(file);
+    char *copy = malloc(block_size);
+    if (!copy) return MDN_FAIL;
+
+    MDNStatus status = md_batch_blocks(&block_id, 1, DN_READ_BLOCKS, NULL, 0, copy);
+    if (status == MDN_SUCCESS) {
+        memcpy(copy + offset, buffer, length);
+        status = md_write_file_blocks(file, index, 1, copy, block_size);
+    }
+
+    free(copy);
+    return status;
+}
+
+// Move bytes [offset, offset + length) of file between it and buffer. Blocks
+// the range covers whole go in batches, the partial ones at either end as
+// ranges
+static MDNStatus md_transfer_range(FileEntry *file, size_t offset, size_t length, char *buffer, int write)
+{
+    if (length == 0)
+        return MDN_SUCCESS;
+
+    size_t block_size = md_file_block_size(file);
+    size_t end = offset + length;
+    int first = offset / block_size;
+    int last = (end - 1) / block_size;
+
+    int edges[2] = { first, last };
+    for (int e = 0; e < (first == last ? 1 : 2); e++) {
+        size_t block_start = (size_t)edges[e] * block_size;
+        size_t lo = offset > block_start ? offset : block_start;
+        size_t hi = end < block_start + block_size ? end : block_start + block_size;
+        if (hi - lo == block_size)
+            continue;
+
+        int block_id = file->blocks[edges[e]];
+        MDNStatus status = !write
+            ? md_read_range(block_id, lo - block_start, hi - lo, buffer + (lo - offset))
+            : md->opts.dedup
+            ? md_dedup_write_range(file, edges[e], lo - block_start, hi - lo, buffer + (lo - offset))
+            : md_write_range(block_id, lo - block_start, hi - lo, buffer + (lo - offset));
+        if (status != MDN_SUCCESS)
+            return status;
+    }
+
+    int whole_from = (offset + block_size - 1) / block_size;
+    int whole_to = end / block_size;
+    if (whole_to <= whole_from)
+        return MDN_SUCCESS;
+
+    char *data = buffer + ((size_t)whole_from * block_size - offset);
+    size_t size = (size_t)(whole_to - whole_from) * block_size;
+    if (write)
+        return md_write_file_blocks(file, whole_from, whole_to - whole_from, data, size);
+    return md_batch_blocks(file->blocks + whole_from, whole_to - whole_from, DN_READ_BLOCKS, NULL, 0, data);
+}
+
+// Free blocks [from, to) of file with one batch per node
+static MDNStatus md_free_file_blocks(FileEntry *file, int from, int to)
+{
+    // with dedup only the blocks no other position references go
+    if (md->opts.dedup) {
+        int *dropped = malloc(sizeof(int) * (to > from ? to - from : 1));
+        if (!dropped) return MDN_FAIL;
+
+        int ndropped = 0;
+        for (int i = from; i < to; i++) {
+            MDBlockClass *c = md_block_class(file->blocks[i]);
+            if (dedup_unref(&md->dedup, file->blocks[i], c->block_size) == 0)
+                dropped[ndropped++] = file->blocks[i];
+        }
+        md_dedup_drop(dropped, ndropped);
+
+        free(dropped);
+        return MDN_SUCCESS;
+    }
+
+    MDNStatus status = md_batch_blocks(file->blocks + from, to - from, DN_FREE_BLOCKS, NULL, 0, NULL);
+
+    for (int i = from; i < to; i++) {
+        LOGM_DEBUG("Deallocating block: blk=%d node=%d", file->blocks[i], md->block_mapping[file->blocks[i]]);
+        md_release_block(file->blocks[i]);
+    }
+
+    return status;
+}
+
 MDNStatus metadatanode_init(int num_dns, size_t capacity, const char *policy_name)
-{   
+{
+    return metadatanode_init_opts(num_dns, capacity, policy_name, NULL);
+}
+
+static const char *md_transport_name(MDTransport transport)
+{
+    switch (transport) {
+        case MD_TRANSPORT_SOCKET: return "socket";
+        case MD_TRANSPORT_SHM: return "shm";
+        case MD_TRANSPORT_TCP: return "tcp";
+        default: return "unknown";
+    }
+}
+
+MDNStatus metadatanode_init_opts(int num_dns, size_t capacity, const char *policy_name, const MDOptions *opts)
+{
+    MDOptions options = {0};
+    if (opts) options = *opts;
+
+    if (options.log_level > 0)
+        log_set_level(options.log_level);
+
+    // without classes the whole cluster is a single one of block_size
+    int num_classes = 0;
+    while (num_classes < MD_MAX_BLOCK_CLASSES && options.block_classes[num_classes] != 0)
+        num_classes++;
+    if (num_classes == 0) {
+        options.block_classes[0] = options.block_size ? options.block_size : BLOCK_SIZE_DEFAULT;
+        options.block_class_shares[0] = 0;
+        num_classes = 1;
+    }
+
+    int total_shares = 0;
+    for (int c = 0; c < num_classes; c++) {
+        size_t size = options.block_classes[c];
+        if (!block_size_valid(size)) {
+            LOGM_ERROR("Block size %zu is not a power of two between %d and %d bytes",
+                 size, BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+            return MDN_FAIL;
+        }
+        if (c > 0 && size <= options.block_classes[c - 1]) {
+            LOGM_ERROR("Block classes must grow, %zu follows %zu", size, options.block_classes[c - 1]);
+            return MDN_FAIL;
+        }
+        if (options.block_class_shares[c] < 0) {
+            LOGM_ERROR("Block class %zu has a negative share of the capacity", size);
+            return MDN_FAIL;
+        }
+        total_shares += options.block_class_shares[c];
+    }
+    if (total_shares == 0) {
+        for (int c = 0; c < num_classes; c++)
+            options.block_class_shares[c] = 1;
+        total_shares = num_classes;
+    }
+
+    options.block_size = options.block_classes[0];
+    block_size = options.block_size;
+
+    size_t class_blocks[MD_MAX_BLOCK_CLASSES];
+    size_t total_blocks = 0;
+    for (int c = 0; c < num_classes; c++) {
+        size_t bytes = capacity * options.block_class_shares[c] / total_shares;
+        class_blocks[c] = (bytes + options.block_classes[c] - 1) / options.block_classes[c];
+        total_blocks += class_blocks[c];
+    }
+
     LOGM("===================================================================");
     LOGM("=== Initializing MetadataNode ===");
     LOGM("Configuration:");
     LOGM("  - Data nodes: %d", num_dns);
     LOGM("  - Total capacity: %zu bytes", capacity);
-    LOGM("  - Block size: %d bytes", BLOCK_SIZE);
-    LOGM("  - Total blocks: %zu", (capacity + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for (int c = 0; c < num_classes; c++)
+        LOGM("  - Block size: %zu bytes (%zu blocks)", options.block_classes[c], class_blocks[c]);
+    LOGM("  - Total blocks: %zu", total_blocks);
     LOGM("  - Allocation policy: %s", policy_name);
+    LOGM("  - Transport: %s", md_transport_name(options.transport));
+    LOGM("  - Datanode engine: %s", options.engine == DN_ENGINE_URING ? "io_uring" :
+                                    options.engine == DN_ENGINE_THREADS ? "threads" : "sync");
+    LOGM("  - Durability: %s", options.durability == DN_DURABILITY_SYNC ? "fdatasync" :
+                               options.durability == DN_DURABILITY_GROUP ? "group commit" : "none");
+    LOGM("  - Deduplication: %s", options.dedup ? "on" : "off");
+    LOGM("  - Compression: %s", options.compress ? "on" : "off");
+
+    if (options.transport == MD_TRANSPORT_TCP &&
+        (!options.addresses || options.num_addresses != num_dns)) {
+        LOGM_ERROR("TCP transport needs one address per datanode, %d, got %d",
+                   num_dns, options.addresses ? options.num_addresses : 0);
+        return MDN_FAIL;
+    }
 
     md = malloc(sizeof(MetadataNode));
 
+    md->opts = options;
+
     md->fs_capacity = capacity;
-    md->num_blocks = (capacity + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    md->num_blocks = total_blocks;
 	md->free_blocks = md->num_blocks;
 
+    md->num_classes = num_classes;
+    md->classes = calloc(num_classes, sizeof(MDBlockClass));
+    if (!md->classes) return MDN_FAIL;
+
+    // the classes take ids in turn, the largest class sets how many there are
     size_t bits_per_word = sizeof(size_t) * CHAR_BIT;
-    uint32_t nwords = (md->num_blocks + bits_per_word - 1) / bits_per_word;
-    md->bitmap = malloc(sizeof(bitmap_t) * nwords);
-    bitmap_init(md->bitmap, md->num_blocks);
+    md->num_block_ids = 0;
+    for (int c = 0; c < num_classes; c++) {
+        MDBlockClass *bc = &md->classes[c];
+        bc->block_size = options.block_classes[c];
+        bc->num_blocks = class_blocks[c];
+        bc->free_blocks = bc->num_blocks;
+        bc->zero_crc = crc32c(0, md_zero_block, bc->block_size);
+
+        uint32_t nwords = (bc->num_blocks + bits_per_word - 1) / bits_per_word;
+        bc->bitmap = malloc(sizeof(bitmap_t) * (nwords > 0 ? nwords : 1));
+        bc->bitmap_bits = (size_t)nwords * bits_per_word;
+        bc->node_capacity = calloc(num_dns, sizeof(size_t));
+        bc->blocks_per_node = calloc(num_dns, sizeof(int));
+        bc->blocks_free = calloc(num_dns, sizeof(int));
+        bc->slots_free = calloc(num_dns, sizeof(int));
+        if (!bc->bitmap || !bc->node_capacity || !bc->blocks_per_node || !bc->blocks_free || !bc->slots_free)
+            return MDN_FAIL;
+        bitmap_init(bc->bitmap, bc->num_blocks);
+
+        if (bc->num_blocks * num_classes > md->num_block_ids)
+            md->num_block_ids = bc->num_blocks * num_classes;
+    }
+
+	md->block_mapping = malloc(sizeof(int) * md->num_block_ids);
+    md->block_crc = malloc(sizeof(uint32_t) * md->num_block_ids);
 
-	md->block_mapping = malloc(sizeof(int) * md->num_blocks);
-	
-	md->num_files = 0;
+    memset(&md->dedup, 0, sizeof(md->dedup));
+    if (options.dedup && dedup_init(&md->dedup, md->num_block_ids) != 0)
+        return MDN_FAIL;
+
+    md->num_files = 0;
     md->files = NULL;
 
+    md->next_handle = 1;
+    md->async_requests = 0;
+    md->async_ready = NULL;
+    md->completions = NULL;
+    md->num_completions = 0;
+    md->cap_completions = 0;
+
     md->num_nodes = num_dns;
     md->nodes = malloc(md->num_nodes * sizeof(DataNode));
     if (!md->nodes) return MDN_FAIL;
 
-	md->connections = malloc(md->num_nodes * sizeof(NodeConnection));
+	md->connections = calloc(md->num_nodes, sizeof(NodeConnection));
     if (!md->connections) return MDN_FAIL;
-	
-	md->blocks_per_node = malloc(sizeof(int) * md->num_nodes);
-	md->blocks_free = malloc(sizeof(int) * md->num_nodes);
 
     if (!alloc_policy_init(policy_name)) {
-        LOGM("ERROR: Failed to initialize allocation policy '%s'", policy_name);
+        LOGM_ERROR("Failed to initialize allocation policy '%s'", policy_name);
         return MDN_FAIL;
     }
     LOGM("Allocation policy '%s' initialized", policy_name);
@@ -131,7 +1289,7 @@ MDNStatus metadatanode_init(int num_dns, size_t capacity, const char *policy_nam
     MDNStatus status;
     status = initialize_datanodes();
     if (status != MDN_SUCCESS) {
-        LOGM("Could not initialize datanodes");
+        LOGM_ERROR("Could not initialize datanodes");
         return status;
     }
 
@@ -149,52 +1307,87 @@ MDNStatus metadatanode_exit(int cleanup)
     LOGM("Exiting");
 
     for (int i = 0; i < md->num_nodes; i++) {
+        // remote datanodes outlive us, they only drop this connection
         pid_t pid = md->connections[i].pid;
-        if (pid > 0) {
+        if (pid > 0 || md->opts.transport == MD_TRANSPORT_TCP) {
             DNCommand cmd = DN_EXIT;
 			
 			DNExitPayload payload;
 			payload.cleanup = cleanup;
 
-            if (md_send_command(md->connections[i].sock_fd, cmd, &payload, sizeof(payload)) != 0) {
-                perror("Failed to send DN_EXIT");
-                return MDN_FAIL;
-            }
-
-            DNStatus status;
+            DNStatus status = DN_FAIL;
             void *response_payload = NULL;
             size_t response_size = 0;
             
-            if (md_recv_response(md->connections[i].sock_fd, &status, &response_payload, &response_size) != 0) {
-                perror("Failed to receive DN_EXIT response");
+            if (md_call(i, cmd, &payload, sizeof(payload), &status, &response_payload, &response_size) != 0) {
+                perror("Failed DN_EXIT");
             }
 
-            (void)response_payload;
+            free(response_payload);
             (void)response_size;
 
             if (status == DN_FAIL) {
                 fprintf(stderr, "Datanode %i failed to exit.\n", i);
             }
 
-            int exit;
-            waitpid(pid, &exit, 0);
+            if (pid > 0) {
+                int exit;
+                waitpid(pid, &exit, 0);
+            }
             LOGM("Datanode %d exited", i);
         }
 
+        comm_close_shm(md->connections[i].sock_fd, SHUT_RDWR);
+        comm_detach(md->connections[i].sock_fd);
+        shm_channel_destroy(md->connections[i].shm);
+        md->connections[i].shm = NULL;
+
         close(md->connections[i].sock_fd);
     }
 
     metadatanode_end();
 
     LOGM("===================================================================\n");
+    log_flush();
 
     return MDN_SUCCESS;
 }
 
+// Largest class whose blocks a file_size file fills at least
+// MD_CLASS_MIN_BLOCKS of, or with a hint the largest not above it, the
+// smallest class when none qualifies
+static int md_pick_class(size_t file_size, size_t hint)
+{
+    int picked = 0;
+    for (int c = 1; c < md->num_classes; c++) {
+        size_t size = md->classes[c].block_size;
+        if (hint ? size <= hint : size * MD_CLASS_MIN_BLOCKS <= file_size)
+            picked = c;
+    }
+    return picked;
+}
+
 MDNStatus metadatanode_create_file(const char * filename, size_t file_size, int * fid)
 {
-    LOGM("===================================================================");
-    LOGM("Creating file '%s' with size %zu bytes (%zu blocks needed)", filename, file_size, (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    return metadatanode_create_file_hint(filename, file_size, 0, fid);
+}
+
+MDNStatus metadatanode_create_file_hint(const char * filename, size_t file_size,
+                                        size_t block_size, int * fid)
+{
+    int block_class = md_pick_class(file_size, block_size);
+    size_t class_size = md->classes[block_class].block_size;
+
+    // a file whose class is full makes do with smaller blocks
+    while (block_class > 0 &&
+           (file_size + class_size - 1) / class_size > md->classes[block_class].free_blocks) {
+        block_class--;
+        class_size = md->classes[block_class].block_size;
+    }
+
+    LOGM_DEBUG("===================================================================");
+    LOGM_DEBUG("Creating file '%s' with size %zu bytes (%zu blocks of %zu bytes needed)", filename, file_size,
+         (file_size + class_size - 1) / class_size, class_size);
 
     FileEntry * files = realloc(md->files, sizeof(FileEntry) * (md->num_files + 1));
     if (!files) return MDN_FAIL;
@@ -208,13 +1401,14 @@ MDNStatus metadatanode_create_file(const char * filename, size_t file_size, int
         return MDN_FAIL;
     }
 
-    int blocks_needed = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (blocks_needed > md->free_blocks) {
+    int blocks_needed = (file_size + class_size - 1) / class_size;
+    if (blocks_needed > md->classes[block_class].free_blocks) {
         free(new_file->filename);
         new_file->filename = NULL;
         return MDN_NO_SPACE;
     }
 
+    new_file->block_class = block_class;
     new_file->num_blocks = 0;
     new_file->blocks = malloc(sizeof(int) * blocks_needed);
     if (!new_file->blocks) {
@@ -225,39 +1419,34 @@ MDNStatus metadatanode_create_file(const char * filename, size_t file_size, int
 
 	AllocContext ctx = {
         .file_blocks = blocks_needed,
+        .block_class = block_class,
     };
 
-    for (int i = 0; i < blocks_needed; i++) {
-        int blk, node;
-        if (metadatanode_alloc_block(ctx, &blk, &node) != MDN_SUCCESS) {
-            LOGM("ERROR: Failed to allocate block %d for file '%s'", i, filename);
-            for (int j = 0; j < i; j++) {
-                int prev = new_file->blocks[j];
-                if (metadatanode_dealloc_block(prev) != MDN_SUCCESS) {
-                    fprintf(stderr, "Warning: failed to dealloc block %d\n", prev);
-                    return MDN_FAIL;
-                }
-            }
-            free(new_file->blocks);
-            new_file->blocks = NULL;
-            free(new_file->filename);
-            new_file->filename = NULL;
-            return MDN_NO_SPACE;
-        }
-
-        new_file->blocks[i] = blk;
-		md->block_mapping[blk] = node;
-        new_file->num_blocks++;
-
-        LOGM("Allocated block %d (global id=%d) on node %d for file '%s'", i, blk, node, filename);
+    MDNStatus status = md_alloc_file_blocks(new_file, 0, blocks_needed, ctx);
+    if (status != MDN_SUCCESS) {
+        free(new_file->blocks);
+        new_file->blocks = NULL;
+        free(new_file->filename);
+        new_file->filename = NULL;
+        return status;
     }
+    new_file->num_blocks = blocks_needed;
 
     *fid = new_file->fid;
     md->num_files++;
 
-    LOGM("Successfully created file '%s' with fid=%d, num_blocks=%d", filename, *fid, new_file->num_blocks);
-    LOGM("===================================================================\n");
+    LOGM_DEBUG("Successfully created file '%s' with fid=%d, num_blocks=%d", filename, *fid, new_file->num_blocks);
+    LOGM_DEBUG("===================================================================\n");
+
+    return MDN_SUCCESS;
+}
+
+MDNStatus metadatanode_file_block_size(int fid, size_t * block_size)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
 
+    *block_size = md_file_block_size(&md->files[fid]);
     return MDN_SUCCESS;
 }
 
@@ -281,13 +1470,14 @@ MDNStatus metadatanode_truncate_file(int fid, size_t new_size)
 	}
 
 	FileEntry *file = &md->files[fid];
+	size_t block_size = md_file_block_size(file);
 
-	size_t current_size = file->num_blocks * BLOCK_SIZE;
-	int blocks_new = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t current_size = file->num_blocks * block_size;
+	int blocks_new = (new_size + block_size - 1) / block_size;
 
-	LOGM("===================================================================");
-    LOGM("Truncating file fid=%d (%s) from %zu to %zu bytes", fid, file->filename, current_size, new_size);
-    LOGM("Current blocks: %d, New blocks: %d", file->num_blocks, blocks_new);
+	LOGM_DEBUG("===================================================================");
+    LOGM_DEBUG("Truncating file fid=%d (%s) from %zu to %zu bytes", fid, file->filename, current_size, new_size);
+    LOGM_DEBUG("Current blocks: %d, New blocks: %d", file->num_blocks, blocks_new);
 
 	if (blocks_new > file->num_blocks) {
 		// need to allocate new blocks
@@ -301,37 +1491,22 @@ MDNStatus metadatanode_truncate_file(int fid, size_t new_size)
 
 		AllocContext ctx = {
 			.file_blocks = blocks_new,
+			.block_class = file->block_class,
 		};
 
-		for (int i = 0; i < blocks_needed; i++) {
-			int blk, node;
-			if (metadatanode_alloc_block(ctx, &blk, &node) != MDN_SUCCESS) {
-				// in this case we don't free the file
-				LOGM("ERROR: Failed to allocate block %d for file '%s'", i, file->filename);
-				for (int j = file->num_blocks; j < file->num_blocks + i; j++) {
-                    metadatanode_dealloc_block(file->blocks[j]);
-                }
-				return MDN_NO_SPACE;
-			}
-			
-			int block_idx = file->num_blocks + i;
-			file->blocks[block_idx] = blk;
-			md->block_mapping[blk] = node;
-
-			LOGM("Allocated block %d (global id=%d) on node %d for file '%s'", block_idx, blk, node, file->filename);
+		MDNStatus status = md_alloc_file_blocks(file, file->num_blocks, file->num_blocks + blocks_needed, ctx);
+		if (status != MDN_SUCCESS) {
+			// in this case we don't free the file
+			return status;
 		}
-		
+
 		file->num_blocks = blocks_new;
 	} else if (blocks_new < file->num_blocks) {
 		// free file blocks
-		int blocks_to_remove = file->num_blocks - blocks_new;
-
-		for (int i = file->num_blocks - 1; i >= blocks_new; i--) {
-			int block_id = file->blocks[i];
-			if (metadatanode_dealloc_block(block_id) != MDN_SUCCESS) {
-                fprintf(stderr, "Warning: failed to dealloc block %d\n", block_id);
-                return MDN_FAIL;
-            }
+		if (md_free_file_blocks(file, blocks_new, file->num_blocks) != MDN_SUCCESS) {
+			fprintf(stderr, "Warning: failed to dealloc blocks of file %d\n", fid);
+			file->num_blocks = blocks_new;
+			return MDN_FAIL;
 		}
 
 		file->num_blocks = blocks_new;
@@ -347,28 +1522,28 @@ MDNStatus metadatanode_truncate_file(int fid, size_t new_size)
 			file->blocks = NULL;
 		}
 	} else {
-		LOGM("File size unchanged");
+		LOGM_DEBUG("File size unchanged");
 	}
 
-	LOGM("Truncate complete: file now has %d blocks", file->num_blocks);
-    LOGM("===================================================================\n");
+	LOGM_DEBUG("Truncate complete: file now has %d blocks", file->num_blocks);
+    LOGM_DEBUG("===================================================================\n");
 
 	return MDN_SUCCESS;
 }
 
 MDNStatus metadatanode_read_file(int fid, void ** buffer, size_t * file_size)
 {
-    FileEntry file = md->files[fid];
+    FileEntry *file = &md->files[fid];
 
-    *file_size = file.num_blocks * BLOCK_SIZE;
-    *buffer = malloc(*file_size);
+    *file_size = file->num_blocks * md_file_block_size(file);
+    *buffer = malloc(*file_size > 0 ? *file_size : 1);
+    if (!*buffer) return MDN_FAIL;
 
-    for (int i = 0; i < file.num_blocks; i++) {
-        void *block_ptr = (char *)(*buffer) + i * BLOCK_SIZE;
-        if (metadatanode_read_block(fid, i, block_ptr) != MDN_SUCCESS) {
-            free(*buffer);
-            return MDN_FAIL;
-        }
+    MDNStatus status = md_batch_blocks(file->blocks, file->num_blocks, DN_READ_BLOCKS, NULL, 0, *buffer);
+    if (status != MDN_SUCCESS) {
+        free(*buffer);
+        *buffer = NULL;
+        return status == MDN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
     }
 
     return MDN_SUCCESS;
@@ -377,196 +1552,194 @@ MDNStatus metadatanode_read_file(int fid, void ** buffer, size_t * file_size)
 MDNStatus metadatanode_write_file(int fid, void * buffer, size_t buffer_size)
 {
     FileEntry * file = &md->files[fid];
-    size_t needed_blocks = (buffer_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t block_size = md_file_block_size(file);
+    size_t needed_blocks = (buffer_size + block_size - 1) / block_size;
 
 	AllocContext ctx = {
-		.file_blocks = needed_blocks
+		.file_blocks = needed_blocks,
+		.block_class = file->block_class,
 	};
 
     // allocate more blocks for file
-    if (needed_blocks > file->num_blocks) {
-        // size_t extra_blocks = needed_blocks - file->num_blocks;
-        int *new_blocks = realloc(file->blocks, sizeof(int) * needed_blocks);
-        if (!new_blocks) return MDN_FAIL;
-        file->blocks = new_blocks;
-
-        for (size_t i = file->num_blocks; i < needed_blocks; i++) {
-            int blk, node;
-            if (metadatanode_alloc_block(ctx, &blk, &node) != MDN_SUCCESS)
-                return MDN_NO_SPACE;
-
-            file->blocks[i] = blk;
-			md->block_mapping[blk] = node;
-        }
-
-        file->num_blocks = needed_blocks;
-    }
+    MDNStatus status = md_grow_file(file, needed_blocks, ctx);
+    if (status != MDN_SUCCESS)
+        return status;
 
-    // write file block by block
-    for (size_t i = 0; i < needed_blocks; i++) {
-        char block_buf[BLOCK_SIZE];
-        memset(block_buf, 0, BLOCK_SIZE);
+    // write the blocks covered by buffer, one batch per datanode
+    return md_write_file_blocks(file, 0, needed_blocks, buffer, buffer_size);
+}
 
-        size_t offset = i * BLOCK_SIZE;
-        size_t remaining = buffer_size - offset;
-        size_t to_copy = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+MDNStatus metadatanode_pread(int fid, size_t offset, size_t length, void * buffer)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
 
-        memcpy(block_buf, (char *)buffer + offset, to_copy);
+    FileEntry *file = &md->files[fid];
+    size_t file_size = (size_t)file->num_blocks * md_file_block_size(file);
 
-        if (to_copy < BLOCK_SIZE)
-            block_buf[to_copy] = '\0';
+    LOGM_DEBUG("Reading %zu bytes at %zu from file fid=%d (%s)", length, offset, fid, file->filename);
 
-        if (metadatanode_write_block(fid, i, block_buf) != MDN_SUCCESS)
-            return MDN_FAIL;
+    if (offset > file_size || length > file_size - offset) {
+        LOGM_ERROR("Range [%zu, %zu) is past the end of file fid=%d (%zu bytes)",
+             offset, offset + length, fid, file_size);
+        return MDN_FAIL;
     }
 
-    return MDN_SUCCESS;
+    return md_transfer_range(file, offset, length, buffer, 0);
 }
 
-MDNStatus metadatanode_alloc_block(AllocContext ctx, int * block_index, int * node_id)
+MDNStatus metadatanode_pwrite(int fid, size_t offset, size_t length, const void * buffer)
 {
-    LOGM("===================================================================");
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
 
-    uint32_t blk;
-    if (bitmap_alloc(md->bitmap, md->num_blocks, &blk) != 0) {
-        LOGM("ERROR: Bitmap allocation failed (no free blocks)");
-        return MDN_NO_SPACE;
-    }
+    FileEntry *file = &md->files[fid];
+    size_t block_size = md_file_block_size(file);
 
-    md->free_blocks--;
+    LOGM_DEBUG("Writing %zu bytes at %zu to file fid=%d (%s)", length, offset, fid, file->filename);
 
-    int data_idx;
-    if (policy->allocate_block(ctx, &data_idx) != 0) {
-        bitmap_free(md->bitmap, md->num_blocks, blk);
-        md->free_blocks++;
-        LOGM("ERROR: Policy failed to allocate block");
-        return MDN_FAIL;
+    // the end must not wrap, nor lie past what the file's class could hold
+    if (length > SIZE_MAX - offset) {
+        LOGM_ERROR("Range of %zu bytes at %zu overflows file fid=%d", length, offset, fid);
+        return MDN_INVALID_BLOCK;
     }
 
-    *block_index = (int)blk;
-    *node_id = data_idx;
+    size_t end = offset + length;
+    size_t needed_blocks = end / block_size + (end % block_size != 0);
+    if (needed_blocks > md->classes[file->block_class].num_blocks) {
+        LOGM_ERROR("Range [%zu, %zu) is past what file fid=%d could hold with %zu byte blocks",
+             offset, end, fid, block_size);
+        return MDN_INVALID_BLOCK;
+    }
 
-	md->blocks_free[data_idx]--;
+    AllocContext ctx = {
+        .file_blocks = needed_blocks,
+        .block_class = file->block_class,
+    };
 
-    DNCommand cmd = DN_ALLOC_BLOCK;
-    DNBlockIndexPayload payload = {0};
-    payload.block_index = *block_index;
+    // a write past the end grows the file, the gap reads as zeros
+    MDNStatus status = md_grow_file(file, needed_blocks, ctx);
+    if (status != MDN_SUCCESS)
+        return status;
 
-    if (md_send_command(md->connections[*node_id].sock_fd, cmd, &payload, sizeof(payload)) != 0) {
-        bitmap_free(md->bitmap, md->num_blocks, blk);
-        md->free_blocks++;
-        perror("Failed to send DN_ALLOC");
-        return MDN_FAIL;
-    }
+    return md_transfer_range(file, offset, length, (char *)buffer, 1);
+}
 
-    DNStatus status;
-    void *response_payload = NULL;
-    size_t response_size = 0;
+MDNStatus metadatanode_alloc_block(AllocContext ctx, int * block_index, int * node_id)
+{
+    LOGM_DEBUG("===================================================================");
 
-    if (md_recv_response(md->connections[*node_id].sock_fd, &status, &response_payload, &response_size) != 0) {
-        bitmap_free(md->bitmap, md->num_blocks, blk);
-        md->free_blocks++;
-        perror("Failed to receive DN_ALLOC response");
+    if (ctx.block_class < 0 || ctx.block_class >= md->num_classes)
         return MDN_FAIL;
-    }
 
-    LOGM("Block allocated: global_id=%d, node=%d, free_blocks=%zu", blk, data_idx, md->free_blocks);
+    // a reservation only, the datanode stores the block once it is written
+    MDNStatus reserved = md_reserve_block(ctx, block_index, node_id);
+    if (reserved != MDN_SUCCESS)
+        return reserved;
 
-    LOGM("===================================================================\n");
+    LOGM_DEBUG("Block allocated: global_id=%d, node=%d, free_blocks=%zu", *block_index, *node_id, md->free_blocks);
+
+    LOGM_DEBUG("===================================================================\n");
 
     return MDN_SUCCESS;
 }
 
 MDNStatus metadatanode_dealloc_block(int block_index)
 {
-    LOGM("===================================================================");
-	int node_id = md->block_mapping[block_index];
+    LOGM_DEBUG("===================================================================");
+    if (block_index < 0 || (size_t)block_index >= md->num_block_ids ||
+        md_block_slot(block_index) >= md_block_class(block_index)->num_blocks)
+        return MDN_INVALID_BLOCK;
 
-	LOGM("Deallocating block: blk=%d node=%d", block_index, node_id);
+	int node_id = md->block_mapping[block_index];
 
-    bitmap_free(md->bitmap, md->num_blocks, (uint32_t)block_index);    
-    md->free_blocks++;
+	LOGM_DEBUG("Deallocating block: blk=%d node=%d", block_index, node_id);
 
     DNCommand cmd = DN_FREE_BLOCK;
     DNBlockIndexPayload payload = {0};
     payload.block_index = block_index;
 
-    if (md_send_command(md->connections[node_id].sock_fd, cmd, &payload, sizeof(payload)) != 0) {
-        perror("Failed to send DN_DEALLOC");
-        return MDN_FAIL;
-    }
-
     DNStatus status;
     void *response_payload = NULL;
     size_t response_size = 0;
 
-    if (md_recv_response(md->connections[node_id].sock_fd, &status, &response_payload, &response_size) != 0) {
-        perror("Failed to receive DN_DEALLOC response");
+    if (md_call(node_id, cmd, &payload, sizeof(payload), &status, &response_payload, &response_size) != 0) {
+        perror("Failed DN_DEALLOC");
         return MDN_FAIL;
     }
+    free(response_payload);
 
-	md->blocks_free[node_id]++;
+    // the block stays reserved until the datanode let go of it, or it could
+    // be handed out again while still stored
+    if (status != DN_SUCCESS) {
+        LOGM_ERROR("DataNode %d failed to free block %d (status=%d)", node_id, block_index, status);
+        return status == DN_INVALID_BLOCK ? MDN_INVALID_BLOCK : MDN_FAIL;
+    }
+    md_release_block(block_index);
 
-    LOGM("===================================================================\n");
+    LOGM_DEBUG("===================================================================\n");
 
-    return status;
+    return MDN_SUCCESS;
 }
 
 MDNStatus metadatanode_read_block(int fid, int file_index, void * buffer)
 {
     FileEntry *file = &md->files[fid];
     
-    LOGM("===================================================================");
-    LOGM("Reading block %d from file fid=%d (%s)", file_index, fid, file->filename);
+    LOGM_DEBUG("===================================================================");
+    LOGM_DEBUG("Reading block %d from file fid=%d (%s)", file_index, fid, file->filename);
 
     if (file_index < 0 || file_index >= file->num_blocks) {
-        LOGM("ERROR: Invalid file index %d (file has %d blocks)", file_index, file->num_blocks);
+        LOGM_ERROR("Invalid file index %d (file has %d blocks)", file_index, file->num_blocks);
         return MDN_FAIL;
     }
 
     int block_id = file->blocks[file_index];
 	int node_id = md->block_mapping[block_id];
+    size_t block_size = md_file_block_size(file);
 
-    LOGM("Block %d maps to: node=%d, block_id=%d", file_index, node_id, block_id);
+    LOGM_DEBUG("Block %d maps to: node=%d, block_id=%d", file_index, node_id, block_id);
          
     DNCommand cmd = DN_READ_BLOCK;
 
     DNBlockIndexPayload payload = {0};
     payload.block_index = block_id;
 
-    if (md_send_command(md->connections[node_id].sock_fd, cmd, &payload, sizeof(payload)) != 0) {
-        perror("Failed to send DN_READ");
+    struct iovec iov = { &payload, sizeof(payload) };
+    DNResponseHeader header;
+
+    if (md_callv(node_id, cmd, &iov, 1, &header) != 0) {
+        perror("Failed DN_READ");
         return MDN_FAIL;
     }
 
-    DNStatus status;
-    void *response_payload = NULL;
-    size_t response_size = BLOCK_SIZE;
+    int sock_fd = md->connections[node_id].sock_fd;
 
-    if (md_recv_response(md->connections[node_id].sock_fd, &status, &response_payload, &response_size) != 0) {
-        perror("Failed to receive DN_READ response");
-        return MDN_FAIL;
+    if (header.status != DN_SUCCESS || header.payload_size != block_size) {
+        LOGM_ERROR("DataNode %d failed to read block %d (status=%d)", node_id, block_id, header.status);
+        recv_discard(sock_fd, header.payload_size);
+        return header.status == DN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
     }
 
-    if (status != DN_SUCCESS) {
-        LOGM("ERROR: DataNode %d failed to read block %d (status=%d)", node_id, block_id, status);
-        free(response_payload);
+    // the block lands directly in the caller's buffer
+    if (recv_all(sock_fd, buffer, block_size) != block_size) {
+        perror("Failed to receive DN_READ data");
         return MDN_FAIL;
     }
 
-    memcpy(buffer, response_payload, BLOCK_SIZE);
-    free(response_payload);
+    if (md_verify_block(block_id, buffer) != 0)
+        return MDN_CORRUPT;
 
-    LOGM("Successfully read block %d from node %d", block_id, node_id);
+    LOGM_DEBUG("Successfully read block %d from node %d", block_id, node_id);
 
-    LOGM("===================================================================\n");
+    LOGM_DEBUG("===================================================================\n");
 
     return MDN_SUCCESS;
 }
 
 MDNStatus metadatanode_write_block(int fid, int file_index, void * buffer) 
 {
-    LOGM("===================================================================");
+    LOGM_DEBUG("===================================================================");
 
     FileEntry *file = &md->files[fid];
 
@@ -574,38 +1747,542 @@ MDNStatus metadatanode_write_block(int fid, int file_index, void * buffer)
         return MDN_FAIL;
 
     int block_id = file->blocks[file_index];
+    size_t block_size = md_file_block_size(file);
+
+    MDDedupRoute *route = NULL;
+    if (md->opts.dedup) {
+        md_async_quiesce();
+
+        MDNStatus status = md_dedup_route(file, file_index, 1, buffer, block_size, &block_id, &route);
+        if (status != MDN_SUCCESS)
+            return status;
+        if (block_id < 0) {
+            LOGM_DEBUG("Block %d of file fid=%d is stored already", file_index, fid);
+            md_dedup_settle(route, MDN_SUCCESS);
+            return MDN_SUCCESS;
+        }
+    }
+
 	int node_id = md->block_mapping[block_id];
 
     DNCommand cmd = DN_WRITE_BLOCK;
 
-    DNBlockPayload payload;
-    payload.block_index = block_id;
-    memcpy(payload.buffer, buffer, BLOCK_SIZE);
+    uint32_t crc = crc32c(0, buffer, block_size);
+
+    // same layout as DNBlockPayload, sent straight from the caller's buffer
+    struct iovec iov[3] = {
+        { &block_id, sizeof(int) },
+        { &crc, sizeof(crc) },
+        { buffer, block_size },
+    };
+    DNResponseHeader header;
+
+    DNStatus status = DN_FAIL;
+    if (md_callv(node_id, cmd, iov, 3, &header) != 0) {
+        perror("Failed DN_WRITE");
+    } else {
+        recv_discard(md->connections[node_id].sock_fd, header.payload_size);
+        status = header.status;
+        if (status != DN_SUCCESS)
+            fprintf(stderr, "Data node %d failed to write block %d\n", node_id, block_id);
+    }
+
+    MDNStatus result = status == DN_SUCCESS ? MDN_SUCCESS :
+                       status == DN_NO_SPACE ? MDN_NO_SPACE :
+                       status == DN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
+    if (result != MDN_SUCCESS && md->opts.dedup)
+        dedup_forget(&md->dedup, block_id);
+    if (route)
+        md_dedup_settle(route, result);
+    if (result != MDN_SUCCESS)
+        return result;
+
+    md->block_crc[block_id] = crc;
+
+    LOGM_DEBUG("===================================================================\n");
+
+    return MDN_SUCCESS;
+}
+
+// Report a finished request to its callback or the completion queue
+static void md_async_complete(MDAsyncRequest *req)
+{
+    md->async_requests--;
+
+    if (req->route)
+        md_dedup_settle(req->route, req->status);
+
+    if (req->cb) {
+        req->cb(req->handle, req->status, req->arg);
+    } else {
+        if (md->num_completions == md->cap_completions) {
+            int cap = md->cap_completions ? md->cap_completions * 2 : 16;
+            MDCompletion *grown = realloc(md->completions, sizeof(MDCompletion) * cap);
+            if (!grown) {
+                LOGM_ERROR("Dropped completion of request %llu", (unsigned long long)req->handle);
+                goto out;
+            }
+            md->completions = grown;
+            md->cap_completions = cap;
+        }
+
+        MDCompletion *c = &md->completions[md->num_completions++];
+        c->handle = req->handle;
+        c->status = req->status;
+        c->arg = req->arg;
+    }
+
+out:
+    free(req->blocks);
+    free(req->order);
+    free(req->crcs);
+    free(req);
+}
+
+static void md_async_op_done(MDAsyncOp *op, DNStatus status)
+{
+    MDAsyncRequest *req = op->req;
+
+    // a write that did not land leaves its blocks' content unknown
+    if (status != DN_SUCCESS && req->cmd == DN_WRITE_BLOCKS && md->opts.dedup) {
+        for (int k = 0; k < op->count; k++)
+            dedup_forget(&md->dedup, req->blocks[req->order[op->first + k]]);
+    }
+
+    if (status != DN_SUCCESS && req->status == MDN_SUCCESS) {
+        LOGM_ERROR("Batch of %d blocks on node %d failed (status=%d)", op->count, op->node_id, status);
+        req->status = status == DN_NO_SPACE ? MDN_NO_SPACE :
+                      status == DN_CORRUPT ? MDN_CORRUPT : MDN_FAIL;
+    }
+    free(op);
+
+    if (--req->remaining == 0)
+        md_async_complete(req);
+}
+
+// The connection is out of sync, fail everything queued or sent on it
+static void md_async_fail_node(int node_id)
+{
+    NodeConnection *conn = &md->connections[node_id];
+
+    MDAsyncOp *lists[2] = { conn->sent, conn->queued };
+    conn->sent = NULL;
+    conn->queued = NULL;
+    conn->queued_tail = NULL;
+    conn->inflight = 0;
+    conn->owed = 0;
+
+    for (int l = 0; l < 2; l++) {
+        while (lists[l]) {
+            MDAsyncOp *op = lists[l];
+            lists[l] = op->next;
+            md_async_op_done(op, DN_FAIL);
+        }
+    }
+}
+
+// Send queued ops of node_id while its window has room. The rest stay
+// queued for metadatanode_poll, which sends them as answers come in
+static void md_async_flush(int node_id)
+{
+    NodeConnection *conn = &md->connections[node_id];
+
+    union {
+        DNBlockListPayload list;
+        char raw[sizeof(DNBlockListPayload) + DN_MAX_BATCH * (sizeof(int) + DN_CRC_SIZE)];
+    } payload;
+    struct iovec iov[DN_MAX_IOV];
+
+    while (conn->queued && conn->inflight < MD_PIPELINE_DEPTH) {
+        MDAsyncOp *op = conn->queued;
+        MDAsyncRequest *req = op->req;
+
+        // the datanode must be able to answer everything sent without us
+        // reading, or it stops reading while we block sending, see
+        // MD_ASYNC_WINDOW_BYTES
+        op->response_bytes = sizeof(DNResponseHeader) +
+            (req->cmd == DN_READ_BLOCKS ? (size_t)op->count * req->block_size : 0);
+        if (conn->inflight > 0 && conn->owed + op->response_bytes > MD_ASYNC_WINDOW_BYTES)
+            break;
+
+        int iovcnt = md_batch_iov(req->blocks, req->order + op->first, op->count,
+                                  req->cmd == DN_WRITE_BLOCKS, req->wdata, req->wsize,
+                                  req->block_size, req->crcs, &payload.list, iov);
+
+        op->req_id = conn->next_req_id++;
+        if (md_send_commandv(conn->sock_fd, op->req_id, req->cmd, iov, iovcnt) != 0) {
+            perror("Failed to submit asynchronous request");
+            md_async_fail_node(node_id);
+            return;
+        }
+        conn->inflight++;
+        conn->owed += op->response_bytes;
+
+        conn->queued = op->next;
+        if (!conn->queued)
+            conn->queued_tail = NULL;
+
+        op->next = conn->sent;
+        conn->sent = op;
+    }
+}
+
+// Receive one response on node_id and retire the op it answers
+static void md_async_reap(int node_id)
+{
+    NodeConnection *conn = &md->connections[node_id];
+    DNResponseHeader header;
+
+    if (md_recv_response_header(conn->sock_fd, &header) != 0) {
+        perror("Failed to receive asynchronous response");
+        md_async_fail_node(node_id);
+        return;
+    }
+    conn->inflight--;
+    md_note_response(node_id, &header);
 
-    if (md_send_command(md->connections[node_id].sock_fd, cmd, &payload, sizeof(payload)) != 0) {
-        perror("Failed to send DN_WRITE");
+    MDAsyncOp **link = &conn->sent;
+    while (*link && (*link)->req_id != header.req_id) {
+        link = &(*link)->next;
+    }
+
+    MDAsyncOp *op = *link;
+    if (!op) {
+        LOGM_ERROR("Unexpected response id=%u from node %d", header.req_id, node_id);
+        md_async_fail_node(node_id);
+        return;
+    }
+    *link = op->next;
+    conn->owed -= op->response_bytes;
+
+    MDAsyncRequest *req = op->req;
+    DNStatus status = header.status;
+    if (md_recv_blocks(conn->sock_fd, &header, req->blocks, req->order + op->first, op->count,
+                       req->block_size, req->rdata, &status) != 0) {
+        md_async_op_done(op, DN_FAIL);
+        md_async_fail_node(node_id);
+        return;
+    }
+
+    // the datanode holds the new data now, later reads are checked against it
+    if (req->cmd == DN_WRITE_BLOCKS && status == DN_SUCCESS) {
+        for (int k = 0; k < op->count; k++) {
+            int i = req->order[op->first + k];
+            md->block_crc[req->blocks[i]] = req->crcs[i];
+        }
+    }
+
+    md_async_op_done(op, status);
+}
+
+static MDNStatus md_async_submit(const int *blocks, int nblocks, DNCommand cmd,
+                                 const char *wdata, size_t wsize, char *rdata,
+                                 MDCallback cb, void *arg, MDHandle *handle)
+{
+    return md_async_submit_route(blocks, nblocks, cmd, wdata, wsize, rdata, NULL, cb, arg, handle);
+}
+
+// Split blocks into one op per node (per DN_MAX_BATCH chunk) and start
+// sending. A write md_dedup_route decided on passes its route, which the
+// request settles when it completes. On failure route is left to the caller
+static MDNStatus md_async_submit_route(const int *blocks, int nblocks, DNCommand cmd,
+                                       const char *wdata, size_t wsize, char *rdata, MDDedupRoute *route,
+                                       MDCallback cb, void *arg, MDHandle *handle)
+{
+    MDAsyncRequest *req = calloc(1, sizeof(MDAsyncRequest));
+    int *node_start = malloc(sizeof(int) * (md->num_nodes + 1));
+    if (!req || !node_start)
+        goto fail;
+
+    req->handle = md->next_handle++;
+    req->cmd = cmd;
+    req->status = MDN_SUCCESS;
+    req->cb = cb;
+    req->arg = arg;
+    req->nblocks = nblocks;
+    req->block_size = BLOCK_SIZE;
+    for (int i = 0; i < nblocks; i++) {
+        if (blocks[i] >= 0) {
+            req->block_size = md_block_class(blocks[i])->block_size;
+            break;
+        }
+    }
+    req->wdata = wdata;
+    req->wsize = wsize;
+    req->rdata = rdata;
+    req->route = route;
+
+    // blocks may move under the caller, e.g. a truncate, before ops are sent
+    req->blocks = malloc(sizeof(int) * (nblocks > 0 ? nblocks : 1));
+    req->order = malloc(sizeof(int) * (nblocks > 0 ? nblocks : 1));
+    if (!req->blocks || !req->order)
+        goto fail;
+
+    if (cmd == DN_WRITE_BLOCKS) {
+        req->crcs = malloc(sizeof(uint32_t) * nblocks);
+        if (!req->crcs)
+            goto fail;
+    }
+    memcpy(req->blocks, blocks, sizeof(int) * nblocks);
+
+    if (md_group_by_node(req->blocks, nblocks, req->order, node_start) != 0)
+        goto fail;
+
+    // as many bytes per command as DN_MAX_BATCH of the smallest blocks
+    int batch = (int)(DN_MAX_BATCH * (size_t)BLOCK_SIZE_MIN / req->block_size);
+    if (batch < 1) batch = 1;
+
+    for (int node = 0; node < md->num_nodes; node++) {
+        for (int first = node_start[node]; first < node_start[node + 1]; first += batch) {
+            MDAsyncOp *op = calloc(1, sizeof(MDAsyncOp));
+            if (!op) {
+                // ops already queued still reference req, let them finish it
+                req->status = MDN_FAIL;
+                goto queued;
+            }
+
+            op->req = req;
+            op->node_id = node;
+            op->first = first;
+            op->count = node_start[node + 1] - first;
+            if (op->count > batch) op->count = batch;
+
+            NodeConnection *conn = &md->connections[node];
+            if (conn->queued_tail)
+                conn->queued_tail->next = op;
+            else
+                conn->queued = op;
+            conn->queued_tail = op;
+
+            req->remaining++;
+        }
+    }
+
+queued:
+    free(node_start);
+    md->async_requests++;
+    *handle = req->handle;
+
+    if (req->remaining == 0) {
+        req->next = md->async_ready;
+        md->async_ready = req;
+        return MDN_SUCCESS;
+    }
+
+    for (int node = 0; node < md->num_nodes; node++) {
+        md_async_flush(node);
+    }
+    return MDN_SUCCESS;
+
+fail:
+    if (req) {
+        free(req->blocks);
+        free(req->order);
+        free(req->crcs);
+    }
+    free(req);
+    free(node_start);
+    return MDN_FAIL;
+}
+
+static void md_async_quiesce(void)
+{
+    if (md->async_requests > 0)
+        metadatanode_drain();
+}
+
+MDNStatus metadatanode_read_block_async(int fid, int file_index, void * buffer,
+                                        MDCallback cb, void * arg, MDHandle * handle)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
+
+    FileEntry *file = &md->files[fid];
+    if (file_index < 0 || file_index >= file->num_blocks)
+        return MDN_INVALID_BLOCK;
+
+    // single block positions are 0, the block lands at buffer itself
+    return md_async_submit(&file->blocks[file_index], 1, DN_READ_BLOCKS, NULL, 0, buffer, cb, arg, handle);
+}
+
+MDNStatus metadatanode_write_block_async(int fid, int file_index, void * buffer,
+                                         MDCallback cb, void * arg, MDHandle * handle)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
+
+    FileEntry *file = &md->files[fid];
+    if (file_index < 0 || file_index >= file->num_blocks)
+        return MDN_INVALID_BLOCK;
+
+    return md_write_file_blocks_async(file, file_index, 1, buffer, md_file_block_size(file), cb, arg, handle);
+}
+
+MDNStatus metadatanode_read_file_async(int fid, void * buffer, size_t buffer_size,
+                                       MDCallback cb, void * arg, MDHandle * handle)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
+
+    FileEntry *file = &md->files[fid];
+    if (buffer_size < (size_t)file->num_blocks * md_file_block_size(file))
         return MDN_FAIL;
+
+    return md_async_submit(file->blocks, file->num_blocks, DN_READ_BLOCKS, NULL, 0, buffer, cb, arg, handle);
+}
+
+MDNStatus metadatanode_write_file_async(int fid, void * buffer, size_t buffer_size,
+                                        MDCallback cb, void * arg, MDHandle * handle)
+{
+    if (fid < 0 || fid >= md->num_files)
+        return MDN_FILE_DNE;
+
+    FileEntry *file = &md->files[fid];
+    size_t block_size = md_file_block_size(file);
+    size_t needed_blocks = (buffer_size + block_size - 1) / block_size;
+
+    if (needed_blocks > file->num_blocks) {
+        MDNStatus status = metadatanode_truncate_file(fid, needed_blocks * block_size);
+        if (status != MDN_SUCCESS)
+            return status;
+    }
+
+    return md_write_file_blocks_async(file, 0, needed_blocks, buffer, buffer_size, cb, arg, handle);
+}
+
+int metadatanode_poll(int timeout_ms)
+{
+    int before = md->async_requests;
+
+    while (md->async_ready) {
+        MDAsyncRequest *req = md->async_ready;
+        md->async_ready = req->next;
+        md_async_complete(req);
+    }
+
+    int fds[md->num_nodes];
+    int nodes[md->num_nodes];
+    int ready[md->num_nodes];
+    int nfds = 0;
+
+    for (int node = 0; node < md->num_nodes; node++) {
+        if (md->connections[node].sent) {
+            fds[nfds] = md->connections[node].sock_fd;
+            nodes[nfds] = node;
+            nfds++;
+        }
+    }
+
+    // completions of requests needing no round trip mean there is no need to wait
+    if (md->async_requests < before)
+        timeout_ms = 0;
+
+    if (nfds > 0) {
+        int n = comm_wait_readable(fds, nfds, ready, timeout_ms);
+        if (n < 0) return -1;
+
+        for (int i = 0; i < nfds; i++) {
+            if (!ready[i]) continue;
+
+            // take everything that already arrived on this node
+            int ready_again = 1;
+            while (ready_again && md->connections[nodes[i]].sent) {
+                md_async_reap(nodes[i]);
+                md_async_flush(nodes[i]);
+                comm_wait_readable(&fds[i], 1, &ready_again, 0);
+            }
+        }
+    }
+
+    return before - md->async_requests;
+}
+
+int metadatanode_reap(MDCompletion * completions, int max)
+{
+    int n = md->num_completions < max ? md->num_completions : max;
+
+    memcpy(completions, md->completions, sizeof(MDCompletion) * n);
+    memmove(md->completions, md->completions + n, sizeof(MDCompletion) * (md->num_completions - n));
+    md->num_completions -= n;
+
+    return n;
+}
+
+MDNStatus metadatanode_drain(void)
+{
+    while (md->async_requests > 0) {
+        if (metadatanode_poll(-1) < 0) {
+            // nothing can be waited for anymore, fail what is left
+            for (int node = 0; node < md->num_nodes; node++) {
+                md_async_fail_node(node);
+            }
+            return MDN_FAIL;
+        }
+    }
+    return MDN_SUCCESS;
+}
+
+MDNStatus metadatanode_sync(void)
+{
+    MDNStatus result = MDN_SUCCESS;
+
+    for (int i = 0; i < md->num_nodes; i++) {
+        DNStatus status;
+        void *response_payload = NULL;
+        size_t response_size = 0;
+
+        if (md_call(i, DN_SYNC, NULL, 0, &status, &response_payload, &response_size) != 0 ||
+            status != DN_SUCCESS) {
+            LOGM_ERROR("DataNode %d failed to sync", i);
+            result = MDN_FAIL;
+        }
+        free(response_payload);
     }
 
+    return result;
+}
+
+MDNStatus metadatanode_node_stats(int node_id, DNStats * stats)
+{
+    if (node_id < 0 || node_id >= md->num_nodes)
+        return MDN_FAIL;
+
     DNStatus status;
     void *response_payload = NULL;
     size_t response_size = 0;
 
-    if (md_recv_response(md->connections[node_id].sock_fd, &status,
-                         &response_payload, &response_size) != 0) {
-        perror("Failed to receive DN_WRITE response");
+    if (md_call(node_id, DN_STATS, NULL, 0, &status, &response_payload, &response_size) != 0)
         return MDN_FAIL;
+
+    MDNStatus result = MDN_FAIL;
+    if (status == DN_SUCCESS && response_size >= sizeof(DNStats)) {
+        memcpy(stats, response_payload, sizeof(DNStats));
+        result = MDN_SUCCESS;
     }
 
     free(response_payload);
+    return result;
+}
+
+MDNStatus metadatanode_list_blocks(int node_id, int ** block_indices, int * count)
+{
+    if (node_id < 0 || node_id >= md->num_nodes)
+        return MDN_FAIL;
+
+    DNStatus status;
+    void *response_payload = NULL;
+    size_t response_size = 0;
+
+    if (md_call(node_id, DN_LIST_BLOCKS, NULL, 0, &status, &response_payload, &response_size) != 0)
+        return MDN_FAIL;
 
     if (status != DN_SUCCESS) {
-        fprintf(stderr, "Data node %d failed to write block %d\n", node_id, block_id);
+        free(response_payload);
         return MDN_FAIL;
     }
 
-    LOGM("===================================================================\n");
-
+    *block_indices = response_payload;
+    *count = (int)(response_size / sizeof(int));
     return MDN_SUCCESS;
 }
 
@@ -616,12 +2293,22 @@ MDNStatus metadatanode_end(void)
         free(md->files[i].blocks);
     }
 
+    for (int c = 0; c < md->num_classes; c++) {
+        free(md->classes[c].bitmap);
+        free(md->classes[c].node_capacity);
+        free(md->classes[c].blocks_per_node);
+        free(md->classes[c].blocks_free);
+        free(md->classes[c].slots_free);
+    }
+    free(md->classes);
+    md->classes = NULL;
+
+    dedup_destroy(&md->dedup);
+
 	free(md->block_mapping);
-	free(md->blocks_free);
+    free(md->block_crc);
     free(md->files);
-
-    free(md->bitmap);
-    md->bitmap = NULL;
+    free(md->completions);
 
     free(md->connections);
     md->connections = NULL;
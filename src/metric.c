@@ -19,7 +19,9 @@ void calculate_load_balance(double *imbalance, double *std_dev,
     double sum_sq = 0;
     
     for (int i = 0; i < md->num_nodes; i++) {
-        int blocks = md->blocks_per_node[i];
+        int blocks = 0;
+        for (int c = 0; c < md->num_classes; c++)
+            blocks += md->classes[c].blocks_per_node[i];
         if (blocks > *max_blocks) *max_blocks = blocks;
         if (blocks < *min_blocks) *min_blocks = blocks;
         sum += blocks;
@@ -34,6 +36,41 @@ void calculate_load_balance(double *imbalance, double *std_dev,
     *imbalance = (avg > 0) ? (*std_dev / avg) : 0.0;
 }
 
+void calculate_cache_stats(SystemMetrics *m)
+{
+    m->cache_hits = 0;
+    m->cache_misses = 0;
+    m->cache_bytes_saved = 0;
+
+    for (int i = 0; i < md->num_nodes; i++) {
+        DNStats stats;
+        if (metadatanode_node_stats(i, &stats) != MDN_SUCCESS)
+            continue;
+        m->cache_hits += stats.block_cache_hits;
+        m->cache_misses += stats.block_cache_misses;
+        m->cache_bytes_saved += stats.block_cache_hit_bytes;
+    }
+
+    unsigned long long lookups = m->cache_hits + m->cache_misses;
+    m->cache_hit_ratio = lookups > 0 ? (double)m->cache_hits / lookups : 0.0;
+}
+
+void calculate_storage_stats(SystemMetrics *m)
+{
+    size_t block_bytes = 0;
+    m->stored_bytes = 0;
+
+    for (int i = 0; i < md->num_nodes; i++) {
+        DNStats stats;
+        if (metadatanode_node_stats(i, &stats) != MDN_SUCCESS)
+            continue;
+        m->stored_bytes += stats.stored_bytes;
+        block_bytes += stats.block_bytes;
+    }
+
+    m->compression_ratio = m->stored_bytes > 0 ? (double)block_bytes / m->stored_bytes : 0.0;
+}
+
 SystemMetrics capture_metrics(double write_time_ms, double read_time_ms,
                               int write_count, int read_count)
 {
@@ -60,6 +97,20 @@ SystemMetrics capture_metrics(double write_time_ms, double read_time_ms,
 	m.metadata_bytes = sizeof(MetadataNode) + 
                        (md->num_files * sizeof(FileEntry)) +
                        (m.blocks_used * sizeof(int)); // + size of allocation logic
+
+    calculate_cache_stats(&m);
+    calculate_storage_stats(&m);
+
+    // compressed blocks fill less than their slot
+    if (md->opts.compress && md->fs_capacity > 0)
+        m.fill_percentage = (int)(m.stored_bytes * 100 / (size_t)md->fs_capacity);
+
+    if (md->opts.dedup) {
+        DedupIndex *d = &md->dedup;
+        m.dedup_ratio = d->physical_bytes > 0 ? (double)d->logical_bytes / d->physical_bytes : 0.0;
+        m.dedup_bytes_saved = d->logical_bytes - d->physical_bytes;
+        m.dedup_writes_saved = d->writes_saved;
+    }
     
     return m;
 }
@@ -79,6 +130,13 @@ void print_metrics(SystemMetrics *m, const char *label)
     printf("Avg Read Latency: %.3f ms (%d reads)\n", 
            m->avg_read_latency_ms, m->read_count);
     printf("Metadata: %.2f KB\n", m->metadata_bytes / 1024.0);
+    printf("Block Cache: %.1f%% hits (%llu/%llu), %.2f KB saved\n",
+           m->cache_hit_ratio * 100.0, m->cache_hits, m->cache_hits + m->cache_misses,
+           m->cache_bytes_saved / 1024.0);
+    printf("Dedup: %.2fx, %.2f KB saved (%llu writes skipped)\n",
+           m->dedup_ratio, m->dedup_bytes_saved / 1024.0, m->dedup_writes_saved);
+    printf("Stored: %.2f KB, compression %.2fx\n",
+           m->stored_bytes / 1024.0, m->compression_ratio);
 }
 
 void export_metrics_csv(const char *filename, SystemMetrics *metrics, 
@@ -92,11 +150,13 @@ void export_metrics_csv(const char *filename, SystemMetrics *metrics,
 	fprintf(f, "policy,fill_pct,blocks_used,blocks_free,"
                "load_imbalance,load_std_dev,max_blocks,min_blocks,"
                "num_files,write_count,read_count,avg_write_latency_ms,"
-               "avg_read_latency_ms,metadata_bytes\n");
+               "avg_read_latency_ms,metadata_bytes,cache_hit_ratio,cache_bytes_saved,"
+               "dedup_ratio,dedup_bytes_saved,dedup_writes_saved,"
+               "stored_bytes,compression_ratio\n");
     
     for (int i = 0; i < count; i++) {
         SystemMetrics *m = &metrics[i];
-        fprintf(f, "%s,%d,%zu,%zu,%.6f,%.4f,%d,%d,%d,%d,%d,%.6f,%.6f,%zu\n",
+        fprintf(f, "%s,%d,%zu,%zu,%.6f,%.4f,%d,%d,%d,%d,%d,%.6f,%.6f,%zu,%.6f,%zu,%.6f,%zu,%llu,%zu,%.6f\n",
                 policy_name,
                 // m->timestamp_ms,
                 m->fill_percentage,
@@ -111,13 +171,22 @@ void export_metrics_csv(const char *filename, SystemMetrics *metrics,
                 m->read_count,
                 m->avg_write_latency_ms,
                 m->avg_read_latency_ms,
-                m->metadata_bytes);
+                m->metadata_bytes,
+                m->cache_hit_ratio,
+                m->cache_bytes_saved,
+                m->dedup_ratio,
+                m->dedup_bytes_saved,
+                m->dedup_writes_saved,
+                m->stored_bytes,
+                m->compression_ratio);
     }
     
     fclose(f);
     printf("Exported %d metrics to %s\n", count, filename);
 }
 
+// Sizes are drawn in BLOCK_SIZE_MIN units, a distribution describes the same
+// files whatever the cluster's block size and larger blocks take fewer of them
 size_t generate_file_size(FileDistribution dist) {
     int blocks;
     
@@ -159,7 +228,7 @@ size_t generate_file_size(FileDistribution dist) {
             blocks = 1;
     }
     
-    return blocks * BLOCK_SIZE;
+    return (size_t)blocks * BLOCK_SIZE_MIN;
 }
 
 const char* dist_to_string(FileDistribution dist) {
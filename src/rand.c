@@ -13,18 +13,18 @@ int rand_init()
 
 int rand_allocate_block(AllocContext ctx, int *node_index)
 {
-    (void)ctx;
+    int *blocks_free = md->classes[ctx.block_class].blocks_free;
 
     for (int attempt = 0; attempt < md->num_nodes; attempt++) {
         int idx = rand() % md->num_nodes;
-        if (0 < md->blocks_free[idx]) {
+        if (0 < blocks_free[idx]) {
             *node_index = idx;
             return 0;
         }
     }
 
     for (int idx = 0; idx < md->num_nodes; idx++) {
-        if (0 < md->blocks_free[idx]) {
+        if (0 < blocks_free[idx]) {
             *node_index = idx;
             return 0;
         }
@@ -22,10 +22,10 @@ int roundrobin_init()
 
 int roundrobin_allocate_block(AllocContext ctx, int *node_index)
 {
-    (void)ctx;
     RRState *s = (RRState *)policy->state;
+    int *blocks_free = md->classes[ctx.block_class].blocks_free;
     s->last_index = (s->last_index + 1) % md->num_nodes;
-    while (md->blocks_free[s->last_index] < 1) {
+    while (blocks_free[s->last_index] < 1) {
         s->last_index = (s->last_index + 1) % md->num_nodes;
     }
     *node_index = s->last_index;
@@ -22,8 +22,8 @@ int sequential_init()
 
 int sequential_allocate_block(AllocContext ctx, int *node_index)
 {
-    (void)ctx;
     SState *s = (SState *)policy->state;
+    int *blocks_free = md->classes[ctx.block_class].blocks_free;
 	
 	if (s->current_index == md->num_nodes) {
 		// no more space
@@ -32,7 +32,7 @@ int sequential_allocate_block(AllocContext ctx, int *node_index)
 
 	*node_index = s->current_index;
     
-	if (md->blocks_free[s->current_index] < 2) {
+	if (blocks_free[s->current_index] < 2) {
 		// no more space on this index
 		s->current_index++;
 	}
@@ -0,0 +1,364 @@
+#include "shmring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+// Returns ETIMEDOUT if nothing woke the wait, 0 otherwise
+static int futex_wait_ms(_Atomic uint32_t *word, uint32_t expected, int timeout_ms)
+{
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000 * 1000 };
+    if (syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, &timeout, NULL, 0) != 0 &&
+        errno == ETIMEDOUT)
+        return ETIMEDOUT;
+    return 0;
+}
+
+static int futex_wait(_Atomic uint32_t *word, uint32_t expected)
+{
+    return futex_wait_ms(word, expected, SHM_WAIT_MAX_MS);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int ring_spin_limit = SHM_SPIN_LIMIT;
+
+void shm_spin_for(int processes)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    ring_spin_limit = cpus > processes ? SHM_SPIN_LIMIT : 0;
+}
+
+// Wake the readers waiting on new data, blocked in a read or polling
+static void ring_wake_readers(ShmRing *ring, int force)
+{
+    if (force || atomic_load(&ring->readers_waiting))
+        futex_wake(&ring->head_seq);
+    if ((force || atomic_load(&ring->readers_polling)) && ring->notify_fd >= 0) {
+        uint64_t one = 1;
+        if (write(ring->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+}
+
+// A dead child stays around as a zombie until reaped, so look at our own
+// children without reaping them
+static int ring_pid_alive(pid_t pid)
+{
+    if (pid <= 0 || pid == getpid())
+        return 1;
+
+    siginfo_t info;
+    info.si_pid = 0;
+    if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0)
+        return info.si_pid == 0;
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Called when a wait timed out, closes the ring once pid is gone
+static int ring_peer_gone(ShmRing *ring, _Atomic pid_t *pid)
+{
+    if (ring_pid_alive(atomic_load(pid)))
+        return 0;
+
+    fprintf(stderr, "[Communication] ERROR: shm ring peer %d died\n", (int)atomic_load(pid));
+    shm_ring_close(ring);
+    return 1;
+}
+
+static double ring_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+ShmChannel *shm_channel_create(void)
+{
+    ShmChannel *channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (channel == MAP_FAILED) {
+        perror("mmap shm channel");
+        return NULL;
+    }
+
+    // anonymous mappings are zero filled, which is an empty open ring.
+    // Without eventfds the rings still work, only polling them spins
+    channel->requests.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->responses.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return channel;
+}
+
+void shm_channel_destroy(ShmChannel *channel)
+{
+    if (!channel)
+        return;
+
+    if (channel->requests.notify_fd >= 0)
+        close(channel->requests.notify_fd);
+    if (channel->responses.notify_fd >= 0)
+        close(channel->responses.notify_fd);
+    munmap(channel, sizeof(ShmChannel));
+}
+
+void shm_channel_bind(ShmChannel *channel, pid_t md_pid, pid_t dn_pid)
+{
+    atomic_store(&channel->requests.producer_pid, md_pid);
+    atomic_store(&channel->requests.consumer_pid, dn_pid);
+    atomic_store(&channel->responses.producer_pid, dn_pid);
+    atomic_store(&channel->responses.consumer_pid, md_pid);
+}
+
+void shm_ring_close(ShmRing *ring)
+{
+    atomic_store(&ring->closed, 1);
+
+    atomic_fetch_add(&ring->head_seq, 1);
+    atomic_fetch_add(&ring->tail_seq, 1);
+    ring_wake_readers(ring, 1);
+    futex_wake(&ring->tail_seq);
+}
+
+void shm_ring_check_producer(ShmRing *ring)
+{
+    if (!atomic_load(&ring->closed))
+        ring_peer_gone(ring, &ring->producer_pid);
+}
+
+size_t shm_ring_readable(ShmRing *ring)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    // a closed ring reads as readable so the caller notices the failure
+    if (head == tail && atomic_load(&ring->closed))
+        return 1;
+    return head - tail;
+}
+
+int shm_ring_wait_readable(ShmRing *ring, int timeout_ms)
+{
+    for (int spins = 0; spins < ring_spin_limit; spins++) {
+        if (shm_ring_readable(ring) > 0)
+            return 1;
+        cpu_relax();
+    }
+
+    double deadline = timeout_ms >= 0 ? ring_now_ms() + timeout_ms : 0;
+    while (1) {
+        atomic_fetch_add(&ring->readers_waiting, 1);
+        uint32_t seq = atomic_load(&ring->head_seq);
+        int readable = shm_ring_readable(ring) > 0;
+        if (!readable) {
+            int wait = SHM_WAIT_MAX_MS;
+            if (timeout_ms >= 0) {
+                double left = deadline - ring_now_ms();
+                if (left <= 0) {
+                    atomic_fetch_sub(&ring->readers_waiting, 1);
+                    return 0;
+                }
+                if (left < wait)
+                    wait = (int)left + 1;
+            }
+            if (futex_wait_ms(&ring->head_seq, seq, wait) == ETIMEDOUT)
+                ring_peer_gone(ring, &ring->producer_pid);
+            readable = shm_ring_readable(ring) > 0;
+        }
+        atomic_fetch_sub(&ring->readers_waiting, 1);
+
+        if (readable)
+            return 1;
+    }
+}
+
+void shm_ring_wait_begin(ShmRing *ring)
+{
+    atomic_fetch_add(&ring->readers_polling, 1);
+}
+
+void shm_ring_wait_end(ShmRing *ring)
+{
+    atomic_fetch_sub(&ring->readers_polling, 1);
+}
+
+void shm_ring_clear_notify(ShmRing *ring)
+{
+    if (ring->notify_fd >= 0) {
+        uint64_t count;
+        if (read(ring->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("eventfd read");
+    }
+}
+
+// Wait until the producer published past tail, returns the readable bytes
+static uint64_t ring_wait_data(ShmRing *ring, uint64_t tail)
+{
+    uint64_t head;
+    int spins = 0;
+
+    while ((head = atomic_load_explicit(&ring->head, memory_order_acquire)) == tail) {
+        if (atomic_load(&ring->closed))
+            return 0;
+
+        if (spins++ < ring_spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_fetch_add(&ring->readers_waiting, 1);
+        uint32_t seq = atomic_load(&ring->head_seq);
+        if (atomic_load(&ring->head) == tail && !atomic_load(&ring->closed) &&
+            futex_wait(&ring->head_seq, seq) == ETIMEDOUT)
+            ring_peer_gone(ring, &ring->producer_pid);
+        atomic_fetch_sub(&ring->readers_waiting, 1);
+    }
+
+    return head - tail;
+}
+
+// Wait until the consumer left room past head, returns the writable bytes
+static uint64_t ring_wait_space(ShmRing *ring, uint64_t head)
+{
+    uint64_t tail;
+    int spins = 0;
+
+    while (head - (tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) == SHM_RING_BYTES) {
+        if (atomic_load(&ring->closed))
+            return 0;
+
+        if (spins++ < ring_spin_limit) {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_fetch_add(&ring->writers_waiting, 1);
+        uint32_t seq = atomic_load(&ring->tail_seq);
+        if (head - atomic_load(&ring->tail) == SHM_RING_BYTES && !atomic_load(&ring->closed) &&
+            futex_wait(&ring->tail_seq, seq) == ETIMEDOUT)
+            ring_peer_gone(ring, &ring->consumer_pid);
+        atomic_fetch_sub(&ring->writers_waiting, 1);
+    }
+
+    return SHM_RING_BYTES - (head - tail);
+}
+
+// Make the bytes up to head visible to the consumer
+static void ring_publish(ShmRing *ring, uint64_t head)
+{
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) == head)
+        return;
+
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    atomic_fetch_add(&ring->head_seq, 1);
+    ring_wake_readers(ring, 0);
+}
+
+ssize_t shm_ring_write(ShmRing *ring, const void *buf, size_t len)
+{
+    struct iovec iov = { (void *)buf, len };
+    return shm_ring_writev(ring, &iov, 1);
+}
+
+ssize_t shm_ring_read(ShmRing *ring, void *buf, size_t len)
+{
+    char *p = buf;
+    size_t total = 0;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (total < len) {
+        uint64_t avail = ring_wait_data(ring, tail);
+        if (avail == 0) {
+            fprintf(stderr, "[Communication] ERROR: shm ring closed after %zu/%zu bytes\n", total, len);
+            return -1;
+        }
+
+        size_t pos = tail % SHM_RING_BYTES;
+        size_t n = len - total;
+        if (n > avail) n = avail;
+        if (n > SHM_RING_BYTES - pos) n = SHM_RING_BYTES - pos;
+
+        memcpy(p + total, ring->data + pos, n);
+        total += n;
+        tail += n;
+
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        atomic_fetch_add(&ring->tail_seq, 1);
+        if (atomic_load(&ring->writers_waiting))
+            futex_wake(&ring->tail_seq);
+    }
+
+    return total;
+}
+
+// A message goes out in one publish, the reader is woken once for it
+// rather than for every piece. Only a full ring publishes early
+ssize_t shm_ring_writev(ShmRing *ring, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0, len = 0;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t room = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const char *p = iov[i].iov_base;
+        size_t done = 0;
+
+        while (done < iov[i].iov_len) {
+            if (room == 0) {
+                ring_publish(ring, head);
+                room = ring_wait_space(ring, head);
+                if (room == 0) {
+                    fprintf(stderr, "[Communication] ERROR: shm ring closed after %zu/%zu bytes\n", total, len);
+                    return -1;
+                }
+            }
+
+            size_t pos = head % SHM_RING_BYTES;
+            size_t n = iov[i].iov_len - done;
+            if (n > room) n = room;
+            if (n > SHM_RING_BYTES - pos) n = SHM_RING_BYTES - pos;
+
+            memcpy(ring->data + pos, p + done, n);
+            done += n;
+            total += n;
+            head += n;
+            room -= n;
+        }
+    }
+
+    ring_publish(ring, head);
+    return total;
+}
+
+ssize_t shm_ring_readv(ShmRing *ring, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        if (shm_ring_read(ring, iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len)
+            return -1;
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
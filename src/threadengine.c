@@ -0,0 +1,340 @@
+#define _DEFAULT_SOURCE
+#include "datanode.h"
+#include "communication.h"
+
+#include <pthread.h>
+
+extern DataNode *dn;
+
+typedef struct ThreadJob ThreadJob;
+
+struct ThreadJob {
+    DNHeader header;
+    void *payload;
+    DNBlockOp op;
+    int taken;          // a worker is running it
+    int done;           // answered or held, still listed until it is freed
+
+    ThreadJob *next;
+};
+
+typedef struct ThreadEngine ThreadEngine;
+
+typedef struct {
+    ThreadEngine *engine;
+    pthread_t thread;
+
+    // read data of the job being run
+    void *buf;
+    size_t buf_cap;
+} ThreadWorker;
+
+struct ThreadEngine {
+    int sock_fd;
+    ThreadWorker *workers;
+    int num_workers;
+
+    pthread_mutex_t lock;       // jobs and stopping
+    pthread_cond_t queued;      // a job was queued or the pool is stopping
+    pthread_cond_t finished;    // a job finished
+    ThreadJob *jobs;            // every unfinished job, in arrival order
+    int stopping;
+
+    // responses go out whole, one at a time. Taken before dn->lock
+    pthread_mutex_t send_lock;
+};
+
+static void threads_send(ThreadEngine *e, uint32_t req_id, DNStatus status, void *data, size_t size)
+{
+    pthread_mutex_lock(&e->send_lock);
+    datanode_respond(e->sock_fd, req_id, status, data, size);
+    pthread_mutex_unlock(&e->send_lock);
+}
+
+// Answer held writes, ready or not
+static void threads_commit(ThreadEngine *e)
+{
+    pthread_mutex_lock(&e->send_lock);
+    if (datanode_commit_due() >= 0)
+        datanode_commit(e->sock_fd);
+    pthread_mutex_unlock(&e->send_lock);
+}
+
+static void threads_run(ThreadWorker *w, ThreadJob *job)
+{
+    ThreadEngine *e = w->engine;
+    DNBlockOp *op = &job->op;
+    uint32_t req_id = job->header.req_id;
+    DNStatus status;
+
+    if (op->is_write) {
+        status = datanode_write_blocks(op->count, op->blocks, op->crcs, op->wdata);
+
+        if (status == DN_SUCCESS && dn->durability == DN_DURABILITY_GROUP) {
+            pthread_mutex_lock(&e->send_lock);
+            datanode_hold_response(e->sock_fd, req_id);
+            pthread_mutex_unlock(&e->send_lock);
+        } else {
+            threads_send(e, req_id, status, NULL, 0);
+        }
+        return;
+    }
+
+    // held writes are answered before a read that follows them
+    threads_commit(e);
+
+    if (dn->mmap_reads) {
+        struct iovec iov[DN_MAX_BATCH];
+        status = datanode_map_blocks(op->count, op->blocks, iov);
+
+        pthread_mutex_lock(&e->send_lock);
+        datanode_respondv(e->sock_fd, req_id, status, iov, status == DN_SUCCESS ? op->count : 0);
+        pthread_mutex_unlock(&e->send_lock);
+        return;
+    }
+
+    size_t data_size = (size_t)op->count * op->block_size;
+    void *buffer = datanode_buffer(&w->buf, &w->buf_cap, data_size);
+    if (!buffer) {
+        threads_send(e, req_id, DN_FAIL, NULL, 0);
+        return;
+    }
+
+    status = datanode_read_blocks(op->count, op->blocks, buffer);
+    if (status == DN_SUCCESS)
+        threads_send(e, req_id, status, buffer, data_size);
+    else
+        threads_send(e, req_id, status, NULL, 0);
+}
+
+static ThreadJob *threads_next(ThreadEngine *e)
+{
+    for (ThreadJob *job = e->jobs; job; job = job->next) {
+        if (!job->taken)
+            return job;
+    }
+    return NULL;
+}
+
+static void threads_remove(ThreadEngine *e, ThreadJob *job)
+{
+    ThreadJob **link = &e->jobs;
+    while (*link != job)
+        link = &(*link)->next;
+    *link = job->next;
+}
+
+static void *threads_worker(void *arg)
+{
+    ThreadWorker *w = arg;
+    ThreadEngine *e = w->engine;
+
+    pthread_mutex_lock(&e->lock);
+    while (1) {
+        ThreadJob *job = NULL;
+        while (!e->stopping && !(job = threads_next(e)))
+            pthread_cond_wait(&e->queued, &e->lock);
+        if (!job)
+            break;
+
+        job->taken = 1;
+        pthread_mutex_unlock(&e->lock);
+
+        LOGD_DEBUG(dn->node_id, "Command %d (request %u)", job->header.cmd, job->header.req_id);
+        threads_run(w, job);
+
+        // with no window, the last job out commits the group
+        pthread_mutex_lock(&e->lock);
+        job->done = 1;
+        int last = 1;
+        for (ThreadJob *x = e->jobs; x; x = x->next)
+            last &= x->done;
+        pthread_mutex_unlock(&e->lock);
+        if (last && dn->durability == DN_DURABILITY_GROUP && dn->group_commit_us == 0)
+            threads_commit(e);
+
+        pthread_mutex_lock(&e->lock);
+        threads_remove(e, job);
+        pthread_cond_broadcast(&e->finished);
+
+        free(job->payload);
+        free(job);
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    return NULL;
+}
+
+// Queue a block operation once no unfinished one conflicts with it, later
+// commands wait behind it
+static void threads_queue(ThreadEngine *e, ThreadJob *job)
+{
+    pthread_mutex_lock(&e->lock);
+
+    ThreadJob **tail;
+    while (1) {
+        int conflict = 0;
+        tail = &e->jobs;
+        for (; *tail; tail = &(*tail)->next) {
+            if (datanode_block_ops_conflict(&(*tail)->op, &job->op))
+                conflict = 1;
+        }
+        if (!conflict)
+            break;
+        pthread_cond_wait(&e->finished, &e->lock);
+    }
+
+    *tail = job;
+    pthread_cond_signal(&e->queued);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void threads_wait_idle(ThreadEngine *e)
+{
+    pthread_mutex_lock(&e->lock);
+    while (e->jobs)
+        pthread_cond_wait(&e->finished, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void threads_stop(ThreadEngine *e, int started)
+{
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    pthread_cond_broadcast(&e->queued);
+    pthread_mutex_unlock(&e->lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(e->workers[i].thread, NULL);
+        free(e->workers[i].buf);
+    }
+    e->num_workers = 0;
+
+    // never taken, the connection failed under them
+    while (e->jobs) {
+        ThreadJob *job = e->jobs;
+        e->jobs = job->next;
+        free(job->payload);
+        free(job);
+    }
+}
+
+// Time group commit windows before waiting for the next command, a receiver
+// blocked in recv would miss their end. Writes still running may join the
+// group, so it waits in 1 ms steps while any job is unfinished
+static void threads_wait_command(ThreadEngine *e)
+{
+    if (dn->durability != DN_DURABILITY_GROUP || dn->group_commit_us == 0)
+        return;
+
+    while (1) {
+        // jobs hold their writes before they are unlisted, so once none is
+        // left every held write is seen below
+        pthread_mutex_lock(&e->lock);
+        int busy = e->jobs != NULL;
+        pthread_mutex_unlock(&e->lock);
+
+        pthread_mutex_lock(&e->send_lock);
+        long due = datanode_commit_due();
+        if (due == 0) {
+            datanode_commit(e->sock_fd);
+            due = -1;
+        }
+        pthread_mutex_unlock(&e->send_lock);
+
+        if (due < 0 && !busy)
+            return;
+
+        int ready = 0;
+        int timeout_ms = due > 0 ? (int)((due + 999) / 1000) : 1;
+        if (comm_wait_readable(&e->sock_fd, 1, &ready, timeout_ms) != 0)
+            return;
+    }
+}
+
+int datanode_threads_loop(int sock_fd, DNStatus *status)
+{
+    ThreadEngine *e = calloc(1, sizeof(ThreadEngine));
+    if (!e) return -1;
+
+    e->sock_fd = sock_fd;
+    e->workers = calloc(dn->workers, sizeof(ThreadWorker));
+    if (!e->workers) {
+        free(e);
+        return -1;
+    }
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_mutex_init(&e->send_lock, NULL);
+    pthread_cond_init(&e->queued, NULL);
+    pthread_cond_init(&e->finished, NULL);
+
+    for (int i = 0; i < dn->workers; i++) {
+        e->workers[i].engine = e;
+        if (pthread_create(&e->workers[i].thread, NULL, threads_worker, &e->workers[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        e->num_workers++;
+    }
+
+    int started = e->num_workers;
+    if (started == 0) {
+        free(e->workers);
+        free(e);
+        return -1;
+    }
+
+    LOGD(dn->node_id, "Serving with %d I/O threads", started);
+
+    *status = DN_FAIL;
+    while (1) {
+        threads_wait_command(e);
+
+        DNHeader header = {0};
+        if (dn_recv_command_header(sock_fd, &header) == -1)
+            break;
+
+        ThreadJob *job = calloc(1, sizeof(ThreadJob));
+        void *payload = malloc(header.payload_size > 0 ? header.payload_size : 1);
+        if (!job || !payload || recv_all(sock_fd, payload, header.payload_size) != header.payload_size) {
+            free(job);
+            free(payload);
+            break;
+        }
+
+        job->header = header;
+        job->payload = payload;
+        if (datanode_block_op(header.cmd, payload, header.payload_size, &job->op)) {
+            threads_queue(e, job);
+            continue;
+        }
+
+        // anything else runs here once the workers are idle, DN_EXIT frees
+        // the datanode they share
+        threads_wait_idle(e);
+        if (header.cmd == DN_EXIT)
+            threads_stop(e, started);
+
+        int exited = datanode_dispatch(sock_fd, header.req_id, header.cmd, payload, header.payload_size);
+        free(payload);
+        free(job);
+
+        if (exited) {
+            *status = DN_SUCCESS;
+            break;
+        }
+    }
+
+    if (e->num_workers > 0)
+        threads_stop(e, started);
+
+    pthread_cond_destroy(&e->finished);
+    pthread_cond_destroy(&e->queued);
+    pthread_mutex_destroy(&e->send_lock);
+    pthread_mutex_destroy(&e->lock);
+    free(e->workers);
+    free(e);
+
+    return 0;
+}
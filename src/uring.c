@@ -0,0 +1,156 @@
+#include "uring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(URing *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->ring_fd = io_uring_setup(entries, &p);
+    if (ring->ring_fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        perror("mmap sq ring");
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            perror("mmap cq ring");
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->ring_fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap sqes");
+        if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_exit(URing *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->ring_fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(URing *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+
+    if (tail - head >= ring->sq_entries)
+        return NULL;
+
+    unsigned idx = tail & *ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned uring_sq_space(URing *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    return ring->sq_entries - (tail - head);
+}
+
+int uring_submit(URing *ring, unsigned wait_nr)
+{
+    unsigned to_submit = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
+
+    int ret;
+    do {
+        ret = io_uring_enter(ring->ring_fd, to_submit, wait_nr, flags);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,554 @@
+#define _DEFAULT_SOURCE
+#include "datanode.h"
+#include "communication.h"
+#include "uring.h"
+
+#include <sys/socket.h>
+
+extern DataNode *dn;
+
+// Commands received and not yet answered
+#define DN_URING_DEPTH 32
+// Block reads/writes in flight across all commands
+#define DN_URING_MAX_OPS 128
+#define DN_URING_ENTRIES 256
+
+typedef enum {
+    URING_RECV_HEADER,
+    URING_RECV_PAYLOAD,
+    URING_FILE,
+    URING_TIMEOUT,      // end of a group commit window
+} UringOpType;
+
+typedef struct UringCmd UringCmd;
+
+typedef struct {
+    UringOpType type;
+    UringCmd *cmd;
+    DNBlockLoc loc;
+
+    // block data and its checksum, one vectored request when the checksum
+    // is a trailer, otherwise one request each
+    int index;
+    int trailer;
+    int parts;
+    int failed;
+    uint32_t crc;
+    struct iovec iov[2];
+
+    // aligned copy of unaligned write data with direct_io
+    void *bounce;
+} UringOp;
+
+// user_data of the checksum request of a split block op
+#define URING_CRC_PART 1
+
+struct UringCmd {
+    int in_use;
+    int dispatched;
+
+    DNHeader header;
+    size_t received;
+    void *payload;
+    size_t payload_cap;
+
+    // block operation, blocks, crcs and wdata point into payload
+    int is_file;
+    int is_write;
+    int count;
+    size_t block_size;      // of every block, a batch is of one class
+    const int *blocks;
+    const uint32_t *crcs;
+    char *wdata;
+    void *rdata;
+    size_t rdata_cap;
+
+    int next;       // next block to submit
+    int pending;    // block ops in flight
+    DNStatus status;
+
+    UringOp recv_op;
+    UringOp *ops;
+    int ops_cap;
+};
+
+typedef struct {
+    URing ring;
+    int sock_fd;
+    UringCmd cmds[DN_URING_DEPTH];
+    int inflight_ops;
+    int failed;
+    int exited;
+    DNStatus exit_status;
+
+    UringOp timeout_op;
+    struct __kernel_timespec timeout_ts;
+    int timeout_armed;
+} UringEngine;
+
+// Aligned for O_DIRECT, contents do not survive growing
+static void *uring_grow(void **buf, size_t *cap, size_t size)
+{
+    if (size <= *cap && *buf)
+        return *buf;
+
+    void *grown;
+    if (posix_memalign(&grown, DN_DIRECT_ALIGN, size > 0 ? size : 1) != 0)
+        return NULL;
+
+    free(*buf);
+    *buf = grown;
+    *cap = size;
+    return grown;
+}
+
+static void uring_op_release(UringOp *op)
+{
+    pthread_mutex_lock(&dn->lock);
+    datanode_block_close(&op->loc);
+    pthread_mutex_unlock(&dn->lock);
+    if (op->bounce) {
+        bufpool_put(&dn->pool, op->bounce);
+        op->bounce = NULL;
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(UringEngine *e)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+    if (!sqe) {
+        uring_submit(&e->ring, 0);
+        sqe = uring_get_sqe(&e->ring);
+    }
+    return sqe;
+}
+
+static int uring_post_recv(UringEngine *e, UringCmd *c, UringOpType type)
+{
+    char *base;
+    size_t len;
+
+    if (type == URING_RECV_HEADER) {
+        base = (char *)&c->header;
+        len = sizeof(c->header);
+    } else {
+        base = c->payload;
+        len = c->header.payload_size;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(e);
+    if (!sqe) return -1;
+
+    c->recv_op.type = type;
+    c->recv_op.cmd = c;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = e->sock_fd;
+    sqe->addr = (uint64_t)(uintptr_t)(base + c->received);
+    sqe->len = len - c->received;
+    sqe->msg_flags = MSG_WAITALL;
+    sqe->user_data = (uint64_t)(uintptr_t)&c->recv_op;
+    return 0;
+}
+
+static UringCmd *uring_free_cmd(UringEngine *e)
+{
+    for (int i = 0; i < DN_URING_DEPTH; i++) {
+        if (!e->cmds[i].in_use)
+            return &e->cmds[i];
+    }
+    return NULL;
+}
+
+// A command may start once no dispatched command touches the same block with
+// a write, commands other than block reads/writes wait for all block I/O
+static int uring_conflicts(UringEngine *e, UringCmd *c)
+{
+    for (int i = 0; i < DN_URING_DEPTH; i++) {
+        UringCmd *x = &e->cmds[i];
+        if (x == c || !x->in_use || !x->dispatched)
+            continue;
+
+        if (!c->is_file)
+            return 1;
+
+        if (!c->is_write && !x->is_write)
+            continue;
+
+        for (int a = 0; a < c->count; a++) {
+            for (int b = 0; b < x->count; b++) {
+                if (c->blocks[a] == x->blocks[b])
+                    return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Decode a received command into a block operation if it is one
+static int uring_parse(UringCmd *c)
+{
+    DNBlockOp op;
+    c->is_file = datanode_block_op(c->header.cmd, c->payload, c->header.payload_size, &op);
+    c->is_write = op.is_write;
+    c->count = op.count;
+    c->block_size = op.block_size;
+    c->blocks = op.blocks;
+    c->crcs = op.crcs;
+    c->wdata = op.wdata;
+    return c->is_file;
+}
+
+static void uring_finish(UringEngine *e, UringCmd *c)
+{
+    LOGD_DEBUG(dn->node_id, "Request %u (%d blocks) %s", c->header.req_id, c->count,
+         c->status == DN_SUCCESS ? "succeeded" : "failed");
+
+    if (!c->is_write && c->status == DN_SUCCESS)
+        datanode_respond(e->sock_fd, c->header.req_id, c->status, c->rdata, (size_t)c->count * c->block_size);
+    else if (c->is_write && c->status == DN_SUCCESS && dn->durability == DN_DURABILITY_GROUP)
+        datanode_hold_response(e->sock_fd, c->header.req_id);
+    else
+        datanode_respond(e->sock_fd, c->header.req_id, c->status, NULL, 0);
+
+    c->in_use = 0;
+    c->dispatched = 0;
+}
+
+// Submit block operations of dispatched commands while there is room
+static void uring_pump(UringEngine *e)
+{
+    for (int i = 0; i < DN_URING_DEPTH; i++) {
+        UringCmd *c = &e->cmds[i];
+        if (!c->in_use || !c->dispatched || !c->is_file)
+            continue;
+
+        while (c->next < c->count && e->inflight_ops < DN_URING_MAX_OPS) {
+            int k = c->next++;
+            UringOp *op = &c->ops[k];
+            char *buf = (c->is_write ? c->wdata : (char *)c->rdata) + (size_t)k * c->block_size;
+
+            if (c->is_write) {
+                op->crc = c->crcs[k];
+                if (crc32c(0, buf, c->block_size) != op->crc) {
+                    LOGD_ERROR(dn->node_id, "block %d arrived damaged", c->blocks[k]);
+                    c->status = DN_CORRUPT;
+                    continue;
+                }
+            }
+
+            if (!c->is_write && blockcache_get(&datanode_class(c->blocks[k])->cache, c->blocks[k], buf) == 0)
+                continue;
+
+            op->failed = 0;
+            op->bounce = NULL;
+            if (c->is_write && dn->direct_io && ((uintptr_t)buf & (DN_DIRECT_ALIGN - 1))) {
+                op->bounce = bufpool_get(&dn->pool);
+                if (!op->bounce) {
+                    // try again once some block I/O completed
+                    c->next--;
+                    break;
+                }
+                memcpy(op->bounce, buf, c->block_size);
+                buf = op->bounce;
+            }
+
+            op->type = URING_FILE;
+            op->cmd = c;
+            op->index = k;
+            DNStatus open_status;
+            pthread_mutex_lock(&dn->lock);
+            int opened = datanode_block_open(c->blocks[k], c->is_write, &op->loc, &open_status);
+            pthread_mutex_unlock(&dn->lock);
+            if (opened != 0) {
+                if (op->bounce) bufpool_put(&dn->pool, op->bounce);
+                if (opened > 0)
+                    memset(buf, 0, c->block_size);     // never written
+                else
+                    c->status = open_status;
+                continue;
+            }
+
+            op->trailer = datanode_block_trailer(&op->loc);
+            op->parts = op->trailer ? 1 : 2;
+
+            // both requests of a split op are taken before either is filled,
+            // submitting in between would send a blank one
+            if (uring_sq_space(&e->ring) < (unsigned)op->parts)
+                uring_submit(&e->ring, 0);
+
+            struct io_uring_sqe *sqe = uring_get_sqe(&e->ring);
+            if (!sqe) {
+                uring_op_release(op);
+                c->status = DN_FAIL;
+                continue;
+            }
+
+            struct io_uring_sqe *crc_sqe = NULL;
+            if (!op->trailer && !(crc_sqe = uring_get_sqe(&e->ring))) {
+                // the data request is taken already, let it complete as a no-op
+                sqe->opcode = IORING_OP_NOP;
+                sqe->user_data = (uint64_t)(uintptr_t)op;
+                op->parts = 1;
+                c->status = DN_FAIL;
+                c->pending++;
+                e->inflight_ops++;
+                continue;
+            }
+
+            op->iov[0].iov_base = buf;
+            op->iov[0].iov_len = c->block_size;
+            op->iov[1].iov_base = &op->crc;
+            op->iov[1].iov_len = DN_CRC_SIZE;
+
+            sqe->opcode = c->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = op->loc.fd;
+            sqe->addr = (uint64_t)(uintptr_t)op->iov;
+            sqe->len = op->trailer ? 2 : 1;
+            sqe->off = op->loc.offset;
+            sqe->user_data = (uint64_t)(uintptr_t)op;
+
+            if (crc_sqe) {
+                crc_sqe->opcode = c->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+                crc_sqe->fd = op->loc.crc_fd;
+                crc_sqe->addr = (uint64_t)(uintptr_t)&op->iov[1];
+                crc_sqe->len = 1;
+                crc_sqe->off = op->loc.crc_offset;
+                crc_sqe->user_data = (uint64_t)(uintptr_t)op | URING_CRC_PART;
+            }
+
+            c->pending++;
+            e->inflight_ops++;
+        }
+
+        if (c->next == c->count && c->pending == 0)
+            uring_finish(e, c);
+    }
+}
+
+static void uring_dispatch(UringEngine *e, UringCmd *c)
+{
+    c->dispatched = 1;
+
+    if (!c->is_file) {
+        if (datanode_dispatch(e->sock_fd, c->header.req_id, c->header.cmd, c->payload, c->header.payload_size)) {
+            e->exited = 1;
+            e->exit_status = DN_SUCCESS;
+        }
+        c->in_use = 0;
+        c->dispatched = 0;
+        return;
+    }
+
+    // held writes are answered before a read that follows them
+    if (!c->is_write && dn->num_held > 0)
+        datanode_commit(e->sock_fd);
+
+    c->next = 0;
+    c->pending = 0;
+    c->status = DN_SUCCESS;
+
+    if (c->count > c->ops_cap) {
+        UringOp *ops = realloc(c->ops, sizeof(UringOp) * c->count);
+        if (!ops) {
+            c->status = DN_FAIL;
+            c->next = c->count;
+            return;
+        }
+        c->ops = ops;
+        c->ops_cap = c->count;
+    }
+
+    if (!c->is_write && !uring_grow(&c->rdata, &c->rdata_cap, (size_t)c->count * c->block_size)) {
+        c->status = DN_FAIL;
+        c->next = c->count;
+    }
+}
+
+static void uring_complete(UringEngine *e, struct io_uring_cqe *cqe, UringCmd **receiving)
+{
+    int part = cqe->user_data & URING_CRC_PART;
+    UringOp *op = (UringOp *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_CRC_PART);
+    UringCmd *c = op->cmd;
+
+    if (op->type == URING_TIMEOUT) {
+        e->timeout_armed = 0;
+        return;
+    }
+
+    if (op->type == URING_FILE) {
+        int expected = part ? (int)DN_CRC_SIZE :
+                       op->trailer ? (int)(c->block_size + DN_CRC_SIZE) : (int)c->block_size;
+        if (cqe->res != expected) {
+            LOGD_ERROR(dn->node_id, "block I/O for request %u returned %d", c->header.req_id, cqe->res);
+            c->status = DN_FAIL;
+            op->failed = 1;
+        }
+        if (--op->parts > 0)
+            return;
+
+        int block_index = c->blocks[op->index];
+        BlockCache *cache = &datanode_class(block_index)->cache;
+        if (c->is_write && !op->failed && dn->durability == DN_DURABILITY_SYNC &&
+            store->commit(&op->loc) != 0) {
+            c->status = DN_FAIL;
+            op->failed = 1;
+        }
+
+        if (c->is_write) {
+            if (op->failed)
+                blockcache_invalidate(cache, block_index);
+            else
+                blockcache_update(cache, block_index, op->iov[0].iov_base);
+        } else if (!op->failed) {
+            char *data = (char *)c->rdata + (size_t)op->index * c->block_size;
+            if (crc32c(0, data, c->block_size) != op->crc) {
+                LOGD_ERROR(dn->node_id, "block %d fails its checksum", block_index);
+                c->status = DN_CORRUPT;
+            } else {
+                blockcache_insert(cache, block_index, data);
+            }
+        }
+
+        uring_op_release(op);
+        c->pending--;
+        e->inflight_ops--;
+        return;
+    }
+
+    if (cqe->res <= 0) {
+        // peer closed the connection or the socket failed
+        e->failed = 1;
+        return;
+    }
+
+    c->received += cqe->res;
+    size_t want = op->type == URING_RECV_HEADER ? sizeof(c->header) : c->header.payload_size;
+
+    if (c->received < want) {
+        if (uring_post_recv(e, c, op->type) != 0) e->failed = 1;
+        return;
+    }
+
+    if (op->type == URING_RECV_HEADER && c->header.payload_size > 0) {
+        c->received = 0;
+        if (!uring_grow(&c->payload, &c->payload_cap, c->header.payload_size) ||
+            uring_post_recv(e, c, URING_RECV_PAYLOAD) != 0) {
+            e->failed = 1;
+        }
+        return;
+    }
+
+    // the whole command is here, it is started from the main loop
+    uring_parse(c);
+    *receiving = NULL;
+}
+
+int datanode_uring_loop(int sock_fd, DNStatus *status)
+{
+    UringEngine *e = calloc(1, sizeof(UringEngine));
+    if (!e) return -1;
+
+    if (uring_init(&e->ring, DN_URING_ENTRIES) != 0) {
+        free(e);
+        return -1;
+    }
+    e->sock_fd = sock_fd;
+
+    LOGD(dn->node_id, "Serving with io_uring engine");
+
+    UringCmd *receiving = NULL;
+    UringCmd *ready = NULL;
+
+    while (!e->failed && !e->exited) {
+        // commands start in arrival order, a conflicting one holds back the rest
+        if (ready && !uring_conflicts(e, ready)) {
+            UringCmd *c = ready;
+            ready = NULL;
+            uring_dispatch(e, c);
+            if (e->exited) break;
+        }
+
+        uring_pump(e);
+
+        if (!receiving && !ready) {
+            UringCmd *c = uring_free_cmd(e);
+            if (c) {
+                c->in_use = 1;
+                c->dispatched = 0;
+                c->received = 0;
+                if (uring_post_recv(e, c, URING_RECV_HEADER) != 0) {
+                    e->failed = 1;
+                    break;
+                }
+                receiving = c;
+            }
+        }
+
+        // group commit once no write is left in flight to join the group and
+        // the window is over, wake up for the end of the window otherwise
+        long due = datanode_commit_due();
+        if (due >= 0 && !ready && e->inflight_ops == 0) {
+            if (due == 0) {
+                datanode_commit(e->sock_fd);
+            } else if (!e->timeout_armed) {
+                struct io_uring_sqe *sqe = uring_sqe(e);
+                if (sqe) {
+                    e->timeout_op.type = URING_TIMEOUT;
+                    e->timeout_ts.tv_sec = due / 1000000;
+                    e->timeout_ts.tv_nsec = (due % 1000000) * 1000;
+                    sqe->opcode = IORING_OP_TIMEOUT;
+                    sqe->addr = (uint64_t)(uintptr_t)&e->timeout_ts;
+                    sqe->len = 1;
+                    sqe->user_data = (uint64_t)(uintptr_t)&e->timeout_op;
+                    e->timeout_armed = 1;
+                } else {
+                    datanode_commit(e->sock_fd);
+                }
+            }
+        }
+
+        // the command holding back ready may have finished in uring_pump
+        // without any I/O left to wait for
+        unsigned wait_nr = ready && !uring_conflicts(e, ready) ? 0 : 1;
+        if (uring_submit(&e->ring, wait_nr) < 0) {
+            e->failed = 1;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&e->ring)) != NULL) {
+            UringCmd *was = receiving;
+            uring_complete(e, cqe, &receiving);
+            uring_cqe_seen(&e->ring);
+
+            if (was && !receiving)
+                ready = was;
+        }
+    }
+
+    *status = e->exited ? e->exit_status : DN_FAIL;
+
+    // the socket is gone on failure, only wait for block I/O before teardown
+    while (e->inflight_ops > 0 && uring_submit(&e->ring, 1) >= 0) {
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&e->ring)) != NULL) {
+            UringOp *op = (UringOp *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_CRC_PART);
+            if (op->type == URING_FILE && --op->parts == 0) {
+                uring_op_release(op);
+                e->inflight_ops--;
+            }
+            uring_cqe_seen(&e->ring);
+        }
+    }
+
+    uring_exit(&e->ring);
+    for (int i = 0; i < DN_URING_DEPTH; i++) {
+        free(e->cmds[i].payload);
+        free(e->cmds[i].rdata);
+        free(e->cmds[i].ops);
+    }
+    free(e);
+
+    return 0;
+}
@@ -34,16 +34,13 @@ int weightedroundrobin_init()
 
 int weightedroundrobin_allocate_block(AllocContext ctx, int *node_index)
 {
-    (void)ctx;
     WRRState *s = (WRRState *)policy->state;
-    
-    size_t node_capacity = md->fs_capacity / md->num_nodes;
-    int max_blocks_per_node = node_capacity / BLOCK_SIZE;
+    MDBlockClass *c = &md->classes[ctx.block_class];
 
     for (int i = 0; i < md->num_nodes; i++) {
-        int blocks_free = md->blocks_free[i];
+        int blocks_free = c->blocks_free[i];
         
-        s->weights[i] = (double)blocks_free / max_blocks_per_node;
+        s->weights[i] = c->blocks_per_node[i] > 0 ? (double)blocks_free / c->blocks_per_node[i] : 0.0;
 
         if (blocks_free <= 0) {
             s->weights[i] = 0.0;
@@ -97,7 +97,7 @@ void workload_imbalance_test(const char *policy, int num_nodes,
     for (int i = 0; i < num_nodes; i++) {
         size_t node_capacity = md->fs_capacity / md->num_nodes;
         int max_blocks = node_capacity / BLOCK_SIZE;
-        int used = max_blocks - md->blocks_free[i];
+        int used = max_blocks - md->classes[0].blocks_free[i];
         printf("  Node %d: %d blocks\n", i, used);
     }
     
@@ -169,8 +169,8 @@ void workload_imbalance_test(const char *policy, int num_nodes,
     for (int i = 0; i < num_nodes; i++) {
         size_t node_capacity = md->fs_capacity / md->num_nodes;
         int max_blocks = node_capacity / BLOCK_SIZE;
-        int used = max_blocks - md->blocks_free[i];
-        printf("  Node %d: %d blocks (%d free)\n", i, used, md->blocks_free[i]);
+        int used = max_blocks - md->classes[0].blocks_free[i];
+        printf("  Node %d: %d blocks (%d free)\n", i, used, md->classes[0].blocks_free[i]);
     }
     
     // PHASE 3: Continue allocating - see how policy responds to imbalance
@@ -223,8 +223,8 @@ void workload_imbalance_test(const char *policy, int num_nodes,
     for (int i = 0; i < num_nodes; i++) {
         size_t node_capacity = md->fs_capacity / md->num_nodes;
         int max_blocks = node_capacity / BLOCK_SIZE;
-        int used = max_blocks - md->blocks_free[i];
-        printf("  Node %d: %d blocks (%d free)\n", i, used, md->blocks_free[i]);
+        int used = max_blocks - md->classes[0].blocks_free[i];
+        printf("  Node %d: %d blocks (%d free)\n", i, used, md->classes[0].blocks_free[i]);
     }
     
     // Final metrics